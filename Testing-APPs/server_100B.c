@@ -21,6 +21,9 @@ typedef struct {
 #define MAX_EVENTS 1024
 int total_contexts = 0;
 sock_context *contexts[MAX_EVENTS];
+// Receive buffer region of the listening socket; a peeled-off socket
+// shares it if requests from its client were pending at peel-off time.
+char *shared_rcv_buffer;
 int peeloff_setup(sock_context *context) {
     char* msg_rcv_buffer = (char *) mmap(NULL, 1024*HOMA_BPAGE_SIZE,
         PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
@@ -31,9 +34,19 @@ int peeloff_setup(sock_context *context) {
     context->buf_args.start = msg_rcv_buffer;
     context->buf_args.length = BUFFER_SIZE;
     if (setsockopt(context->fd, IPPROTO_HOMA, SO_HOMA_RCVBUF, &context->buf_args, sizeof(struct homa_rcvbuf_args)) < 0) {
-        perror("cannot set sockopts\n");
-        return -1;
+        munmap(msg_rcv_buffer, BUFFER_SIZE);
+        if (errno != EBUSY) {
+            perror("cannot set sockopts\n");
+            return -1;
+        }
+        context->buf_args.start = shared_rcv_buffer;
+        context->buf_args.length = 0;
     }
+    memset(&context->args, 0, sizeof(context->args));
+    context->hdr.msg_namelen = sizeof(context->client_addr);
+    context->hdr.msg_iov = NULL;
+    context->hdr.msg_iovlen = 0;
+    context->hdr.msg_controllen = sizeof(context->args);
     return 0;
 }
 
@@ -53,7 +66,9 @@ int peeloff_sock_ops(sock_context *context) {
             }
         }
         else {
-            char* peeloff_msg_buffer = context->buf_args.start;
+            // The bpages are returned to Homa by the next recvmsg call.
+            char* peeloff_msg_buffer = context->buf_args.start
+                    + context->args.bpage_offsets[0];
             if (homa_reply_connected(context->fd, peeloff_msg_buffer, msg_len, context->args.id) < 0) {
                 perror("failed to reply!");
                 return -1;
@@ -66,7 +81,8 @@ int peeloff_sock_ops(sock_context *context) {
 void cleanup_contexts(sock_context **contexts, int num_of_contexts) {
     for (int i = 0; i < num_of_contexts; i++) {
         close(contexts[i]->fd);
-        munmap(contexts[i]->buf_args.start, contexts[i]->buf_args.length);
+        if (contexts[i]->buf_args.length != 0)
+            munmap(contexts[i]->buf_args.start, contexts[i]->buf_args.length);
         free(contexts[i]);
     }
 }
@@ -94,6 +110,7 @@ int main() {
     hdr.msg_controllen = sizeof(args);
     buf_args.start = msg_rcv_buffer;
     buf_args.length = BUFFER_SIZE;
+    shared_rcv_buffer = msg_rcv_buffer;
     if (msg_rcv_buffer == MAP_FAILED) {
         perror("mmapping failed!");
         return -1;
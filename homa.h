@@ -162,6 +162,430 @@ _Static_assert(sizeof(struct homa_abort_args) <= 32, "homa_abort_args grew");
 #define SO_HOMA_RCVBUF 10
 /** define SO_HOMA_PEELOFF: getsockopt option for returning the fd of a branched-off socket */
 #define SO_HOMA_PEELOFF 11
+/**
+ * define SO_HOMA_SHARE_RCVBUF: setsockopt option for sharing the buffer
+ * region of another Homa socket (the argument is that socket's fd).
+ */
+#define SO_HOMA_SHARE_RCVBUF 12
+/**
+ * define SO_HOMA_PEELOFF_BATCH: getsockopt option for peeling off sockets
+ * for several clients in one call (optval refers to a struct
+ * homa_peeloff_batch_args).
+ */
+#define SO_HOMA_PEELOFF_BATCH 13
+
+/**
+ * define SO_HOMA_RING: setsockopt option for creating a completion ring
+ * that can be mapped into user space with mmap (optval refers to a
+ * struct homa_ring_args).
+ */
+#define SO_HOMA_RING 14
+
+/**
+ * define SO_HOMA_POLL: socket option for the busy-polling behavior of
+ * threads waiting for messages on a socket (optval refers to a
+ * struct homa_poll_args).
+ */
+#define SO_HOMA_POLL 15
+
+/**
+ * define SO_HOMA_INLINE: socket option (an int) giving the size of the
+ * largest incoming message that recvmsg will copy directly into the
+ * caller's iovec, without allocating space in the buffer region. 0 (the
+ * default) disables inline delivery; may not exceed HOMA_MAX_INLINE.
+ */
+#define SO_HOMA_INLINE 16
+
+/**
+ * define SO_HOMA_ZEROCOPY: socket option (an int) that enables
+ * MSG_ZEROCOPY for sendmsg on a Homa socket (the generic SO_ZEROCOPY
+ * option is only accepted for TCP and UDP sockets). When enabled,
+ * messages sent with MSG_ZEROCOPY are transmitted directly from the
+ * caller's pages; a completion notification is queued on the socket's
+ * error queue once the pages are no longer referenced.
+ */
+#define SO_HOMA_ZEROCOPY 17
+
+/**
+ * define SO_HOMA_BPAGE_QUOTA: socket option (an int) giving a soft limit
+ * on the number of bpages of a shared buffer region that this socket's
+ * messages may hold (see the bpage_quota sysctl). 0 means no quota; -1
+ * (the default) means the bpage_quota sysctl value applies.
+ */
+#define SO_HOMA_BPAGE_QUOTA 18
+
+/**
+ * define HOMA_MAX_INLINE: largest value that may be specified with
+ * SO_HOMA_INLINE (inline messages are held in packet buffers until
+ * recvmsg is invoked, so they shouldn't be large).
+ */
+#define HOMA_MAX_INLINE 16384
+
+/**
+ * struct homa_peeloff_entry - Describes one client in a
+ * SO_HOMA_PEELOFF_BATCH request.
+ */
+struct homa_peeloff_entry {
+	/**
+	 * @addr: (in) Address of the client; its family must match that
+	 * of the socket.
+	 */
+	union {
+		struct sockaddr_in in4;
+		struct sockaddr_in6 in6;
+	} addr;
+
+	/**
+	 * @fd: (out) File descriptor for the new socket, or a negative
+	 * errno if no socket could be peeled off for this client.
+	 */
+	int32_t fd;
+
+	/**
+	 * @id: (out) Id of the oldest unread request from the client, which
+	 * has been moved to the new socket and can be read from it with
+	 * recvmsg; 0 if there were no unread requests.
+	 */
+	uint64_t id;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_peeloff_entry) >= 40,
+	       "homa_peeloff_entry shrunk");
+_Static_assert(sizeof(struct homa_peeloff_entry) <= 40,
+	       "homa_peeloff_entry grew");
+#endif
+
+/**
+ * struct homa_peeloff_batch_args - getsockopt argument for
+ * SO_HOMA_PEELOFF_BATCH.
+ */
+struct homa_peeloff_batch_args {
+	/** @entries: (in) Array of @count clients to peel off. */
+	struct homa_peeloff_entry *entries;
+
+	/**
+	 * @count: (in) Number of entries in @entries; (out) number of
+	 * entries that were processed (each has a valid @fd field). The
+	 * same number is returned by getsockopt.
+	 */
+	uint32_t count;
+
+	/** @_pad: Reserved; must be zero. */
+	uint32_t _pad;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_peeloff_batch_args) >= 16,
+	       "homa_peeloff_batch_args shrunk");
+_Static_assert(sizeof(struct homa_peeloff_batch_args) <= 16,
+	       "homa_peeloff_batch_args grew");
+#endif
+
+/**
+ * struct homa_recvbatch_msg - Describes one message returned by the
+ * HOMAIOCRECVBATCH ioctl. The fields have the same meanings as the
+ * corresponding values returned by recvmsg.
+ */
+struct homa_recvbatch_msg {
+	/** @id: Id of the RPC for the message. */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: For responses, the completion cookie given
+	 * when the request was sent; zero for requests.
+	 */
+	uint64_t completion_cookie;
+
+	/** @addr: Address of the message's sender. */
+	union {
+		struct sockaddr_in in4;
+		struct sockaddr_in6 in6;
+	} addr;
+
+	/**
+	 * @length: Total length of the message, or a negative errno if
+	 * the RPC failed (this is what recvmsg would have returned).
+	 */
+	int32_t length;
+
+	/** @num_bpages: Number of valid entries in @bpage_offsets. */
+	uint32_t num_bpages;
+
+	/**
+	 * @bpage_offsets: Locations of the message's data in the buffer
+	 * region, in the same form as homa_recvmsg_args.bpage_offsets.
+	 * The application owns these bpages until it returns them to Homa.
+	 */
+	uint32_t bpage_offsets[HOMA_MAX_BPAGES];
+
+	uint32_t _pad;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_recvbatch_msg) >= 120,
+	       "homa_recvbatch_msg shrunk");
+_Static_assert(sizeof(struct homa_recvbatch_msg) <= 120,
+	       "homa_recvbatch_msg grew");
+#endif
+
+/**
+ * struct homa_recvbatch_args - Structure that passes arguments and results
+ * between user space and the HOMAIOCRECVBATCH ioctl, which receives
+ * several messages in a single kernel call.
+ */
+struct homa_recvbatch_args {
+	/**
+	 * @msgs: (in) Array of @max_msgs entries, which will be filled in
+	 * with information about the messages received.
+	 */
+	struct homa_recvbatch_msg *msgs;
+
+	/** @max_msgs: (in) Number of entries available at @msgs. */
+	uint32_t max_msgs;
+
+	/** @num_msgs: (out) Number of entries in @msgs that were filled in. */
+	uint32_t num_msgs;
+
+	/**
+	 * @flags: (in) OR-ed combination of HOMA_RECVMSG_REQUEST,
+	 * HOMA_RECVMSG_RESPONSE, and HOMA_RECVMSG_NONBLOCKING, with the
+	 * same meanings as for recvmsg. If nonblocking isn't specified,
+	 * the call waits for the first message but not for later ones.
+	 */
+	uint32_t flags;
+
+	/** @num_bpages: (in) Number of entries in @bpage_offsets. */
+	uint32_t num_bpages;
+
+	/**
+	 * @bpage_offsets: (in) Bpages from previously received messages
+	 * that are being returned to Homa; the list may contain bpages
+	 * from any number of messages.
+	 */
+	uint32_t *bpage_offsets;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_recvbatch_args) >= 32,
+	       "homa_recvbatch_args shrunk");
+_Static_assert(sizeof(struct homa_recvbatch_args) <= 32,
+	       "homa_recvbatch_args grew");
+#endif
+
+/**
+ * struct homa_sendbatch_msg - Describes one message to send with the
+ * HOMAIOCSENDBATCH ioctl.
+ */
+struct homa_sendbatch_msg {
+	/**
+	 * @id: (in/out) 0 means the message is a new request, and the id
+	 * of its RPC is returned here; otherwise the message is the
+	 * response for the request with this id.
+	 */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: (in) For requests, returned by recvmsg when
+	 * the RPC completes; must be zero for responses.
+	 */
+	uint64_t completion_cookie;
+
+	/** @iov: (in) Describes the contents of the message. */
+	const struct iovec *iov;
+
+	/** @iovcnt: (in) Number of entries in @iov. */
+	uint32_t iovcnt;
+
+	/**
+	 * @result: (out) 0 if the message was accepted for delivery,
+	 * otherwise a negative errno (as sendmsg would have returned).
+	 */
+	int32_t result;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_sendbatch_msg) >= 32,
+	       "homa_sendbatch_msg shrunk");
+_Static_assert(sizeof(struct homa_sendbatch_msg) <= 32,
+	       "homa_sendbatch_msg grew");
+#endif
+
+/**
+ * struct homa_sendbatch_args - Structure that passes arguments and results
+ * between user space and the HOMAIOCSENDBATCH ioctl, which sends several
+ * requests and/or responses on a connected socket in one kernel call.
+ */
+struct homa_sendbatch_args {
+	/** @msgs: (in) Array of @num_msgs messages to send. */
+	struct homa_sendbatch_msg *msgs;
+
+	/** @num_msgs: (in) Number of entries in @msgs. */
+	uint32_t num_msgs;
+
+	/**
+	 * @num_done: (out) Number of entries in @msgs that were processed.
+	 * Each has a valid @result field, except that if the ioctl fails
+	 * with EFAULT the last one's result couldn't be returned (that
+	 * message was processed all the same).
+	 */
+	uint32_t num_done;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_sendbatch_args) >= 16,
+	       "homa_sendbatch_args shrunk");
+_Static_assert(sizeof(struct homa_sendbatch_args) <= 16,
+	       "homa_sendbatch_args grew");
+#endif
+
+/**
+ * struct homa_release_args - Structure that passes arguments and results
+ * between user space and the HOMAIOCRELEASE ioctl, which returns bpages
+ * to a socket's buffer pool without receiving a message, and reports how
+ * the pool is being used.
+ */
+struct homa_release_args {
+	/**
+	 * @bpage_offsets: (in) Bpages (from previously received messages)
+	 * that the application no longer needs; may be NULL if
+	 * @num_bpages is 0.
+	 */
+	uint32_t *bpage_offsets;
+
+	/** @num_bpages: (in) Number of entries in @bpage_offsets. */
+	uint32_t num_bpages;
+
+	/** @total_bpages: (out) Total number of bpages in the pool. */
+	uint32_t total_bpages;
+
+	/**
+	 * @free_bpages: (out) Number of bpages in the pool that are
+	 * currently free (after releasing @bpage_offsets).
+	 */
+	uint32_t free_bpages;
+
+	/**
+	 * @held_bpages: (out) Number of bpages holding data for messages
+	 * on this socket that haven't yet been returned to Homa (these
+	 * count against the socket's quota).
+	 */
+	uint32_t held_bpages;
+
+	/**
+	 * @waiting_rpcs: (out) Number of incoming RPCs on this socket that
+	 * are stalled waiting for buffer space.
+	 */
+	uint32_t waiting_rpcs;
+
+	uint32_t _pad;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_release_args) >= 32,
+	       "homa_release_args shrunk");
+_Static_assert(sizeof(struct homa_release_args) <= 32,
+	       "homa_release_args grew");
+#endif
+
+/** struct homa_ring_args - setsockopt argument for SO_HOMA_RING. */
+struct homa_ring_args {
+	/**
+	 * @entries: Number of entries in the completion ring; must be a
+	 * power of 2.
+	 */
+	uint32_t entries;
+
+	/**
+	 * @free_entries: Number of entries in the free ring (each holds
+	 * one bpage offset); must be a power of 2.
+	 */
+	uint32_t free_entries;
+};
+
+/**
+ * struct homa_ring_hdr - Appears at the beginning of the memory mapped
+ * with mmap for a socket's completion ring. The completion ring holds
+ * struct homa_recvbatch_msg entries, produced by the kernel as messages
+ * complete and consumed by the application; the free ring holds bpage
+ * offsets produced by the application and consumed by the kernel. All
+ * indexes increase without bound; they are reduced modulo the ring size
+ * to select an entry. Each index is written only by its owner: the owner
+ * must use a store-release when advancing it, and the other side must
+ * read it with a load-acquire.
+ */
+struct homa_ring_hdr {
+	/** @head: Index of the next completion the kernel will post. */
+	uint32_t head;
+	uint32_t _pad1[15];
+
+	/** @tail: Index of the next completion the application will read. */
+	uint32_t tail;
+	uint32_t _pad2[15];
+
+	/** @free_head: Index of the next free-ring slot the app will fill. */
+	uint32_t free_head;
+	uint32_t _pad3[15];
+
+	/** @free_tail: Index of the next free-ring slot the kernel will read. */
+	uint32_t free_tail;
+	uint32_t _pad4[15];
+
+	/** @entries: Number of entries in the completion ring. */
+	uint32_t entries;
+
+	/** @free_entries: Number of entries in the free ring. */
+	uint32_t free_entries;
+
+	/**
+	 * @entries_offset: Offset from the start of the mapping to the
+	 * completion ring (an array of struct homa_recvbatch_msg).
+	 */
+	uint32_t entries_offset;
+
+	/**
+	 * @free_offset: Offset from the start of the mapping to the free
+	 * ring (an array of uint32_t bpage offsets).
+	 */
+	uint32_t free_offset;
+	uint32_t _pad5[12];
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_ring_hdr) >= 320,
+	       "homa_ring_hdr shrunk");
+_Static_assert(sizeof(struct homa_ring_hdr) <= 320,
+	       "homa_ring_hdr grew");
+#endif
+
+/**
+ * define HOMA_RING_BYTES - Number of bytes that must be mapped to access
+ * a completion ring created with the given homa_ring_args values.
+ */
+#define HOMA_RING_BYTES(entries, free_entries) \
+	(sizeof(struct homa_ring_hdr) + \
+	 (entries) * sizeof(struct homa_recvbatch_msg) + \
+	 (free_entries) * sizeof(uint32_t))
+
+/** struct homa_poll_args - socket option value for SO_HOMA_POLL. */
+struct homa_poll_args {
+	/**
+	 * @usecs: How long (in microseconds) a thread waiting for a message
+	 * on the socket busy-waits before sleeping. -1 means use the
+	 * poll_usecs sysctl value.
+	 */
+	int32_t usecs;
+
+	/** @flags: OR-ed combination of HOMA_POLL_* flags. */
+	uint32_t flags;
+};
+
+/**
+ * define HOMA_POLL_ADAPTIVE: flag for homa_poll_args: poll only when the
+ * socket's recent message inter-arrival times suggest that a message will
+ * arrive before the poll budget expires; otherwise sleep right away.
+ */
+#define HOMA_POLL_ADAPTIVE 1
 
 /** struct homa_rcvbuf_args - setsockopt argument for SO_HOMA_RCVBUF. */
 struct homa_rcvbuf_args {
@@ -172,6 +596,40 @@ struct homa_rcvbuf_args {
 	size_t length;
 };
 
+/**
+ * struct homa_rcvbuf_ext_args - Extended setsockopt argument for
+ * SO_HOMA_RCVBUF, which allows flags to be specified when the region is
+ * registered. Homa distinguishes it from struct homa_rcvbuf_args by
+ * the option length.
+ */
+struct homa_rcvbuf_ext_args {
+	/** @rcvbuf: Describes the buffer region. */
+	struct homa_rcvbuf_args rcvbuf;
+
+	/** @flags: OR-ed combination of HOMA_RCVBUF_* flags. */
+	uint32_t flags;
+
+	/** @_pad: Reserved for future use; must be zero. */
+	uint32_t _pad;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_rcvbuf_ext_args) >= 24,
+	       "homa_rcvbuf_ext_args shrunk");
+_Static_assert(sizeof(struct homa_rcvbuf_ext_args) <= 24,
+	       "homa_rcvbuf_ext_args grew");
+#endif
+
+/**
+ * define HOMA_RCVBUF_PIN: flag for homa_rcvbuf_ext_args: pin the region's
+ * pages when it is registered, so that Homa can copy incoming data into
+ * the region through its own kernel mapping (with memcpy, in any context)
+ * rather than with copy_to_user. For best performance the region should
+ * be backed by huge pages (e.g. mmap with MAP_HUGETLB), so that large
+ * copies are not broken up at 4 KB boundaries.
+ */
+#define HOMA_RCVBUF_PIN 1
+
 /* Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
  */
@@ -188,6 +646,9 @@ struct homa_rcvbuf_args {
  */
 
 #define HOMAIOCABORT  _IOWR(0x89, 0xe3, struct homa_abort_args)
+#define HOMAIOCRECVBATCH _IOWR(0x89, 0xe4, struct homa_recvbatch_args)
+#define HOMAIOCSENDBATCH _IOWR(0x89, 0xe5, struct homa_sendbatch_args)
+#define HOMAIOCRELEASE _IOWR(0x89, 0xe6, struct homa_release_args)
 #define HOMAIOCFREEZE _IO(0x89, 0xef)
 
 #ifndef __STRIP__ /* See strip.py */
@@ -208,6 +669,15 @@ ssize_t homa_replyv(int sockfd, const struct iovec *iov,
 		    int iovcnt, const struct sockaddr *dest_addr,
 		    uint32_t addrlen,  uint64_t id);
 int homa_peeloff(int sockfd, struct sockaddr *client_addr, uint32_t addrlen);
+int     homa_recv_batch(int sockfd, struct homa_recvbatch_msg *msgs,
+			uint32_t max_msgs, int flags,
+			const uint32_t *bpage_offsets, uint32_t num_bpages);
+int     homa_send_batch(int sockfd, struct homa_sendbatch_msg *msgs,
+			uint32_t count);
+int     homa_peeloff_batch(int sockfd, struct homa_peeloff_entry *entries,
+			   uint32_t count);
+int     homa_release(int sockfd, const uint32_t *bpage_offsets,
+		     uint32_t num_bpages, struct homa_release_args *stats);
 #endif /* See strip.py */
 
 #ifdef __cplusplus
@@ -207,6 +207,97 @@ int homa_abort(int sockfd, uint64_t id, int error)
 	return ioctl(sockfd, HOMAIOCABORT, &args);
 }
 
+/**
+ * homa_recv_batch() - Receive several messages with a single kernel call.
+ * @sockfd:         File descriptor for the socket on which to receive.
+ * @msgs:           Information about the received messages is returned
+ *                  here.
+ * @max_msgs:       Number of entries available at @msgs.
+ * @flags:          OR-ed combination of HOMA_RECVMSG_REQUEST,
+ *                  HOMA_RECVMSG_RESPONSE, and HOMA_RECVMSG_NONBLOCKING.
+ * @bpage_offsets:  Bpages from previously received messages that can now
+ *                  be recycled (may be NULL if @num_bpages is 0).
+ * @num_bpages:     Number of entries in @bpage_offsets.
+ *
+ * Return:      The number of entries of @msgs that were filled in; if an
+ *              error occurred before any message was received, -1 is
+ *              returned and errno is set appropriately.
+ */
+int homa_recv_batch(int sockfd, struct homa_recvbatch_msg *msgs,
+		    uint32_t max_msgs, int flags,
+		    const uint32_t *bpage_offsets, uint32_t num_bpages)
+{
+	struct homa_recvbatch_args args;
+	int result;
+
+	args.msgs = msgs;
+	args.max_msgs = max_msgs;
+	args.num_msgs = 0;
+	args.flags = flags;
+	args.num_bpages = num_bpages;
+	args.bpage_offsets = (uint32_t *)bpage_offsets;
+	result = ioctl(sockfd, HOMAIOCRECVBATCH, &args);
+	if (result < 0)
+		return result;
+	return args.num_msgs;
+}
+
+/**
+ * homa_send_batch() - Send several requests and/or responses on a
+ * connected socket with a single kernel call.
+ * @sockfd:   File descriptor for a connected socket.
+ * @msgs:     Messages to send. For each entry, an id of 0 means a new
+ *            request (its id is returned in the entry); any other id
+ *            means the response for that request. The result field of
+ *            each processed entry is set to 0 or a negative errno.
+ * @count:    Number of entries in @msgs.
+ *
+ * Return:    The number of entries processed; if an error prevented any
+ *            entries from being processed, -1 is returned and errno is
+ *            set appropriately.
+ */
+int homa_send_batch(int sockfd, struct homa_sendbatch_msg *msgs,
+		    uint32_t count)
+{
+	struct homa_sendbatch_args args = {msgs, count, 0};
+	int result;
+
+	result = ioctl(sockfd, HOMAIOCSENDBATCH, &args);
+	if (result < 0)
+		return result;
+	return args.num_done;
+}
+
+/**
+ * homa_release() - Return bpages to a socket's buffer pool at any time
+ * (rather than with the next call to recvmsg), and find out how the pool
+ * is being used.
+ * @sockfd:         File descriptor for the socket whose pool the bpages
+ *                  came from.
+ * @bpage_offsets:  Bpages from previously received messages that can now
+ *                  be recycled (may be NULL if @num_bpages is 0).
+ * @num_bpages:     Number of entries in @bpage_offsets.
+ * @stats:          If non-NULL, information about the pool's occupancy
+ *                  (after the release) is returned here.
+ *
+ * Return:      0 for success. If an error occurred, -1 is returned and
+ *              errno is set appropriately.
+ */
+int homa_release(int sockfd, const uint32_t *bpage_offsets,
+		 uint32_t num_bpages, struct homa_release_args *stats)
+{
+	struct homa_release_args args = {
+		.bpage_offsets = (uint32_t *)bpage_offsets,
+		.num_bpages = num_bpages,
+	};
+	int result;
+
+	result = ioctl(sockfd, HOMAIOCRELEASE, &args);
+	if (result == 0 && stats)
+		*stats = args;
+	return result;
+}
+
 /**
  * homa_reply_connected() - Send a response message from a connected homa socket
  * for an RPC previously received with a call to recvmsg.
@@ -291,3 +382,27 @@ int homa_peeloff(int sockfd, struct sockaddr *client_addr, uint32_t addrlen)
 {
   	return getsockopt(sockfd, IPPROTO_HOMA, SO_HOMA_PEELOFF, (void *)client_addr, &addrlen);
 }
+
+/**
+ * homa_peeloff_batch() - Peel off sockets for several clients of a
+ * listening socket in one system call.
+ * @sockfd:   The socket from which to peel off.
+ * @entries:  One entry for each client; the addr field of each must be
+ *            filled in. On return, the fd field of each processed entry
+ *            holds the new socket's file descriptor (or a negative errno)
+ *            and the id field holds the id of the client's oldest unread
+ *            request, which is now available via recvmsg on the new socket.
+ * @count:    Number of entries in @entries.
+ *
+ * Return:    The number of entries processed, or -1 if an error occurred
+ *            (errno will be set).
+ */
+int homa_peeloff_batch(int sockfd, struct homa_peeloff_entry *entries,
+		       uint32_t count)
+{
+	struct homa_peeloff_batch_args args = {entries, count, 0};
+	socklen_t len = sizeof(args);
+
+	return getsockopt(sockfd, IPPROTO_HOMA, SO_HOMA_PEELOFF_BATCH,
+			  &args, &len);
+}
@@ -291,7 +291,7 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	int rank, recalc;
 
 	if (rpc->msgin.length < 0 || rpc->state == RPC_DEAD ||
-	    rpc->msgin.num_bpages <= 0) {
+	    (rpc->msgin.num_bpages <= 0 && !rpc->msgin.inline_data)) {
 		homa_rpc_unlock(rpc);
 		goto done;
 	}
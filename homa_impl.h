@@ -25,17 +25,22 @@
 #include <linux/audit.h>
 #include <linux/icmp.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/completion.h>
+#include <linux/hrtimer.h>
 #include <linux/proc_fs.h>
+#include <linux/rbtree.h>
 #include <linux/sched/clock.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/socket.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <net/busy_poll.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/protocol.h>
@@ -62,6 +67,9 @@ unsigned int mock_compound_order(struct page *page);
 #define cpu_to_node mock_cpu_to_node
 int mock_cpu_to_node(int cpu);
 
+#undef cpumask_of_node
+#define cpumask_of_node(node) ((const struct cpumask *)NULL)
+
 #undef current
 #define current current_task
 extern struct task_struct *current_task;
@@ -76,6 +84,9 @@ void *mock_kmalloc(size_t size, gfp_t flags);
 #undef kmalloc_array
 #define kmalloc_array(count, size, type) mock_kmalloc((count) * (size), type)
 
+#undef kvmalloc_array
+#define kvmalloc_array(count, size, type) mock_kmalloc((count) * (size), type)
+
 #define kthread_complete_and_exit(...)
 
 #ifdef page_address
@@ -114,6 +125,10 @@ void mock_spin_unlock(spinlock_t *lock);
 #define vmalloc mock_vmalloc
 void *mock_vmalloc(size_t size);
 
+#undef vmalloc_user
+#define vmalloc_user mock_vmalloc_user
+void *mock_vmalloc_user(size_t size);
+
 #undef DECLARE_PER_CPU
 #define DECLARE_PER_CPU(type, name) extern type name[10]
 
@@ -135,7 +150,10 @@ void *mock_vmalloc(size_t size);
 #endif /* See strip.py */
 
 /* Forward declarations. */
+struct homa_interest_queue;
+struct homa_pacer;
 struct homa_peer;
+struct homa_reaper;
 struct homa_sock;
 struct homa;
 
@@ -145,7 +163,7 @@ struct homa;
 #include "homa_metrics.h"
 
 /* Declarations used in this file, so they can't be made at the end. */
-void     homa_throttle_lock_slow(struct homa *homa);
+void     homa_throttle_lock_slow(struct homa_pacer *pacer);
 
 #define sizeof32(type) ((int)(sizeof(type)))
 
@@ -253,6 +271,147 @@ enum homa_freeze_type {
 	NEED_ACK_MISSING_DATA  = 6,
 };
 
+/**
+ * struct homa_pacer - Holds the output queue state for one network
+ * device (identified by its network namespace and ifindex). Each pacer keeps its own estimate
+ * of the device's transmit queue and its own list of throttled RPCs, and
+ * has its own kernel thread, so that output on different devices is
+ * paced independently. Pacers are created on demand; a device's pacer is
+ * removed from homa->pacers when the device is unregistered, and freed
+ * once no RPC refers to it.
+ */
+struct homa_pacer {
+	/**
+	 * @link_idle_time: The time, measured by sched_clock, at which we
+	 * estimate that all of the packets we have passed to Linux for
+	 * transmission on this device will have been transmitted. May be
+	 * in the past. This estimate assumes that only Homa is transmitting
+	 * data, so it could be a severe underestimate if there is competing
+	 * traffic from, say, TCP. Access only with atomic ops.
+	 */
+	atomic64_t link_idle_time __aligned(L1_CACHE_BYTES);
+
+	/**
+	 * @mutex: Ensures that only one instance of homa_pacer_xmit
+	 * runs at a time for this pacer. Only used in "try" mode: never
+	 * block on this.
+	 */
+	spinlock_t mutex __aligned(L1_CACHE_BYTES);
+
+	/**
+	 * @fifo_count: When this becomes <= zero, it's time for the
+	 * pacer to allow the oldest RPC to transmit.
+	 */
+	int fifo_count;
+
+	/**
+	 * @wake_time: time (in sched_clock units) when the pacer thread
+	 * last woke up (if the thread is running), the time when @hrtimer
+	 * is due to wake it (if it is sleeping on the timer), or 0 if it
+	 * is sleeping because there is nothing to transmit.
+	 */
+	__u64 wake_time;
+
+	/**
+	 * @throttle_lock: Used to synchronize access to @throttled_rpcs
+	 * and @throttled_by_age. To insert or remove an RPC from them,
+	 * must first acquire the RPC's lock, then this lock.
+	 */
+	spinlock_t throttle_lock;
+
+	/**
+	 * @throttled_rpcs: Contains all homa_rpcs sending on this device
+	 * that have bytes ready for transmission, but which couldn't be
+	 * sent without exceeding the queue limits for transmission. Sorted
+	 * by homa_rpc.throttled_bytes (fewest first, SRPT), with ties in
+	 * insertion order; linked through homa_rpc.throttled_node. May be
+	 * tested for emptiness without holding @throttle_lock.
+	 */
+	struct rb_root_cached throttled_rpcs;
+
+	/**
+	 * @throttled_by_age: Contains the same RPCs as @throttled_rpcs,
+	 * sorted by msgout.init_ns (oldest first) and linked through
+	 * homa_rpc.throttled_age_node. Used to implement
+	 * homa->pacer_fifo_fraction.
+	 */
+	struct rb_root_cached throttled_by_age;
+
+	/**
+	 * @throttle_add: The time (in sched_clock() units) when the most
+	 * recent RPC was added to @throttled_rpcs.
+	 */
+	__u64 throttle_add;
+
+	/** @homa: Overall information about the Homa transport. */
+	struct homa *homa;
+
+	/**
+	 * @net_cookie: net_cookie for the network namespace containing the
+	 * device whose output this pacer manages (ifindexes are only unique
+	 * within a namespace). Cookies are never reused, so no reference to
+	 * the namespace is needed. 0 for homa->default_pacer.
+	 */
+	__u64 net_cookie;
+
+	/**
+	 * @ifindex: Index of the network device whose output this pacer
+	 * manages. 0 is used for homa->default_pacer.
+	 */
+	int ifindex;
+
+	/** @links: Used to link this pacer into homa->pacers. */
+	struct list_head links;
+
+	/**
+	 * @refs: One reference while the pacer is in homa->pacers, plus one
+	 * for each RPC whose msgout.pacer refers to it. When this reaches
+	 * zero the pacer is queued on homa->dead_pacers to be freed.
+	 */
+	refcount_t refs;
+
+	/**
+	 * @dead_links: Used to link this pacer into homa->dead_pacers
+	 * (empty if it isn't there).
+	 */
+	struct list_head dead_links;
+
+	/**
+	 * @free_work: Used to stop @kthread and free the pacer from process
+	 * context once @refs reaches zero.
+	 */
+	struct work_struct free_work;
+
+	/**
+	 * @kthread: Kernel thread that transmits packets from
+	 * @throttled_rpcs in a way that limits queue buildup in the
+	 * NIC. NULL if the thread hasn't been started yet (or couldn't
+	 * be started); homa_check_pacer still services the pacer then.
+	 */
+	struct task_struct *kthread;
+
+	/**
+	 * @start_work: Used to start @kthread from process context, since
+	 * pacers can be created at softirq level.
+	 */
+	struct work_struct start_work;
+
+	/** @kthread_done: Completed when @kthread exits. */
+	struct completion kthread_done;
+
+	/**
+	 * @hrtimer: Used to wake up @kthread when the NIC queue has drained
+	 * enough to transmit more packets (only if homa->pacer_hrtimer is
+	 * set).
+	 */
+	struct hrtimer hrtimer;
+
+	/**
+	 * @exit: true means that @kthread should exit as soon as possible.
+	 */
+	bool exit;
+};
+
 /**
  * struct homa - Overall information about the Homa protocol implementation.
  *
@@ -267,16 +426,6 @@ struct homa {
 	 */
 	atomic64_t next_outgoing_id;
 
-	/**
-	 * @link_idle_time: The time, measured by sched_clock, at which we
-	 * estimate that all of the packets we have passed to Linux for
-	 * transmission will have been transmitted. May be in the past.
-	 * This estimate assumes that only Homa is transmitting data, so
-	 * it could be a severe underestimate if there is competing traffic
-	 * from, say, TCP. Access only with atomic ops.
-	 */
-	atomic64_t link_idle_time __aligned(L1_CACHE_BYTES);
-
 	/**
 	 * @grantable_lock: Used to synchronize access to grant-related
 	 * fields below, from @grantable_peers to @last_grantable_change.
@@ -377,50 +526,53 @@ struct homa {
 	int grant_nonfifo_left;
 
 	/**
-	 * @pacer_mutex: Ensures that only one instance of homa_pacer_xmit
-	 * runs at a time. Only used in "try" mode: never block on this.
+	 * @pacers_lock: Used to synchronize additions to and removals from
+	 * @pacers, and all access to @dead_pacers; not needed for lookups
+	 * in @pacers (RCU is used instead).
 	 */
-	spinlock_t pacer_mutex __aligned(L1_CACHE_BYTES);
+	spinlock_t pacers_lock __aligned(L1_CACHE_BYTES);
 
 	/**
-	 * @pacer_fifo_fraction: The fraction of time (in thousandths) when
-	 * the pacer should transmit next from the oldest message, rather
-	 * than the highest-priority message. Set externally via sysctl.
+	 * @pacers: Contains one struct homa_pacer for each registered
+	 * network device that Homa has transmitted on (plus @default_pacer).
+	 * Manipulate only with "_rcu" functions.
 	 */
-	int pacer_fifo_fraction;
+	struct list_head pacers;
 
 	/**
-	 * @pacer_fifo_count: When this becomes <= zero, it's time for the
-	 * pacer to allow the oldest RPC to transmit.
+	 * @default_pacer: Pacer used for output whose device couldn't be
+	 * determined or whose own pacer couldn't be allocated. Its thread
+	 * is started by homa_init.
 	 */
-	int pacer_fifo_count;
+	struct homa_pacer *default_pacer;
 
 	/**
-	 * @pacer_wake_time: time (in sched_clock units) when the pacer last
-	 * woke up (if the pacer is running) or 0 if the pacer is sleeping.
+	 * @dead_pacers: Pacers that are no longer referenced but whose
+	 * free_work hasn't yet freed them.
 	 */
-	__u64 pacer_wake_time;
+	struct list_head dead_pacers;
 
 	/**
-	 * @throttle_lock: Used to synchronize access to @throttled_rpcs. To
-	 * insert or remove an RPC from throttled_rpcs, must first acquire
-	 * the RPC's socket lock, then this lock.
+	 * @pacer_notifier: Used to learn when network devices are
+	 * unregistered, so their pacers can be released. notifier_call
+	 * is NULL if the notifier isn't registered.
 	 */
-	spinlock_t throttle_lock;
+	struct notifier_block pacer_notifier;
 
 	/**
-	 * @throttled_rpcs: Contains all homa_rpcs that have bytes ready
-	 * for transmission, but which couldn't be sent without exceeding
-	 * the queue limits for transmission. Manipulate only with "_rcu"
-	 * functions.
+	 * @pacer_fifo_fraction: The fraction of time (in thousandths) when
+	 * the pacer should transmit next from the oldest message, rather
+	 * than the highest-priority message. Set externally via sysctl.
 	 */
-	struct list_head throttled_rpcs;
+	int pacer_fifo_fraction;
 
 	/**
-	 * @throttle_add: The time (in sched_clock() units) when the most
-	 * recent RPC was added to @throttled_rpcs.
+	 * @pacer_hrtimer: Nonzero means that when the NIC queue is too long
+	 * for a pacer thread to transmit, it arms an hrtimer and sleeps
+	 * until the queue has drained; zero means the thread busy-waits.
+	 * Set externally via sysctl.
 	 */
-	__u64 throttle_add;
+	int pacer_hrtimer;
 
 	/**
 	 * @throttle_min_bytes: If a packet has fewer bytes than this, then it
@@ -680,22 +832,15 @@ struct homa {
 	int max_dead_buffs;
 
 	/**
-	 * @pacer_kthread: Kernel thread that transmits packets from
-	 * throttled_rpcs in a way that limits queue buildup in the
-	 * NIC.
+	 * @reapers: One background reaper for each NUMA node that has
+	 * cores; NULL for other nodes.
 	 */
-	struct task_struct *pacer_kthread;
-
-	/**
-	 * @pacer_exit: true means that the pacer thread should exit as
-	 * soon as possible.
-	 */
-	bool pacer_exit;
+	struct homa_reaper *reapers[MAX_NUMNODES];
 
 	/**
 	 * @max_nic_queue_ns: Limits the NIC queue length: we won't queue
-	 * up a packet for transmission if link_idle_time is this many
-	 * nanoseconds in the future (or more). Set externally via sysctl.
+	 * up a packet for transmission if a pacer's link_idle_time is this
+	 * many nanoseconds in the future (or more). Set externally via sysctl.
 	 */
 	int max_nic_queue_ns;
 
@@ -727,6 +872,13 @@ struct homa {
 	 */
 	int gso_force_software;
 
+	/**
+	 * @zerocopy_min: Messages shorter than this are copied from user
+	 * space even if they are sent with MSG_ZEROCOPY. Set externally
+	 * via sysctl.
+	 */
+	int zerocopy_min;
+
 	/**
 	 * @hijack_tcp: Non-zero means encapsulate outgoing Homa packets
 	 * as TCP packets (i.e. use TCP as the IP protocol). This makes TSO
@@ -768,6 +920,9 @@ struct homa {
 	 *                            core isn't overloaded).
 	 * HOMA_GRO_GEN3              Use the "Gen3" mechanisms for load
 	 *                            balancing.
+	 * HOMA_GRO_EARLY_DEMUX       Look up the destination socket during
+	 *                            GRO and attach it to the packet, so
+	 *                            SoftIRQ doesn't have to look it up.
 	 */
 	#define HOMA_GRO_SAME_CORE         2
 	#define HOMA_GRO_IDLE              4
@@ -776,8 +931,10 @@ struct homa {
 	#define HOMA_GRO_FAST_GRANTS    0x20
 	#define HOMA_GRO_SHORT_BYPASS   0x40
 	#define HOMA_GRO_GEN3           0x80
+	#define HOMA_GRO_EARLY_DEMUX   0x100
 	#define HOMA_GRO_NORMAL      (HOMA_GRO_SAME_CORE | HOMA_GRO_GEN2 | \
-				      HOMA_GRO_SHORT_BYPASS | HOMA_GRO_FAST_GRANTS)
+				      HOMA_GRO_SHORT_BYPASS | HOMA_GRO_FAST_GRANTS | \
+				      HOMA_GRO_EARLY_DEMUX)
 
 	/*
 	 * @busy_usecs: if there has been activity on a core within the
@@ -856,6 +1013,15 @@ struct homa {
 	 */
 	int bpage_lease_usecs;
 
+	/**
+	 * @bpage_quota: soft limit on the number of bpages that RPCs in one
+	 * socket may hold in a buffer pool shared with other sockets (see
+	 * homa_pool_allocate). 0 means no limit. This is the default for
+	 * sockets that haven't set SO_HOMA_BPAGE_QUOTA. Set externally via
+	 * sysctl.
+	 */
+	int bpage_quota;
+
 	/**
 	 * @next_id: Set via sysctl; causes next_outgoing_id to be set to
 	 * this value; always reads as zero. Typically used while debugging to
@@ -949,25 +1115,25 @@ static inline void homa_set_doff(struct homa_data_hdr *h, int size)
 }
 
 /**
- * homa_throttle_lock() - Acquire the throttle lock. If the lock
+ * homa_throttle_lock() - Acquire a pacer's throttle lock. If the lock
  * isn't immediately available, record stats on the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @pacer:   Pacer whose lock should be acquired.
  */
-static inline void homa_throttle_lock(struct homa *homa)
-	__acquires(&homa->throttle_lock)
+static inline void homa_throttle_lock(struct homa_pacer *pacer)
+	__acquires(&pacer->throttle_lock)
 {
-	if (!spin_trylock_bh(&homa->throttle_lock))
-		homa_throttle_lock_slow(homa);
+	if (!spin_trylock_bh(&pacer->throttle_lock))
+		homa_throttle_lock_slow(pacer);
 }
 
 /**
- * homa_throttle_unlock() - Release the throttle lock.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_throttle_unlock() - Release a pacer's throttle lock.
+ * @pacer:   Pacer whose lock should be released.
  */
-static inline void homa_throttle_unlock(struct homa *homa)
-	__releases(&homa->throttle_lock)
+static inline void homa_throttle_unlock(struct homa_pacer *pacer)
+	__releases(&pacer->throttle_lock)
 {
-	spin_unlock_bh(&homa->throttle_lock);
+	spin_unlock_bh(&pacer->throttle_lock);
 }
 
 /** skb_is_ipv6() - Return true if the packet is encapsulated with IPv6,
@@ -1039,6 +1205,27 @@ static inline struct in6_addr skb_canonical_ipv6_saddr(struct sk_buff *skb)
 				: ipv4_to_ipv6(ip_hdr(skb)->saddr);
 }
 
+/**
+ * skb_remote_sockaddr() - Fill in a socket address describing the sender
+ * of an incoming packet, in the form used to look up connected sockets.
+ * @skb:    Incoming packet; its IP header must be accessible.
+ * @sport:  Source port from the packet's Homa header (network byte order).
+ * @addr:   Will be filled in with the sender's address and port.
+ */
+static inline void skb_remote_sockaddr(struct sk_buff *skb, __be16 sport,
+				       union sockaddr_in_union *addr)
+{
+	if (skb_is_ipv6(skb)) {
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_addr = ipv6_hdr(skb)->saddr;
+		addr->in6.sin6_port = sport;
+	} else {
+		addr->in4.sin_family = AF_INET;
+		addr->in4.sin_addr.s_addr = ip_hdr(skb)->saddr;
+		addr->in4.sin_port = sport;
+	}
+}
+
 /**
  * is_mapped_ipv4() - Return true if an IPv6 address is actually an
  * IPv4-mapped address, false otherwise.
@@ -1091,6 +1278,8 @@ extern struct homa *global_homa;
 void     homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
 			 int port, int error);
 void     homa_abort_sock_rpcs(struct homa_sock *hsk, int error);
+int      homa_accept(struct socket *sock, struct socket *newsock,
+		     struct proto_accept_arg *arg);
 void     homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		      struct homa_rpc *rpc);
 void     homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb);
@@ -1098,13 +1287,14 @@ void     homa_add_to_throttled(struct homa_rpc *rpc);
 int      homa_backlog_rcv(struct sock *sk, struct sk_buff *skb);
 int      homa_bind(struct socket *sk, struct sockaddr *addr,
 		   int addr_len);
-int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
+int      homa_check_nic_queue(struct homa_pacer *pacer, struct sk_buff *skb,
 			      bool force);
 struct homa_rpc *homa_choose_fifo_grant(struct homa *homa);
 struct homa_interest *homa_choose_interest(struct homa *homa,
-					   struct list_head *head,
+					   struct homa_interest_queue *queue,
 					   int offset);
 void     homa_close(struct sock *sock, long timeout);
+int      homa_copy_inline(struct sk_buff_head *skbs, struct msghdr *msg);
 int      homa_copy_to_user(struct homa_rpc *rpc);
 void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 void     homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
@@ -1123,7 +1313,8 @@ int      homa_err_handler_v6(struct sk_buff *skb,
 			     struct inet6_skb_parm *opt, u8 type,  u8 code,
 			     int offset, __be32 info);
 int      homa_fill_data_interleaved(struct homa_rpc *rpc,
-				    struct sk_buff *skb, struct iov_iter *iter);
+				    struct sk_buff *skb, struct iov_iter *iter,
+				    bool zerocopy);
 void     homa_freeze(struct homa_rpc *rpc, enum homa_freeze_type type,
 		     char *format);
 void     homa_freeze_peers(struct homa *homa);
@@ -1137,7 +1328,11 @@ enum hrtimer_restart homa_hrtimer(struct hrtimer *timer);
 int      homa_init(struct homa *homa);
 void     homa_incoming_sysctl_changed(struct homa *homa);
 int      homa_ioc_abort(struct sock *sk, int *karg);
+int      homa_ioc_recv_batch(struct sock *sk, int *karg);
+int      homa_ioc_release(struct sock *sk, int *karg);
+int      homa_ioc_send_batch(struct sock *sk, int *karg);
 int      homa_ioctl(struct sock *sk, int cmd, int *karg);
+int      homa_listen(struct socket *sock, int backlog);
 int      homa_load(void);
 void     homa_log_throttled(struct homa *homa);
 int      homa_message_in_init(struct homa_rpc *rpc, int length,
@@ -1145,17 +1340,30 @@ int      homa_message_in_init(struct homa_rpc *rpc, int length,
 int      homa_message_out_fill(struct homa_rpc *rpc,
 			       struct iov_iter *iter, int xmit);
 void     homa_message_out_init(struct homa_rpc *rpc, int length);
+int      homa_mmap(struct file *file, struct socket *sock,
+		   struct vm_area_struct *vma);
 void     homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 			   struct homa_rpc *rpc);
 struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 				     struct iov_iter *iter, int offset,
 				     int length, int max_seg_data);
 void     homa_outgoing_sysctl_changed(struct homa *homa);
-int      homa_pacer_main(void *transport);
-void     homa_pacer_stop(struct homa *homa);
-void     homa_pacer_xmit(struct homa *homa);
+bool     homa_pacer_arm_timer(struct homa_pacer *pacer);
+struct homa_pacer *homa_pacer_get(struct homa *homa, struct net_device *dev);
+enum hrtimer_restart homa_pacer_hrtimer(struct hrtimer *timer);
+int      homa_pacer_main(void *arg);
+int      homa_pacer_netdev_event(struct notifier_block *nb,
+				 unsigned long event, void *ptr);
+struct homa_pacer *homa_pacer_new(struct homa *homa, struct net_device *dev,
+				  gfp_t gfp);
+void     homa_pacer_put(struct homa_pacer *pacer);
+void     homa_pacer_stop(struct homa_pacer *pacer);
+void     homa_pacer_xmit(struct homa_pacer *pacer);
+void     homa_pacers_destroy(struct homa *homa);
 __poll_t homa_poll(struct file *file, struct socket *sock,
 		   struct poll_table_struct *wait);
+__u64    homa_poll_budget(struct homa_sock *hsk, __u64 now);
+void     homa_poll_record_arrival(struct homa_sock *hsk);
 char    *homa_print_ipv4_addr(__be32 addr);
 char    *homa_print_ipv6_addr(const struct in6_addr *addr);
 char    *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len);
@@ -1184,6 +1392,8 @@ int      homa_shutdown(struct socket *sock, int how);
 int      homa_snprintf(char *buffer, int size, int used,
 		       const char *format, ...) __printf(4, 5);
 int      homa_softirq(struct sk_buff *skb);
+void     homa_sock_flush_wakeups(void);
+void     homa_sock_wakeup(struct homa_sock *hsk);
 void     homa_spin(int ns);
 char    *homa_symbol_for_type(uint8_t type);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
@@ -1227,20 +1437,25 @@ void     homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk);
  */
 static inline void homa_check_pacer(struct homa *homa, int softirq)
 {
-	if (list_empty(&homa->throttled_rpcs))
-		return;
-
-	/* The ">> 1" in the line below gives homa_pacer_main the first chance
-	 * to queue new packets; if the NIC queue becomes more than half
-	 * empty, then we will help out here.
-	 */
-	if ((sched_clock() + (homa->max_nic_queue_ns >> 1)) <
-			atomic64_read(&homa->link_idle_time))
-		return;
-	tt_record("homa_check_pacer calling homa_pacer_xmit");
-	homa_pacer_xmit(homa);
-	INC_METRIC(pacer_needed_help, 1);
+	struct homa_pacer *pacer;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(pacer, &homa->pacers, links) {
+		if (RB_EMPTY_ROOT(&pacer->throttled_rpcs.rb_root))
+			continue;
+
+		/* The ">> 1" in the line below gives homa_pacer_main the
+		 * first chance to queue new packets; if the NIC queue
+		 * becomes more than half empty, then we will help out here.
+		 */
+		if ((sched_clock() + (homa->max_nic_queue_ns >> 1)) <
+				atomic64_read(&pacer->link_idle_time))
+			continue;
+		tt_record1("homa_check_pacer calling homa_pacer_xmit for device %d",
+			   pacer->ifindex);
+		homa_pacer_xmit(pacer);
+		INC_METRIC(pacer_needed_help, 1);
+	}
+	rcu_read_unlock();
 }
-
-extern struct completion homa_pacer_kthread_done;
 #endif /* _HOMA_IMPL_H */
@@ -9,6 +9,7 @@
 #include "homa_offload.h"
 #include "homa_peer.h"
 #include "homa_pool.h"
+#include "homa_ring.h"
 
 /**
  * homa_message_in_init() - Constructor for homa_message_in.
@@ -34,14 +35,24 @@ int homa_message_in_init(struct homa_rpc *rpc, int length, int unsched)
 	rpc->msgin.priority = 0;
 	rpc->msgin.resend_all = 0;
 	rpc->msgin.num_bpages = 0;
-	err = homa_pool_allocate(rpc);
-	if (err != 0)
-		return err;
-	if (rpc->msgin.num_bpages == 0) {
-		/* The RPC is now queued waiting for buffer space, so we're
-		 * going to discard all of its packets.
+	rpc->msgin.inline_data = 0;
+	if (length <= READ_ONCE(rpc->hsk->inline_max) &&
+	    !READ_ONCE(rpc->hsk->ring)) {
+		/* Small enough for recvmsg to copy straight from the
+		 * packets to the application's iovec: no buffers needed.
 		 */
-		rpc->msgin.granted = 0;
+		rpc->msgin.inline_data = 1;
+		INC_METRIC(inline_msgs, 1);
+	} else {
+		err = homa_pool_allocate(rpc);
+		if (err != 0)
+			return err;
+		if (rpc->msgin.num_bpages == 0) {
+			/* The RPC is now queued waiting for buffer space,
+			 * so we're going to discard all of its packets.
+			 */
+			rpc->msgin.granted = 0;
+		}
 	}
 	if (length < HOMA_NUM_SMALL_COUNTS * 64) {
 		INC_METRIC(small_msg_bytes[(length - 1) >> 6], length);
@@ -236,6 +247,12 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 	int n = 0;             /* Number of filled entries in skbs. */
 	int i;
 
+	/* Inline messages stay in their packets until homa_recvmsg copies
+	 * them out with homa_copy_inline.
+	 */
+	if (rpc->msgin.inline_data)
+		return 0;
+
 	/* Tricky note: we can't hold the RPC lock while we're actually
 	 * copying to user space, because (a) it's illegal to hold a spinlock
 	 * while copying to user space and (b) we'd like for homa_softirq
@@ -282,6 +299,18 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 			int copied = 0;
 			char *dst;
 
+			/* If the region is pinned, the kernel can copy
+			 * through its own mapping, which avoids user page
+			 * faults and per-chunk SMAP toggling.
+			 */
+			if (READ_ONCE(rpc->hsk->buffer_pool->pinned_pages)) {
+				error = homa_pool_copy_skb(rpc, skbs[i]);
+				if (error)
+					goto free_skbs;
+				INC_METRIC(pinned_copy_bytes, pkt_length);
+				copied = pkt_length;
+			}
+
 			/* Each iteration of this loop copies to one
 			 * user buffer.
 			 */
@@ -351,6 +380,57 @@ free_skbs:
 	return error;
 }
 
+/**
+ * homa_copy_inline() - Copy a complete inline message (one with no
+ * buffer space; see SO_HOMA_INLINE) from its packets directly into the
+ * iovec passed to recvmsg. If the iovec is too small, the message is
+ * truncated and MSG_TRUNC is set in @msg->msg_flags.
+ * @skbs:    Packets containing all of the message's data, in any order;
+ *           they have been removed from their RPC (which need not be
+ *           locked) and are freed by this function.
+ * @msg:     Describes the iovec to copy into; its msg_iter is advanced
+ *           over the data that was copied.
+ *
+ * Return:   Zero for success or a negative errno if there is an error.
+ */
+int homa_copy_inline(struct sk_buff_head *skbs, struct msghdr *msg)
+{
+	int chunk, offset, next_offset, error = 0;
+	struct sk_buff *skb, *next;
+	int frees = 0;
+
+	while (!skb_queue_empty(skbs)) {
+		/* Packets can arrive out of order, but the iovec must be
+		 * filled sequentially; there are only a few packets, so a
+		 * simple scan for the lowest offset is fine.
+		 */
+		next = NULL;
+		next_offset = 0;
+		skb_queue_walk(skbs, skb) {
+			offset = ntohl(((struct homa_data_hdr *)skb->data)
+				       ->seg.offset);
+			if (!next || offset < next_offset) {
+				next = skb;
+				next_offset = offset;
+			}
+		}
+		__skb_unlink(next, skbs);
+		chunk = homa_data_len(next);
+		if (chunk > iov_iter_count(&msg->msg_iter)) {
+			chunk = iov_iter_count(&msg->msg_iter);
+			msg->msg_flags |= MSG_TRUNC;
+		}
+		if (error == 0 && chunk > 0)
+			error = skb_copy_datagram_iter(next,
+					sizeof(struct homa_data_hdr),
+					&msg->msg_iter, chunk);
+		kfree_skb(next);
+		frees++;
+	}
+	INC_METRIC(skb_frees, frees);
+	return error;
+}
+
 /**
  * homa_dispatch_pkts() - Top-level function that processes a batch of packets,
  * all related to the same RPC.
@@ -381,26 +461,17 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 	struct sk_buff *next;
 	int num_acks = 0;
 
-	/* For homa_sock_find_connected()*/
-	/* Declare a sockaddr_storage to hold the remote address. */
-	struct sockaddr_storage remote_addr_storage;
-	struct sockaddr *remote_addr = (struct sockaddr *)&remote_addr_storage;
-	/* Extract source IP and port from the packet. */
-	if (skb_is_ipv6(skb)) {
-		/* IPv6 packet. */
-		struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)remote_addr;
-		sa6->sin6_family = AF_INET6;
-		sa6->sin6_addr = ipv6_hdr(skb)->saddr;
-		sa6->sin6_port = h->common.sport; // Already in network byte order
-	} else {
-		/* IPv4 packet. */
-		struct sockaddr_in *sa4 = (struct sockaddr_in *)remote_addr;
-		sa4->sin_family = AF_INET;
-		sa4->sin_addr.s_addr = ip_hdr(skb)->saddr; // Network byte order
-		sa4->sin_port = h->common.sport;           // Network byte order
+	/* Find the appropriate socket: homa_gro_early_demux will normally
+	 * have attached it to the packet already.
+	 */
+	hsk = homa_skb_sock(skb);
+	if (!hsk) {
+		union sockaddr_in_union remote;
+
+		skb_remote_sockaddr(skb, h->common.sport, &remote);
+		hsk = homa_sock_find_connected(homa->port_map, &remote.sa,
+					       dport);
 	}
-	/* Find the appropriate socket.*/
-	hsk = homa_sock_find_connected(homa->port_map, remote_addr, dport);
 	if (!hsk) {
 		if (skb_is_ipv6(skb))
 			icmp6_send(skb, ICMPV6_DEST_UNREACH,
@@ -419,6 +490,11 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 		return;
 	}
 
+	/* Remember which NIC queue the socket's packets arrive on, so that
+	 * threads waiting on the socket can poll it (see homa_busy_poll).
+	 */
+	sk_mark_napi_id(&hsk->sock, skb);
+
 	/* Each iteration through the following loop processes one packet. */
 	for (; skb; skb = next) {
 		h = (struct homa_data_hdr *)skb->data;
@@ -445,11 +521,21 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 				if (h->common.type == DATA) {
 					int created;
 
+					/* If hsk was just peeled off, the
+					 * RPC may not have been moved to it
+					 * yet.
+					 */
+					if (unlikely(READ_ONCE(hsk->migrating)))
+						rpc = homa_find_parent_rpc(hsk,
+								&saddr, id);
+
 					/* Create a new RPC if one doesn't
 					 * already exist.
 					 */
-					rpc = homa_rpc_new_server(hsk, &saddr,
-								  h, &created);
+					if (!rpc)
+						rpc = homa_rpc_new_server(hsk,
+								&saddr, h,
+								&created);
 					if (IS_ERR(rpc)) {
 						pr_warn("homa_pkt_dispatch couldn't create server rpc: error %lu",
 							-PTR_ERR(rpc));
@@ -464,6 +550,8 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 			} else {
 				rpc = homa_find_client_rpc(hsk, id);
 			}
+			if (unlikely(!rpc) && hsk->connect)
+				rpc = homa_find_parent_rpc(hsk, &saddr, id);
 		}
 		if (unlikely(!rpc)) {
 			if (h->common.type != CUTOFFS &&
@@ -557,8 +645,8 @@ discard:
 	}
 
 	if (hsk->dead_skbs >= 2 * hsk->homa->dead_buffs_limit) {
-		/* We get here if neither homa_wait_for_message
-		 * nor homa_timer can keep up with reaping dead
+		/* We get here if neither the reaper thread nor
+		 * homa_wait_for_message can keep up with reaping dead
 		 * RPCs. See reap.txt for details.
 		 */
 		__u64 start = sched_clock();
@@ -604,7 +692,7 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 			goto discard;
 	}
 
-	if (rpc->msgin.num_bpages == 0) {
+	if (rpc->msgin.num_bpages == 0 && !rpc->msgin.inline_data) {
 		/* Drop packets that arrive when we can't allocate buffer
 		 * space. If we keep them around, packet buffer usage can
 		 * exceed available cache space, resulting in poor
@@ -619,13 +707,29 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 
 	homa_add_packet(rpc, skb);
 
+	/* Inline messages can't be copied out piecemeal, so there's no
+	 * point handing them off until they are complete.
+	 */
 	if (skb_queue_len(&rpc->msgin.packets) != 0 &&
-	    !(atomic_read(&rpc->flags) & RPC_PKTS_READY)) {
+	    !(atomic_read(&rpc->flags) & RPC_PKTS_READY) &&
+	    (!rpc->msgin.inline_data || rpc->msgin.bytes_remaining == 0)) {
 		atomic_or(RPC_PKTS_READY, &rpc->flags);
 		homa_sock_lock(rpc->hsk, "homa_data_pkt");
 		homa_rpc_handoff(rpc);
 		homa_sock_unlock(rpc->hsk);
 	}
+	if ((atomic_read(&rpc->flags) & RPC_RING_WAITING) &&
+	    rpc->msgin.bytes_remaining == 0) {
+		/* The message is now complete; try again to hand it off
+		 * (it will most likely go to the completion ring).
+		 */
+		atomic_andnot(RPC_RING_WAITING, &rpc->flags);
+		homa_sock_lock(rpc->hsk, "homa_data_pkt #2");
+		homa_rpc_handoff(rpc);
+		homa_sock_unlock(rpc->hsk);
+	}
+	if (atomic_read(&rpc->flags) & RPC_RING_PENDING)
+		homa_ring_post(rpc);
 
 	if (ntohs(h->cutoff_version) != homa->cutoff_version) {
 		/* The sender has out-of-date cutoffs. Note: we may need
@@ -1159,13 +1263,14 @@ int homa_register_interests(struct homa_interest *interest,
 					       ready_links);
 			goto claim_rpc;
 		}
-		/* Insert this thread at the *front* of the list;
+		/* Insert this thread at the *front* of its list;
 		 * we'll get better cache locality if we reuse
 		 * the same thread over and over, rather than
 		 * round-robining between threads.  Same below.
 		 */
-		list_add(&interest->response_links,
-			 &hsk->response_interests);
+		homa_interest_queue_add(&hsk->response_interests,
+					&interest->response_links,
+					interest->core);
 	}
 	if (flags & HOMA_RECVMSG_REQUEST) {
 		if (!list_empty(&hsk->ready_requests)) {
@@ -1178,7 +1283,9 @@ int homa_register_interests(struct homa_interest *interest,
 				list_del(&interest->response_links);
 			goto claim_rpc;
 		}
-		list_add(&interest->request_links, &hsk->request_interests);
+		homa_interest_queue_add(&hsk->request_interests,
+					&interest->request_links,
+					interest->core);
 	}
 	homa_sock_unlock(hsk);
 	return 0;
@@ -1188,7 +1295,7 @@ claim_rpc:
 	if (!list_empty(&hsk->ready_requests) ||
 	    !list_empty(&hsk->ready_responses)) {
 		// There are still more RPCs available, so let Linux know.
-		hsk->sock.sk_data_ready(&hsk->sock);
+		homa_sock_wakeup(hsk);
 	}
 
 	/* This flag is needed to keep the RPC from being reaped during the
@@ -1208,6 +1315,141 @@ claim_rpc:
 	return 0;
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/**
+ * struct homa_busy_poll_args - Passed to homa_busy_poll_end while a
+ * thread drives NAPI polling in homa_busy_poll.
+ */
+struct homa_busy_poll_args {
+	/** @interest: The waiting thread's interest. */
+	struct homa_interest *interest;
+
+	/** @end: sched_clock() time when polling should stop. */
+	__u64 end;
+};
+
+/**
+ * homa_busy_poll_end() - Callback for napi_busy_loop: decides whether
+ * busy polling should stop.
+ * @p:           Points to a struct homa_busy_poll_args.
+ * @start_time:  Not used.
+ *
+ * Return:  True means stop polling: either an RPC has been handed to the
+ *          waiting thread or its poll budget has expired.
+ */
+static bool homa_busy_poll_end(void *p, unsigned long start_time)
+{
+	struct homa_busy_poll_args *args = p;
+
+	return atomic_long_read(&args->interest->ready_rpc) != 0 ||
+			sched_clock() >= args->end;
+}
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
+/**
+ * homa_busy_poll() - If busy polling has been enabled for a socket (with
+ * SO_BUSY_POLL), poll the NIC queue that the socket's packets arrive on,
+ * so that packets are processed by the waiting thread's core without
+ * waiting for an interrupt.
+ * @hsk:       Socket on which a thread is waiting.
+ * @interest:  Interest of the waiting thread.
+ * @end:       sched_clock() time when the thread's poll budget expires.
+ *
+ * Return:     True if the NIC queue was polled, false if busy polling isn't
+ *             enabled for @hsk (or no packets have arrived for it yet).
+ */
+static bool homa_busy_poll(struct homa_sock *hsk,
+			   struct homa_interest *interest, __u64 end)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	struct homa_offload_core *offload_core;
+	struct sock *sk = &hsk->sock;
+	struct homa_busy_poll_args args;
+	unsigned int napi_id;
+
+	napi_id = READ_ONCE(sk->sk_napi_id);
+	if (!sk_can_busy_loop(sk) || napi_id < MIN_NAPI_ID)
+		return false;
+	args.interest = interest;
+	args.end = end;
+
+	/* napi_busy_loop may reschedule, so this thread could finish on a
+	 * different core; busy_polling is just a hint, so that's OK.
+	 */
+	offload_core = &per_cpu(homa_offload_core, raw_smp_processor_id());
+	WRITE_ONCE(offload_core->busy_polling, 1);
+	napi_busy_loop(napi_id, homa_busy_poll_end, &args,
+		       READ_ONCE(sk->sk_prefer_busy_poll),
+		       READ_ONCE(sk->sk_busy_poll_budget) ?: BUSY_POLL_BUDGET);
+	WRITE_ONCE(offload_core->busy_polling, 0);
+	INC_METRIC(busy_poll_loops, 1);
+	return true;
+#else /* CONFIG_NET_RX_BUSY_POLL */
+	return false;
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+}
+
+/**
+ * homa_poll_budget() - Decide how long a thread waiting for a message on a
+ * socket should busy-wait before going to sleep.
+ * @hsk:    Socket on which the thread is waiting.
+ * @now:    Current time, in sched_clock() units.
+ *
+ * Return:  The poll budget in ns; 0 means the thread should sleep without
+ *          polling.
+ */
+__u64 homa_poll_budget(struct homa_sock *hsk, __u64 now)
+{
+	int usecs = READ_ONCE(hsk->poll_usecs);
+	__u64 budget, last, expected;
+
+	if (usecs < 0)
+		usecs = hsk->homa->poll_usecs;
+	budget = 1000 * (__u64)usecs;
+	if (budget == 0 || !READ_ONCE(hsk->poll_adaptive))
+		return budget;
+
+	/* Poll only if the next message is expected within the budget.
+	 * If it is overdue by more than the budget, the traffic pattern
+	 * has probably changed, so don't count on it either.
+	 */
+	last = READ_ONCE(hsk->last_arrival);
+	if (last == 0)
+		return budget;
+	expected = last + READ_ONCE(hsk->avg_interarrival);
+	if (expected > now + budget || now > expected + budget)
+		return 0;
+	return budget;
+}
+
+/**
+ * homa_poll_record_arrival() - Update a socket's inter-arrival statistics
+ * (used for adaptive polling) when an RPC becomes ready on it.
+ * @hsk:    Socket on which an RPC is being handed off; must be locked.
+ */
+void homa_poll_record_arrival(struct homa_sock *hsk)
+{
+	__u64 now = sched_clock();
+	__u64 gap, limit, avg;
+	int usecs;
+
+	if (hsk->last_arrival != 0) {
+		/* Limit the influence of idle periods, so that polling
+		 * resumes quickly once traffic picks up again.
+		 */
+		usecs = hsk->poll_usecs;
+		if (usecs < 0)
+			usecs = hsk->homa->poll_usecs;
+		limit = 4000 * (__u64)usecs;
+		gap = now - hsk->last_arrival;
+		if (gap > limit)
+			gap = limit;
+		avg = hsk->avg_interarrival;
+		WRITE_ONCE(hsk->avg_interarrival, avg - (avg >> 2) + (gap >> 2));
+	}
+	WRITE_ONCE(hsk->last_arrival, now);
+}
+
 /**
  * homa_wait_for_message() - Wait for receipt of an incoming message
  * that matches the parameters. Various other activities can occur while
@@ -1225,7 +1467,7 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 				       __u64 id)
 	__acquires(&rpc->bucket_lock)
 {
-	__u64 poll_start, poll_end, now;
+	__u64 poll_start, poll_end, budget, now;
 	int error, blocked = 0, polled = 0;
 	struct homa_rpc *result = NULL;
 	struct homa_interest interest;
@@ -1247,11 +1489,16 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 			goto found_rpc;
 		}
 
-		/* There is no ready RPC so far. Clean up dead RPCs before
-		 * going to sleep (or returning, if in nonblocking mode).
+		/* There is no ready RPC so far. Dead RPCs are normally freed
+		 * by the socket's reaper thread; clean them up here (before
+		 * going to sleep, or returning if in nonblocking mode) only
+		 * if there is no reaper or it isn't keeping up.
 		 */
-		while (1) {
+		while (!homa_reaper_active(hsk) ||
+		       hsk->dead_skbs >= hsk->homa->dead_buffs_limit) {
 			int reaper_result;
+			__u64 reap_ns;
+
 			rpc = (struct homa_rpc *)atomic_long_read(&interest
 								  .ready_rpc);
 			if (rpc) {
@@ -1259,8 +1506,16 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 					   rpc->id);
 				goto found_rpc;
 			}
+			if (homa_reaper_active(hsk))
+				INC_METRIC(forced_reaps, 1);
+			reap_ns = sched_clock();
 			reaper_result = homa_rpc_reap(hsk,
 						      hsk->homa->reap_limit);
+			reap_ns = sched_clock() - reap_ns;
+			INC_METRIC(wait_reaps, 1);
+			INC_METRIC(wait_reap_ns, reap_ns);
+			if (reap_ns > HOMA_SLOW_REAP_NS)
+				INC_METRIC(wait_reap_slow, 1);
 			if (reaper_result == 0) {
 				break;
 			}
@@ -1282,8 +1537,11 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		 */
 		now = sched_clock();
 		poll_start = now;
-		poll_end = now + (1000 * hsk->homa->poll_usecs);
-		while (1) {
+		budget = homa_poll_budget(hsk, now);
+		poll_end = now + budget;
+		if (budget == 0)
+			INC_METRIC(poll_skips, 1);
+		while (budget != 0) {
 			__u64 blocked;
 			rpc = (struct homa_rpc *)atomic_long_read(&interest.ready_rpc);
 			if (rpc) {
@@ -1292,12 +1550,18 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 					   current->pid);
 				polled = 1;
 				INC_METRIC(poll_ns, now - poll_start);
+				INC_METRIC(poll_hits, 1);
 				goto found_rpc;
 			}
 			if (now >= poll_end) {
 				INC_METRIC(poll_ns, now - poll_start);
+				INC_METRIC(poll_misses, 1);
 				break;
 			}
+			if (homa_busy_poll(hsk, &interest, poll_end)) {
+				now = sched_clock();
+				continue;
+			}
 			blocked = sched_clock();
 			schedule();
 			now = sched_clock();
@@ -1379,7 +1643,8 @@ found_rpc:
 			}
 			atomic_andnot(RPC_PKTS_READY, &rpc->flags);
 			if (rpc->msgin.bytes_remaining == 0 &&
-			    !skb_queue_len(&rpc->msgin.packets)) {
+			    (rpc->msgin.inline_data ||
+			     !skb_queue_len(&rpc->msgin.packets))) {
 				goto done;
 			}
 			homa_rpc_unlock(rpc);
@@ -1403,39 +1668,56 @@ done:
 }
 
 /**
- * homa_choose_interest() - Given a list of interests for an incoming
- * message, choose the best one to handle it (if any).
+ * homa_choose_interest() - Given the interests for an incoming message,
+ * choose the best one to handle it (if any).
  * @homa:        Overall information about the Homa transport.
- * @head:        Head pointers for the list of interest: either
- *		 hsk->request_interests or hsk->response_interests.
+ * @queue:       Interests to choose from: either hsk->request_interests or
+ *               hsk->response_interests.
  * @offset:      Offset of "next" pointers in the list elements (either
  *               offsetof(request_links) or offsetof(response_links).
  * Return:       An interest to use for the incoming message, or NULL if none
  *               is available. If possible, this function tries to pick an
  *               interest whose thread is running on a core that isn't
- *               currently busy doing Homa transport work.
+ *               currently busy doing Homa transport work, preferring
+ *               threads on the current core's NUMA node. The cost doesn't
+ *               depend on the number of waiting threads: at most
+ *               HOMA_INTEREST_SCAN interests are examined per node.
  */
 struct homa_interest *homa_choose_interest(struct homa *homa,
-					   struct list_head *head, int offset)
+					   struct homa_interest_queue *queue,
+					   int offset)
 {
 	__u64 busy_time = sched_clock() - homa->busy_ns;
+	int node = homa_interest_node(raw_smp_processor_id());
 	struct homa_interest *backup = NULL;
 	struct homa_interest *interest;
-	struct list_head *pos;
-
-	list_for_each(pos, head) {
-		interest = (struct homa_interest *)(((char *)pos) - offset);
-		if (per_cpu(homa_offload_core, interest->core).last_active <
-				busy_time) {
-			if (backup)
-				INC_METRIC(handoffs_alt_thread, 1);
-			return interest;
+	struct list_head *head, *pos;
+	int i, scanned;
+
+	for (i = 0; i < HOMA_INTEREST_NODES; i++) {
+		head = &queue->nodes[(node + i) % HOMA_INTEREST_NODES];
+		scanned = 0;
+		list_for_each(pos, head) {
+			interest = (struct homa_interest *)(((char *)pos)
+					- offset);
+			if (per_cpu(homa_offload_core, interest->core)
+					.last_active < busy_time) {
+				if (backup)
+					INC_METRIC(handoffs_alt_thread, 1);
+				return interest;
+			}
+			if (!backup)
+				backup = interest;
+			scanned++;
+			if (scanned >= HOMA_INTEREST_SCAN)
+				break;
 		}
-		if (!backup)
-			backup = interest;
 	}
 
-	/* All interested threads are on busy cores; return the first. */
+	/* All of the interested threads we checked are on busy cores;
+	 * return the first (the most recently registered on the nearest
+	 * node).
+	 */
 	return backup;
 }
 
@@ -1454,6 +1736,8 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 	if ((atomic_read(&rpc->flags) & RPC_HANDING_OFF) ||
 	    !list_empty(&rpc->ready_links))
 		return;
+	if (hsk->poll_adaptive)
+		homa_poll_record_arrival(hsk);
 
 	/* First, see if someone is interested in this RPC specifically.
 	 */
@@ -1470,8 +1754,20 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 							 response_links));
 		if (interest)
 			goto thread_waiting;
+		if (hsk->ring && homa_ring_defer(rpc))
+			return;
 		list_add_tail(&rpc->ready_links, &hsk->ready_responses);
 		INC_METRIC(responses_queued, 1);
+	} else if (hsk->accept_queue_len < hsk->accept_backlog) {
+		/* The socket is listening and the request's client doesn't
+		 * have a socket of its own yet (if it did, the request would
+		 * have been delivered there), so save the request for
+		 * homa_accept.
+		 */
+		list_add_tail(&rpc->ready_links, &hsk->accept_queue);
+		atomic_or(RPC_ACCEPT_QUEUED, &rpc->flags);
+		hsk->accept_queue_len++;
+		INC_METRIC(requests_accept_queued, 1);
 	} else {
 		interest = homa_choose_interest(hsk->homa,
 						&hsk->request_interests,
@@ -1479,6 +1775,8 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 							 request_links));
 		if (interest)
 			goto thread_waiting;
+		if (hsk->ring && homa_ring_defer(rpc))
+			return;
 		list_add_tail(&rpc->ready_links, &hsk->ready_requests);
 		INC_METRIC(requests_queued, 1);
 	}
@@ -1488,7 +1786,7 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 	 */
 
 	/* Notify the poll mechanism. */
-	hsk->sock.sk_data_ready(&hsk->sock);
+	homa_sock_wakeup(hsk);
 	tt_record2("homa_rpc_handoff finished queuing id %d for port %d",
 		   rpc->id, hsk->port);
 	return;
@@ -1528,6 +1826,66 @@ thread_waiting:
 	wake_up_process(interest->thread);
 }
 
+/**
+ * homa_sock_wakeup() - Notify poll/epoll waiters that a socket has ready
+ * RPCs. When invoked during a batch of packets in homa_softirq, the wakeup
+ * is deferred until the end of the batch, so a burst of handoffs on a
+ * socket produces a single wakeup (and, for EPOLLEXCLUSIVE waiters, wakes
+ * a single thread; that thread wakes another if RPCs remain once it has
+ * claimed one).
+ * @hsk:    Socket with ready RPCs; must be locked.
+ */
+void homa_sock_wakeup(struct homa_sock *hsk)
+{
+	struct homa_offload_core *offload_core;
+
+	offload_core = &per_cpu(homa_offload_core, raw_smp_processor_id());
+	if (offload_core->defer_wakeups) {
+		if (hsk->wakeup_pending) {
+			INC_METRIC(sock_wakeups_coalesced, 1);
+			return;
+		}
+		if (offload_core->num_wakeups < HOMA_MAX_DEFERRED_WAKEUPS) {
+			hsk->wakeup_pending = 1;
+			offload_core->wakeups[offload_core->num_wakeups] = hsk;
+			offload_core->num_wakeups++;
+			return;
+		}
+	}
+	INC_METRIC(sock_wakeups, 1);
+	hsk->sock.sk_data_ready(&hsk->sock);
+}
+
+/**
+ * homa_sock_flush_wakeups() - Issue the wakeups deferred by
+ * homa_sock_wakeup during a batch of packets on this core, and stop
+ * deferring wakeups. Invoked by homa_softirq at the end of each batch,
+ * with no locks held. Sockets can't be freed until the batch is finished,
+ * since homa_softirq runs in an RCU read-side critical section.
+ */
+void homa_sock_flush_wakeups(void)
+{
+	struct homa_offload_core *offload_core;
+	struct homa_sock *hsk;
+	int i;
+
+	offload_core = &per_cpu(homa_offload_core, raw_smp_processor_id());
+	offload_core->defer_wakeups = 0;
+	for (i = 0; i < offload_core->num_wakeups; i++) {
+		hsk = offload_core->wakeups[i];
+
+		/* Acquiring the lock ensures that RPCs queued by other cores
+		 * that saw wakeup_pending are visible to the woken threads.
+		 */
+		homa_sock_lock(hsk, "homa_sock_flush_wakeups");
+		hsk->wakeup_pending = 0;
+		homa_sock_unlock(hsk);
+		INC_METRIC(sock_wakeups, 1);
+		hsk->sock.sk_data_ready(&hsk->sock);
+	}
+	offload_core->num_wakeups = 0;
+}
+
 /**
  * homa_incoming_sysctl_changed() - Invoked whenever a sysctl value is changed;
  * any input-related parameters that depend on sysctl-settable values.
@@ -104,6 +104,10 @@ char *homa_metrics_print(struct homa *homa)
 		  m->large_msg_bytes, lower);
 		M("sent_msg_bytes            %15llu  otal bytes in all outgoing messages\n",
 		  m->sent_msg_bytes);
+		M("zerocopy_msgs             %15llu  Outgoing messages sent without copying (MSG_ZEROCOPY)\n",
+		  m->zerocopy_msgs);
+		M("zerocopy_fallbacks        %15llu  MSG_ZEROCOPY packets copied because data was too fragmented\n",
+		  m->zerocopy_fallbacks);
 		for (i = DATA; i < BOGUS;  i++) {
 			char *symbol = homa_symbol_for_type(i);
 
@@ -140,10 +144,34 @@ char *homa_metrics_print(struct homa *homa)
 		  m->requests_received);
 		M("requests_queued           %15llu  Requests for which no thread was waiting\n",
 		  m->requests_queued);
+		M("requests_accept_queued    %15llu  Requests queued for homa_accept\n",
+		  m->requests_accept_queued);
+		M("accepts                   %15llu  Sockets created by homa_accept\n",
+		  m->accepts);
+		M("disconnects               %15llu  Connected sockets disconnected\n",
+		  m->disconnects);
+		M("rpcs_migrated             %15llu  RPCs moved to a peeled-off socket\n",
+		  m->rpcs_migrated);
+		M("rpc_table_grows           %15llu  RPC hash tables replaced with larger ones\n",
+		  m->rpc_table_grows);
+		M("parent_rpc_lookups        %15llu  Peeled-off socket packets for parent's RPCs\n",
+		  m->parent_rpc_lookups);
 		M("responses_received        %15llu  Incoming response messages\n",
 		  m->responses_received);
 		M("responses_queued          %15llu  Responses for which no thread was waiting\n",
 		  m->responses_queued);
+		M("ring_posts                %15llu  Messages posted to completion rings\n",
+		  m->ring_posts);
+		M("ring_overflows            %15llu  Messages queued because completion ring was full\n",
+		  m->ring_overflows);
+		M("pinned_copy_bytes         %15llu  Bytes copied to pinned buffer regions by recvmsg\n",
+		  m->pinned_copy_bytes);
+		M("inline_msgs               %15llu  Incoming messages delivered to recvmsg iovecs without bpages\n",
+		  m->inline_msgs);
+		M("sock_wakeups              %15llu  Poll/epoll wakeups for sockets with ready RPCs\n",
+		  m->sock_wakeups);
+		M("sock_wakeups_coalesced    %15llu  Ready RPCs covered by an already-pending wakeup\n",
+		  m->sock_wakeups_coalesced);
 		M("fast_wakeups              %15llu  Messages received while polling\n",
 		  m->fast_wakeups);
 		M("slow_wakeups              %15llu  Messages received after thread went to sleep\n",
@@ -154,6 +182,16 @@ char *homa_metrics_print(struct homa *homa)
 		  m->handoffs_alt_thread);
 		M("poll_ns                   %15llu  Time spent polling for incoming messages\n",
 		  m->poll_ns);
+		M("poll_hits                 %15llu  Polls that received a message\n",
+		  m->poll_hits);
+		M("poll_misses               %15llu  Polls that ended without a message\n",
+		  m->poll_misses);
+		M("poll_skips                %15llu  Waits that slept without polling\n",
+		  m->poll_skips);
+		M("busy_poll_loops           %15llu  Calls to napi_busy_loop while waiting for messages\n",
+		  m->busy_poll_loops);
+		M("gro_busy_poll_local       %15llu  GRO batches kept on a busy-polling core\n",
+		  m->gro_busy_poll_local);
 		M("softirq_calls             %15llu  Calls to homa_softirq (i.e. # GRO pkts received)\n",
 		  m->softirq_calls);
 		M("softirq_ns                %15llu  Time spent in homa_softirq during SoftIRQ\n",
@@ -191,6 +229,22 @@ char *homa_metrics_print(struct homa *homa)
 		  m->reply_ns);
 		M("abort_calls               %15llu  Total invocations of abort kernel call\n",
 		  m->reply_calls);
+		M("recv_batch_calls          %15llu  Total invocations of recv_batch kernel call\n",
+		  m->recv_batch_calls);
+		M("recv_batch_msgs           %15llu  Messages returned by recv_batch kernel call\n",
+		  m->recv_batch_msgs);
+		M("send_batch_ns             %15llu  Time spent in send_batch kernel call\n",
+		  m->send_batch_ns);
+		M("send_batch_calls          %15llu  Total invocations of send_batch kernel call\n",
+		  m->send_batch_calls);
+		M("send_batch_msgs           %15llu  Messages processed by send_batch kernel call\n",
+		  m->send_batch_msgs);
+		M("release_ns                %15llu  Time spent in release kernel call\n",
+		  m->release_ns);
+		M("release_calls             %15llu  Total invocations of release kernel call\n",
+		  m->release_calls);
+		M("release_bpages            %15llu  Bpages returned by release kernel call\n",
+		  m->release_bpages);
 		M("so_set_buf_ns             %15llu  Time spent in setsockopt SO_HOMA_RCVBUF\n",
 		  m->so_set_buf_ns);
 		M("so_set_buf_calls          %15llu  Total invocations of setsockopt SO_HOMA_RCVBUF\n",
@@ -218,6 +272,12 @@ char *homa_metrics_print(struct homa *homa)
 		  m->pacer_skipped_rpcs);
 		M("pacer_needed_help         %15llu  homa_pacer_xmit invocations from homa_check_pacer\n",
 		  m->pacer_needed_help);
+		M("pacers_created            %15llu  Pacers created for network devices\n",
+		  m->pacers_created);
+		M("pacers_freed              %15llu  Pacers freed after their devices went away\n",
+		  m->pacers_freed);
+		M("pacer_timer_sleeps        %15llu  Pacer thread sleeps waiting for NIC queue to drain\n",
+		  m->pacer_timer_sleeps);
 		M("throttled_ns              %15llu  Time when the throttled queue was nonempty\n",
 		  m->throttled_ns);
 		M("resent_packets            %15llu  DATA packets sent in response to RESENDs\n",
@@ -226,6 +286,8 @@ char *homa_metrics_print(struct homa *homa)
 		  m->peer_hash_links);
 		M("peer_new_entries          %15llu  New entries created in peer table\n",
 		  m->peer_new_entries);
+		M("geometry_cache_hits       %15llu  Messages using geometry cached in socket\n",
+		  m->geometry_cache_hits);
 		M("peer_kmalloc_errors       %15llu  kmalloc failures creating peer table entries\n",
 		  m->peer_kmalloc_errors);
 		M("peer_route_errors         %15llu  Routing failures creating peer table entries\n",
@@ -304,9 +366,19 @@ char *homa_metrics_print(struct homa *homa)
 		  m->reaper_dead_skbs);
 		M("forced_reaps              %15llu  Reaps forced by accumulation of dead RPCs\n",
 		  m->forced_reaps);
+		M("reaper_queued             %15llu  Sockets queued for a background reaper thread\n",
+		  m->reaper_queued);
+		M("reaper_ns                 %15llu  Time spent in background reaper threads\n",
+		  m->reaper_ns);
+		M("wait_reaps                %15llu  In-line reaps by homa_wait_for_message\n",
+		  m->wait_reaps);
+		M("wait_reap_ns              %15llu  Time in homa_wait_for_message spent reaping\n",
+		  m->wait_reap_ns);
+		M("wait_reap_slow            %15llu  In-line reaps in homa_wait_for_message > 10 us\n",
+		  m->wait_reap_slow);
 		M("throttle_list_adds        %15llu  Calls to homa_add_to_throttled\n",
 		  m->throttle_list_adds);
-		M("throttle_list_checks      %15llu  List elements checked in homa_add_to_throttled\n",
+		M("throttle_list_checks      %15llu  Tree nodes checked in homa_add_to_throttled\n",
 		  m->throttle_list_checks);
 		M("ack_overflows             %15llu  Explicit ACKs sent because peer->acks was full\n",
 		  m->ack_overflows);
@@ -314,8 +386,12 @@ char *homa_metrics_print(struct homa *homa)
 		  m->ignored_need_acks);
 		M("bpage_reuses              %15llu  Buffer page could be reused because ref count was zero\n",
 		  m->bpage_reuses);
+		M("bpage_lease_revokes       %15llu  Owned buffer pages freed because their leases expired\n",
+		  m->bpage_lease_revokes);
 		M("buffer_alloc_failures     %15llu  homa_pool_allocate didn't find enough buffer space for an RPC\n",
 		  m->buffer_alloc_failures);
+		M("bpage_quota_deferrals     %15llu  Buffer allocations deferred because socket was over quota\n",
+		  m->bpage_quota_deferrals);
 		M("linux_pkt_alloc_bytes     %15llu  Bytes allocated in new packets by NIC driver due to cache overflows\n",
 		  m->linux_pkt_alloc_bytes);
 		M("dropped_data_no_bufs      %15llu  Data bytes dropped because app buffers full\n",
@@ -328,6 +404,10 @@ char *homa_metrics_print(struct homa *homa)
 		  m->gro_grant_bypasses);
 		M("gro_data_bypasses         %15llu  Data packets passed directly to homa_softirq by homa_gro_receive\n",
 		  m->gro_data_bypasses);
+		M("early_demux_hits          %15llu  Packets whose socket was found during GRO\n",
+		  m->early_demux_hits);
+		M("early_demux_misses        %15llu  Packets with no socket attached during GRO\n",
+		  m->early_demux_misses);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			M("temp%-2d                  %15llu  Temporary use in testing\n",
 			  i, m->temp[i]);
@@ -55,6 +55,19 @@ struct homa_metrics {
 	 */
 	__u64 sent_msg_bytes;
 
+	/**
+	 * @zerocopy_msgs: total number of outgoing messages whose data
+	 * was transmitted from the sender's pages (MSG_ZEROCOPY).
+	 */
+	__u64 zerocopy_msgs;
+
+	/**
+	 * @zerocopy_fallbacks: total number of packets in MSG_ZEROCOPY
+	 * messages whose data had to be copied because it occupied too
+	 * many separate pages.
+	 */
+	__u64 zerocopy_fallbacks;
+
 	/**
 	 * @packets_sent: total number of packets sent for each packet type
 	 * (entry 0 corresponds to DATA, and so on).
@@ -109,6 +122,42 @@ struct homa_metrics {
 	 */
 	__u64 requests_queued;
 
+	/**
+	 * @requests_accept_queued: total number of requests that were added
+	 * to the accept queue of a listening socket (their client didn't
+	 * yet have a socket of its own).
+	 */
+	__u64 requests_accept_queued;
+
+	/**
+	 * @accepts: total number of sockets created by homa_accept.
+	 */
+	__u64 accepts;
+
+	/**
+	 * @disconnects: total number of connected sockets disconnected
+	 * by homa_disconnect.
+	 */
+	__u64 disconnects;
+
+	/**
+	 * @rpcs_migrated: total number of RPCs moved from one socket to
+	 * another by homa_rpc_migrate.
+	 */
+	__u64 rpcs_migrated;
+
+	/**
+	 * @rpc_table_grows: total number of times that a socket's RPC hash
+	 * table was replaced with a larger one by homa_rpc_table_grow.
+	 */
+	__u64 rpc_table_grows;
+
+	/**
+	 * @parent_rpc_lookups: total number of packets arriving on a
+	 * peeled-off socket whose RPCs were found in the socket's parent.
+	 */
+	__u64 parent_rpc_lookups;
+
 	/**
 	 * @responses_received: total number of response messages received.
 	 */
@@ -120,6 +169,46 @@ struct homa_metrics {
 	 */
 	__u64 responses_queued;
 
+	/**
+	 * @ring_posts: total number of messages posted to a socket's
+	 * completion ring by homa_ring_post.
+	 */
+	__u64 ring_posts;
+
+	/**
+	 * @ring_overflows: total number of complete messages that were
+	 * queued for recvmsg because their socket's completion ring was
+	 * full.
+	 */
+	__u64 ring_overflows;
+
+	/**
+	 * @pinned_copy_bytes: total number of bytes of incoming message
+	 * data that homa_copy_to_user copied through the kernel's mapping
+	 * of a pinned buffer region (rather than with copy_to_user).
+	 */
+	__u64 pinned_copy_bytes;
+
+	/**
+	 * @inline_msgs: total number of incoming messages that were
+	 * delivered directly into recvmsg's iovec, without buffer space
+	 * (see SO_HOMA_INLINE).
+	 */
+	__u64 inline_msgs;
+
+	/**
+	 * @sock_wakeups: total number of times that poll/epoll waiters
+	 * were notified (via sk_data_ready) that a socket has ready RPCs.
+	 */
+	__u64 sock_wakeups;
+
+	/**
+	 * @sock_wakeups_coalesced: total number of RPCs that became ready
+	 * on a socket while a wakeup for the socket was already pending
+	 * (so no additional wakeup was needed).
+	 */
+	__u64 sock_wakeups_coalesced;
+
 	/**
 	 * @fast_wakeups: total number of times that a message arrived for
 	 * a receiving thread that was polling in homa_wait_for_message.
@@ -151,6 +240,41 @@ struct homa_metrics {
 	 */
 	__u64 poll_ns;
 
+	/**
+	 * @poll_hits: total number of times that a thread busy-waiting in
+	 * homa_wait_for_message received an RPC before its poll budget
+	 * expired.
+	 */
+	__u64 poll_hits;
+
+	/**
+	 * @poll_misses: total number of times that a thread's poll budget
+	 * in homa_wait_for_message expired without an RPC arriving.
+	 */
+	__u64 poll_misses;
+
+	/**
+	 * @poll_skips: total number of times that a thread in
+	 * homa_wait_for_message went to sleep without polling because
+	 * adaptive polling predicted that no message would arrive within the
+	 * poll budget (or the budget was 0).
+	 */
+	__u64 poll_skips;
+
+	/**
+	 * @busy_poll_loops: total number of times that a thread in
+	 * homa_wait_for_message polled a NIC queue itself (via
+	 * napi_busy_loop) because SO_BUSY_POLL was set on its socket.
+	 */
+	__u64 busy_poll_loops;
+
+	/**
+	 * @gro_busy_poll_local: total number of GRO batches that were
+	 * processed on the core that received them, rather than steered to
+	 * another core, because a thread on that core was busy polling.
+	 */
+	__u64 gro_busy_poll_local;
+
 	/**
 	 * @softirq_calls: total number of calls to homa_softirq (i.e.,
 	 * total number of GRO packets processed, each of which could contain
@@ -234,6 +358,55 @@ struct homa_metrics {
 	 */
 	__u64 abort_calls;
 
+	/**
+	 * @recv_batch_calls: total number of invocations of the
+	 * homa_ioc_recv_batch kernel call (time spent in it is included
+	 * in @recv_ns).
+	 */
+	__u64 recv_batch_calls;
+
+	/**
+	 * @recv_batch_msgs: total number of messages returned by
+	 * homa_ioc_recv_batch.
+	 */
+	__u64 recv_batch_msgs;
+
+	/**
+	 * @send_batch_ns: total time spent executing the
+	 * homa_ioc_send_batch kernel call handler.
+	 */
+	__u64 send_batch_ns;
+
+	/**
+	 * @send_batch_calls: total number of invocations of the
+	 * homa_ioc_send_batch kernel call.
+	 */
+	__u64 send_batch_calls;
+
+	/**
+	 * @send_batch_msgs: total number of messages processed by
+	 * homa_ioc_send_batch.
+	 */
+	__u64 send_batch_msgs;
+
+	/**
+	 * @release_ns: total time spent executing the homa_ioc_release
+	 * kernel call handler.
+	 */
+	__u64 release_ns;
+
+	/**
+	 * @release_calls: total number of invocations of the
+	 * homa_ioc_release kernel call.
+	 */
+	__u64 release_calls;
+
+	/**
+	 * @release_bpages: total number of bpages returned to buffer pools
+	 * by the homa_ioc_release kernel call.
+	 */
+	__u64 release_bpages;
+
 	/**
 	 * @so_set_buf_ns: total time spent executing the homa_ioc_set_buf
 	 * kernel call handler.
@@ -281,8 +454,8 @@ struct homa_metrics {
 	__u64 pacer_lost_ns;
 
 	/**
-	 * @pacer_bytes: total number of bytes transmitted when
-	 * @homa->throttled_rpcs is nonempty.
+	 * @pacer_bytes: total number of bytes transmitted when the
+	 * throttled list of the packet's pacer is nonempty.
 	 */
 	__u64 pacer_bytes;
 
@@ -300,8 +473,28 @@ struct homa_metrics {
 	__u64 pacer_needed_help;
 
 	/**
-	 * @throttled_ns: total amount of time that @homa->throttled_rpcs
-	 * is nonempty.
+	 * @pacers_created: total number of pacers created by
+	 * homa_pacer_get for network devices (not counting the default
+	 * pacer).
+	 */
+	__u64 pacers_created;
+
+	/**
+	 * @pacers_freed: total number of device pacers freed after their
+	 * devices were unregistered.
+	 */
+	__u64 pacers_freed;
+
+	/**
+	 * @pacer_timer_sleeps: total number of times that a pacer thread
+	 * armed its hrtimer and slept, waiting for the NIC queue to drain
+	 * (see homa->pacer_hrtimer).
+	 */
+	__u64 pacer_timer_sleeps;
+
+	/**
+	 * @throttled_ns: total amount of time that the throttled lists of
+	 * pacers are nonempty (summed over all pacers).
 	 */
 	__u64 throttled_ns;
 
@@ -323,6 +516,12 @@ struct homa_metrics {
 	 */
 	__u64 peer_new_entries;
 
+	/**
+	 * @geometry_cache_hits: total # of outgoing messages on connected
+	 * sockets that used the packet geometry cached in the socket.
+	 */
+	__u64 geometry_cache_hits;
+
 	/**
 	 * @peer_kmalloc errors: total number of times homa_peer_find
 	 * returned an error because it couldn't allocate memory for a new
@@ -560,14 +759,44 @@ struct homa_metrics {
 	 */
 	__u64 forced_reaps;
 
+	/**
+	 * @reaper_queued: total number of times a socket was queued for
+	 * its background reaper thread.
+	 */
+	__u64 reaper_queued;
+
+	/**
+	 * @reaper_ns: total time spent by background reaper threads
+	 * reaping RPCs.
+	 */
+	__u64 reaper_ns;
+
+	/**
+	 * @wait_reaps: total number of times that homa_wait_for_message
+	 * reaped RPCs in-line (delaying the application thread).
+	 */
+	__u64 wait_reaps;
+
+	/**
+	 * @wait_reap_ns: total time spent by homa_wait_for_message reaping
+	 * RPCs in-line.
+	 */
+	__u64 wait_reap_ns;
+
+	/**
+	 * @wait_reap_slow: number of in-line reaps in homa_wait_for_message
+	 * that took longer than HOMA_SLOW_REAP_NS.
+	 */
+	__u64 wait_reap_slow;
+
 	/**
 	 * @throttle_list_adds: total number of calls to homa_add_to_throttled.
 	 */
 	__u64 throttle_list_adds;
 
 	/**
-	 * @throttle_list_checks: number of list elements examined in
-	 * calls to homa_add_to_throttled.
+	 * @throttle_list_checks: number of throttled RPCs compared against
+	 * (i.e. tree levels descended) in calls to homa_add_to_throttled.
 	 */
 	__u64 throttle_list_checks;
 
@@ -591,6 +820,13 @@ struct homa_metrics {
 	 */
 	__u64 bpage_reuses;
 
+	/**
+	 * @bpage_lease_revokes: total number of times that a bpage owned
+	 * by a core was returned to the free pool because its lease had
+	 * expired.
+	 */
+	__u64 bpage_lease_revokes;
+
 	/**
 	 * @buffer_alloc_failures: total number of times that
 	 * homa_pool_allocate was unable to allocate buffer space for
@@ -598,6 +834,14 @@ struct homa_metrics {
 	 */
 	__u64 buffer_alloc_failures;
 
+	/**
+	 * @bpage_quota_deferrals: total number of times that
+	 * homa_pool_allocate made an RPC wait for buffer space because its
+	 * socket was over its quota (homa->bpage_quota) and sockets under
+	 * their quotas were waiting.
+	 */
+	__u64 bpage_quota_deferrals;
+
 	/**
 	 * @linux_pkt_alloc_bytes: total bytes allocated in new packet buffers
 	 * by the NIC driver because of packet cache underflows.
@@ -637,6 +881,20 @@ struct homa_metrics {
 	 */
 	__u64 gro_data_bypasses;
 
+	/**
+	 * @early_demux_hits: total number of incoming packets for which
+	 * homa_gro_early_demux found the destination socket, so that
+	 * SoftIRQ didn't need to look it up.
+	 */
+	__u64 early_demux_hits;
+
+	/**
+	 * @early_demux_misses: total number of incoming packets for which
+	 * homa_gro_early_demux couldn't attach a socket (no socket for
+	 * the port, or the socket was shutting down).
+	 */
+	__u64 early_demux_misses;
+
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	__u64 temp[NUM_TEMP_METRICS];
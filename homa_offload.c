@@ -6,6 +6,7 @@
 
 #include "homa_impl.h"
 #include "homa_offload.h"
+#include "homa_sock.h"
 
 DEFINE_PER_CPU(struct homa_offload_core, homa_offload_core);
 
@@ -56,6 +57,9 @@ int homa_offload_init(void)
 		offload_core->last_app_active = 0;
 		offload_core->held_skb = NULL;
 		offload_core->held_bucket = 0;
+		offload_core->defer_wakeups = 0;
+		offload_core->num_wakeups = 0;
+		offload_core->busy_polling = 0;
 	}
 
 	int res1 = inet_add_offload(&homa_offload, IPPROTO_HOMA);
@@ -252,6 +256,40 @@ struct sk_buff *homa_gso_segment(struct sk_buff *skb,
 	return segs;
 }
 
+/**
+ * homa_gro_early_demux() - Look up the socket that will receive an incoming
+ * packet and attach it to the packet (with a reference), so that
+ * homa_dispatch_pkts doesn't need to look it up during SoftIRQ.
+ * @homa:    Overall information about the Homa transport.
+ * @skb:     The incoming packet; its Homa header must be accessible.
+ */
+void homa_gro_early_demux(struct homa *homa, struct sk_buff *skb)
+{
+	struct homa_common_hdr *h = (struct homa_common_hdr *)
+			skb_transport_header(skb);
+	union sockaddr_in_union remote;
+	struct homa_sock *hsk;
+
+	if (skb->sk)
+		return;
+	skb_remote_sockaddr(skb, h->sport, &remote);
+	rcu_read_lock();
+	hsk = homa_sock_find_connected(homa->port_map, &remote.sa,
+				       ntohs(h->dport));
+	if (hsk && !hsk->shutdown &&
+	    refcount_inc_not_zero(&hsk->sock.sk_refcnt)) {
+		/* The sock_pfree destructor marks the socket as "prefetched",
+		 * so the IP layer will leave it attached to the packet.
+		 */
+		skb->sk = &hsk->sock;
+		skb->destructor = sock_pfree;
+		INC_METRIC(early_demux_hits, 1);
+	} else {
+		INC_METRIC(early_demux_misses, 1);
+	}
+	rcu_read_unlock();
+}
+
 /**
  * homa_gro_receive() - Invoked for each input packet at a very low
  * level in the stack to perform GRO. However, this code does GRO in an
@@ -309,6 +347,8 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 //	if (!pskb_may_pull(skb, 64))
 //		tt_record("homa_gro_receive can't pull enough data "
 //				"from packet for trace");
+	if (homa->gro_policy & HOMA_GRO_EARLY_DEMUX)
+		homa_gro_early_demux(homa, skb);
 	if (h_new->common.type == DATA) {
 		if (h_new->seg.offset == (__force __be32)-1) {
 			tt_record2("homa_gro_receive replaced offset %d with %d",
@@ -590,7 +630,13 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 	//		NAPI_GRO_CB(skb)->count);
 
 	per_cpu(homa_offload_core, raw_smp_processor_id()).held_skb = NULL;
-	if (homa->gro_policy & HOMA_GRO_GEN3) {
+	if (READ_ONCE(per_cpu(homa_offload_core,
+			      raw_smp_processor_id()).busy_polling)) {
+		/* A thread on this core is waiting for these packets and
+		 * polling NAPI itself: don't hand them to another core.
+		 */
+		INC_METRIC(gro_busy_poll_local, 1);
+	} else if (homa->gro_policy & HOMA_GRO_GEN3) {
 		homa_gro_gen3(homa, skb);
 	} else if (homa->gro_policy & HOMA_GRO_GEN2) {
 		homa_gro_gen2(homa, skb);
@@ -7,6 +7,15 @@
 
 #include <linux/types.h>
 
+struct homa_sock;
+
+/**
+ * define HOMA_MAX_DEFERRED_WAKEUPS - Maximum number of distinct sockets
+ * whose wakeups can be deferred during a single call to homa_softirq;
+ * sockets beyond this are woken immediately.
+ */
+#define HOMA_MAX_DEFERRED_WAKEUPS 8
+
 /**
  * struct homa_offload_core - Stores core-specific information used during
  * GRO operations.
@@ -70,10 +79,36 @@ struct homa_offload_core {
 	 * verify that @held_skb is still available.
 	 */
 	int held_bucket;
+
+	/**
+	 * @defer_wakeups: nonzero means that homa_softirq is processing a
+	 * batch of packets on this core, so wakeups for sockets with newly
+	 * ready RPCs are collected in @wakeups and issued when the batch
+	 * is finished (see homa_sock_wakeup).
+	 */
+	int defer_wakeups;
+
+	/** @num_wakeups: Number of valid entries in @wakeups. */
+	int num_wakeups;
+
+	/**
+	 * @wakeups: Sockets for which a wakeup has been deferred until the
+	 * end of the current batch.
+	 */
+	struct homa_sock *wakeups[HOMA_MAX_DEFERRED_WAKEUPS];
+
+	/**
+	 * @busy_polling: nonzero means that a thread on this core is
+	 * waiting for a message and driving NAPI itself (see
+	 * homa_busy_poll), so packets received by GRO on this core should be
+	 * processed by SoftIRQ here rather than steered to another core.
+	 */
+	int busy_polling;
 };
 DECLARE_PER_CPU(struct homa_offload_core, homa_offload_core);
 
 int      homa_gro_complete(struct sk_buff *skb, int thoff);
+void     homa_gro_early_demux(struct homa *homa, struct sk_buff *skb);
 void     homa_gro_gen2(struct homa *homa, struct sk_buff *skb);
 void     homa_gro_gen3(struct homa *homa, struct sk_buff *skb);
 void     homa_gro_hook_tcp(void);
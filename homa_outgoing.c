@@ -29,6 +29,10 @@ void homa_message_out_init(struct homa_rpc *rpc, int length)
 		rpc->msgout.unscheduled = length;
 	rpc->msgout.sched_priority = 0;
 	rpc->msgout.init_ns = sched_clock();
+	if (rpc->msgout.pacer)
+		homa_pacer_put(rpc->msgout.pacer);
+	rpc->msgout.pacer = homa_pacer_get(rpc->hsk->homa,
+			homa_get_dst(rpc->peer, rpc->hsk)->dev);
 }
 
 /**
@@ -42,10 +46,12 @@ void homa_message_out_init(struct homa_rpc *rpc, int length)
  *                  homa_skb_info has been filled in with the packet geometry.
  * @iter:           Describes location(s) of (remaining) message data in user
  *                  space.
+ * @zerocopy:       True means the data should be referenced in place
+ *                  (MSG_ZEROCOPY) rather than copied.
  * Return:          Either a negative errno or 0 (for success).
  */
 int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
-			       struct iov_iter *iter)
+			       struct iov_iter *iter, bool zerocopy)
 {
 	struct homa_skb_info *homa_info = homa_get_skb_info(skb);
 	int seg_length = homa_info->seg_length;
@@ -62,8 +68,12 @@ int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
 
 		if (bytes_left < seg_length)
 			seg_length = bytes_left;
-		err = homa_skb_append_from_iter(rpc->hsk->homa, skb, iter,
-						seg_length);
+		if (zerocopy)
+			err = homa_skb_append_zerocopy(rpc->hsk->homa, skb,
+						       iter, seg_length);
+		else
+			err = homa_skb_append_from_iter(rpc->hsk->homa, skb,
+							iter, seg_length);
 		if (err != 0)
 			return err;
 		bytes_left -= seg_length;
@@ -72,6 +82,9 @@ int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
 		if (bytes_left == 0)
 			break;
 
+		/* User pages may have used up all of the frags. */
+		if (zerocopy && skb_shinfo(skb)->nr_frags >= HOMA_MAX_SKB_FRAGS)
+			return -EMSGSIZE;
 		seg.offset = htonl(offset);
 		err = homa_skb_append_to_frag(rpc->hsk->homa, skb, &seg,
 					      sizeof(seg));
@@ -97,13 +110,20 @@ int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
  *                much data.
  * @max_seg_data: Maximum number of bytes of message data that can go in
  *                a single segment of the GSO packet.
+ *
+ * If rpc->msgout.uarg is set, the packet will refer to the data in user
+ * space rather than copying it; if the data is too fragmented for that,
+ * it is copied after all.
  * Return: A pointer to the new packet, or a negative errno.
  */
 struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 				     struct iov_iter *iter, int offset,
 				     int length, int max_seg_data)
 {
+	bool zerocopy = rpc->msgout.uarg != NULL;
+	size_t iter_count = iov_iter_count(iter);
 	struct homa_skb_info *homa_info;
+	struct homa_ack ack = {};
 	struct homa_data_hdr *h;
 	struct sk_buff *skb;
 	int err, gso_size;
@@ -112,6 +132,12 @@ struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 	segs = length + max_seg_data - 1;
 	do_div(segs, max_seg_data);
 
+	/* Fetch the ack before the retry point below, so a retry
+	 * doesn't consume (and lose) an additional ack.
+	 */
+	homa_peer_get_acks(rpc->peer, 1, &ack);
+
+retry:
 	/* Initialize the overall skb. */
 	skb = homa_skb_new_tx(sizeof32(struct homa_data_hdr));
 	if (!skb)
@@ -132,8 +158,7 @@ struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 	h->common.sender_id = cpu_to_be64(rpc->id);
 	h->message_length = htonl(rpc->msgout.length);
 	h->incoming = htonl(rpc->msgout.unscheduled);
-	h->ack.client_id = 0;
-	homa_peer_get_acks(rpc->peer, 1, &h->ack);
+	h->ack = ack;
 	h->cutoff_version = rpc->peer->cutoff_version;
 	h->retransmit = 0;
 	h->seg.offset = htonl(-1);
@@ -151,14 +176,35 @@ struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 				sizeof32(struct homa_seg_hdr));
 		h->seg.offset = htonl(offset);
 		gso_size = max_seg_data + sizeof(struct homa_seg_hdr);
-		err = homa_fill_data_interleaved(rpc, skb, iter);
+		err = homa_fill_data_interleaved(rpc, skb, iter, zerocopy);
 	} else {
 		gso_size = max_seg_data;
-		err = homa_skb_append_from_iter(rpc->hsk->homa, skb, iter,
-						length);
+		if (zerocopy)
+			err = homa_skb_append_zerocopy(rpc->hsk->homa, skb,
+						       iter, length);
+		else
+			err = homa_skb_append_from_iter(rpc->hsk->homa, skb,
+							iter, length);
+	}
+	if (unlikely(err == -EMSGSIZE && zerocopy)) {
+		/* The user's buffer is too fragmented to fit in the skb's
+		 * frags; start over and copy this packet's data. Don't use
+		 * homa_skb_free_tx: it could cache the user's pages. Clear
+		 * the zerocopy flag so the completion notification tells the
+		 * application that (some of) the data was copied, as TCP
+		 * does.
+		 */
+		iov_iter_revert(iter, iter_count - iov_iter_count(iter));
+		kfree_skb(skb);
+		uarg_to_msgzc(rpc->msgout.uarg)->zerocopy = 0;
+		INC_METRIC(zerocopy_fallbacks, 1);
+		zerocopy = false;
+		goto retry;
 	}
 	if (err)
 		goto error;
+	if (zerocopy)
+		skb_zcopy_set(skb, rpc->msgout.uarg, NULL);
 
 	if (segs > 1) {
 		skb_shinfo(skb)->gso_segs = segs;
@@ -177,6 +223,96 @@ error:
 	return ERR_PTR(err);
 }
 
+/**
+ * homa_compute_geometry() - Compute the sizes of the packets used to
+ * transmit outgoing messages via a given dst.
+ * @hsk:       Socket that will send the packets.
+ * @dst:       Route that the packets will take.
+ * @geometry:  Filled in with the results.
+ */
+static void homa_compute_geometry(struct homa_sock *hsk,
+				  struct dst_entry *dst,
+				  struct homa_geometry *geometry)
+{
+	int max_seg_data, gso_size;
+	__u64 segs_per_gso;
+
+	geometry->mtu = dst_mtu(dst);
+	max_seg_data = geometry->mtu - hsk->ip_header_length
+			- sizeof(struct homa_data_hdr);
+	geometry->max_gso_size = hsk->homa->max_gso_size;
+	gso_size = dst->dev->gso_max_size;
+	if (gso_size > geometry->max_gso_size)
+		gso_size = geometry->max_gso_size;
+
+	/* Round gso_size down to an even # of mtus; calculation depends
+	 * on whether we're doing TCP hijacking (need more space in TSO packet
+	 * if no hijacking).
+	 */
+	if (hsk->sock.sk_protocol == IPPROTO_TCP) {
+		/* Hijacking */
+		segs_per_gso = gso_size - hsk->ip_header_length
+				- sizeof(struct homa_data_hdr);
+		do_div(segs_per_gso, max_seg_data);
+	} else {
+		/* No hijacking */
+		segs_per_gso = gso_size - hsk->ip_header_length -
+				sizeof(struct homa_data_hdr) +
+				sizeof(struct homa_seg_hdr);
+		do_div(segs_per_gso, max_seg_data +
+				sizeof(struct homa_seg_hdr));
+	}
+	if (segs_per_gso == 0)
+		segs_per_gso = 1;
+	geometry->max_seg_data = max_seg_data;
+	geometry->max_gso_data = segs_per_gso * max_seg_data;
+}
+
+/**
+ * homa_get_geometry() - Find the packet geometry to use for an RPC's
+ * outgoing message. If the RPC's peer is the one its (connected) socket
+ * is connected to, the geometry cached in the socket is used as long as
+ * the peer's dst hasn't changed; otherwise the geometry is computed (and
+ * cached, if appropriate).
+ * @rpc:       RPC whose message is about to be sent. Must be locked.
+ * @geometry:  Filled in with the geometry to use.
+ */
+static void homa_get_geometry(struct homa_rpc *rpc,
+			      struct homa_geometry *geometry)
+{
+	struct homa_sock *hsk = rpc->hsk;
+	struct dst_entry *dst, *old;
+	unsigned int seq;
+	bool hit;
+
+	dst = homa_get_dst(rpc->peer, hsk);
+	if (rpc->peer != READ_ONCE(hsk->peer)) {
+		homa_compute_geometry(hsk, dst, geometry);
+		return;
+	}
+	do {
+		seq = read_seqbegin(&hsk->geometry_lock);
+		*geometry = hsk->geometry;
+		hit = hsk->dst == dst;
+	} while (read_seqretry(&hsk->geometry_lock, seq));
+	if (likely(hit && geometry->max_gso_size == hsk->homa->max_gso_size)) {
+		INC_METRIC(geometry_cache_hits, 1);
+		return;
+	}
+
+	/* The socket holds a reference to the cached dst, so its address
+	 * can't be reused by a different dst while it is cached.
+	 */
+	homa_compute_geometry(hsk, dst, geometry);
+	dst_hold(dst);
+	write_seqlock_bh(&hsk->geometry_lock);
+	old = hsk->dst;
+	hsk->dst = dst;
+	hsk->geometry = *geometry;
+	write_sequnlock_bh(&hsk->geometry_lock);
+	dst_release(old);
+}
+
 /**
  * homa_message_out_fill() - Initializes information for sending a message
  * for an RPC (either request or response); copies the message data from
@@ -200,26 +336,14 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	__releases(rpc->bucket_lock)
 	__acquires(rpc->bucket_lock)
 {
-	/* Geometry information for packets:
-	 * mtu:              largest size for an on-the-wire packet (including
-	 *                   all headers through IP header, but not Ethernet
-	 *                   header).
-	 * max_seg_data:     largest amount of Homa message data that fits
-	 *                   in an on-the-wire packet (after segmentation).
-	 * max_gso_data:     largest amount of Homa message data that fits
-	 *                   in a GSO packet (before segmentation).
-	 */
-	int mtu, max_seg_data, max_gso_data;
-
+	struct homa_geometry geometry;
+	int max_seg_data, max_gso_data;
 	struct sk_buff **last_link;
-	struct dst_entry *dst;
-	__u64 segs_per_gso;
 	int overlap_xmit;
 
 	/* Bytes of the message that haven't yet been copied into skbs. */
 	int bytes_left;
 
-	int gso_size;
 	int err;
 
 	homa_message_out_init(rpc, iter->count);
@@ -231,37 +355,17 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		goto error;
 	}
 
-	/* Compute the geometry of packets. */
-	dst = homa_get_dst(rpc->peer, rpc->hsk);
-	mtu = dst_mtu(dst);
-	max_seg_data = mtu - rpc->hsk->ip_header_length
-			- sizeof(struct homa_data_hdr);
-	gso_size = dst->dev->gso_max_size;
-	if (gso_size > rpc->hsk->homa->max_gso_size)
-		gso_size = rpc->hsk->homa->max_gso_size;
-
-	/* Round gso_size down to an even # of mtus; calculation depends
-	 * on whether we're doing TCP hijacking (need more space in TSO packet
-	 * if no hijacking).
-	 */
-	if (rpc->hsk->sock.sk_protocol == IPPROTO_TCP) {
-		/* Hijacking */
-		segs_per_gso = gso_size - rpc->hsk->ip_header_length
-				- sizeof(struct homa_data_hdr);
-		do_div(segs_per_gso, max_seg_data);
-	} else {
-		/* No hijacking */
-		segs_per_gso = gso_size - rpc->hsk->ip_header_length -
-				sizeof(struct homa_data_hdr) +
-				sizeof(struct homa_seg_hdr);
-		do_div(segs_per_gso, max_seg_data +
-				sizeof(struct homa_seg_hdr));
+	homa_get_geometry(rpc, &geometry);
+	max_seg_data = geometry.max_seg_data;
+	max_gso_data = geometry.max_gso_data;
+	if (rpc->msgout.uarg) {
+		max_gso_data = homa_skb_max_zerocopy_data(max_seg_data,
+				max_gso_data,
+				rpc->hsk->sock.sk_protocol != IPPROTO_TCP);
+		INC_METRIC(zerocopy_msgs, 1);
 	}
-	if (segs_per_gso == 0)
-		segs_per_gso = 1;
-	max_gso_data = segs_per_gso * max_seg_data;
 	UNIT_LOG("; ", "mtu %d, max_seg_data %d, max_gso_data %d",
-		 mtu, max_seg_data, max_gso_data);
+		 geometry.mtu, max_seg_data, max_gso_data);
 
 	overlap_xmit = rpc->msgout.length > 2 * max_gso_data;
 	rpc->msgout.granted = rpc->msgout.unscheduled;
@@ -290,7 +394,7 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 			skb_data_bytes = bytes_left;
 		skb = homa_new_data_packet(rpc, iter, offset, skb_data_bytes,
 					   max_seg_data);
-		if (unlikely(!skb)) {
+		if (unlikely(IS_ERR(skb))) {
 			err = PTR_ERR(skb);
 			homa_rpc_lock(rpc, "homa_message_out_fill");
 			goto error;
@@ -309,7 +413,7 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		*last_link = NULL;
 		rpc->msgout.num_skbs++;
 		rpc->msgout.copied_from_user = rpc->msgout.length - bytes_left;
-		if (overlap_xmit && list_empty(&rpc->throttled_links) &&
+		if (overlap_xmit && RB_EMPTY_NODE(&rpc->throttled_node) &&
 		    xmit && offset < rpc->msgout.granted) {
 			tt_record1("waking up pacer for id %d", rpc->id);
 			homa_add_to_throttled(rpc);
@@ -318,6 +422,7 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	tt_record2("finished copy from user space for id %d, length %d",
 		   rpc->id, rpc->msgout.length);
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
+	rpc->msgout.uarg = NULL;
 	INC_METRIC(sent_msg_bytes, rpc->msgout.length);
 	if (!overlap_xmit && xmit)
 		homa_xmit_data(rpc, false);
@@ -325,6 +430,7 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 
 error:
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
+	rpc->msgout.uarg = NULL;
 	return err;
 }
 
@@ -523,7 +629,8 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 
 		if ((rpc->msgout.length - rpc->msgout.next_xmit_offset)
 				>= homa->throttle_min_bytes) {
-			if (!homa_check_nic_queue(homa, skb, force)) {
+			if (!homa_check_nic_queue(rpc->msgout.pacer, skb,
+						  force)) {
 				tt_record1("homa_xmit_data adding id %u to throttle queue",
 					   rpc->id);
 				homa_add_to_throttled(rpc);
@@ -716,7 +823,7 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			new_homa_info->offset = offset;
 			tt_record3("retransmitting offset %d, length %d, id %d",
 				   offset, seg_length, rpc->id);
-			homa_check_nic_queue(rpc->hsk->homa, new_skb, true);
+			homa_check_nic_queue(rpc->msgout.pacer, new_skb, true);
 			__homa_xmit_data(new_skb, rpc, priority);
 			INC_METRIC(resent_packets, 1);
 		}
@@ -743,13 +850,281 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
 	homa->ns_per_mbyte = tmp;
 }
 
+/**
+ * homa_pacer_start() - Work queue function that starts the thread for
+ * a pacer created by homa_pacer_get.
+ * @work:    The start_work field of the pacer.
+ */
+static void homa_pacer_start(struct work_struct *work)
+{
+	struct homa_pacer *pacer = container_of(work, struct homa_pacer,
+						start_work);
+	struct task_struct *thread;
+
+	thread = kthread_run(homa_pacer_main, pacer, "homa_pacer/%d",
+			     pacer->ifindex);
+	if (IS_ERR(thread)) {
+		pr_err("couldn't create homa pacer thread for device %d: error %ld\n",
+		       pacer->ifindex, PTR_ERR(thread));
+		return;
+	}
+	WRITE_ONCE(pacer->kthread, thread);
+}
+
+/**
+ * homa_pacer_free() - Stop a pacer's thread and free the pacer. The pacer
+ * must not be in homa->pacers or homa->dead_pacers. May sleep.
+ * @pacer:    Pacer to free.
+ */
+static void homa_pacer_free(struct homa_pacer *pacer)
+{
+	cancel_work_sync(&pacer->start_work);
+	if (pacer->kthread) {
+		homa_pacer_stop(pacer);
+		wait_for_completion(&pacer->kthread_done);
+	}
+
+	/* homa_check_pacer may still be looking at the pacer. */
+	synchronize_rcu();
+	kfree(pacer);
+}
+
+/**
+ * homa_pacer_free_work() - Work queue function that frees a pacer once
+ * its last reference has been released.
+ * @work:    The free_work field of the pacer.
+ */
+static void homa_pacer_free_work(struct work_struct *work)
+{
+	struct homa_pacer *pacer = container_of(work, struct homa_pacer,
+						free_work);
+	struct homa *homa = pacer->homa;
+
+	/* If the pacer is no longer in dead_pacers, homa_pacers_destroy
+	 * has claimed it and will free it.
+	 */
+	spin_lock_bh(&homa->pacers_lock);
+	if (list_empty(&pacer->dead_links)) {
+		spin_unlock_bh(&homa->pacers_lock);
+		return;
+	}
+	list_del_init(&pacer->dead_links);
+	spin_unlock_bh(&homa->pacers_lock);
+	tt_record1("freeing pacer for device %d", pacer->ifindex);
+	homa_pacer_free(pacer);
+	INC_METRIC(pacers_freed, 1);
+}
+
+/**
+ * homa_pacer_put() - Release a reference to a pacer (see homa_pacer_get);
+ * if this was the last one, the pacer is freed (asynchronously, since
+ * this function may be invoked at softirq level).
+ * @pacer:    Pacer to release.
+ */
+void homa_pacer_put(struct homa_pacer *pacer)
+{
+	struct homa *homa = pacer->homa;
+
+	if (!refcount_dec_and_test(&pacer->refs))
+		return;
+	spin_lock_bh(&homa->pacers_lock);
+	list_add_tail(&pacer->dead_links, &homa->dead_pacers);
+	spin_unlock_bh(&homa->pacers_lock);
+	schedule_work(&pacer->free_work);
+}
+
+/**
+ * homa_pacer_new() - Allocate and initialize a pacer. The pacer's thread
+ * is not started and the pacer is not added to homa->pacers. The pacer
+ * has one reference, which belongs to homa->pacers once it's added.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @dev:      Network device whose output the pacer will manage, or NULL
+ *            for homa->default_pacer.
+ * @gfp:      Flags to use for memory allocation.
+ *
+ * Return:    The new pacer, or NULL if memory couldn't be allocated.
+ */
+struct homa_pacer *homa_pacer_new(struct homa *homa, struct net_device *dev,
+				  gfp_t gfp)
+{
+	struct homa_pacer *pacer;
+
+	pacer = kzalloc(sizeof(*pacer), gfp);
+	if (!pacer)
+		return NULL;
+	atomic64_set(&pacer->link_idle_time, sched_clock());
+	spin_lock_init(&pacer->mutex);
+	pacer->fifo_count = 1;
+	spin_lock_init(&pacer->throttle_lock);
+	pacer->throttled_rpcs = RB_ROOT_CACHED;
+	pacer->throttled_by_age = RB_ROOT_CACHED;
+	pacer->homa = homa;
+	refcount_set(&pacer->refs, 1);
+	INIT_LIST_HEAD(&pacer->dead_links);
+	INIT_WORK(&pacer->free_work, homa_pacer_free_work);
+	if (dev) {
+		pacer->net_cookie = dev_net(dev)->net_cookie;
+		pacer->ifindex = dev->ifindex;
+	}
+	INIT_LIST_HEAD(&pacer->links);
+	INIT_WORK(&pacer->start_work, homa_pacer_start);
+	init_completion(&pacer->kthread_done);
+	hrtimer_init(&pacer->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pacer->hrtimer.function = &homa_pacer_hrtimer;
+	return pacer;
+}
+
+/**
+ * homa_pacer_get() - Find the pacer for a network device, creating it
+ * if it doesn't already exist. This function may be invoked at softirq
+ * level; the thread for a new pacer is started later from a work queue.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @dev:     Device on which packets will be transmitted; may be NULL.
+ *
+ * Return:   The pacer for @dev, with a reference taken for the caller
+ *           (release it with homa_pacer_put). homa->default_pacer is
+ *           returned if @dev is NULL or being unregistered, or if a new
+ *           pacer couldn't be allocated.
+ */
+struct homa_pacer *homa_pacer_get(struct homa *homa, struct net_device *dev)
+{
+	struct homa_pacer *pacer;
+	__u64 net_cookie;
+	int ifindex;
+
+	if (!dev) {
+		pacer = homa->default_pacer;
+		refcount_inc(&pacer->refs);
+		return pacer;
+	}
+	net_cookie = dev_net(dev)->net_cookie;
+	ifindex = dev->ifindex;
+
+	/* A pacer found here may have just been removed from the list
+	 * (its refs could even be zero); it's still safe to touch until
+	 * the RCU read-side critical section ends.
+	 */
+	rcu_read_lock();
+	list_for_each_entry_rcu(pacer, &homa->pacers, links) {
+		if (pacer->ifindex == ifindex &&
+		    pacer->net_cookie == net_cookie &&
+		    refcount_inc_not_zero(&pacer->refs)) {
+			rcu_read_unlock();
+			return pacer;
+		}
+	}
+	rcu_read_unlock();
+
+	spin_lock_bh(&homa->pacers_lock);
+
+	/* Must check again: someone else could have created the pacer. */
+	list_for_each_entry(pacer, &homa->pacers, links) {
+		if (pacer->ifindex == ifindex &&
+		    pacer->net_cookie == net_cookie)
+			goto done;
+	}
+
+	/* Don't create a pacer that homa_pacer_netdev_event has already
+	 * had its chance to release (it runs after reg_state changes,
+	 * and after a grace period that also covers this lock).
+	 */
+	if (READ_ONCE(dev->reg_state) != NETREG_REGISTERED) {
+		pacer = homa->default_pacer;
+		goto done;
+	}
+	pacer = homa_pacer_new(homa, dev, GFP_ATOMIC);
+	if (!pacer) {
+		pacer = homa->default_pacer;
+		goto done;
+	}
+	list_add_tail_rcu(&pacer->links, &homa->pacers);
+	schedule_work(&pacer->start_work);
+	INC_METRIC(pacers_created, 1);
+
+done:
+	refcount_inc(&pacer->refs);
+	spin_unlock_bh(&homa->pacers_lock);
+	return pacer;
+}
+
+/**
+ * homa_pacer_netdev_event() - Invoked by the netdevice notifier chain for
+ * changes to network devices. When a device is unregistered, its pacer is
+ * removed from homa->pacers (so it won't be found for new RPCs) and the
+ * list's reference is released; the pacer's thread keeps running until
+ * RPCs that still refer to it are gone.
+ * @nb:      The pacer_notifier field of a struct homa.
+ * @event:   Which event occurred (NETDEV_*).
+ * @ptr:     Information about the event (struct netdev_notifier_info).
+ *
+ * Return:   Always NOTIFY_DONE.
+ */
+int homa_pacer_netdev_event(struct notifier_block *nb, unsigned long event,
+			    void *ptr)
+{
+	struct homa *homa = container_of(nb, struct homa, pacer_notifier);
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct homa_pacer *pacer, *found = NULL;
+	__u64 net_cookie;
+
+	if (event != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+	net_cookie = dev_net(dev)->net_cookie;
+
+	spin_lock_bh(&homa->pacers_lock);
+	list_for_each_entry(pacer, &homa->pacers, links) {
+		if (pacer != homa->default_pacer &&
+		    pacer->ifindex == dev->ifindex &&
+		    pacer->net_cookie == net_cookie) {
+			list_del_rcu(&pacer->links);
+			found = pacer;
+			break;
+		}
+	}
+	spin_unlock_bh(&homa->pacers_lock);
+	if (found)
+		homa_pacer_put(found);
+	return NOTIFY_DONE;
+}
+
+/**
+ * homa_pacers_destroy() - Stop the threads for all of the pacers in a
+ * struct homa and free the pacers, including any waiting to be freed by
+ * their free_work. All sockets must have been shut down and
+ * homa->pacer_notifier unregistered.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_pacers_destroy(struct homa *homa)
+{
+	struct homa_pacer *pacer, *tmp;
+
+	/* Claim pacers whose free_work hasn't run yet. */
+	spin_lock_bh(&homa->pacers_lock);
+	while (!list_empty(&homa->dead_pacers)) {
+		pacer = list_first_entry(&homa->dead_pacers,
+					 struct homa_pacer, dead_links);
+		list_del_init(&pacer->dead_links);
+		spin_unlock_bh(&homa->pacers_lock);
+		cancel_work_sync(&pacer->free_work);
+		homa_pacer_free(pacer);
+		spin_lock_bh(&homa->pacers_lock);
+	}
+	spin_unlock_bh(&homa->pacers_lock);
+
+	list_for_each_entry_safe(pacer, tmp, &homa->pacers, links) {
+		list_del_rcu(&pacer->links);
+		homa_pacer_free(pacer);
+	}
+	homa->default_pacer = NULL;
+}
+
 /**
  * homa_check_nic_queue() - This function is invoked before passing a packet
  * to the NIC for transmission. It serves two purposes. First, it maintains
  * an estimate of the NIC queue length. Second, it indicates to the caller
  * whether the NIC queue is so full that no new packets should be queued
  * (Homa's SRPT depends on keeping the NIC queue short).
- * @homa:     Overall data about the Homa protocol implementation.
+ * @pacer:    Pacer for the device on which @skb will be transmitted.
  * @skb:      Packet that is about to be transmitted.
  * @force:    True means this packet is going to be transmitted
  *            regardless of the queue length.
@@ -759,9 +1134,11 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
  *            the transmission of @skb. If nonzero is returned, then the
  *            queue estimate is updated to reflect the transmission of @skb.
  */
-int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
+int homa_check_nic_queue(struct homa_pacer *pacer, struct sk_buff *skb,
+			 bool force)
 {
 	__u64 idle, new_idle, clock, ns_for_packet;
+	struct homa *homa = pacer->homa;
 	int bytes;
 
 	bytes = homa_get_skb_info(skb)->wire_bytes;
@@ -770,17 +1147,17 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 	do_div(ns_for_packet, 1000000);
 	while (1) {
 		clock = sched_clock();
-		idle = atomic64_read(&homa->link_idle_time);
+		idle = atomic64_read(&pacer->link_idle_time);
 		if ((clock + homa->max_nic_queue_ns) < idle && !force &&
 		    !(homa->flags & HOMA_FLAG_DONT_THROTTLE))
 			return 0;
-		if (!list_empty(&homa->throttled_rpcs))
+		if (!RB_EMPTY_ROOT(&pacer->throttled_rpcs.rb_root))
 			INC_METRIC(pacer_bytes, bytes);
 #ifndef __STRIP__ /* See strip.py */
 		if (idle < clock) {
-			if (homa->pacer_wake_time) {
-				__u64 lost = (homa->pacer_wake_time > idle)
-						? clock - homa->pacer_wake_time
+			if (pacer->wake_time) {
+				__u64 lost = (pacer->wake_time > idle)
+						? clock - pacer->wake_time
 						: clock - idle;
 				INC_METRIC(pacer_lost_ns, lost);
 				tt_record1("pacer lost %d cycles", lost);
@@ -797,7 +1174,7 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 #endif /* See strip.py */
 
 		/* This method must be thread-safe. */
-		if (atomic64_cmpxchg_relaxed(&homa->link_idle_time, idle,
+		if (atomic64_cmpxchg_relaxed(&pacer->link_idle_time, idle,
 					     new_idle) == idle)
 			break;
 	}
@@ -805,51 +1182,140 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 }
 
 /**
- * homa_pacer_main() - Top-level function for the pacer thread.
- * @transport:  Pointer to struct homa.
+ * homa_pacer_main() - Top-level function for a pacer thread.
+ * @arg:    Pointer to the struct homa_pacer that the thread serves.
  *
- * Return:         Always 0.
+ * Return:  Always 0.
  */
-int homa_pacer_main(void *transport)
+int homa_pacer_main(void *arg)
 {
-	struct homa *homa = (struct homa *)transport;
+	struct homa_pacer *pacer = (struct homa_pacer *)arg;
+	__u64 start;
 
-	homa->pacer_wake_time = sched_clock();
+	/* Our creator also sets @kthread, but only after kthread_run
+	 * returns; set it now so that homa_pacer_hrtimer can't see NULL
+	 * if the timer fires before then.
+	 */
+	WRITE_ONCE(pacer->kthread, current);
+	start = sched_clock();
+	pacer->wake_time = start;
 	while (1) {
-		if (homa->pacer_exit) {
-			homa->pacer_wake_time = 0;
+		if (pacer->exit) {
+			pacer->wake_time = 0;
 			break;
 		}
-		homa_pacer_xmit(homa);
+		homa_pacer_xmit(pacer);
 
-		/* Sleep this thread if the throttled list is empty. Even
-		 * if the throttled list isn't empty, call the scheduler
-		 * to give other processes a chance to run (if we don't,
-		 * softirq handlers can get locked out, which prevents
-		 * incoming packets from being handled).
+		/* Sleep this thread if the throttled list is empty, or (in
+		 * hrtimer mode) until the NIC queue has drained. Otherwise
+		 * call the scheduler to give other processes a chance to
+		 * run (if we don't, softirq handlers can get locked out,
+		 * which prevents incoming packets from being handled).
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
-#ifndef __STRIP__ /* See strip.py */
-		if (list_first_or_null_rcu(&homa->throttled_rpcs,
-					   struct homa_rpc, throttled_links) == NULL)
-			tt_record("pacer sleeping");
-		else
-#else /* See strip.py */
-		if (list_first_or_null_rcu(&homa->throttled_rpcs,
-					   struct homa_rpc,
-					   throttled_links) != NULL)
-#endif /* See strip.py */
+		if (RB_EMPTY_ROOT(&pacer->throttled_rpcs.rb_root)) {
+			tt_record1("pacer sleeping for device %d",
+				   pacer->ifindex);
+			pacer->wake_time = 0;
+		} else if (!pacer->homa->pacer_hrtimer ||
+			   !homa_pacer_arm_timer(pacer)) {
 			__set_current_state(TASK_RUNNING);
-		INC_METRIC(pacer_ns, sched_clock() - homa->pacer_wake_time);
-		homa->pacer_wake_time = 0;
+			pacer->wake_time = 0;
+		}
+		INC_METRIC(pacer_ns, sched_clock() - start);
 		schedule();
-		homa->pacer_wake_time = sched_clock();
 		__set_current_state(TASK_RUNNING);
+
+		/* If the thread slept on its hrtimer, leave wake_time at the
+		 * time the timer was due so that homa_check_nic_queue charges
+		 * any timer latency to pacer_lost_ns.
+		 */
+		start = sched_clock();
+		if (pacer->wake_time == 0 || pacer->wake_time > start)
+			pacer->wake_time = start;
 	}
-	kthread_complete_and_exit(&homa_pacer_kthread_done, 0);
+	hrtimer_cancel(&pacer->hrtimer);
+	kthread_complete_and_exit(&pacer->kthread_done, 0);
 	return 0;
 }
 
+/**
+ * homa_pacer_arm_timer() - Invoked by a pacer thread in hrtimer mode
+ * when its throttled list is nonempty. If the NIC queue is too long to
+ * transmit more packets now, arms the pacer's hrtimer for the time when
+ * the queue will have drained to homa->max_nic_queue_ns.
+ * @pacer:   Pacer whose thread is about to sleep.
+ *
+ * Return:   True if the timer was armed (the thread should sleep), false
+ *           if packets can be transmitted now.
+ */
+bool homa_pacer_arm_timer(struct homa_pacer *pacer)
+{
+	__u64 idle, now;
+
+	now = sched_clock();
+	idle = atomic64_read(&pacer->link_idle_time);
+	if ((now + pacer->homa->max_nic_queue_ns) >= idle)
+		return false;
+	pacer->wake_time = idle - pacer->homa->max_nic_queue_ns;
+	tt_record2("pacer for device %d sleeping for %d ns", pacer->ifindex,
+		   pacer->wake_time - now);
+	hrtimer_start(&pacer->hrtimer, ns_to_ktime(pacer->wake_time - now),
+		      HRTIMER_MODE_REL);
+	INC_METRIC(pacer_timer_sleeps, 1);
+	return true;
+}
+
+/**
+ * homa_pacer_hrtimer() - Invoked by the hrtimer mechanism to wake up a
+ * pacer thread once its NIC queue has drained. Runs at IRQ level.
+ * @timer:   The hrtimer field of a struct homa_pacer.
+ *
+ * Return:   Always HRTIMER_NORESTART.
+ */
+enum hrtimer_restart homa_pacer_hrtimer(struct hrtimer *timer)
+{
+	struct homa_pacer *pacer = container_of(timer, struct homa_pacer,
+						hrtimer);
+
+	wake_up_process(READ_ONCE(pacer->kthread));
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * homa_throttled_age_less() - Comparison function for the throttled_by_age
+ * tree of a pacer.
+ * @a:       throttled_age_node of one RPC.
+ * @b:       throttled_age_node of another RPC.
+ *
+ * Return:   True if @a's message was started before @b's.
+ */
+static bool homa_throttled_age_less(struct rb_node *a, const struct rb_node *b)
+{
+	return rb_entry(a, struct homa_rpc, throttled_age_node)->msgout.init_ns
+			< rb_entry(b, struct homa_rpc,
+				   throttled_age_node)->msgout.init_ns;
+}
+
+/**
+ * homa_throttled_erase() - Remove an RPC from the throttled trees of
+ * its pacer.
+ * @pacer:   Pacer whose trees contain @rpc. The caller must hold its
+ *           throttle lock.
+ * @rpc:     RPC to remove; must currently be throttled.
+ */
+static void homa_throttled_erase(struct homa_pacer *pacer,
+				 struct homa_rpc *rpc)
+	__must_hold(&pacer->throttle_lock)
+{
+	rb_erase_cached(&rpc->throttled_node, &pacer->throttled_rpcs);
+	RB_CLEAR_NODE(&rpc->throttled_node);
+	rb_erase_cached(&rpc->throttled_age_node, &pacer->throttled_by_age);
+	RB_CLEAR_NODE(&rpc->throttled_age_node);
+	if (RB_EMPTY_ROOT(&pacer->throttled_rpcs.rb_root))
+		INC_METRIC(throttled_ns, sched_clock() - pacer->throttle_add);
+}
+
 /**
  * homa_pacer_xmit() - Transmit packets from  the throttled list. Note:
  * this function may be invoked from either process context or softirq (BH)
@@ -861,17 +1327,19 @@ int homa_pacer_main(void *transport)
  * this method gets invoked from other places as well, to increase the
  * likelihood that we keep the link busy. Those other invocations are not
  * guaranteed to happen, so the pacer thread provides a backstop.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @pacer:   Pacer whose throttled list should be serviced.
  */
-void homa_pacer_xmit(struct homa *homa)
+void homa_pacer_xmit(struct homa_pacer *pacer)
 {
+	struct homa *homa = pacer->homa;
 	struct homa_rpc *rpc;
+	struct rb_node *node;
 	int i;
 
 	/* Make sure only one instance of this function executes at a
-	 * time.
+	 * time for this pacer.
 	 */
-	if (!spin_trylock_bh(&homa->pacer_mutex))
+	if (!spin_trylock_bh(&pacer->mutex))
 		return;
 
 	/* Each iteration through the following loop sends one packet. We
@@ -884,13 +1352,15 @@ void homa_pacer_xmit(struct homa *homa)
 
 		/* If the NIC queue is too long, wait until it gets shorter. */
 		now = sched_clock();
-		idle_time = atomic64_read(&homa->link_idle_time);
+		idle_time = atomic64_read(&pacer->link_idle_time);
 		while ((now + homa->max_nic_queue_ns) < idle_time) {
 			/* If we've xmitted at least one packet then
 			 * return (this helps with testing and also
 			 * allows homa_pacer_main to yield the core).
+			 * In hrtimer mode, never spin: the pacer thread
+			 * will sleep until the queue has drained.
 			 */
-			if (i != 0)
+			if (i != 0 || homa->pacer_hrtimer)
 				goto done;
 			now = sched_clock();
 		}
@@ -908,36 +1378,28 @@ void homa_pacer_xmit(struct homa *homa)
 		 * throttle lock while locking the RPC is important because
 		 * it keeps the RPC from being deleted before it can be locked.
 		 */
-		homa_throttle_lock(homa);
-		homa->pacer_fifo_count -= homa->pacer_fifo_fraction;
-		if (homa->pacer_fifo_count <= 0) {
-			struct homa_rpc *cur;
-			__u64 oldest = ~0;
-
-			homa->pacer_fifo_count += 1000;
-			rpc = NULL;
-			list_for_each_entry_rcu(cur, &homa->throttled_rpcs,
-						throttled_links) {
-				if (cur->msgout.init_ns < oldest) {
-					rpc = cur;
-					oldest = cur->msgout.init_ns;
-				}
-			}
+		homa_throttle_lock(pacer);
+		pacer->fifo_count -= homa->pacer_fifo_fraction;
+		if (pacer->fifo_count <= 0) {
+			pacer->fifo_count += 1000;
+			node = rb_first_cached(&pacer->throttled_by_age);
+			rpc = rb_entry_safe(node, struct homa_rpc,
+					    throttled_age_node);
 		} else {
-			rpc = list_first_or_null_rcu(&homa->throttled_rpcs,
-						     struct homa_rpc,
-						     throttled_links);
+			node = rb_first_cached(&pacer->throttled_rpcs);
+			rpc = rb_entry_safe(node, struct homa_rpc,
+					    throttled_node);
 		}
 		if (!rpc) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
 			break;
 		}
 		if (!homa_rpc_try_lock(rpc, "homa_pacer_xmit")) {
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
 			INC_METRIC(pacer_skipped_rpcs, 1);
 			break;
 		}
-		homa_throttle_unlock(homa);
+		homa_throttle_unlock(pacer);
 
 		tt_record4("pacer calling homa_xmit_data for rpc id %llu, port %d, offset %d, bytes_left %d",
 			   rpc->id, rpc->hsk->port,
@@ -953,44 +1415,31 @@ void homa_pacer_xmit(struct homa *homa)
 			/* Nothing more to transmit from this message (right
 			 * now), so remove it from the throttled list.
 			 */
-			homa_throttle_lock(homa);
-			if (!list_empty(&rpc->throttled_links)) {
+			homa_throttle_lock(pacer);
+			if (!RB_EMPTY_NODE(&rpc->throttled_node)) {
 				tt_record2("pacer removing id %d from throttled list, offset %d",
 					   rpc->id, rpc->msgout.next_xmit_offset);
-				list_del_rcu(&rpc->throttled_links);
-				if (list_empty(&homa->throttled_rpcs))
-					INC_METRIC(throttled_ns, sched_clock()
-							- homa->throttle_add);
-
-				/* Note: this reinitialization is only safe
-				 * because the pacer only looks at the first
-				 * element of the list, rather than traversing
-				 * it (and besides, we know the pacer isn't
-				 * active concurrently, since this code *is*
-				 * the pacer). It would not be safe under more
-				 * general usage patterns.
-				 */
-				INIT_LIST_HEAD_RCU(&rpc->throttled_links);
+				homa_throttled_erase(pacer, rpc);
 			}
-			homa_throttle_unlock(homa);
+			homa_throttle_unlock(pacer);
 		}
 		homa_rpc_unlock(rpc);
 	}
 done:
-	spin_unlock_bh(&homa->pacer_mutex);
+	spin_unlock_bh(&pacer->mutex);
 }
 
 /**
- * homa_pacer_stop() - Will cause the pacer thread to exit (waking it up
- * if necessary); doesn't return until after the pacer thread has exited.
- * @homa:    Overall data about the Homa protocol implementation.
+ * homa_pacer_stop() - Will cause a pacer's thread to exit (waking it up
+ * if necessary); doesn't return until after the thread has exited.
+ * @pacer:   Pacer whose thread should exit; its kthread must be non-NULL.
  */
-void homa_pacer_stop(struct homa *homa)
+void homa_pacer_stop(struct homa_pacer *pacer)
 {
-	homa->pacer_exit = true;
-	wake_up_process(homa->pacer_kthread);
-	kthread_stop(homa->pacer_kthread);
-	homa->pacer_kthread = NULL;
+	pacer->exit = true;
+	wake_up_process(pacer->kthread);
+	kthread_stop(pacer->kthread);
+	pacer->kthread = NULL;
 }
 
 /**
@@ -1002,41 +1451,50 @@ void homa_pacer_stop(struct homa *homa)
 void homa_add_to_throttled(struct homa_rpc *rpc)
 	__must_hold(&rpc->bucket->lock)
 {
-	struct homa *homa = rpc->hsk->homa;
+	struct homa_pacer *pacer = rpc->msgout.pacer;
+	struct rb_node **link, *parent = NULL;
+	struct task_struct *thread;
 	struct homa_rpc *candidate;
-	int bytes_left;
+	bool leftmost = true;
 	int checks = 0;
 	__u64 now;
 
-	if (!list_empty(&rpc->throttled_links))
+	if (!RB_EMPTY_NODE(&rpc->throttled_node))
 		return;
 	now = sched_clock();
-	if (!list_empty(&homa->throttled_rpcs))
-		INC_METRIC(throttled_ns, now - homa->throttle_add);
-	homa->throttle_add = now;
-	bytes_left = rpc->msgout.length - rpc->msgout.next_xmit_offset;
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(candidate, &homa->throttled_rpcs,
-				throttled_links) {
-		int bytes_left_cand;
-
+	if (!RB_EMPTY_ROOT(&pacer->throttled_rpcs.rb_root))
+		INC_METRIC(throttled_ns, now - pacer->throttle_add);
+	pacer->throttle_add = now;
+	rpc->throttled_bytes = rpc->msgout.length -
+			rpc->msgout.next_xmit_offset;
+	homa_throttle_lock(pacer);
+
+	/* RPCs with the same number of bytes are kept in insertion order,
+	 * so equal keys go to the right.
+	 */
+	link = &pacer->throttled_rpcs.rb_root.rb_node;
+	while (*link) {
 		checks++;
-
-		/* Watch out: the pacer might have just transmitted the last
-		 * packet from candidate.
-		 */
-		bytes_left_cand = candidate->msgout.length -
-				candidate->msgout.next_xmit_offset;
-		if (bytes_left_cand > bytes_left) {
-			list_add_tail_rcu(&rpc->throttled_links,
-					  &candidate->throttled_links);
-			goto done;
+		parent = *link;
+		candidate = rb_entry(parent, struct homa_rpc, throttled_node);
+		if (rpc->throttled_bytes < candidate->throttled_bytes) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
 		}
 	}
-	list_add_tail_rcu(&rpc->throttled_links, &homa->throttled_rpcs);
-done:
-	homa_throttle_unlock(homa);
-	wake_up_process(homa->pacer_kthread);
+	rb_link_node(&rpc->throttled_node, parent, link);
+	rb_insert_color_cached(&rpc->throttled_node, &pacer->throttled_rpcs,
+			       leftmost);
+	rb_add_cached(&rpc->throttled_age_node, &pacer->throttled_by_age,
+		      homa_throttled_age_less);
+	homa_throttle_unlock(pacer);
+
+	/* The thread for a new pacer may not have started yet. */
+	thread = READ_ONCE(pacer->kthread);
+	if (thread)
+		wake_up_process(thread);
 	INC_METRIC(throttle_list_adds, 1);
 	INC_METRIC(throttle_list_checks, checks);
 //	tt_record("woke up pacer thread");
@@ -1049,45 +1507,54 @@ done:
  */
 void homa_remove_from_throttled(struct homa_rpc *rpc)
 {
-	if (unlikely(!list_empty(&rpc->throttled_links))) {
+	if (unlikely(!RB_EMPTY_NODE(&rpc->throttled_node))) {
+		struct homa_pacer *pacer = rpc->msgout.pacer;
+
 		UNIT_LOG("; ", "removing id %llu from throttled list", rpc->id);
-		homa_throttle_lock(rpc->hsk->homa);
-		list_del(&rpc->throttled_links);
-		if (list_empty(&rpc->hsk->homa->throttled_rpcs))
-			INC_METRIC(throttled_ns, sched_clock()
-					- rpc->hsk->homa->throttle_add);
-		homa_throttle_unlock(rpc->hsk->homa);
-		INIT_LIST_HEAD(&rpc->throttled_links);
+		homa_throttle_lock(pacer);
+		homa_throttled_erase(pacer, rpc);
+		homa_throttle_unlock(pacer);
 	}
 }
 
 /**
  * homa_log_throttled() - Print information to the system log about the
- * RPCs on the throttled list.
+ * RPCs on the throttled lists of all pacers.
  * @homa:   Overall information about the Homa transport.
  */
 void homa_log_throttled(struct homa *homa)
 {
+	struct homa_pacer *pacer;
 	struct homa_rpc *rpc;
-	__s64 bytes = 0;
-	int rpcs = 0;
-
-	pr_notice("Printing throttled list\n");
-	homa_throttle_lock(homa);
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
-		rpcs++;
-		if (!homa_rpc_try_lock(rpc, "homa_log_throttled")) {
-			pr_notice("Skipping throttled RPC: locked\n");
-			continue;
+	struct rb_node *node;
+	__s64 bytes;
+	int rpcs;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(pacer, &homa->pacers, links) {
+		bytes = 0;
+		rpcs = 0;
+		pr_notice("Printing throttled list for device %d\n",
+			  pacer->ifindex);
+		homa_throttle_lock(pacer);
+		for (node = rb_first_cached(&pacer->throttled_rpcs); node;
+		     node = rb_next(node)) {
+			rpc = rb_entry(node, struct homa_rpc, throttled_node);
+			rpcs++;
+			if (!homa_rpc_try_lock(rpc, "homa_log_throttled")) {
+				pr_notice("Skipping throttled RPC: locked\n");
+				continue;
+			}
+			if (*rpc->msgout.next_xmit)
+				bytes += rpc->msgout.length
+						- rpc->msgout.next_xmit_offset;
+			if (rpcs <= 20)
+				homa_rpc_log(rpc);
+			homa_rpc_unlock(rpc);
 		}
-		if (*rpc->msgout.next_xmit)
-			bytes += rpc->msgout.length
-					- rpc->msgout.next_xmit_offset;
-		if (rpcs <= 20)
-			homa_rpc_log(rpc);
-		homa_rpc_unlock(rpc);
+		homa_throttle_unlock(pacer);
+		pr_notice("Finished printing throttle list: %d rpcs, %lld bytes\n",
+			  rpcs, bytes);
 	}
-	homa_throttle_unlock(homa);
-	pr_notice("Finished printing throttle list: %d rpcs, %lld bytes\n",
-		  rpcs, bytes);
+	rcu_read_unlock();
 }
@@ -8,6 +8,8 @@
 #include "homa_offload.h"
 #include "homa_peer.h"
 #include "homa_pool.h"
+#include "homa_ring.h"
+#include "homa_skb.h"
 
 /* Not yet sure what these variables are for */
 static long sysctl_homa_mem[3] __read_mostly;
@@ -53,17 +55,17 @@ static const struct proto_ops homa_proto_ops = {
 	.bind		   = homa_bind,
 	.connect	   = inet_dgram_connect,
 	.socketpair	   = sock_no_socketpair,
-	.accept		   = sock_no_accept,
+	.accept		   = homa_accept,
 	.getname	   = inet_getname,
 	.poll		   = homa_poll,
 	.ioctl		   = inet_ioctl,
-	.listen		   = sock_no_listen,
+	.listen		   = homa_listen,
 	.shutdown	   = homa_shutdown,
 	.setsockopt	   = sock_common_setsockopt,
 	.getsockopt	   = sock_common_getsockopt,
 	.sendmsg	   = inet_sendmsg,
 	.recvmsg	   = inet_recvmsg,
-	.mmap		   = sock_no_mmap,
+	.mmap		   = homa_mmap,
 	.set_peek_off	   = sk_set_peek_off,
 };
 
@@ -74,17 +76,17 @@ static const struct proto_ops homav6_proto_ops = {
 	.bind		   = homa_bind,
 	.connect	   = inet_dgram_connect,
 	.socketpair	   = sock_no_socketpair,
-	.accept		   = sock_no_accept,
+	.accept		   = homa_accept,
 	.getname	   = inet6_getname,
 	.poll		   = homa_poll,
 	.ioctl		   = inet6_ioctl,
-	.listen		   = sock_no_listen,
+	.listen		   = homa_listen,
 	.shutdown	   = homa_shutdown,
 	.setsockopt	   = sock_common_setsockopt,
 	.getsockopt	   = sock_common_getsockopt,
 	.sendmsg	   = inet_sendmsg,
 	.recvmsg	   = inet_recvmsg,
-	.mmap		   = sock_no_mmap,
+	.mmap		   = homa_mmap,
 	.set_peek_off	   = sk_set_peek_off,
 };
 
@@ -202,6 +204,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "bpage_quota",
+		.data		= &homa_data.bpage_quota,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "busy_usecs",
 		.data		= &homa_data.busy_usecs,
@@ -377,6 +386,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "pacer_hrtimer",
+		.data		= &homa_data.pacer_hrtimer,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "poll_usecs",
 		.data		= &homa_data.poll_usecs,
@@ -489,6 +505,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "zerocopy_min",
+		.data		= &homa_data.zerocopy_min,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
 	{}
 #endif
@@ -660,6 +683,9 @@ void __exit homa_unload(void)
 	unregister_net_sysctl_table(homa_ctl_header);
 	proc_remove(metrics_dir_entry);
 	homa_destroy(homa);
+
+	/* Wait for any pending homa_sock_put_rcu callbacks. */
+	rcu_barrier();
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
 	inet_unregister_protosw(&homa_protosw);
 	inet6_del_protocol(&homav6_protocol, IPPROTO_HOMA);
@@ -733,17 +759,61 @@ int homa_shutdown(struct socket *sock, int how)
 }
 
 /**
- * homa_disconnect() - Invoked when disconnect system call is invoked on a
- * Homa socket.
+ * homa_disconnect() - Invoked when connect is invoked on a Homa socket
+ * with an AF_UNSPEC address: undoes the effect of an earlier connect, so
+ * that the socket can be connected to a different peer. The socket keeps
+ * its port and its buffer pool. Outstanding client RPCs are aborted with
+ * ECONNRESET (the errors are returned by recvmsg as usual) and server
+ * RPCs are freed.
  * @sk:    Socket to disconnect
- * @flags: ??
+ * @flags: Flags from the connect call (ignored).
  *
  * Return: 0 on success, otherwise a negative errno.
  */
 int homa_disconnect(struct sock *sk, int flags)
 {
-	pr_warn("unimplemented disconnect invoked on Homa socket\n");
-	return -EINVAL;
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_rpc *rpc;
+	bool owner;
+
+	homa_sock_lock(hsk, "homa_disconnect");
+	if (hsk->shutdown) {
+		homa_sock_unlock(hsk);
+		return -ESHUTDOWN;
+	}
+	if (!hsk->connect) {
+		homa_sock_unlock(hsk);
+		return 0;
+	}
+
+	/* A peeled-off socket shares its parent's port, so it can't
+	 * become an ordinary unconnected socket.
+	 */
+	rcu_read_lock();
+	owner = homa_sock_find(hsk->homa->port_map, hsk->port) == hsk;
+	rcu_read_unlock();
+	if (!owner) {
+		homa_sock_unlock(hsk);
+		return -EOPNOTSUPP;
+	}
+	homa_sock_unhash_connected(hsk);
+	homa_sock_unlock(hsk);
+
+	homa_abort_sock_rpcs(hsk, -ECONNRESET);
+	rcu_read_lock();
+	if (homa_protect_rpcs(hsk)) {
+		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+			if (homa_is_client(rpc->id))
+				continue;
+			homa_rpc_lock(rpc, "homa_disconnect");
+			homa_rpc_free(rpc);
+			homa_rpc_unlock(rpc);
+		}
+		homa_unprotect_rpcs(hsk);
+	}
+	rcu_read_unlock();
+	INC_METRIC(disconnects, 1);
+	return 0;
 }
 
 /**
@@ -782,6 +852,410 @@ int homa_ioc_abort(struct sock *sk, int *karg)
 	return ret;
 }
 
+/**
+ * homa_recv_complete() - Invoked once information about a received message
+ * has been collected for the application: transfers ownership of the
+ * message's buffers to the application and frees the RPC if it is no
+ * longer needed.
+ * @rpc:     RPC containing the message; must be locked by caller. It is
+ *           unlocked (and possibly freed) by this function.
+ * @result:  Value being returned to the application for this message
+ *           (message length or negative errno).
+ */
+static void homa_recv_complete(struct homa_rpc *rpc, int result)
+	__releases(rpc->bucket_lock)
+{
+	/* This indicates that the application now owns the buffers, so
+	 * we won't free them in homa_rpc_free. They still count against
+	 * the socket's quota until the application returns them.
+	 */
+	rpc->msgin.num_bpages = 0;
+
+	if (homa_is_client(rpc->id)) {
+		homa_peer_add_ack(rpc);
+		homa_rpc_free(rpc);
+	} else {
+		if (result < 0)
+			homa_rpc_free(rpc);
+		else
+			rpc->state = RPC_IN_SERVICE;
+	}
+	homa_rpc_unlock(rpc);
+}
+
+/**
+ * homa_ioc_recv_batch() - The top-level function for the ioctl that
+ * implements the homa_recv_batch user-level API: recycles the bpages
+ * passed in, then returns as many ready messages as will fit (waiting
+ * only for the first, unless the call is nonblocking).
+ * @sk:       Socket for this request.
+ * @karg:     Used to pass information from user space (a struct
+ *            homa_recvbatch_args).
+ *
+ * Return: 0 if at least one message was returned (or none were requested),
+ * otherwise a negative errno.
+ */
+int homa_ioc_recv_batch(struct sock *sk, int *karg)
+{
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_recvbatch_msg __user *umsgs;
+	struct homa_recvbatch_args args;
+	__u32 offsets[HOMA_MAX_BPAGES];
+	struct homa_recvbatch_msg msg;
+	__u32 returned, count;
+	struct homa_rpc *rpc;
+	int result = 0;
+	int flags;
+
+	if (unlikely(copy_from_user(&args, (void __user *)karg, sizeof(args))))
+		return -EFAULT;
+	if (args.flags & ~HOMA_RECVMSG_VALID_FLAGS)
+		return -EINVAL;
+
+	/* Inline messages have no buffers to return them in. */
+	if (READ_ONCE(hsk->inline_max) > 0)
+		return -EINVAL;
+	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
+			sched_clock();
+
+	for (returned = 0; returned < args.num_bpages; returned += count) {
+		count = min_t(__u32, args.num_bpages - returned,
+			      HOMA_MAX_BPAGES);
+		if (copy_from_user(offsets,
+				   (void __user *)(args.bpage_offsets + returned),
+				   count * sizeof(__u32))) {
+			result = -EFAULT;
+			break;
+		}
+		result = homa_pool_return_buffers(hsk, count, offsets);
+		if (result != 0)
+			break;
+	}
+	if (args.num_bpages > 0) {
+		/* RPCs waiting for buffer space may now be able to proceed;
+		 * without this, homa_wait_for_message below could wait
+		 * forever for a message stuck behind them.
+		 */
+		homa_pool_check_waiting(hsk->buffer_pool);
+	}
+	if (result != 0)
+		return result;
+
+	umsgs = (struct homa_recvbatch_msg __user *)args.msgs;
+	flags = args.flags;
+	args.num_msgs = 0;
+	while (args.num_msgs < args.max_msgs) {
+		rpc = homa_wait_for_message(hsk, flags, 0);
+		if (IS_ERR(rpc)) {
+			/* Running out of ready messages isn't an error once
+			 * at least one has been returned.
+			 */
+			if (args.num_msgs == 0)
+				result = PTR_ERR(rpc);
+			break;
+		}
+		if (unlikely(rpc->msgin.inline_data && !rpc->error)) {
+			/* The message arrived before SO_HOMA_INLINE was
+			 * cleared, so there are no buffers to return it in.
+			 * Put it back for recvmsg rather than discard it.
+			 */
+			homa_sock_lock(hsk, "homa_ioc_recv_batch");
+			atomic_or(RPC_PKTS_READY, &rpc->flags);
+			list_add(&rpc->ready_links, homa_is_client(rpc->id)
+				 ? &hsk->ready_responses
+				 : &hsk->ready_requests);
+			homa_sock_wakeup(hsk);
+			homa_sock_unlock(hsk);
+			homa_rpc_unlock(rpc);
+			if (args.num_msgs == 0)
+				result = -EMSGSIZE;
+			break;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.id = rpc->id;
+		msg.completion_cookie = rpc->completion_cookie;
+		msg.length = rpc->error ? rpc->error : rpc->msgin.length;
+		if (likely(rpc->msgin.length >= 0)) {
+			msg.num_bpages = rpc->msgin.num_bpages;
+			memcpy(msg.bpage_offsets, rpc->msgin.bpage_offsets,
+			       sizeof(msg.bpage_offsets));
+		}
+		if (sk->sk_family == AF_INET6) {
+			msg.addr.in6.sin6_family = AF_INET6;
+			msg.addr.in6.sin6_port = htons(rpc->dport);
+			msg.addr.in6.sin6_addr = rpc->peer->addr;
+		} else {
+			msg.addr.in4.sin_family = AF_INET;
+			msg.addr.in4.sin_port = htons(rpc->dport);
+			msg.addr.in4.sin_addr.s_addr =
+					ipv6_to_ipv4(rpc->peer->addr);
+		}
+		homa_recv_complete(rpc, msg.length);
+
+		if (unlikely(copy_to_user(umsgs + args.num_msgs, &msg,
+					  sizeof(msg)))) {
+			/* As in homa_recvmsg, the message's buffers will be
+			 * leaked.
+			 */
+			result = -EFAULT;
+			break;
+		}
+		args.num_msgs++;
+
+		/* Only wait for the first message. */
+		flags |= HOMA_RECVMSG_NONBLOCKING;
+	}
+	INC_METRIC(recv_batch_msgs, args.num_msgs);
+
+	if (unlikely(copy_to_user((void __user *)karg, &args, sizeof(args))))
+		return -EFAULT;
+	return result;
+}
+
+/**
+ * define HOMA_SENDBATCH_CHUNK - Number of messages that
+ * homa_ioc_send_batch copies in from user space at a time.
+ */
+#define HOMA_SENDBATCH_CHUNK 16
+
+/**
+ * struct homa_sendbatch_entry - Kernel-side state for one message being
+ * sent by homa_ioc_send_batch.
+ */
+struct homa_sendbatch_entry {
+	/** @msg: Copy of the user's description of the message. */
+	struct homa_sendbatch_msg msg;
+
+	/** @iov: Kernel copy of msg.iov (allocated by import_iovec). */
+	struct iovec *iov;
+
+	/** @iter: Describes the message's data in user space. */
+	struct iov_iter iter;
+};
+
+/**
+ * homa_sendbatch_one() - Send one of the messages for homa_ioc_send_batch.
+ * @hsk:     Connected socket on which to send.
+ * @dest:    Address of @hsk's peer.
+ * @msg:     Describes the message; if it is a request, the id of the new
+ *           RPC is stored in msg->id.
+ * @iter:    Describes the message's data in user space.
+ *
+ * Return:   0 for success, otherwise a negative errno.
+ */
+static int homa_sendbatch_one(struct homa_sock *hsk,
+			      const union sockaddr_in_union *dest,
+			      struct homa_sendbatch_msg *msg,
+			      struct iov_iter *iter)
+{
+	struct in6_addr canonical_dest;
+	struct homa_rpc *rpc;
+	int result;
+
+	if (msg->id == 0) {
+		rpc = homa_rpc_new_client(hsk, dest);
+		if (IS_ERR(rpc))
+			return PTR_ERR(rpc);
+		INC_METRIC(send_calls, 1);
+		rpc->completion_cookie = msg->completion_cookie;
+		result = homa_message_out_fill(rpc, iter, 1);
+		if (result)
+			goto error;
+		msg->id = rpc->id;
+		homa_rpc_unlock(rpc); /* Locked by homa_rpc_new_client. */
+		return 0;
+	}
+
+	INC_METRIC(reply_calls, 1);
+	if (msg->completion_cookie != 0)
+		return -EINVAL;
+	canonical_dest = canonical_ipv6_addr(dest);
+	rpc = homa_find_server_rpc(hsk, &canonical_dest, msg->id);
+	if (!rpc) {
+		/* As in homa_sendmsg, this isn't an error: the client may
+		 * no longer be interested in the RPC.
+		 */
+		return 0;
+	}
+	if (rpc->error) {
+		result = rpc->error;
+		goto error;
+	}
+	if (rpc->state != RPC_IN_SERVICE) {
+		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
+		return -EINVAL;
+	}
+	rpc->state = RPC_OUTGOING;
+	result = homa_message_out_fill(rpc, iter, 1);
+	if (result && rpc->state != RPC_DEAD)
+		goto error;
+	homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
+	return 0;
+
+error:
+	homa_rpc_free(rpc);
+	homa_rpc_unlock(rpc);
+	return result;
+}
+
+/**
+ * homa_ioc_release() - The top-level function for the ioctl that
+ * implements the homa_release user-level API: returns bpages to the
+ * socket's buffer pool (plus any the application has placed in its
+ * completion ring's free ring), immediately retries RPCs that were
+ * waiting for buffer space, and reports the pool's occupancy.
+ * @sk:       Socket for this request.
+ * @karg:     Used to pass information from user space (a struct
+ *            homa_release_args).
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_ioc_release(struct sock *sk, int *karg)
+{
+	struct homa_sock *hsk = homa_sk(sk);
+	__u32 offsets[HOMA_MAX_BPAGES];
+	struct homa_release_args args;
+	__u32 returned, count;
+	int result = 0;
+
+	if (unlikely(copy_from_user(&args, (void __user *)karg, sizeof(args))))
+		return -EFAULT;
+	if (args._pad || !READ_ONCE(hsk->buffer_pool->region))
+		return -EINVAL;
+
+	for (returned = 0; returned < args.num_bpages; returned += count) {
+		count = min_t(__u32, args.num_bpages - returned,
+			      HOMA_MAX_BPAGES);
+		if (copy_from_user(offsets,
+				   (void __user *)(args.bpage_offsets + returned),
+				   count * sizeof(__u32))) {
+			result = -EFAULT;
+			break;
+		}
+		result = homa_pool_return_buffers(hsk, count, offsets);
+		if (result != 0)
+			break;
+	}
+	INC_METRIC(release_bpages, returned);
+	if (hsk->ring) {
+		homa_sock_lock(hsk, "homa_ioc_release");
+		homa_ring_recycle(hsk);
+		homa_sock_unlock(hsk);
+	}
+
+	/* Don't wait for the next recvmsg to unblock stalled RPCs. */
+	homa_pool_check_waiting(hsk->buffer_pool);
+	if (result != 0)
+		return result;
+
+	homa_pool_get_occupancy(hsk, &args);
+	if (unlikely(copy_to_user((void __user *)karg, &args, sizeof(args))))
+		return -EFAULT;
+	return 0;
+}
+
+/**
+ * homa_ioc_send_batch() - The top-level function for the ioctl that
+ * implements the homa_send_batch user-level API: sends several requests
+ * and/or responses on a connected socket. The peer address is resolved
+ * once for the whole batch, and tx pages for each group of messages are
+ * stashed with a single acquisition of the page pool lock.
+ * @sk:       Socket for this request; must be connected.
+ * @karg:     Used to pass information from user space (a struct
+ *            homa_sendbatch_args).
+ *
+ * Return: 0 on success (individual messages may still have failed; see
+ * their result fields), otherwise a negative errno.
+ */
+int homa_ioc_send_batch(struct sock *sk, int *karg)
+{
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_sendbatch_msg __user *umsgs;
+	struct homa_sendbatch_entry *entries;
+	struct homa_sendbatch_args args;
+	union sockaddr_in_union dest;
+	struct homa_sendbatch_entry *e;
+	int total, result = 0;
+	__u32 count, i;
+	ssize_t length;
+
+	if (unlikely(copy_from_user(&args, (void __user *)karg, sizeof(args))))
+		return -EFAULT;
+	if (!hsk->connect)
+		return -ENOTCONN;
+	dest = hsk->remote_host;
+	if (dest.sa.sa_family != AF_INET && dest.sa.sa_family != AF_INET6)
+		return -EAFNOSUPPORT;
+	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
+			sched_clock();
+
+	entries = kmalloc_array(HOMA_SENDBATCH_CHUNK, sizeof(*entries),
+				GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+	umsgs = (struct homa_sendbatch_msg __user *)args.msgs;
+	args.num_done = 0;
+	while (result == 0 && args.num_done < args.num_msgs) {
+		count = min_t(__u32, args.num_msgs - args.num_done,
+			      HOMA_SENDBATCH_CHUNK);
+
+		/* First pass: find out how much data the messages contain. */
+		total = 0;
+		for (i = 0; i < count; i++) {
+			e = &entries[i];
+			e->iov = NULL;
+			if (copy_from_user(&e->msg, umsgs + args.num_done + i,
+					   sizeof(e->msg))) {
+				e->msg.result = -EFAULT;
+				continue;
+			}
+			length = import_iovec(ITER_SOURCE,
+					      (const struct iovec __user *)
+					      e->msg.iov, e->msg.iovcnt, 0,
+					      &e->iov, &e->iter);
+			if (length < 0) {
+				e->msg.result = length;
+				continue;
+			}
+			e->msg.result = 0;
+
+			/* Clamp as we go: each length can be up to
+			 * MAX_RW_COUNT, so the sum could overflow.
+			 */
+			total += min_t(ssize_t, length,
+				       HOMA_MAX_MESSAGE_LENGTH - total);
+		}
+		homa_skb_stash_pages(hsk->homa, total);
+
+		/* Second pass: send the messages. If a result can't be
+		 * returned, the remaining messages aren't sent; the message
+		 * whose result couldn't be returned was still processed, so
+		 * it counts in num_done.
+		 */
+		for (i = 0; i < count; i++) {
+			e = &entries[i];
+			if (e->msg.result == 0 && result == 0)
+				e->msg.result = homa_sendbatch_one(hsk, &dest,
+								   &e->msg,
+								   &e->iter);
+			kfree(e->iov);
+			if (result != 0)
+				continue;
+			if (copy_to_user(umsgs + args.num_done, &e->msg,
+					 sizeof(e->msg)))
+				result = -EFAULT;
+			args.num_done++;
+			INC_METRIC(send_batch_msgs, 1);
+		}
+	}
+	kfree(entries);
+
+	if (unlikely(copy_to_user((void __user *)karg, &args, sizeof(args))))
+		return -EFAULT;
+	return result;
+}
+
 /**
  * homa_ioctl() - Implements the ioctl system call for Homa sockets.
  * @sk:    Socket on which the system call was invoked.
@@ -802,6 +1276,21 @@ int homa_ioctl(struct sock *sk, int cmd, int *karg)
 		INC_METRIC(abort_calls, 1);
 		INC_METRIC(abort_ns, sched_clock() - start);
 		break;
+	case HOMAIOCRECVBATCH:
+		result = homa_ioc_recv_batch(sk, karg);
+		INC_METRIC(recv_batch_calls, 1);
+		INC_METRIC(recv_ns, sched_clock() - start);
+		break;
+	case HOMAIOCSENDBATCH:
+		result = homa_ioc_send_batch(sk, karg);
+		INC_METRIC(send_batch_calls, 1);
+		INC_METRIC(send_batch_ns, sched_clock() - start);
+		break;
+	case HOMAIOCRELEASE:
+		result = homa_ioc_release(sk, karg);
+		INC_METRIC(release_calls, 1);
+		INC_METRIC(release_ns, sched_clock() - start);
+		break;
 	case HOMAIOCFREEZE:
 		tt_record1("Freezing timetrace because of HOMAIOCFREEZE ioctl, pid %d",
 			   current->pid);
@@ -835,6 +1324,188 @@ int homa_socket(struct sock *sk)
 	return result;
 }
 
+/**
+ * homa_setsockopt_share_rcvbuf() - Implements the SO_HOMA_SHARE_RCVBUF
+ * option for setsockopt: arranges for a socket to use the buffer pool of
+ * another Homa socket.
+ * @hsk:     Socket on which setsockopt was invoked.
+ * @optval:  Address in user space of the other socket's file descriptor.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_share_rcvbuf(struct homa_sock *hsk,
+					sockptr_t optval, unsigned int optlen)
+{
+	struct socket *other;
+	int fd, err;
+
+	if (optlen != sizeof(int))
+		return -EINVAL;
+	if (copy_from_sockptr(&fd, optval, optlen))
+		return -EFAULT;
+	other = sockfd_lookup(fd, &err);
+	if (!other)
+		return err;
+	if (!other->sk || other->sk->sk_prot->recvmsg != homa_recvmsg)
+		err = -EINVAL;
+	else if (READ_ONCE(hsk->buffer_pool->region))
+		/* The application may already own buffers in the region. */
+		err = -EBUSY;
+	else
+		err = homa_sock_share_pool(hsk, homa_sk(other->sk));
+	sockfd_put(other);
+	return err;
+}
+
+/**
+ * homa_setsockopt_ring() - Implements the SO_HOMA_RING option for
+ * setsockopt: creates a completion ring for a socket, which the
+ * application can then map with mmap. Once a socket has a ring, messages
+ * that no thread is waiting for are delivered through the ring rather than
+ * recvmsg.
+ * @hsk:     Socket on which setsockopt was invoked. Must already have a
+ *           buffer region.
+ * @optval:  Address in user space of a struct homa_ring_args.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_ring(struct homa_sock *hsk, sockptr_t optval,
+				unsigned int optlen)
+{
+	struct homa_ring_args args;
+	struct homa_ring *ring;
+	int err;
+
+	if (optlen != sizeof(args))
+		return -EINVAL;
+	if (copy_from_sockptr(&args, optval, optlen))
+		return -EFAULT;
+	if (!READ_ONCE(hsk->buffer_pool->region))
+		return -EINVAL;
+
+	/* Messages are copied into the buffer region in softirq context, so
+	 * its pages must stay resident.
+	 */
+	err = homa_pool_pin(hsk->buffer_pool);
+	if (err != 0)
+		return err;
+	ring = homa_ring_new(&args);
+	if (IS_ERR(ring))
+		return PTR_ERR(ring);
+
+	homa_sock_lock(hsk, "homa_setsockopt_ring");
+	if (hsk->ring) {
+		err = -EBUSY;
+	} else {
+		hsk->ring = ring;
+		ring = NULL;
+	}
+	homa_sock_unlock(hsk);
+	homa_ring_free(ring);
+	return err;
+}
+
+/**
+ * homa_setsockopt_poll() - Implements the SO_HOMA_POLL option for
+ * setsockopt: configures how threads waiting for messages on a socket
+ * busy-wait before sleeping.
+ * @hsk:     Socket on which setsockopt was invoked.
+ * @optval:  Address in user space of a struct homa_poll_args.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_poll(struct homa_sock *hsk, sockptr_t optval,
+				unsigned int optlen)
+{
+	struct homa_poll_args args;
+
+	if (optlen != sizeof(args))
+		return -EINVAL;
+	if (copy_from_sockptr(&args, optval, optlen))
+		return -EFAULT;
+	if (args.usecs < -1 || (args.flags & ~HOMA_POLL_ADAPTIVE))
+		return -EINVAL;
+
+	homa_sock_lock(hsk, "homa_setsockopt_poll");
+	WRITE_ONCE(hsk->poll_usecs, args.usecs);
+	WRITE_ONCE(hsk->poll_adaptive, !!(args.flags & HOMA_POLL_ADAPTIVE));
+	hsk->last_arrival = 0;
+	hsk->avg_interarrival = 0;
+	homa_sock_unlock(hsk);
+	return 0;
+}
+
+/**
+ * homa_setsockopt_inline() - Implements the SO_HOMA_INLINE option for
+ * setsockopt: sets the size of the largest message that recvmsg will
+ * copy directly into the caller's iovec.
+ * @hsk:     Socket on which setsockopt was invoked.
+ * @optval:  Address in user space of an int.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_inline(struct homa_sock *hsk, sockptr_t optval,
+				  unsigned int optlen)
+{
+	int max;
+
+	if (optlen != sizeof(max))
+		return -EINVAL;
+	if (copy_from_sockptr(&max, optval, optlen))
+		return -EFAULT;
+	if (max < 0 || max > HOMA_MAX_INLINE)
+		return -EINVAL;
+	WRITE_ONCE(hsk->inline_max, max);
+	return 0;
+}
+
+/**
+ * homa_setsockopt_zerocopy() - Implements the SO_HOMA_ZEROCOPY option for
+ * setsockopt: enables or disables MSG_ZEROCOPY for sendmsg.
+ * @hsk:     Socket on which setsockopt was invoked.
+ * @optval:  Address in user space of an int (0 or 1).
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_zerocopy(struct homa_sock *hsk, sockptr_t optval,
+				    unsigned int optlen)
+{
+	int enable;
+
+	if (optlen != sizeof(enable))
+		return -EINVAL;
+	if (copy_from_sockptr(&enable, optval, optlen))
+		return -EFAULT;
+	if (enable < 0 || enable > 1)
+		return -EINVAL;
+	sock_valbool_flag(&hsk->sock, SOCK_ZEROCOPY, enable);
+	return 0;
+}
+
+/**
+ * homa_setsockopt_bpage_quota() - Implements the SO_HOMA_BPAGE_QUOTA option
+ * for setsockopt: sets the socket's soft quota of bpages in a shared
+ * buffer region.
+ * @hsk:     Socket on which setsockopt was invoked.
+ * @optval:  Address in user space of an int.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_bpage_quota(struct homa_sock *hsk,
+				       sockptr_t optval, unsigned int optlen)
+{
+	int quota;
+
+	if (optlen != sizeof(quota))
+		return -EINVAL;
+	if (copy_from_sockptr(&quota, optval, optlen))
+		return -EFAULT;
+	if (quota < -1)
+		return -EINVAL;
+	WRITE_ONCE(hsk->bpage_quota, quota);
+	return 0;
+}
+
 /**
  * homa_setsockopt() - Implements the getsockopt system call for Homa sockets.
  * @sk:      Socket on which the system call was invoked.
@@ -849,29 +1520,72 @@ int homa_setsockopt(struct sock *sk, int level, int optname,
 		    sockptr_t optval, unsigned int optlen)
 {
 	struct homa_sock *hsk = homa_sk(sk);
-	struct homa_rcvbuf_args args;
+	struct homa_rcvbuf_ext_args args = {};
 	__u64 start = sched_clock();
+	struct page **pages = NULL;
+	int num_pages = 0;
 	int ret;
 
-	if (level != IPPROTO_HOMA || optname != SO_HOMA_RCVBUF)
+	if (level != IPPROTO_HOMA)
+		return -ENOPROTOOPT;
+	if (optname == SO_HOMA_SHARE_RCVBUF)
+		return homa_setsockopt_share_rcvbuf(hsk, optval, optlen);
+	if (optname == SO_HOMA_RING)
+		return homa_setsockopt_ring(hsk, optval, optlen);
+	if (optname == SO_HOMA_POLL)
+		return homa_setsockopt_poll(hsk, optval, optlen);
+	if (optname == SO_HOMA_INLINE)
+		return homa_setsockopt_inline(hsk, optval, optlen);
+	if (optname == SO_HOMA_ZEROCOPY)
+		return homa_setsockopt_zerocopy(hsk, optval, optlen);
+	if (optname == SO_HOMA_BPAGE_QUOTA)
+		return homa_setsockopt_bpage_quota(hsk, optval, optlen);
+	if (optname != SO_HOMA_RCVBUF)
 		return -ENOPROTOOPT;
-	if (optlen != sizeof(struct homa_rcvbuf_args))
+	if (optlen != sizeof(struct homa_rcvbuf_args) &&
+	    optlen != sizeof(struct homa_rcvbuf_ext_args))
 		return -EINVAL;
 
 	if (copy_from_sockptr(&args, optval, optlen))
 		return -EFAULT;
+	if ((args.flags & ~HOMA_RCVBUF_PIN) || args._pad)
+		return -EINVAL;
 
 	/* Do a trivial test to make sure we can at least write the first
 	 * page of the region.
 	 */
-	if (copy_to_user((__force void __user *)args.start, &args,
-			 sizeof(args)))
+	if (copy_to_user((__force void __user *)args.rcvbuf.start,
+			 &args.rcvbuf, sizeof(args.rcvbuf)))
 		return -EFAULT;
 
+	/* Pinning can sleep, so it must happen before locking the socket. */
+	if (args.flags & HOMA_RCVBUF_PIN) {
+		pages = homa_pool_pin_region((__force void __user *)
+					     args.rcvbuf.start,
+					     args.rcvbuf.length, &num_pages);
+		if (IS_ERR(pages))
+			return PTR_ERR(pages);
+	}
+
 	homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_RCV_BUF");
-	ret = homa_pool_init(hsk, (__force void __user *)args.start,
-			     args.length);
+	if (homa_pool_shared(hsk->buffer_pool)) {
+		/* Other sockets have messages in the current region. */
+		ret = -EBUSY;
+	} else if (hsk->buffer_pool->pinned_pages) {
+		/* A completion ring is copying into the current region. */
+		ret = -EBUSY;
+	} else {
+		ret = homa_pool_init(hsk, (__force void __user *)
+				     args.rcvbuf.start, args.rcvbuf.length);
+		if (ret == 0 && pages) {
+			homa_pool_set_pinned(hsk->buffer_pool, pages,
+					     num_pages);
+			pages = NULL;
+		}
+	}
 	homa_sock_unlock(hsk);
+	if (pages)
+		homa_pool_unpin_region(pages, num_pages);
 	INC_METRIC(so_set_buf_calls, 1);
 	INC_METRIC(so_set_buf_ns, sched_clock() - start);
 	return ret;
@@ -879,7 +1593,9 @@ int homa_setsockopt(struct sock *sk, int level, int optname,
 
 /**
  * homa_do_peeloff() - Helper routine to branch off a socket which has one-to-one abstraction.
- *					   The new socket will not inherit any RPC-related information about the original socket.
+ *					   The original socket's unread requests from the remote host are moved to
+ *					   the new socket; if there are any, the new socket shares the buffer pool
+ *					   of the original socket, otherwise it gets a pool of its own.
  * @sk:       The original sock, must be one-to-many (unconnected)
  * @uaddr:    The remote host the new socket wants to establish connection with
  * @addr_len: The length of the address, used for addr validation
@@ -889,8 +1605,6 @@ int homa_setsockopt(struct sock *sk, int level, int optname,
 static int homa_do_peeloff(struct sock *sk, struct sockaddr *uaddr, int addr_len, struct socket **sockp) {
 	struct homa_sock *hsk = homa_sk(sk);
 	struct socket *sock;
-	struct homa *homa = global_homa;
-	struct homa_socktab *socktab = homa->port_map;
 	int err = 0;
 
 	/* Check for shutdown */
@@ -919,75 +1633,29 @@ static int homa_do_peeloff(struct sock *sk, struct sockaddr *uaddr, int addr_len
 		if (addr_len < sizeof(struct sockaddr_in6))
 			return -EINVAL;
 	}
-	/* Creates the new socket. */
+	/* Creates the new socket; homa_socket will initialize it with a
+	 * client port of its own, which it gives up in homa_sock_peel.
+	 */
 	err = sock_create(sk->sk_family, SOCK_DGRAM, IPPROTO_HOMA, &sock);
 	if (err < 0)
 		return err;
-	/* Now we imitate what homa_sock_init does. */
-	struct homa_sock *hsk2 = homa_sk(sock->sk);
-	int i;
-	spin_lock_bh(&socktab->write_lock);
-	atomic_set(&hsk2->protect_count, 0);
-	spin_lock_init(&hsk2->lock);
-	hsk2->last_locker = "none";
-	atomic_set(&hsk2->protect_count, 0);
-	hsk2->homa = homa;
-	hsk2->ip_header_length = (hsk2->inet.sk.sk_family == AF_INET)
-			? HOMA_IPV4_HEADER_LENGTH : HOMA_IPV6_HEADER_LENGTH;
-	hsk2->shutdown = false;
-	/* Cautions! Now we have more than one homa socket on one port. */
-	hsk2->port = hsk->port;
-	hsk2->inet.inet_num = hsk2->port;
-	hsk2->inet.inet_sport = htons(hsk2->port);
-	hsk2->socktab_links.sock = hsk2;
-	/* Cautions! Peeled-off sockets are always connected. */
-	hsk2->connect = true;
-	/* Setting information for the remote host. */
-	if (sk->sk_family == AF_INET) {
-		hsk2->remote_host.in4.sin_family = AF_INET;
-		hsk2->remote_host.in4.sin_addr.s_addr = ((struct sockaddr_in *)uaddr)->sin_addr.s_addr;
-		hsk2->remote_host.in4.sin_port = ((struct sockaddr_in *)uaddr)->sin_port;
-	}
-	if (sk->sk_family == AF_INET6) {
-		hsk2->remote_host.in6.sin6_family = AF_INET6;
-		hsk2->remote_host.in6.sin6_addr = ((struct sockaddr_in6 *)uaddr)->sin6_addr;
-		hsk2->remote_host.in6.sin6_port = ((struct sockaddr_in6 *)uaddr)->sin6_port;
-	}
-	/* Adding the links to the sockets' hash table. */
-	hlist_add_head_rcu(&hsk2->socktab_links.hash_links,
-			   &socktab->buckets[homa_port_hash(hsk2->port)]);
-	/* Other relevant fields filled by homa_sock_init */
-	INIT_LIST_HEAD(&hsk2->active_rpcs);
-	INIT_LIST_HEAD(&hsk2->dead_rpcs);
-	hsk2->dead_skbs = 0;
-	INIT_LIST_HEAD(&hsk2->waiting_for_bufs);
-	INIT_LIST_HEAD(&hsk2->ready_requests);
-	INIT_LIST_HEAD(&hsk2->ready_responses);
-	INIT_LIST_HEAD(&hsk2->request_interests);
-	INIT_LIST_HEAD(&hsk2->response_interests);
-	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk2->client_rpc_buckets[i];
-
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-		bucket->id = i;
-	}
-	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk2->server_rpc_buckets[i];
-
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-		bucket->id = i + 1000000;
-	}
-	hsk2->buffer_pool = kzalloc(sizeof(*hsk2->buffer_pool), GFP_KERNEL);
-	if (!hsk2->buffer_pool) {
+	/* Requests from the remote host that are in progress (or waiting
+	 * to be read) on the original socket move to the new socket along
+	 * with their buffers, so the pool must be shared. Otherwise the
+	 * new socket keeps its own pool, so the application can give it a
+	 * region with SO_HOMA_RCVBUF (or share one with
+	 * SO_HOMA_SHARE_RCVBUF). The pool must be chosen before the peel:
+	 * once the socket is connected, requests can arrive on it.
+	 */
+	if (homa_rpc_peer_pending(hsk, (union sockaddr_in_union *)uaddr))
+		err = homa_sock_share_pool(homa_sk(sock->sk), hsk);
+	if (err == 0)
+		err = homa_sock_peel(homa_sk(sock->sk), hsk, uaddr);
+	if (err < 0) {
 		sock_release(sock);
-		spin_unlock_bh(&socktab->write_lock);
-		return -ENOMEM;
+		return err;
 	}
-	if (homa->hijack_tcp)
-		hsk2->sock.sk_protocol = IPPROTO_TCP;
-	spin_unlock_bh(&socktab->write_lock);
+	homa_rpc_migrate_peer(hsk, homa_sk(sock->sk));
 	*sockp = sock;
 	return 0;
 }
@@ -1003,8 +1671,18 @@ static int homa_do_peeloff(struct sock *sk, struct sockaddr *uaddr, int addr_len
  */
 static int homa_getsockopt_peeloff_common(struct sock *sk, struct sockaddr *uaddr,
                                           uint32_t addr_len, struct file **newfile) {
+	struct homa_sock *connected;
 	struct socket *newsock;
 	int retval;
+
+	/* If already peeled off, return -EISCONN */
+	rcu_read_lock();
+	connected = homa_sock_find_connected(global_homa->port_map, uaddr,
+					     homa_sk(sk)->port);
+	retval = (connected && connected->connect) ? -EISCONN : 0;
+	rcu_read_unlock();
+	if (retval < 0)
+		return retval;
 	retval = homa_do_peeloff(sk, uaddr, addr_len, &newsock);
 	if (retval < 0)
 		goto out;
@@ -1045,12 +1723,11 @@ static int homa_getsockopt_peeloff(struct sock *sk, char __user *optval, int __u
 	/* Copy uaddr and addrlen from user space. */
 	if (unlikely(copy_from_user(&addrlen, optlen, sizeof(int))))
 		return -EFAULT;
-	if (unlikely(copy_from_user(uaddr, optval, sizeof(struct sockaddr))))
+	if (addrlen > sizeof(storage))
+		addrlen = sizeof(storage);
+	memset(&storage, 0, sizeof(storage));
+	if (unlikely(copy_from_user(uaddr, optval, addrlen)))
 		return -EFAULT;
-	/* If already peeled off, return -EISCONN */
-	struct homa_sock *hsk = homa_sock_find_connected(global_homa->port_map, uaddr, homa_sk(sk)->port);
-	if (hsk && hsk->connect)
-		return -EISCONN;
 	retval = homa_getsockopt_peeloff_common(sk, uaddr, addrlen, &newfile);
 	if (retval < 0)
 		goto out;
@@ -1069,6 +1746,90 @@ out:
 	return retval;
 }
 
+/**
+ * homa_getsockopt_peeloff_batch() - Implements SO_HOMA_PEELOFF_BATCH:
+ * peels off a socket for each of several clients in a single call.
+ * @sk:      The original (listening) socket.
+ * @optval:  User-space address of a struct homa_peeloff_batch_args.
+ * @optlen:  User-space address of the length of @optval.
+ *
+ * A failure to peel off an individual client is reported in the fd field
+ * of its entry and does not stop the batch; the count field of the
+ * arguments is updated to the number of entries processed.
+ * Return:   The number of entries processed, or a negative errno if
+ *           none were. Once an entry has been processed its fd is
+ *           installed, so the count is returned even if the arguments
+ *           can't be updated.
+ */
+static int homa_getsockopt_peeloff_batch(struct sock *sk,
+					 char __user *optval,
+					 int __user *optlen)
+{
+	struct homa_peeloff_entry __user *uentry;
+	struct homa_peeloff_batch_args args;
+	struct homa_peeloff_entry entry;
+	struct homa_sock *newhsk;
+	struct homa_rpc *rpc;
+	struct file *newfile;
+	u32 i;
+	int len;
+	int fd;
+
+	if (copy_from_user(&len, optlen, sizeof(len)))
+		return -EFAULT;
+	if (len < sizeof(args))
+		return -EINVAL;
+	if (copy_from_user(&args, optval, sizeof(args)))
+		return -EFAULT;
+	if (args._pad != 0)
+		return -EINVAL;
+
+	uentry = (struct homa_peeloff_entry __user *)args.entries;
+	for (i = 0; i < args.count; i++, uentry++) {
+		if (copy_from_user(&entry, uentry, sizeof(entry)))
+			break;
+		newfile = NULL;
+		entry.id = 0;
+		fd = homa_getsockopt_peeloff_common(sk,
+				(struct sockaddr *)&entry.addr,
+				sizeof(entry.addr), &newfile);
+		if (fd >= 0) {
+			/* The client's unread requests were migrated to the
+			 * new socket; tell the application about the oldest
+			 * one so it can be read there without first going
+			 * through the listener.
+			 */
+			newhsk = homa_sk(sock_from_file(newfile)->sk);
+			homa_sock_lock(newhsk, "peeloff_batch");
+			rpc = list_first_entry_or_null(&newhsk->ready_requests,
+						       struct homa_rpc,
+						       ready_links);
+			if (rpc)
+				entry.id = rpc->id;
+			homa_sock_unlock(newhsk);
+		}
+		entry.fd = fd;
+		if (copy_to_user(uentry, &entry, sizeof(entry))) {
+			if (fd >= 0) {
+				fput(newfile);
+				put_unused_fd(fd);
+			}
+			break;
+		}
+		if (fd >= 0)
+			fd_install(fd, newfile);
+
+		/* args.count comes from the application, so it's unbounded. */
+		cond_resched();
+	}
+	if (i == 0 && args.count != 0)
+		return -EFAULT;
+	args.count = i;
+	if (copy_to_user(optval, &args, sizeof(args)) && i == 0)
+		return -EFAULT;
+	return i;
+}
+
 
 /**
  * homa_getsockopt() - Implements the getsockopt system call for Homa sockets.
@@ -1089,10 +1850,66 @@ int homa_getsockopt(struct sock *sk, int level, int optname,
 	int len;
 	if (optname == SO_HOMA_PEELOFF)
 		goto peeloff;
+	if (optname == SO_HOMA_PEELOFF_BATCH) {
+		if (level != IPPROTO_HOMA)
+			return -ENOPROTOOPT;
+		return homa_getsockopt_peeloff_batch(sk, optval, optlen);
+	}
 
 	if (copy_from_sockptr(&len, USER_SOCKPTR(optlen), sizeof(uint32_t)))
 		return -EFAULT;
 
+	if (level == IPPROTO_HOMA && optname == SO_HOMA_POLL) {
+		struct homa_poll_args poll_args;
+
+		if (len < sizeof(poll_args))
+			return -EINVAL;
+		poll_args.usecs = READ_ONCE(hsk->poll_usecs);
+		poll_args.flags = READ_ONCE(hsk->poll_adaptive)
+				? HOMA_POLL_ADAPTIVE : 0;
+		len = sizeof(poll_args);
+		if (copy_to_sockptr(USER_SOCKPTR(optlen), &len, sizeof(int)))
+			return -EFAULT;
+		if (copy_to_sockptr(USER_SOCKPTR(optval), &poll_args, len))
+			return -EFAULT;
+		return 0;
+	}
+	if (level == IPPROTO_HOMA && optname == SO_HOMA_INLINE) {
+		int max = READ_ONCE(hsk->inline_max);
+
+		if (len < sizeof(max))
+			return -EINVAL;
+		len = sizeof(max);
+		if (copy_to_sockptr(USER_SOCKPTR(optlen), &len, sizeof(int)))
+			return -EFAULT;
+		if (copy_to_sockptr(USER_SOCKPTR(optval), &max, len))
+			return -EFAULT;
+		return 0;
+	}
+	if (level == IPPROTO_HOMA && optname == SO_HOMA_ZEROCOPY) {
+		int enabled = sock_flag(sk, SOCK_ZEROCOPY);
+
+		if (len < sizeof(enabled))
+			return -EINVAL;
+		len = sizeof(enabled);
+		if (copy_to_sockptr(USER_SOCKPTR(optlen), &len, sizeof(int)))
+			return -EFAULT;
+		if (copy_to_sockptr(USER_SOCKPTR(optval), &enabled, len))
+			return -EFAULT;
+		return 0;
+	}
+	if (level == IPPROTO_HOMA && optname == SO_HOMA_BPAGE_QUOTA) {
+		int quota = READ_ONCE(hsk->bpage_quota);
+
+		if (len < sizeof(quota))
+			return -EINVAL;
+		len = sizeof(quota);
+		if (copy_to_sockptr(USER_SOCKPTR(optlen), &len, sizeof(int)))
+			return -EFAULT;
+		if (copy_to_sockptr(USER_SOCKPTR(optval), &quota, len))
+			return -EFAULT;
+		return 0;
+	}
 	if (level != IPPROTO_HOMA || optname != SO_HOMA_RCVBUF)
 		return -ENOPROTOOPT;
 	if (len < sizeof(val))
@@ -1179,6 +1996,7 @@ static int homa_sendmsg_original(struct sock *sk, struct msghdr *msg, size_t len
 			   : tt_addr(addr->in6.sin6_addr),
 			   ntohs(addr->in6.sin6_port), rpc->id, length);
 		rpc->completion_cookie = args.completion_cookie;
+		rpc->msgout.uarg = msg->msg_ubuf;
 		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
 		if (result)
 			goto error;
@@ -1232,6 +2050,7 @@ static int homa_sendmsg_original(struct sock *sk, struct msghdr *msg, size_t len
 		}
 		rpc->state = RPC_OUTGOING;
 
+		rpc->msgout.uarg = msg->msg_ubuf;
 		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
 		if (result && rpc->state != RPC_DEAD)
 			goto error;
@@ -1279,20 +2098,11 @@ static int homa_sendmsg_connected(struct sock *sk, struct msghdr *msg, size_t le
 
 	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
 			start;
-	// Retrieve addr from connected socket
-	// ipv4
-	if (sk->sk_family == AF_INET) {
-		addr.in4.sin_family = AF_INET;
-		addr.in4.sin_addr.s_addr = hsk->remote_host.in4.sin_addr.s_addr;
-		addr.in4.sin_port = hsk->remote_host.in4.sin_port;
-	}
-	// ipv6
-	else if (sk->sk_family == AF_INET6) {
-		addr.in6.sin6_family = AF_INET6;
-		addr.in6.sin6_addr = hsk->remote_host.in6.sin6_addr;
-		addr.in6.sin6_port = hsk->remote_host.in6.sin6_port;
-	}
-	else {
+	/* Retrieve addr from connected socket (the peer itself is cached
+	 * in hsk->peer, so homa_rpc_new_client won't look it up again).
+	 */
+	addr = hsk->remote_host;
+	if (addr.sa.sa_family != AF_INET && addr.sa.sa_family != AF_INET6) {
 		pr_err("homa_sendmsg: unsupported address family\n");
 		return -EAFNOSUPPORT;
 	}
@@ -1337,6 +2147,7 @@ static int homa_sendmsg_connected(struct sock *sk, struct msghdr *msg, size_t le
 			   : tt_addr(addr.in6.sin6_addr),
 			   ntohs(addr.in6.sin6_port), rpc->id, length);
 		rpc->completion_cookie = args.completion_cookie;
+		rpc->msgout.uarg = msg->msg_ubuf;
 		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
 		if (result) {
 			pr_err("homa_sendmsg: homa_msg_out_fill had issues!\n");
@@ -1397,6 +2208,7 @@ static int homa_sendmsg_connected(struct sock *sk, struct msghdr *msg, size_t le
 		}
 		rpc->state = RPC_OUTGOING;
 
+		rpc->msgout.uarg = msg->msg_ubuf;
 		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
 		if (result && rpc->state != RPC_DEAD) {
 			pr_err("homa_sendmsg error: homa_message_out_fill failed; resonse msg.\n");
@@ -1420,19 +2232,58 @@ error:
 	return result;
 }
 
-int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
+/**
+ * homa_sendmsg() - Send a request or response message on a Homa socket.
+ * @sk:     Socket on which the system call was invoked.
+ * @msg:    Structure describing the message to send; the msg_control
+ *          field points to additional information.
+ * @length: Number of bytes of the message.
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
+{
 	struct homa_sock *hsk = homa_sk(sk);
-	if (hsk->connect) {
-		return homa_sendmsg_connected(sk, msg, length);
+	struct ubuf_info *uarg = NULL;
+	int result;
+
+	if ((msg->msg_flags & MSG_ZEROCOPY) && sock_flag(sk, SOCK_ZEROCOPY)) {
+		/* Every MSG_ZEROCOPY call gets a notification, but short
+		 * messages are cheaper to copy than to pin.
+		 */
+		uarg = msg_zerocopy_realloc(sk, length, NULL);
+		if (!uarg)
+			return -ENOBUFS;
+		if (length < hsk->homa->zerocopy_min)
+			uarg_to_msgzc(uarg)->zerocopy = 0;
+		else
+			msg->msg_ubuf = uarg;
 	}
-	return homa_sendmsg_original(sk, msg, length);
+
+	if (hsk->connect)
+		result = homa_sendmsg_connected(sk, msg, length);
+	else
+		result = homa_sendmsg_original(sk, msg, length);
+
+	if (uarg) {
+		/* Packets hold their own references to uarg. */
+		msg->msg_ubuf = NULL;
+		if (result)
+			net_zcopy_put_abort(uarg, true);
+		else
+			net_zcopy_put(uarg);
+	}
+	return result;
 }
+
 /**
  * homa_recvmsg() - Receive a message from a Homa socket.
  * @sk:          Socket on which the system call was invoked.
  * @msg:         Controlling information for the receive.
- * @len:         Total bytes of space available in msg->msg_iov; not used.
- * @flags:       Flags from system call; only MSG_DONTWAIT is used.
+ * @len:         Total bytes of space available in msg->msg_iov; not used
+ *               (only inline messages are copied there, and msg->msg_iter
+ *               already knows its size).
+ * @flags:       Flags from system call; only MSG_DONTWAIT and MSG_ERRQUEUE
+ *               are used.
  * @addr_len:    Store the length of the sender address here
  * Return:       The length of the message on success, otherwise a negative
  *               errno.
@@ -1442,12 +2293,22 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 {
 	struct homa_sock *hsk = homa_sk(sk);
 	struct homa_recvmsg_args control;
+	struct sk_buff_head inline_skbs;
 	__u64 start = sched_clock();
 	struct homa_rpc *rpc;
 	__u64 finish;
 	int result;
 
+	if (unlikely(flags & MSG_ERRQUEUE)) {
+		/* MSG_ZEROCOPY completion notifications. */
+		if (sk->sk_family == AF_INET6)
+			return sock_recv_errqueue(sk, msg, len, SOL_IPV6,
+						  IPV6_RECVERR);
+		return sock_recv_errqueue(sk, msg, len, SOL_IP, IP_RECVERR);
+	}
+
 	INC_METRIC(recv_calls, 1);
+	__skb_queue_head_init(&inline_skbs);
 	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active = start;
 	if (unlikely(!msg->msg_control)) {
 		/* This test isn't strictly necessary, but it provides a
@@ -1473,8 +2334,14 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		pr_err("err with num_bpages or flags in control\n");
 		goto done;
 	}
-	result = homa_pool_release_buffers(hsk->buffer_pool, control.num_bpages,
-					   control.bpage_offsets);
+	result = homa_pool_return_buffers(hsk, control.num_bpages,
+					  control.bpage_offsets);
+	if (control.num_bpages > 0) {
+		/* Let RPCs waiting for buffer space proceed before we wait
+		 * (their messages may be the ones we'd wait for).
+		 */
+		homa_pool_check_waiting(hsk->buffer_pool);
+	}
 	control.num_bpages = 0;
 	if (result != 0) {
 		pr_err("err with pool_release_buffers\n");
@@ -1520,6 +2387,9 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		control.num_bpages = rpc->msgin.num_bpages;
 		memcpy(control.bpage_offsets, rpc->msgin.bpage_offsets,
 		       sizeof(rpc->msgin.bpage_offsets));
+		if (rpc->msgin.inline_data && !rpc->error)
+			skb_queue_splice_init(&rpc->msgin.packets,
+					      &inline_skbs);
 	}
 	if (sk->sk_family == AF_INET6) {
 		struct sockaddr_in6 *in6 = msg->msg_name;
@@ -1537,24 +2407,21 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		*addr_len = sizeof(*in4);
 	}
 
-	/* This indicates that the application now owns the buffers, so
-	 * we won't free them in homa_rpc_free.
+	/* Must release the RPC lock (locked by homa_wait_for_message, and
+	 * potentially free the RPC) before copying the results back to
+	 * user space.
 	 */
-	rpc->msgin.num_bpages = 0;
+	homa_recv_complete(rpc, result);
 
-	/* Must release the RPC lock (and potentially free the RPC) before
-	 * copying the results back to user space.
+	/* Inline messages go straight to the iovec (this can't be done
+	 * while holding the RPC lock).
 	 */
-	if (homa_is_client(rpc->id)) {
-		homa_peer_add_ack(rpc);
-		homa_rpc_free(rpc);
-	} else {
-		if (result < 0)
-			homa_rpc_free(rpc);
-		else
-			rpc->state = RPC_IN_SERVICE;
+	if (!skb_queue_empty(&inline_skbs)) {
+		int err = homa_copy_inline(&inline_skbs, msg);
+
+		if (err)
+			result = err;
 	}
-	homa_rpc_unlock(rpc); /* Locked by homa_wait_for_message. */
 
 done:
 	if (unlikely(copy_to_user((__force void __user *)msg->msg_control,
@@ -1580,6 +2447,8 @@ static int __homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
 	if (hsk->connect) {
 		return -EISCONN;
 	}
+	if (hsk->accept_backlog > 0)
+		return -EINVAL;
 	if (sk->sk_family == AF_INET) {
 		struct sockaddr_in *usin = (struct sockaddr_in *) uaddr;
 		if (addr_len < sizeof(*usin))
@@ -1588,6 +2457,7 @@ static int __homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
 		hsk->remote_host.in4.sin_addr.s_addr = usin->sin_addr.s_addr;
 		hsk->remote_host.in4.sin_port = usin->sin_port;
 		hsk->connect = true;
+		homa_sock_hash_connected(hsk);
 		return 0;
 	}
 	if (sk->sk_family == AF_INET6) {
@@ -1598,6 +2468,7 @@ static int __homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
 		hsk->remote_host.in6.sin6_addr = usin6->sin6_addr;
 		hsk->remote_host.in6.sin6_port = usin6->sin6_port;
 		hsk->connect = true;
+		homa_sock_hash_connected(hsk);
 		return 0;
 	}
 	return -EAFNOSUPPORT;
@@ -1605,12 +2476,232 @@ static int __homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
 
 int homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len) {
 	int res;
+
+	/* inet_dgram_connect normally handles this before we are called. */
+	if (addr_len >= sizeof(uaddr->sa_family) &&
+	    uaddr->sa_family == AF_UNSPEC)
+		return homa_disconnect(sk, 0);
 	homa_sock_lock(homa_sk(sk), "homa_connect");
 	res = __homa_connect(sk, uaddr, addr_len);
 	homa_sock_unlock(homa_sk(sk));
+	if (res == 0)
+		homa_sock_cache_peer(homa_sk(sk));
 	return res;
 }
 
+/**
+ * homa_listen() - Implements the listen system call for Homa sockets.
+ * Once a socket is listening, requests from clients that don't yet have
+ * a socket of their own are held for homa_accept rather than being
+ * returned by recvmsg.
+ * @sock:     Socket on which the system call was invoked.
+ * @backlog:  Maximum number of requests to hold for homa_accept (the
+ *            kernel has already limited this to net.core.somaxconn).
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_listen(struct socket *sock, int backlog)
+{
+	struct homa_sock *hsk = homa_sk(sock->sk);
+	int result = 0;
+
+	if (backlog < 1)
+		backlog = 1;
+	homa_sock_lock(hsk, "homa_listen");
+	if (hsk->shutdown)
+		result = -ESHUTDOWN;
+	else if (hsk->connect)
+		result = -EINVAL;
+	else
+		hsk->accept_backlog = backlog;
+	homa_sock_unlock(hsk);
+	return result;
+}
+
+/**
+ * homa_accept_take() - Wait until a listening socket's accept queue is
+ * nonempty, then remove the oldest request from the queue.
+ * @hsk:       Listening socket; the caller must own its lock_sock lock
+ *             (it is released while waiting).
+ * @nonblock:  Nonzero means return -EAGAIN instead of waiting if the
+ *             accept queue is empty.
+ *
+ * Return: The RPC that was removed, or an ERR_PTR. The RPC is not locked,
+ * but it has RPC_HANDING_OFF set so that it won't be reaped; the caller
+ * must pass it to homa_accept_move or homa_accept_requeue.
+ */
+static struct homa_rpc *homa_accept_take(struct homa_sock *hsk, int nonblock)
+{
+	struct homa_rpc *rpc;
+	int result;
+
+	while (1) {
+		homa_sock_lock(hsk, "homa_accept_take");
+		if (hsk->shutdown) {
+			homa_sock_unlock(hsk);
+			return ERR_PTR(-ESHUTDOWN);
+		}
+		if (!list_empty(&hsk->accept_queue))
+			break;
+		homa_sock_unlock(hsk);
+		if (nonblock)
+			return ERR_PTR(-EAGAIN);
+		release_sock(&hsk->sock);
+		result = wait_event_interruptible(*sk_sleep(&hsk->sock),
+				!list_empty(&hsk->accept_queue) ||
+				hsk->shutdown);
+		lock_sock(&hsk->sock);
+		if (result != 0)
+			return ERR_PTR(result);
+	}
+	rpc = list_first_entry(&hsk->accept_queue, struct homa_rpc,
+			       ready_links);
+	list_del_init(&rpc->ready_links);
+	atomic_andnot(RPC_ACCEPT_QUEUED, &rpc->flags);
+	hsk->accept_queue_len--;
+	atomic_or(RPC_HANDING_OFF, &rpc->flags);
+	homa_sock_unlock(hsk);
+	return rpc;
+}
+
+/**
+ * homa_accept_requeue() - Return an RPC obtained from homa_accept_take
+ * to the front of the accept queue (used when homa_accept fails).
+ * @hsk:     Listening socket.
+ * @rpc:     RPC returned by homa_accept_take.
+ */
+static void homa_accept_requeue(struct homa_sock *hsk, struct homa_rpc *rpc)
+{
+	homa_rpc_lock(rpc, "homa_accept_requeue");
+	atomic_andnot(RPC_HANDING_OFF, &rpc->flags);
+	homa_sock_lock(hsk, "homa_accept_requeue");
+	if (rpc->state != RPC_DEAD && !hsk->shutdown) {
+		list_add(&rpc->ready_links, &hsk->accept_queue);
+		atomic_or(RPC_ACCEPT_QUEUED, &rpc->flags);
+		hsk->accept_queue_len++;
+	}
+	homa_sock_unlock(hsk);
+	homa_rpc_unlock(rpc);
+}
+
+/**
+ * homa_accept_move() - Move an RPC removed from an accept queue to the
+ * socket that homa_accept created for its client.
+ * @rpc:      RPC that has been removed from the accept queue of its
+ *            socket; RPC_HANDING_OFF must be set. Must not be locked.
+ * @newhsk:   New socket, already peeled off from @rpc->hsk.
+ */
+static void homa_accept_move(struct homa_rpc *rpc, struct homa_sock *newhsk)
+{
+	int err;
+
+	/* RPC_HANDING_OFF keeps the RPC from being reaped while it is
+	 * unlocked, but it must be clear during homa_rpc_migrate so that
+	 * the RPC can be handed off in its new socket. If the migration
+	 * fails, the RPC is either dead or its socket is being shut down.
+	 */
+	homa_rpc_lock(rpc, "homa_accept_move");
+	while (1) {
+		atomic_andnot(RPC_HANDING_OFF, &rpc->flags);
+		err = homa_rpc_migrate(rpc, newhsk);
+		if (err != -EBUSY)
+			break;
+		atomic_or(RPC_HANDING_OFF, &rpc->flags);
+		homa_rpc_unlock(rpc);
+		schedule();
+		homa_rpc_lock(rpc, "homa_accept_move #2");
+	}
+	homa_rpc_unlock(rpc);
+}
+
+/**
+ * homa_accept() - Implements the accept system call for Homa sockets.
+ * Waits for a request to arrive from a client that has no socket of its
+ * own yet, then creates a socket peeled off from the listening socket and
+ * connected to that client. All of the client's queued requests are moved
+ * to the new socket, where they can be received with recvmsg. The new
+ * socket shares the buffer pool of the listening socket.
+ * @sock:     Listening socket on which the system call was invoked.
+ * @newsock:  Socket allocated by the kernel (without a struct sock) to
+ *            hold the result.
+ * @arg:      Additional information about the request, such as flags.
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_accept(struct socket *sock, struct socket *newsock,
+		struct proto_accept_arg *arg)
+{
+	struct homa_sock *hsk = homa_sk(sock->sk);
+	union sockaddr_in_union client;
+	struct homa_sock *newhsk;
+	struct homa_peer *peer;
+	struct homa_rpc *rpc;
+	struct socket *tmp;
+	int err, dport;
+
+	if (hsk->accept_backlog == 0)
+		return -EINVAL;
+
+	/* Accepts are serialized, so that two of them can't create
+	 * sockets for the same client.
+	 */
+	lock_sock(sock->sk);
+	rpc = homa_accept_take(hsk, arg->flags & O_NONBLOCK);
+	if (IS_ERR(rpc)) {
+		err = PTR_ERR(rpc);
+		goto done;
+	}
+	peer = rpc->peer;
+	dport = rpc->dport;
+	memset(&client, 0, sizeof(client));
+	if (sock->sk->sk_family == AF_INET6) {
+		client.in6.sin6_family = AF_INET6;
+		client.in6.sin6_addr = peer->addr;
+		client.in6.sin6_port = htons(dport);
+	} else {
+		client.in4.sin_family = AF_INET;
+		client.in4.sin_addr.s_addr = ipv6_to_ipv4(peer->addr);
+		client.in4.sin_port = htons(dport);
+	}
+
+	/* Homa can't initialize the struct sock for @newsock directly, so
+	 * create a complete socket (homa_socket gives it a client port of
+	 * its own, which it gives up in homa_sock_peel) and transplant its
+	 * struct sock into @newsock.
+	 */
+	err = sock_create(sock->sk->sk_family, SOCK_DGRAM, IPPROTO_HOMA, &tmp);
+	if (err < 0)
+		goto requeue;
+	newhsk = homa_sk(tmp->sk);
+	err = homa_sock_share_pool(newhsk, hsk);
+	if (err == 0)
+		err = homa_sock_peel(newhsk, hsk, &client.sa);
+	if (err < 0) {
+		sock_release(tmp);
+		goto requeue;
+	}
+
+	/* From now on new packets from the client go to newhsk; move the
+	 * client's other requests (queued or partially received) too.
+	 */
+	homa_accept_move(rpc, newhsk);
+	homa_rpc_migrate_peer(hsk, newhsk);
+
+	sock_graft(&newhsk->sock, newsock);
+	tmp->sk = NULL;
+	sock_release(tmp);
+	newsock->state = SS_CONNECTED;
+	INC_METRIC(accepts, 1);
+	err = 0;
+	goto done;
+
+requeue:
+	homa_accept_requeue(hsk, rpc);
+done:
+	release_sock(sock->sk);
+	return err;
+}
+
 /**
  * homa_hash() - Not needed for Homa.
  * @sk:    Socket for the operation
@@ -1663,6 +2754,7 @@ int homa_softirq(struct sk_buff *skb)
 	start = sched_clock();
 	INC_METRIC(softirq_calls, 1);
 	per_cpu(homa_offload_core, raw_smp_processor_id()).last_active = start;
+	per_cpu(homa_offload_core, raw_smp_processor_id()).defer_wakeups = 1;
 
 	/* skb may actually contain many distinct packets, linked through
 	 * skb_shinfo(skb)->frag_list by the Homa GRO mechanism. Make a
@@ -1791,6 +2883,7 @@ discard:
 		homa_dispatch_pkts(packets, homa);
 		packets = other_pkts;
 	}
+	homa_sock_flush_wakeups();
 
 	atomic_dec(&per_cpu(homa_offload_core, raw_smp_processor_id()).softirq_backlog);
 	INC_METRIC(softirq_ns, sched_clock() - start);
@@ -1905,6 +2998,7 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 		   struct poll_table_struct *wait)
 {
 	struct sock *sk = sock->sk;
+	int freed;
 	__u32 mask;
 
 	sock_poll_wait(file, sock, wait);
@@ -1914,11 +3008,52 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 		mask |= POLLIN;
 
 	if (!list_empty(&homa_sk(sk)->ready_requests) ||
-	    !list_empty(&homa_sk(sk)->ready_responses))
+	    !list_empty(&homa_sk(sk)->ready_responses) ||
+	    !list_empty(&homa_sk(sk)->accept_queue))
 		mask |= POLLIN | POLLRDNORM;
+	if (!skb_queue_empty_lockless(&sk->sk_error_queue))
+		mask |= POLLERR;
+	if (homa_sk(sk)->ring) {
+		if (homa_ring_readable(homa_sk(sk)->ring))
+			mask |= POLLIN | POLLRDNORM;
+
+		/* Applications that consume the ring without system calls
+		 * enter the kernel only to poll, so this is a good time to
+		 * reclaim the bpages they have returned.
+		 */
+		homa_sock_lock(homa_sk(sk), "homa_poll");
+		freed = homa_ring_recycle(homa_sk(sk));
+		homa_sock_unlock(homa_sk(sk));
+		if (freed)
+			homa_pool_check_waiting(homa_sk(sk)->buffer_pool);
+	}
 	return (__poll_t)mask;
 }
 
+/**
+ * homa_mmap() - Implements the mmap system call for Homa sockets: maps
+ * the socket's completion ring (see SO_HOMA_RING) into the application's
+ * address space.
+ * @file:  Open file for the socket.
+ * @sock:  Socket on which the system call was invoked.
+ * @vma:   Describes the new mapping.
+ *
+ * Return: 0 for success, otherwise a negative errno.
+ */
+int homa_mmap(struct file *file, struct socket *sock,
+	      struct vm_area_struct *vma)
+{
+	struct homa_sock *hsk = homa_sk(sock->sk);
+	struct homa_ring *ring;
+
+	homa_sock_lock(hsk, "homa_mmap");
+	ring = hsk->ring;
+	homa_sock_unlock(hsk);
+	if (!ring)
+		return -EINVAL;
+	return homa_ring_mmap(ring, vma);
+}
+
 /**
  * homa_dointvec() - This function is a wrapper around proc_dointvec. It is
  * invoked to read and write sysctl values and also update other values
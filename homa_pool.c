@@ -11,9 +11,6 @@
  */
 #define MIN_POOL_SIZE 2
 
-/* Used when determining how many bpages to consider for allocation. */
-#define MIN_EXTRA 4
-
 #ifdef __UNIT_TEST__
 /* When running unit tests, allow HOMA_BPAGE_SIZE and HOMA_BPAGE_SHIFT
  * to be overridden.
@@ -28,17 +25,154 @@
 /**
  * set_bpages_needed() - Set the bpages_needed field of @pool based
  * on the length of the first RPC that's waiting for buffer space.
- * The caller must own the lock for @pool->hsk.
+ * The caller must own @pool->lock.
  * @pool: Pool to update.
  */
 static void set_bpages_needed(struct homa_pool *pool)
 {
-	struct homa_rpc *rpc = list_first_entry(&pool->hsk->waiting_for_bufs,
+	struct homa_rpc *rpc = list_first_entry(&pool->waiting_for_bufs,
 			struct homa_rpc, buf_links);
 	pool->bpages_needed = (rpc->msgin.length + HOMA_BPAGE_SIZE - 1)
 			>> HOMA_BPAGE_SHIFT;
 }
 
+/**
+ * homa_pool_over_quota() - Returns true if a socket has used up its quota
+ * of bpages in a pool (hsk->bpage_quota, or homa->bpage_quota if the
+ * socket hasn't set one). Quotas only apply to pools shared by multiple
+ * sockets.
+ * @pool:  Pool from which buffer space is needed.
+ * @hsk:   Socket whose RPC needs the space; must use @pool.
+ */
+static bool homa_pool_over_quota(struct homa_pool *pool,
+				 struct homa_sock *hsk)
+{
+	int quota = READ_ONCE(hsk->bpage_quota);
+
+	if (quota < 0)
+		quota = pool->homa->bpage_quota;
+	return quota > 0 && homa_pool_shared(pool) &&
+			atomic_read(&hsk->bpages_held) >= quota;
+}
+
+/**
+ * homa_pool_uncharge() - Remove bpages from the count of those held by
+ * a socket. The count never goes negative: the application may return
+ * bpages through a different socket sharing the pool than the one that
+ * received them.
+ * @hsk:         Socket whose count should be reduced.
+ * @num_bpages:  Number of bpages to remove.
+ */
+static void homa_pool_uncharge(struct homa_sock *hsk, int num_bpages)
+{
+	int held, new;
+
+	held = atomic_read(&hsk->bpages_held);
+	while (1) {
+		new = held > num_bpages ? held - num_bpages : 0;
+		new = atomic_cmpxchg(&hsk->bpages_held, held, new);
+		if (new == held)
+			break;
+		held = new;
+	}
+}
+
+/**
+ * homa_pool_mark_free() - Add a bpage to a pool's free map so that it can
+ * be allocated again. The caller must hold @pool->free_lock.
+ * @pool:    Pool containing the bpage.
+ * @index:   Index of the bpage in @pool->descriptors; its reference count
+ *           must be zero.
+ */
+static void homa_pool_mark_free(struct homa_pool *pool, int index)
+{
+	int word = index / BITS_PER_LONG;
+
+	pool->free_map[word] |= 1UL << (index % BITS_PER_LONG);
+	pool->free_summary[word / BITS_PER_LONG] |=
+			1UL << (word % BITS_PER_LONG);
+	if (word / BITS_PER_LONG < pool->free_hint)
+		pool->free_hint = word / BITS_PER_LONG;
+}
+
+/**
+ * homa_pool_claim_free() - Remove the lowest-numbered bpage from a pool's
+ * free map. Preferring low indexes reduces the cache footprint of the pool
+ * by reusing a few bpages over and over. The caller must hold
+ * @pool->free_lock.
+ * @pool:    Pool from which to claim a bpage.
+ * Return:   Index of the claimed bpage, or -1 if the free map is empty.
+ */
+static int homa_pool_claim_free(struct homa_pool *pool)
+{
+	int summary_words = BITS_TO_LONGS(BITS_TO_LONGS(pool->num_bpages));
+	int i, word, bit;
+
+	for (i = pool->free_hint; i < summary_words; i++) {
+		if (pool->free_summary[i])
+			break;
+	}
+	pool->free_hint = i;
+	if (i >= summary_words)
+		return -1;
+	word = i * BITS_PER_LONG + __ffs(pool->free_summary[i]);
+	bit = __ffs(pool->free_map[word]);
+	pool->free_map[word] &= ~(1UL << bit);
+	if (pool->free_map[word] == 0)
+		pool->free_summary[i] &= ~(1UL << (word % BITS_PER_LONG));
+	return word * BITS_PER_LONG + bit;
+}
+
+/**
+ * homa_pool_free_page() - Invoked when the reference count for a bpage
+ * reaches zero; makes the bpage available for allocation again.
+ * @pool:    Pool containing the bpage.
+ * @index:   Index of the bpage in @pool->descriptors.
+ */
+static void homa_pool_free_page(struct homa_pool *pool, int index)
+{
+	spin_lock_bh(&pool->free_lock);
+	homa_pool_mark_free(pool, index);
+	spin_unlock_bh(&pool->free_lock);
+	atomic_inc(&pool->free_bpages);
+}
+
+/**
+ * homa_pool_new() - Allocate a new homa_pool. The pool has no region
+ * (homa_pool_init must be invoked before buffers can be allocated from it).
+ * @homa:    Overall information about the Homa transport.
+ * Return:   The new pool, with a reference count of 1, or NULL if memory
+ *           couldn't be allocated.
+ */
+struct homa_pool *homa_pool_new(struct homa *homa)
+{
+	struct homa_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	pool->homa = homa;
+	refcount_set(&pool->refs, 1);
+	spin_lock_init(&pool->lock);
+	spin_lock_init(&pool->free_lock);
+	INIT_LIST_HEAD(&pool->waiting_for_bufs);
+	pool->bpages_needed = INT_MAX;
+	return pool;
+}
+
+/**
+ * homa_pool_put() - Release a reference to a pool; if this was the last
+ * reference, then the pool is destroyed and freed.
+ * @pool:    Pool to release.
+ */
+void homa_pool_put(struct homa_pool *pool)
+{
+	if (!refcount_dec_and_test(&pool->refs))
+		return;
+	homa_pool_destroy(pool);
+	kfree(pool);
+}
+
 /**
  * homa_pool_init() - Initialize a homa_pool; any previous contents are
  * destroyed.
@@ -52,17 +186,19 @@ int homa_pool_init(struct homa_sock *hsk, void __user *region,
 		   __u64 region_size)
 {
 	struct homa_pool *pool = hsk->buffer_pool;
-	int i, result;
+	int i, result, map_words;
 
 	homa_pool_destroy(hsk->buffer_pool);
 
 	if (((uintptr_t)region) & ~PAGE_MASK)
 		return -EINVAL;
-	pool->hsk = hsk;
+	pool->homa = hsk->homa;
 	pool->region = (char *)region;
 	pool->num_bpages = region_size >> HOMA_BPAGE_SHIFT;
 	pool->descriptors = NULL;
 	pool->cores = NULL;
+	pool->free_map = NULL;
+	pool->free_summary = NULL;
 	if (pool->num_bpages < MIN_POOL_SIZE) {
 		result = -EINVAL;
 		goto error;
@@ -96,8 +232,25 @@ int homa_pool_init(struct homa_sock *hsk, void __user *region,
 	for (i = 0; i < pool->num_cores; i++) {
 		pool->cores[i].page_hint = 0;
 		pool->cores[i].allocated = 0;
-		pool->cores[i].next_candidate = 0;
 	}
+	pool->lease_core = 0;
+
+	/* Initially every bpage is free. */
+	map_words = BITS_TO_LONGS(pool->num_bpages);
+	pool->free_map = kmalloc_array(map_words, sizeof(unsigned long),
+				       GFP_ATOMIC);
+	pool->free_summary = kmalloc_array(BITS_TO_LONGS(map_words),
+					   sizeof(unsigned long), GFP_ATOMIC);
+	if (!pool->free_map || !pool->free_summary) {
+		result = -ENOMEM;
+		goto error;
+	}
+	memset(pool->free_map, 0, map_words * sizeof(unsigned long));
+	memset(pool->free_summary, 0,
+	       BITS_TO_LONGS(map_words) * sizeof(unsigned long));
+	pool->free_hint = 0;
+	for (i = 0; i < pool->num_bpages; i++)
+		homa_pool_mark_free(pool, i);
 	pool->check_waiting_invoked = 0;
 
 	return 0;
@@ -105,6 +258,8 @@ int homa_pool_init(struct homa_sock *hsk, void __user *region,
 error:
 	kfree(pool->descriptors);
 	kfree(pool->cores);
+	kfree(pool->free_map);
+	kfree(pool->free_summary);
 	pool->region = NULL;
 	return result;
 }
@@ -118,11 +273,152 @@ void homa_pool_destroy(struct homa_pool *pool)
 {
 	if (!pool->region)
 		return;
+	if (pool->pinned_pages) {
+		unpin_user_pages_dirty_lock(pool->pinned_pages,
+					    pool->num_pinned_pages, true);
+		kvfree(pool->pinned_pages);
+		pool->pinned_pages = NULL;
+		pool->num_pinned_pages = 0;
+	}
 	kfree(pool->descriptors);
 	kfree(pool->cores);
+	kfree(pool->free_map);
+	kfree(pool->free_summary);
 	pool->region = NULL;
 }
 
+/**
+ * homa_pool_pin_pages() - Pin the (hardware) pages of a region of user
+ * memory. Must be invoked in the context of a thread of the process that
+ * owns the region, with no locks held.
+ * @region:     First byte of the region; must be page-aligned.
+ * @num_pages:  Number of pages in the region.
+ *
+ * Return:      A kvmalloced array holding the @num_pages pinned pages,
+ *              or an ERR_PTR if the region couldn't be pinned.
+ */
+static struct page **homa_pool_pin_pages(char *region, int num_pages)
+{
+	struct page **pages;
+	int pinned;
+
+	if (num_pages <= 0)
+		return ERR_PTR(-EINVAL);
+	pages = kvmalloc_array(num_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return ERR_PTR(-ENOMEM);
+	pinned = pin_user_pages_fast((unsigned long)region, num_pages,
+				     FOLL_WRITE | FOLL_LONGTERM, pages);
+	if (pinned != num_pages) {
+		if (pinned > 0)
+			unpin_user_pages(pages, pinned);
+		kvfree(pages);
+		return ERR_PTR((pinned < 0) ? pinned : -EFAULT);
+	}
+	return pages;
+}
+
+/**
+ * homa_pool_pin() - Pin the pages of a pool's region in memory, so that
+ * they can be written by the kernel from any context (e.g. softirq). Once
+ * pinned, the region stays pinned until the pool is destroyed. Must be
+ * invoked in the context of a thread of the process that owns the region,
+ * with no locks held.
+ * @pool:    Pool whose region should be pinned; must have been
+ *           initialized with homa_pool_init.
+ *
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_pool_pin(struct homa_pool *pool)
+{
+	struct page **pages;
+	int num_pages;
+	char *region;
+
+	spin_lock_bh(&pool->lock);
+	region = pool->region;
+	num_pages = (pool->num_bpages << HOMA_BPAGE_SHIFT) >> PAGE_SHIFT;
+	spin_unlock_bh(&pool->lock);
+	if (!region)
+		return -EINVAL;
+	if (smp_load_acquire(&pool->pinned_pages))
+		return 0;
+
+	pages = homa_pool_pin_pages(region, num_pages);
+	if (IS_ERR(pages))
+		return PTR_ERR(pages);
+
+	/* Another thread may have pinned the region while we were, or the
+	 * region may have changed.
+	 */
+	spin_lock_bh(&pool->lock);
+	if (!pool->pinned_pages && pool->region == region) {
+		pool->num_pinned_pages = num_pages;
+		smp_store_release(&pool->pinned_pages, pages);
+		pages = NULL;
+	}
+	spin_unlock_bh(&pool->lock);
+	if (pages)
+		homa_pool_unpin_region(pages, num_pages);
+	return 0;
+}
+
+/**
+ * homa_pool_pin_region() - Pin a region of user memory that is about to
+ * become a pool's region (see homa_pool_set_pinned). Pinning before the
+ * pool is initialized means that the pool never exists in an unpinned
+ * state. Must be invoked in the context of a thread of the process that
+ * owns the region, with no locks held.
+ * @region:       First byte of the region; must be page-aligned.
+ * @region_size:  Total number of bytes in the region (only the bytes that
+ *                homa_pool_init will divide into bpages are pinned).
+ * @num_pages:    The number of pages pinned is stored here.
+ *
+ * Return:        A kvmalloced array of pinned pages, which must eventually
+ *                be passed to homa_pool_set_pinned or
+ *                homa_pool_unpin_region, or an ERR_PTR.
+ */
+struct page **homa_pool_pin_region(void __user *region, __u64 region_size,
+				   int *num_pages)
+{
+	if (((uintptr_t)region) & ~PAGE_MASK)
+		return ERR_PTR(-EINVAL);
+	*num_pages = ((region_size >> HOMA_BPAGE_SHIFT) << HOMA_BPAGE_SHIFT)
+			>> PAGE_SHIFT;
+	return homa_pool_pin_pages((__force char *)region, *num_pages);
+}
+
+/**
+ * homa_pool_unpin_region() - Release pages pinned by homa_pool_pin_region
+ * that were never handed to a pool.
+ * @pages:       Pages to unpin; the array is freed.
+ * @num_pages:   Number of entries in @pages.
+ */
+void homa_pool_unpin_region(struct page **pages, int num_pages)
+{
+	unpin_user_pages(pages, num_pages);
+	kvfree(pages);
+}
+
+/**
+ * homa_pool_set_pinned() - Hand a pool the pinned pages of its region, so
+ * that data can be copied into the region with homa_pool_copy_skb. The
+ * caller must hold the lock for the socket that owns the pool.
+ * @pool:        Pool that has just been initialized with homa_pool_init.
+ * @pages:       Pinned pages for the pool's region, from
+ *               homa_pool_pin_region. The pool takes ownership of the
+ *               array.
+ * @num_pages:   Number of entries in @pages.
+ */
+void homa_pool_set_pinned(struct homa_pool *pool, struct page **pages,
+			  int num_pages)
+{
+	spin_lock_bh(&pool->lock);
+	pool->num_pinned_pages = num_pages;
+	smp_store_release(&pool->pinned_pages, pages);
+	spin_unlock_bh(&pool->lock);
+}
+
 /**
  * homa_pool_get_rcvbuf() - Return information needed to handle getsockopt
  * for HOMA_SO_RCVBUF.
@@ -138,6 +434,71 @@ void homa_pool_get_rcvbuf(struct homa_sock *hsk,
 	homa_sock_unlock(hsk);
 }
 
+/**
+ * homa_pool_get_occupancy() - Fill in the occupancy fields of a
+ * homa_release_args for the HOMAIOCRELEASE ioctl.
+ * @hsk:          Socket on which the ioctl was invoked; must not be locked.
+ * @args:         The output fields of this structure are filled in.
+ */
+void homa_pool_get_occupancy(struct homa_sock *hsk,
+			     struct homa_release_args *args)
+{
+	struct homa_pool *pool = hsk->buffer_pool;
+	struct homa_rpc *rpc;
+	int waiting = 0;
+
+	args->total_bpages = pool->num_bpages;
+	args->free_bpages = atomic_read(&pool->free_bpages);
+	args->held_bpages = atomic_read(&hsk->bpages_held);
+	spin_lock_bh(&pool->lock);
+	list_for_each_entry(rpc, &pool->waiting_for_bufs, buf_links) {
+		if (rpc->hsk == hsk)
+			waiting++;
+	}
+	spin_unlock_bh(&pool->lock);
+	args->waiting_rpcs = waiting;
+}
+
+/**
+ * homa_pool_revoke_lease() - Check the bpage owned by one core (a different
+ * core on each call); if its lease has expired and no message is using it,
+ * take it away from the core and return it to the free map. Checking only
+ * one core per call keeps the cost of allocation independent of the number
+ * of cores (except when the pool runs short of space: see
+ * homa_pool_get_pages).
+ * @pool:    Pool whose leases should be checked.
+ * @now:     Current time, in sched_clock() units.
+ */
+static void homa_pool_revoke_lease(struct homa_pool *pool, __u64 now)
+{
+	struct homa_bpage *bpage;
+	int core_num, index;
+
+	core_num = READ_ONCE(pool->lease_core);
+	WRITE_ONCE(pool->lease_core, (core_num + 1 < pool->num_cores)
+			? core_num + 1 : 0);
+	index = READ_ONCE(pool->cores[core_num].page_hint);
+	bpage = &pool->descriptors[index];
+
+	/* Do a quick check without locking the page, and if the page looks
+	 * promising, then lock it and check again (must check again in
+	 * case someone else snuck in and changed the page).
+	 */
+	if (atomic_read(&bpage->refs) != 1 || bpage->owner < 0 ||
+	    bpage->expiration > now)
+		return;
+	if (!spin_trylock_bh(&bpage->lock))
+		return;
+	if (atomic_read(&bpage->refs) == 1 && bpage->owner >= 0 &&
+	    bpage->expiration <= now) {
+		bpage->owner = -1;
+		atomic_set(&bpage->refs, 0);
+		homa_pool_free_page(pool, index);
+		INC_METRIC(bpage_lease_revokes, 1);
+	}
+	spin_unlock_bh(&bpage->lock);
+}
+
 /**
  * homa_pool_get_pages() - Allocate one or more full pages from the pool.
  * @pool:         Pool from which to allocate pages
@@ -155,90 +516,61 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 			int set_owner)
 {
 	int core_num = raw_smp_processor_id();
-	struct homa_pool_core *core;
 	__u64 now = sched_clock();
-	int alloced = 0;
-	int limit = 0;
+	int i, index;
 
-	core = &pool->cores[core_num];
+	homa_pool_revoke_lease(pool, now);
 	if (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
 		atomic_add(num_pages, &pool->free_bpages);
-		return -1;
-	}
 
-	/* Once we get to this point we know we will be able to find
-	 * enough free pages; now we just have to find them.
-	 */
-	while (alloced != num_pages) {
-		struct homa_bpage *bpage;
-		int cur, ref_count;
-
-		/* If we don't need to use all of the bpages in the pool,
-		 * then try to use only the ones with low indexes. This
-		 * will reduce the cache footprint for the pool by reusing
-		 * a few bpages over and over. Specifically this code will
-		 * not consider any candidate page whose index is >= limit.
-		 * Limit is chosen to make sure there are a reasonable
-		 * number of free pages in the range, so we won't have to
-		 * check a huge number of pages.
+		/* Before giving up, reclaim every expired lease: otherwise
+		 * pages leased to idle cores could keep the pool "full"
+		 * until enough later allocations happen to reach them.
 		 */
-		if (limit == 0) {
-			int extra;
-
-			limit = pool->num_bpages
-					- atomic_read(&pool->free_bpages);
-			extra = limit >> 2;
-			limit += (extra < MIN_EXTRA) ? MIN_EXTRA : extra;
-			if (limit > pool->num_bpages)
-				limit = pool->num_bpages;
+		for (i = 0; i < pool->num_cores; i++)
+			homa_pool_revoke_lease(pool, now);
+		if (atomic_sub_return(num_pages, &pool->free_bpages) < 0) {
+			atomic_add(num_pages, &pool->free_bpages);
+			return -1;
 		}
+	}
 
-		cur = core->next_candidate;
-		core->next_candidate++;
-		if (cur >= limit) {
-			core->next_candidate = 0;
-
-			/* Must recompute the limit for each new loop through
-			 * the bpage array: we may need to consider a larger
-			 * range of pages because of concurrent allocations.
+	/* Once we get to this point we know that the free map contains
+	 * enough pages; now we just have to claim them.
+	 */
+	spin_lock_bh(&pool->free_lock);
+	for (i = 0; i < num_pages; i++) {
+		index = homa_pool_claim_free(pool);
+		if (unlikely(index < 0)) {
+			/* Shouldn't ever happen: free_bpages is out of sync
+			 * with free_map. Undo the partial allocation.
 			 */
-			limit = 0;
-			continue;
+			while (i > 0) {
+				i--;
+				homa_pool_mark_free(pool, pages[i]);
+			}
+			spin_unlock_bh(&pool->free_lock);
+			atomic_add(num_pages, &pool->free_bpages);
+			return -1;
 		}
-		bpage = &pool->descriptors[cur];
+		pages[i] = index;
+	}
+	spin_unlock_bh(&pool->free_lock);
 
-		/* Figure out whether this candidate is free (or can be
-		 * stolen). Do a quick check without locking the page, and
-		 * if the page looks promising, then lock it and check again
-		 * (must check again in case someone else snuck in and
-		 * grabbed the page).
-		 */
-		ref_count = atomic_read(&bpage->refs);
-		if (ref_count >= 2 || (ref_count == 1 && (bpage->owner < 0 ||
-				bpage->expiration > now)))
-			continue;
-		if (!spin_trylock_bh(&bpage->lock))
-			continue;
-		ref_count = atomic_read(&bpage->refs);
-		if (ref_count >= 2 || (ref_count == 1 && (bpage->owner < 0 ||
-				bpage->expiration > now))) {
-			spin_unlock_bh(&bpage->lock);
-			continue;
-		}
-		if (bpage->owner >= 0)
-			atomic_inc(&pool->free_bpages);
+	for (i = 0; i < num_pages; i++) {
+		struct homa_bpage *bpage = &pool->descriptors[pages[i]];
+
+		spin_lock_bh(&bpage->lock);
 		if (set_owner) {
 			atomic_set(&bpage->refs, 2);
 			bpage->owner = core_num;
 			bpage->expiration = now + 1000 *
-					pool->hsk->homa->bpage_lease_usecs;
+					pool->homa->bpage_lease_usecs;
 		} else {
 			atomic_set(&bpage->refs, 1);
 			bpage->owner = -1;
 		}
 		spin_unlock_bh(&bpage->lock);
-		pages[alloced] = cur;
-		alloced++;
 	}
 	return 0;
 }
@@ -249,9 +581,9 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
  *        not already have been allocated). The fields @msgin->num_buffers
  *        and @msgin->buffers are filled in. Must be locked by caller.
  * Return: The return value is normally 0, which means either buffer space
- * was allocated or the @rpc was queued on @hsk->waiting. If a fatal error
- * occurred, such as no buffer pool present, then a negative errno is
- * returned.
+ * was allocated or the @rpc was queued on @pool->waiting_for_bufs. If a
+ * fatal error occurred, such as no buffer pool present, then a negative
+ * errno is returned.
  */
 int homa_pool_allocate(struct homa_rpc *rpc)
 {
@@ -261,10 +593,30 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 	struct homa_pool_core *core;
 	struct homa_bpage *bpage;
 	struct homa_rpc *other;
+	bool over_quota;
 
 	if (!pool->region)
 		return -ENOMEM;
 
+	/* The quota is soft: a socket over its quota can still allocate
+	 * space, except that it must yield to sockets under their quotas
+	 * that are already waiting for space.
+	 */
+	over_quota = homa_pool_over_quota(pool, rpc->hsk);
+	if (unlikely(over_quota) && !list_empty(&pool->waiting_for_bufs)) {
+		bool yield;
+
+		spin_lock_bh(&pool->lock);
+		other = list_first_entry_or_null(&pool->waiting_for_bufs,
+						 struct homa_rpc, buf_links);
+		yield = other && !homa_pool_over_quota(pool, other->hsk);
+		spin_unlock_bh(&pool->lock);
+		if (yield) {
+			INC_METRIC(bpage_quota_deferrals, 1);
+			goto queue;
+		}
+	}
+
 	/* First allocate any full bpages that are needed. */
 	full_pages = rpc->msgin.length >> HOMA_BPAGE_SHIFT;
 	if (unlikely(full_pages)) {
@@ -302,17 +654,17 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 		} else {
 			bpage->owner = -1;
 
-			/* We know the reference count can't reach zero here
-			 * because of check above, so we won't have to decrement
-			 * pool->free_bpages.
+			/* Messages may have released the page since the check
+			 * above, so the reference count could reach zero here.
 			 */
-			atomic_dec_return(&bpage->refs);
+			if (atomic_dec_return(&bpage->refs) == 0)
+				homa_pool_free_page(pool, core->page_hint);
 			spin_unlock_bh(&bpage->lock);
 			goto new_page;
 		}
 	}
 	bpage->expiration = sched_clock() +
-			1000 * pool->hsk->homa->bpage_lease_usecs;
+			1000 * pool->homa->bpage_lease_usecs;
 	atomic_inc(&bpage->refs);
 	spin_unlock_bh(&bpage->lock);
 	goto allocate_partial;
@@ -335,31 +687,37 @@ allocate_partial:
 	core->allocated += partial;
 
 success:
+	atomic_add(rpc->msgin.num_bpages, &rpc->hsk->bpages_held);
 	tt_record4("Allocated %d bpage pointers on port %d for id %d, free_bpages now %d",
-		   rpc->msgin.num_bpages, pool->hsk->port, rpc->id,
+		   rpc->msgin.num_bpages, rpc->hsk->port, rpc->id,
 		   atomic_read(&pool->free_bpages));
 	return 0;
 
 	/* We get here if there wasn't enough buffer space for this
-	 * message; add the RPC to hsk->waiting_for_bufs.
+	 * message; add the RPC to pool->waiting_for_bufs. RPCs from sockets
+	 * under their quotas come first, then shorter messages.
 	 */
 out_of_space:
 	INC_METRIC(buffer_alloc_failures, 1);
 	tt_record4("Buffer allocation failed, port %d, id %d, length %d, free_bpages %d",
-		   pool->hsk->port, rpc->id, rpc->msgin.length,
+		   rpc->hsk->port, rpc->id, rpc->msgin.length,
 		   atomic_read(&pool->free_bpages));
-	homa_sock_lock(pool->hsk, "homa_pool_allocate");
-	list_for_each_entry(other, &pool->hsk->waiting_for_bufs, buf_links) {
-		if (other->msgin.length > rpc->msgin.length) {
+queue:
+	spin_lock_bh(&pool->lock);
+	list_for_each_entry(other, &pool->waiting_for_bufs, buf_links) {
+		bool other_over = homa_pool_over_quota(pool, other->hsk);
+
+		if ((other_over && !over_quota) || (other_over == over_quota &&
+		    other->msgin.length > rpc->msgin.length)) {
 			list_add_tail(&rpc->buf_links, &other->buf_links);
 			goto queued;
 		}
 	}
-	list_add_tail_rcu(&rpc->buf_links, &pool->hsk->waiting_for_bufs);
+	list_add_tail_rcu(&rpc->buf_links, &pool->waiting_for_bufs);
 
 queued:
 	set_bpages_needed(pool);
-	homa_sock_unlock(pool->hsk);
+	spin_unlock_bh(&pool->lock);
 	return 0;
 }
 
@@ -389,6 +747,80 @@ void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 			rpc->msgin.bpage_offsets[bpage_index] + bpage_offset;
 }
 
+/**
+ * homa_pool_contig_bytes() - Return how many bytes starting at a given
+ * offset in a pool's region are contiguous in the kernel's mapping of the
+ * pinned pages. Within a huge page, consecutive pages are physically
+ * contiguous (as are their struct pages), so they are also contiguous in
+ * the kernel's direct mapping and large copies need not be broken up at
+ * every page boundary.
+ * @pages:        Pinned pages for the region.
+ * @pool_offset:  Offset within the region of the first byte.
+ * @length:       Don't return a value larger than this.
+ */
+static int homa_pool_contig_bytes(struct page **pages,
+				  unsigned long pool_offset, int length)
+{
+	unsigned long index = pool_offset >> PAGE_SHIFT;
+	int bytes = PAGE_SIZE - offset_in_page(pool_offset);
+
+	/* Highmem pages must be mapped one at a time. */
+	if (IS_ENABLED(CONFIG_HIGHMEM))
+		return min(bytes, length);
+	while (bytes < length && pages[index + 1] == pages[index] + 1) {
+		bytes += PAGE_SIZE;
+		index++;
+	}
+	return min(bytes, length);
+}
+
+/**
+ * homa_pool_copy_skb() - Copy the data from an incoming packet into the
+ * buffer space allocated for its message, using the kernel's own mapping
+ * of the (pinned) region. Unlike copy_to_user, this can be invoked in any
+ * context (e.g. softirq) and never faults.
+ * @rpc:     RPC the packet belongs to; buffer space must have been
+ *           allocated for its message and the pool of its socket must be
+ *           pinned.
+ * @skb:     DATA packet for @rpc.
+ *
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_pool_copy_skb(struct homa_rpc *rpc, struct sk_buff *skb)
+{
+	struct homa_data_hdr *h = (struct homa_data_hdr *)skb->data;
+	struct homa_pool *pool = rpc->hsk->buffer_pool;
+	int offset = ntohl(h->seg.offset);
+	int pkt_length = homa_data_len(skb);
+	int copied, chunk, buf_bytes, err;
+	unsigned long pool_offset;
+	struct page **pages;
+	char *dst, *vaddr;
+
+	pages = smp_load_acquire(&pool->pinned_pages);
+	if (!pages)
+		return -EFAULT;
+	for (copied = 0; copied < pkt_length; copied += chunk) {
+		chunk = pkt_length - copied;
+		dst = homa_pool_get_buffer(rpc, offset + copied, &buf_bytes);
+		if (buf_bytes == 0) {
+			/* skb has data beyond message end? */
+			break;
+		}
+		if (chunk > buf_bytes)
+			chunk = buf_bytes;
+		pool_offset = dst - pool->region;
+		chunk = homa_pool_contig_bytes(pages, pool_offset, chunk);
+		vaddr = kmap_local_page(pages[pool_offset >> PAGE_SHIFT]);
+		err = skb_copy_bits(skb, sizeof(*h) + copied,
+				    vaddr + offset_in_page(pool_offset), chunk);
+		kunmap_local(vaddr);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
 /**
  * homa_pool_release_buffers() - Release buffer space so that it can be
  * reused.
@@ -402,7 +834,9 @@ void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 int homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 			      __u32 *buffers)
 {
+	bool locked = false;
 	int result = 0;
+	int freed = 0;
 	int i;
 
 	if (!pool->region)
@@ -412,21 +846,51 @@ int homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 		struct homa_bpage *bpage = &pool->descriptors[bpage_index];
 
 		if (bpage_index < pool->num_bpages) {
-			if (atomic_dec_return(&bpage->refs) == 0)
-				atomic_inc(&pool->free_bpages);
+			if (atomic_dec_return(&bpage->refs) != 0)
+				continue;
+
+			/* Hold the free lock for the rest of the batch,
+			 * rather than reacquiring it for each page.
+			 */
+			if (!locked) {
+				spin_lock_bh(&pool->free_lock);
+				locked = true;
+			}
+			homa_pool_mark_free(pool, bpage_index);
+			freed++;
 		} else {
 			result = -EINVAL;
 		}
 	}
-	tt_record3("Released %d bpages, free_bpages for port %d now %d",
-		   num_buffers, pool->hsk->port,
-		   atomic_read(&pool->free_bpages));
+	if (locked)
+		spin_unlock_bh(&pool->free_lock);
+	atomic_add(freed, &pool->free_bpages);
+	tt_record2("Released %d bpages, free_bpages now %d",
+		   num_buffers, atomic_read(&pool->free_bpages));
 	return result;
 }
 
+/**
+ * homa_pool_return_buffers() - Invoked when the application returns bpages
+ * to Homa through a socket (recvmsg, HOMAIOCRELEASE, etc.): releases the
+ * bpages and removes them from the socket's quota charge.
+ * @hsk:          Socket through which the bpages were returned.
+ * @num_buffers:  Number of buffers to release.
+ * @buffers:      Offsets of the buffers within the socket's pool.
+ * Return:        0 for success, otherwise a negative errno.
+ */
+int homa_pool_return_buffers(struct homa_sock *hsk, int num_buffers,
+			     __u32 *buffers)
+{
+	homa_pool_uncharge(hsk, num_buffers);
+	return homa_pool_release_buffers(hsk->buffer_pool, num_buffers,
+					 buffers);
+}
+
 /**
  * homa_pool_check_waiting() - Checks to see if there are enough free
- * bpages to wake up any RPCs that were blocked. Whenever
+ * bpages to wake up any RPCs that were blocked (from any of the sockets
+ * sharing the pool). Whenever
  * homa_pool_release_buffers is invoked, this function must be invoked later,
  * at a point when the caller holds no locks (homa_pool_release_buffers may
  * be invoked with locks held, so it can't safely invoke this function).
@@ -443,30 +907,30 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 	while (atomic_read(&pool->free_bpages) >= pool->bpages_needed) {
 		struct homa_rpc *rpc;
 
-		homa_sock_lock(pool->hsk, "buffer pool");
-		if (list_empty(&pool->hsk->waiting_for_bufs)) {
+		spin_lock_bh(&pool->lock);
+		if (list_empty(&pool->waiting_for_bufs)) {
 			pool->bpages_needed = INT_MAX;
-			homa_sock_unlock(pool->hsk);
+			spin_unlock_bh(&pool->lock);
 			break;
 		}
-		rpc = list_first_entry(&pool->hsk->waiting_for_bufs,
+		rpc = list_first_entry(&pool->waiting_for_bufs,
 				       struct homa_rpc, buf_links);
 		if (!homa_rpc_try_lock(rpc, "homa_pool_check_waiting")) {
 			/* Can't just spin on the RPC lock because we're
-			 * holding the socket lock (see sync.txt). Instead,
-			 * release the socket lock and try the entire
+			 * holding the pool lock (see sync.txt). Instead,
+			 * release the pool lock and try the entire
 			 * operation again.
 			 */
-			homa_sock_unlock(pool->hsk);
+			spin_unlock_bh(&pool->lock);
 			UNIT_LOG("; ", "rpc lock unavailable in %s", __func__);
 			continue;
 		}
 		list_del_init(&rpc->buf_links);
-		if (list_empty(&pool->hsk->waiting_for_bufs))
+		if (list_empty(&pool->waiting_for_bufs))
 			pool->bpages_needed = INT_MAX;
 		else
 			set_bpages_needed(pool);
-		homa_sock_unlock(pool->hsk);
+		spin_unlock_bh(&pool->lock);
 		tt_record4("Retrying buffer allocation for id %d, length %d, free_bpages %d, new bpages_needed %d",
 			   rpc->id, rpc->msgin.length,
 			   atomic_read(&pool->free_bpages),
@@ -78,12 +78,6 @@ struct homa_pool_core {
 			 * from the page.
 			 */
 			int allocated;
-
-			/**
-			 * @next_candidate: when searching for free bpages,
-			 * check this index next.
-			 */
-			int next_candidate;
 		};
 	};
 };
@@ -95,16 +89,36 @@ _Static_assert(sizeof(struct homa_pool_core) == L1_CACHE_BYTES,
 
 /**
  * struct homa_pool - Describes a pool of buffer space for incoming
- * messages for a particular socket; managed by homa_pool.c. The pool is
- * divided up into "bpages", which are a multiple of the hardware page size.
- * A bpage may be owned by a particular core so that it can more efficiently
- * allocate space for small messages.
+ * messages for a particular socket, or for a group of sockets sharing the
+ * pool (see homa_sock_share_pool); managed by homa_pool.c. The pool
+ * is divided up into "bpages", which are a multiple of the hardware page
+ * size. A bpage may be owned by a particular core so that it can more
+ * efficiently allocate space for small messages.
  */
 struct homa_pool {
+	/** @homa: overall information about the Homa transport. */
+	struct homa *homa;
+
+	/**
+	 * @refs: number of sockets whose buffer_pool refers to this pool.
+	 * The pool is freed by homa_pool_put when this reaches zero.
+	 */
+	refcount_t refs;
+
+	/**
+	 * @lock: used to synchronize access to @waiting_for_bufs and
+	 * @bpages_needed. If both are needed, the socket lock must be
+	 * acquired before this lock.
+	 */
+	spinlock_t lock;
+
 	/**
-	 * @hsk: the socket that this pool belongs to.
+	 * @waiting_for_bufs: contains RPCs (from any of the sockets using
+	 * this pool) that are blocked because there wasn't enough space in
+	 * the pool for their incoming messages. Sorted in increasing order
+	 * of message length.
 	 */
-	struct homa_sock *hsk;
+	struct list_head waiting_for_bufs;
 
 	/**
 	 * @region: beginning of the pool's region (in the app's virtual
@@ -119,6 +133,17 @@ struct homa_pool {
 	/** @descriptors: kmalloced area containing one entry for each bpage. */
 	struct homa_bpage *descriptors;
 
+	/**
+	 * @pinned_pages: if non-NULL, the (hardware) pages of @region,
+	 * pinned by homa_pool_pin so that incoming messages can be copied
+	 * into the region without the help of an application thread (see
+	 * homa_ring.c). Has @num_pinned_pages entries.
+	 */
+	struct page **pinned_pages;
+
+	/** @num_pinned_pages: number of entries in @pinned_pages. */
+	int num_pinned_pages;
+
 	/**
 	 * @free_bpages: the number of pages still available for allocation
 	 * by homa_pool_get pages. This equals the number of pages with zero
@@ -127,9 +152,44 @@ struct homa_pool {
 	 */
 	atomic_t free_bpages;
 
+	/**
+	 * @free_lock: synchronizes access to @free_map, @free_summary, and
+	 * @free_hint. No other lock may be acquired while holding this one.
+	 */
+	spinlock_t free_lock;
+
+	/**
+	 * @free_map: kmalloced bitmap with one bit per bpage. A bit is set
+	 * if the bpage's reference count is zero and it hasn't yet been
+	 * claimed by homa_pool_get_pages. Always contains at least
+	 * @free_bpages set bits.
+	 */
+	unsigned long *free_map;
+
+	/**
+	 * @free_summary: kmalloced bitmap with one bit for each word of
+	 * @free_map; a bit is set if the corresponding word is nonzero. This
+	 * makes it cheap to find the lowest-numbered free bpage even in
+	 * very large pools.
+	 */
+	unsigned long *free_summary;
+
+	/**
+	 * @free_hint: index of the first word of @free_summary that may be
+	 * nonzero (all earlier words are known to be zero).
+	 */
+	int free_hint;
+
+	/**
+	 * @lease_core: index in @cores of the core whose owned bpage will
+	 * be checked for an expired lease during the next call to
+	 * homa_pool_get_pages.
+	 */
+	int lease_core;
+
 	/**
 	 * @bpages_needed: the number of free bpages required to satisfy the
-	 * needs of the first RPC on @hsk->waiting_for_bufs, or INT_MAX if
+	 * needs of the first RPC on @waiting_for_bufs, or INT_MAX if
 	 * that queue is empty.
 	 */
 	int bpages_needed;
@@ -149,16 +209,49 @@ struct homa_pool {
 
 int      homa_pool_allocate(struct homa_rpc *rpc);
 void     homa_pool_check_waiting(struct homa_pool *pool);
+int      homa_pool_copy_skb(struct homa_rpc *rpc, struct sk_buff *skb);
 void     homa_pool_destroy(struct homa_pool *pool);
 void __user *homa_pool_get_buffer(struct homa_rpc *rpc, int offset,
 				  int *available);
+void     homa_pool_get_occupancy(struct homa_sock *hsk,
+				 struct homa_release_args *args);
 int      homa_pool_get_pages(struct homa_pool *pool, int num_pages,
 			     __u32 *pages, int leave_locked);
 void     homa_pool_get_rcvbuf(struct homa_sock *hsk,
 			      struct homa_rcvbuf_args *args);
 int      homa_pool_init(struct homa_sock *hsk, void *buf_region,
 			__u64 region_size);
+struct homa_pool *homa_pool_new(struct homa *homa);
+int      homa_pool_pin(struct homa_pool *pool);
+struct page **homa_pool_pin_region(void __user *region, __u64 region_size,
+				   int *num_pages);
+void     homa_pool_put(struct homa_pool *pool);
 int      homa_pool_release_buffers(struct homa_pool *pool,
 				   int num_buffers, __u32 *buffers);
+int      homa_pool_return_buffers(struct homa_sock *hsk, int num_buffers,
+				  __u32 *buffers);
+void     homa_pool_set_pinned(struct homa_pool *pool, struct page **pages,
+			      int num_pages);
+void     homa_pool_unpin_region(struct page **pages, int num_pages);
+
+/**
+ * homa_pool_get() - Add a reference to a pool (e.g. because another
+ * socket is going to share it).
+ * @pool:    Pool to reference; must already have at least one reference.
+ */
+static inline void homa_pool_get(struct homa_pool *pool)
+{
+	refcount_inc(&pool->refs);
+}
+
+/**
+ * homa_pool_shared() - Returns true if more than one socket is currently
+ * using a pool.
+ * @pool:    Pool to check.
+ */
+static inline bool homa_pool_shared(struct homa_pool *pool)
+{
+	return refcount_read(&pool->refs) > 1;
+}
 
 #endif /* _HOMA_POOL_H */
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+/* This file contains functions that manage completion rings. A completion
+ * ring is memory shared between the kernel and an application: when a
+ * message arrives on the socket and no thread is waiting for it, Homa
+ * copies the message into the socket's buffer pool and posts a
+ * description of it in the ring, so an application that polls the ring
+ * can receive messages without any system calls. The application returns
+ * bpages to Homa through a second (free) ring in the same memory.
+ */
+
+#include "homa_impl.h"
+#include "homa_peer.h"
+#include "homa_pool.h"
+#include "homa_ring.h"
+
+/**
+ * homa_ring_new() - Allocate and initialize a completion ring.
+ * @args:    Sizes requested by the application.
+ *
+ * Return:   The new ring, or an ERR_PTR if the arguments were invalid or
+ *           memory couldn't be allocated.
+ */
+struct homa_ring *homa_ring_new(const struct homa_ring_args *args)
+{
+	struct homa_ring *ring;
+	size_t size;
+
+	if (args->entries == 0 || args->entries > HOMA_RING_MAX_ENTRIES ||
+	    !is_power_of_2(args->entries) || args->free_entries == 0 ||
+	    args->free_entries > HOMA_RING_MAX_ENTRIES ||
+	    !is_power_of_2(args->free_entries))
+		return ERR_PTR(-EINVAL);
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+	size = PAGE_ALIGN(HOMA_RING_BYTES(args->entries, args->free_entries));
+	ring->hdr = vmalloc_user(size);
+	if (!ring->hdr) {
+		kfree(ring);
+		return ERR_PTR(-ENOMEM);
+	}
+	ring->size = size;
+	ring->mask = args->entries - 1;
+	ring->free_mask = args->free_entries - 1;
+	ring->hdr->entries = args->entries;
+	ring->hdr->free_entries = args->free_entries;
+	ring->hdr->entries_offset = sizeof(struct homa_ring_hdr);
+	ring->hdr->free_offset = sizeof(struct homa_ring_hdr) +
+			args->entries * sizeof(struct homa_recvbatch_msg);
+	ring->entries = (struct homa_recvbatch_msg *)
+			((char *)ring->hdr + ring->hdr->entries_offset);
+	ring->free = (__u32 *)((char *)ring->hdr + ring->hdr->free_offset);
+	return ring;
+}
+
+/**
+ * homa_ring_free() - Release all of the resources of a completion ring.
+ * The ring's memory must no longer be mapped by the application (this is
+ * the case once the socket's file has been released).
+ * @ring:    Ring to free; may be NULL.
+ */
+void homa_ring_free(struct homa_ring *ring)
+{
+	if (!ring)
+		return;
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+/**
+ * homa_ring_mmap() - Map a completion ring into the application's
+ * address space.
+ * @ring:    Ring to map.
+ * @vma:     Describes the application's mapping; must start at offset 0
+ *           and must not be larger than the ring.
+ *
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_ring_mmap(struct homa_ring *ring, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring->hdr, 0);
+}
+
+/**
+ * homa_ring_readable() - Returns true if a completion ring contains
+ * entries that the application hasn't yet consumed.
+ * @ring:    Ring to check.
+ */
+bool homa_ring_readable(struct homa_ring *ring)
+{
+	return READ_ONCE(ring->hdr->tail) != READ_ONCE(ring->head);
+}
+
+/**
+ * homa_ring_recycle() - Release the bpages that the application has
+ * placed in a socket's free ring. The caller must hold the socket lock
+ * and should invoke homa_pool_check_waiting once it holds no locks.
+ * @hsk:     Socket whose free ring should be drained; must have a ring.
+ *
+ * Return:   The number of bpages released.
+ */
+int homa_ring_recycle(struct homa_sock *hsk)
+{
+	struct homa_ring *ring = hsk->ring;
+	__u32 head, offset;
+	int count = 0;
+
+	head = smp_load_acquire(&ring->hdr->free_head);
+	if (head - ring->free_tail > ring->free_mask + 1) {
+		/* The application has corrupted the index; ignore it. */
+		return 0;
+	}
+	while (ring->free_tail != head) {
+		offset = READ_ONCE(ring->free[ring->free_tail
+				   & ring->free_mask]);
+		homa_pool_return_buffers(hsk, 1, &offset);
+		ring->free_tail++;
+		count++;
+	}
+	smp_store_release(&ring->hdr->free_tail, ring->free_tail);
+	return count;
+}
+
+/**
+ * homa_ring_post() - Deliver a complete incoming message through its
+ * socket's completion ring: copy its data into the buffer pool, post a
+ * description of it, and hand ownership of its buffers to the
+ * application. If the ring is full the RPC is queued for recvmsg instead.
+ * Invoked with the RPC locked but not the socket, after homa_rpc_handoff
+ * set RPC_RING_PENDING.
+ * @rpc:     RPC whose message is complete. May be freed by this function
+ *           (client RPCs are finished once their response is posted), but
+ *           is still locked on return.
+ */
+void homa_ring_post(struct homa_rpc *rpc)
+{
+	struct homa_sock *hsk = rpc->hsk;
+	struct homa_recvbatch_msg *msg;
+	struct homa_ring *ring;
+	struct sk_buff *skb;
+	int err = 0, freed;
+	__u32 tail;
+
+	atomic_andnot(RPC_RING_PENDING | RPC_PKTS_READY, &rpc->flags);
+	if (rpc->state == RPC_DEAD)
+		return;
+	while ((skb = __skb_dequeue(&rpc->msgin.packets)) != NULL) {
+		if (err == 0)
+			err = homa_pool_copy_skb(rpc, skb);
+		kfree_skb(skb);
+	}
+
+	homa_sock_lock(hsk, "homa_ring_post");
+	ring = hsk->ring;
+	freed = homa_ring_recycle(hsk);
+	tail = smp_load_acquire(&ring->hdr->tail);
+	if (err != 0 || ring->head - tail > ring->mask) {
+		/* Let recvmsg return the message (or the error) instead. */
+		if (err != 0)
+			rpc->error = err;
+		else
+			INC_METRIC(ring_overflows, 1);
+		atomic_or(RPC_PKTS_READY, &rpc->flags);
+		list_add_tail(&rpc->ready_links, homa_is_client(rpc->id)
+			      ? &hsk->ready_responses : &hsk->ready_requests);
+		homa_sock_wakeup(hsk);
+		homa_sock_unlock(hsk);
+		if (freed)
+			homa_pool_check_waiting(hsk->buffer_pool);
+		return;
+	}
+
+	msg = &ring->entries[ring->head & ring->mask];
+	memset(msg, 0, sizeof(*msg));
+	msg->id = rpc->id;
+	msg->completion_cookie = rpc->completion_cookie;
+	msg->length = rpc->msgin.length;
+	msg->num_bpages = rpc->msgin.num_bpages;
+	memcpy(msg->bpage_offsets, rpc->msgin.bpage_offsets,
+	       sizeof(msg->bpage_offsets));
+	if (hsk->inet.sk.sk_family == AF_INET6) {
+		msg->addr.in6.sin6_family = AF_INET6;
+		msg->addr.in6.sin6_port = htons(rpc->dport);
+		msg->addr.in6.sin6_addr = rpc->peer->addr;
+	} else {
+		msg->addr.in4.sin_family = AF_INET;
+		msg->addr.in4.sin_port = htons(rpc->dport);
+		msg->addr.in4.sin_addr.s_addr = ipv6_to_ipv4(rpc->peer->addr);
+	}
+	ring->head++;
+	smp_store_release(&ring->hdr->head, ring->head);
+	INC_METRIC(ring_posts, 1);
+	tt_record3("homa_ring_post posted id %d, length %d, port %d",
+		   rpc->id, rpc->msgin.length, hsk->port);
+
+	/* The application now owns the buffers (see homa_recvmsg). */
+	rpc->msgin.num_bpages = 0;
+	if (!homa_is_client(rpc->id))
+		rpc->state = RPC_IN_SERVICE;
+
+	/* Wake up applications that sleep in poll rather than spinning. */
+	homa_sock_wakeup(hsk);
+	homa_sock_unlock(hsk);
+
+	/* Recycled bpages may let RPCs waiting for buffer space proceed. */
+	if (freed)
+		homa_pool_check_waiting(hsk->buffer_pool);
+
+	if (homa_is_client(rpc->id)) {
+		homa_peer_add_ack(rpc);
+		homa_rpc_free(rpc);
+	}
+}
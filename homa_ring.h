@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* This file contains definitions for completion rings, which allow
+ * applications to receive messages without invoking recvmsg.
+ */
+
+#ifndef _HOMA_RING_H
+#define _HOMA_RING_H
+
+#include "homa_rpc.h"
+
+/**
+ * define HOMA_RING_MAX_ENTRIES - Upper limit on the number of entries in
+ * either the completion ring or the free ring of a socket.
+ */
+#define HOMA_RING_MAX_ENTRIES (1 << 16)
+
+/**
+ * struct homa_ring - Kernel-side information about a socket's completion
+ * ring. The ring's memory is shared with the application, so the kernel
+ * keeps its own copies of the indexes it owns and never trusts values
+ * written by the application without checking them.
+ */
+struct homa_ring {
+	/**
+	 * @hdr: Start of the memory shared with the application
+	 * (allocated with vmalloc_user).
+	 */
+	struct homa_ring_hdr *hdr;
+
+	/** @entries: The completion ring. */
+	struct homa_recvbatch_msg *entries;
+
+	/** @free: The free ring (bpage offsets returned by the app). */
+	__u32 *free;
+
+	/** @size: Total bytes at @hdr (a multiple of PAGE_SIZE). */
+	size_t size;
+
+	/** @mask: Number of entries in @entries, minus 1. */
+	__u32 mask;
+
+	/** @free_mask: Number of entries in @free, minus 1. */
+	__u32 free_mask;
+
+	/**
+	 * @head: Index of the next entry to post in @entries; the
+	 * authoritative copy of hdr->head.
+	 */
+	__u32 head;
+
+	/**
+	 * @free_tail: Index of the next entry to read from @free; the
+	 * authoritative copy of hdr->free_tail.
+	 */
+	__u32 free_tail;
+};
+
+void     homa_ring_free(struct homa_ring *ring);
+int      homa_ring_mmap(struct homa_ring *ring, struct vm_area_struct *vma);
+struct homa_ring
+	*homa_ring_new(const struct homa_ring_args *args);
+void     homa_ring_post(struct homa_rpc *rpc);
+bool     homa_ring_readable(struct homa_ring *ring);
+int      homa_ring_recycle(struct homa_sock *hsk);
+
+/**
+ * homa_ring_defer() - Invoked by homa_rpc_handoff when no thread is waiting
+ * for an RPC whose socket has a completion ring, to decide whether the
+ * RPC should bypass the ready lists. The socket must be locked.
+ * @rpc:     RPC being handed off; must be locked.
+ *
+ * Return:   True means the RPC must not be queued for recvmsg: either its
+ *           message is complete and the caller must invoke homa_ring_post
+ *           after releasing the socket lock (RPC_RING_PENDING is set), or
+ *           the message is incomplete and the RPC should be handed off
+ *           again once it is complete (RPC_RING_WAITING is set). False
+ *           means the RPC should be queued as usual (e.g., it failed, or
+ *           its message has no buffers because it will be delivered
+ *           inline by recvmsg).
+ */
+static inline bool homa_ring_defer(struct homa_rpc *rpc)
+{
+	if (rpc->error || rpc->msgin.length < 0 || rpc->msgin.inline_data)
+		return false;
+	if (rpc->msgin.bytes_remaining == 0)
+		atomic_or(RPC_RING_PENDING, &rpc->flags);
+	else
+		atomic_or(RPC_RING_WAITING, &rpc->flags);
+	return true;
+}
+
+#endif /* _HOMA_RING_H */
@@ -6,6 +6,7 @@
 #include "homa_peer.h"
 #include "homa_pool.h"
 #include "homa_grant.h"
+#include "homa_ring.h"
 #include "homa_skb.h"
 
 /**
@@ -35,13 +36,14 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	/* Initialize fields that don't require the socket lock. */
 	crpc->hsk = hsk;
 	crpc->id = atomic64_fetch_add(2, &hsk->homa->next_outgoing_id);
-	bucket = homa_client_rpc_bucket(hsk, crpc->id);
-	crpc->bucket = bucket;
 	crpc->state = RPC_OUTGOING;
 	atomic_set(&crpc->flags, 0);
 	atomic_set(&crpc->grants_in_progress, 0);
-	crpc->peer = homa_peer_find(hsk->homa->peers, &dest_addr_as_ipv6,
-				    &hsk->inet);
+	crpc->peer = READ_ONCE(hsk->peer);
+	if (!crpc->peer || !ipv6_addr_equal(&crpc->peer->addr,
+					    &dest_addr_as_ipv6))
+		crpc->peer = homa_peer_find(hsk->homa->peers,
+					    &dest_addr_as_ipv6, &hsk->inet);
 	if (IS_ERR(crpc->peer)) {
 		tt_record("error in homa_peer_find");
 		err = PTR_ERR(crpc->peer);
@@ -52,6 +54,7 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->error = 0;
 	crpc->msgin.length = -1;
 	crpc->msgin.num_bpages = 0;
+	crpc->msgin.inline_data = 0;
 	memset(&crpc->msgout, 0, sizeof(crpc->msgout));
 	crpc->msgout.length = -1;
 	INIT_LIST_HEAD(&crpc->ready_links);
@@ -59,7 +62,8 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&crpc->dead_links);
 	crpc->interest = NULL;
 	INIT_LIST_HEAD(&crpc->grantable_links);
-	INIT_LIST_HEAD(&crpc->throttled_links);
+	RB_CLEAR_NODE(&crpc->throttled_node);
+	RB_CLEAR_NODE(&crpc->throttled_age_node);
 	crpc->silent_ticks = 0;
 	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	crpc->done_timer_ticks = 0;
@@ -71,7 +75,12 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	 * to be performed without holding locks. Also, can't hold spin
 	 * locks while doing things that could block, such as memory allocation.
 	 */
-	homa_bucket_lock(bucket, crpc->id, "homa_rpc_new_client");
+	homa_rpc_table_maybe_grow(hsk, false);
+	do {
+		bucket = homa_client_rpc_bucket(hsk, crpc->id);
+	} while (!homa_bucket_lock_current(bucket, crpc->id,
+					   "homa_rpc_new_client"));
+	crpc->bucket = bucket;
 	homa_sock_lock(hsk, "homa_rpc_new_client");
 	if (hsk->shutdown) {
 		homa_sock_unlock(hsk);
@@ -80,6 +89,7 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 		goto error;
 	}
 	hlist_add_head(&crpc->hash_links, &bucket->rpcs);
+	atomic_inc(&hsk->client_rpcs);
 	list_add_tail_rcu(&crpc->active_links, &hsk->active_rpcs);
 	homa_sock_unlock(hsk);
 
@@ -119,8 +129,10 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	/* Lock the bucket, and make sure no-one else has already created
 	 * the desired RPC.
 	 */
-	bucket = homa_server_rpc_bucket(hsk, id);
-	homa_bucket_lock(bucket, id, "homa_rpc_new_server");
+	homa_rpc_table_maybe_grow(hsk, true);
+	do {
+		bucket = homa_server_rpc_bucket(hsk, id);
+	} while (!homa_bucket_lock_current(bucket, id, "homa_rpc_new_server"));
 	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
 		if (srpc->id == id &&
 		    srpc->dport == ntohs(h->common.sport) &&
@@ -144,7 +156,10 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->state = RPC_INCOMING;
 	atomic_set(&srpc->flags, 0);
 	atomic_set(&srpc->grants_in_progress, 0);
-	srpc->peer = homa_peer_find(hsk->homa->peers, source, &hsk->inet);
+	srpc->peer = READ_ONCE(hsk->peer);
+	if (!srpc->peer || !ipv6_addr_equal(&srpc->peer->addr, source))
+		srpc->peer = homa_peer_find(hsk->homa->peers, source,
+					    &hsk->inet);
 	if (IS_ERR(srpc->peer)) {
 		err = PTR_ERR(srpc->peer);
 		goto error;
@@ -162,7 +177,8 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&srpc->dead_links);
 	srpc->interest = NULL;
 	INIT_LIST_HEAD(&srpc->grantable_links);
-	INIT_LIST_HEAD(&srpc->throttled_links);
+	RB_CLEAR_NODE(&srpc->throttled_node);
+	RB_CLEAR_NODE(&srpc->throttled_age_node);
 	srpc->silent_ticks = 0;
 	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	srpc->done_timer_ticks = 0;
@@ -183,6 +199,7 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 		goto error;
 	}
 	hlist_add_head(&srpc->hash_links, &bucket->rpcs);
+	atomic_inc(&hsk->server_rpcs);
 	list_add_tail_rcu(&srpc->active_links, &hsk->active_rpcs);
 	if (ntohl(h->seg.offset) == 0 && srpc->msgin.num_bpages > 0) {
 		atomic_or(RPC_PKTS_READY, &srpc->flags);
@@ -246,6 +263,8 @@ void homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 		}
 	}
 	rpc = homa_find_server_rpc(hsk2, saddr, id);
+	if (!rpc)
+		rpc = homa_find_parent_rpc(hsk2, saddr, id);
 	if (rpc) {
 		tt_record1("homa_rpc_acked freeing id %d", rpc->id);
 		homa_rpc_free(rpc);
@@ -297,10 +316,20 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	/* Unlink from all lists, so no-one will ever find this RPC again. */
 	homa_sock_lock(rpc->hsk, "homa_rpc_free");
 	__hlist_del(&rpc->hash_links);
+	atomic_dec(homa_is_client(rpc->id) ? &rpc->hsk->client_rpcs
+					   : &rpc->hsk->server_rpcs);
 	list_del_rcu(&rpc->active_links);
 	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
 	__list_del_entry(&rpc->ready_links);
-	__list_del_entry(&rpc->buf_links);
+	if (atomic_read(&rpc->flags) & RPC_ACCEPT_QUEUED) {
+		atomic_andnot(RPC_ACCEPT_QUEUED, &rpc->flags);
+		rpc->hsk->accept_queue_len--;
+	}
+	if (!list_empty(&rpc->buf_links)) {
+		spin_lock_bh(&rpc->hsk->buffer_pool->lock);
+		list_del_init(&rpc->buf_links);
+		spin_unlock_bh(&rpc->hsk->buffer_pool->lock);
+	}
 	if (rpc->interest) {
 		rpc->interest->reg_rpc = NULL;
 		wake_up_process(rpc->interest->thread);
@@ -329,11 +358,262 @@ void homa_rpc_free(struct homa_rpc *rpc)
 		 * missed.
 		 */
 		rpc->hsk->homa->max_dead_buffs = rpc->hsk->dead_skbs;
+	homa_reaper_enqueue(rpc->hsk);
 
 	homa_sock_unlock(rpc->hsk);
 	homa_remove_from_throttled(rpc);
 }
 
+/**
+ * homa_rpc_migrate() - Move an RPC from its current socket to a socket
+ * peeled off from it (such as one created by homa_accept), so that the
+ * RPC is found, handed off, and replied to via the new socket.
+ * @rpc:   RPC to move; must be locked by the caller and must not currently
+ *         be owned by an application thread. On return it is still locked,
+ *         but if the migration succeeded its lock is now that of a bucket
+ *         in @hsk (this is transparent to callers of homa_rpc_unlock).
+ * @hsk:   Socket to which @rpc should be moved. Must use the same buffer
+ *         pool as @rpc->hsk, since @rpc may already have buffer space
+ *         allocated.
+ *
+ * Return: 0 for success. -EBUSY means that the RPC can't be moved right
+ *         now because another thread is scanning the active RPCs of its
+ *         socket: the caller should release the RPC lock and try again.
+ *         Any other negative errno means the RPC can't be moved.
+ */
+int homa_rpc_migrate(struct homa_rpc *rpc, struct homa_sock *hsk)
+	__must_hold(&rpc->bucket->lock)
+{
+	struct homa_rpc_bucket *old_bucket = rpc->bucket;
+	struct homa_sock *old_hsk = rpc->hsk;
+	struct homa_rpc_bucket *bucket;
+	int result = 0;
+
+	if (hsk == old_hsk)
+		return 0;
+	if (rpc->state == RPC_DEAD || hsk->buffer_pool != old_hsk->buffer_pool)
+		return -EINVAL;
+
+	/* Lock ordering: the RPC's current bucket, then its new bucket, then
+	 * the old socket, then the new one. The new socket must be a peeled
+	 * off child of the old one, so no-one locks them in the opposite
+	 * order. The second lock of each pair has the same lockdep class as
+	 * the first, so it is taken with a nested variant.
+	 */
+	while (1) {
+		if (homa_is_client(rpc->id))
+			bucket = homa_client_rpc_bucket(hsk, rpc->id);
+		else
+			bucket = homa_server_rpc_bucket(hsk, rpc->id);
+		homa_bucket_lock_nested(bucket, rpc->id, "homa_rpc_migrate");
+		if (likely(!bucket->moved))
+			break;
+		homa_bucket_unlock(bucket, rpc->id);
+		cpu_relax();
+	}
+	homa_sock_lock(old_hsk, "homa_rpc_migrate");
+	homa_sock_lock_nested(hsk, "homa_rpc_migrate #2");
+	if (old_hsk->shutdown || hsk->shutdown) {
+		result = -ESHUTDOWN;
+		goto done;
+	}
+
+	/* Threads scanning old_hsk->active_rpcs under homa_protect_rpcs
+	 * don't hold the socket lock; if the RPC moved to a different list
+	 * while one of them was looking at it, the scan would continue
+	 * down the wrong list.
+	 */
+	if (atomic_read(&old_hsk->protect_count) != 0) {
+		result = -EBUSY;
+		goto done;
+	}
+
+	__hlist_del(&rpc->hash_links);
+	hlist_add_head(&rpc->hash_links, &bucket->rpcs);
+	if (homa_is_client(rpc->id)) {
+		atomic_dec(&old_hsk->client_rpcs);
+		atomic_inc(&hsk->client_rpcs);
+	} else {
+		atomic_dec(&old_hsk->server_rpcs);
+		atomic_inc(&hsk->server_rpcs);
+	}
+	list_del_rcu(&rpc->active_links);
+	list_add_tail_rcu(&rpc->active_links, &hsk->active_rpcs);
+	list_del_init(&rpc->ready_links);
+	if (atomic_read(&rpc->flags) & RPC_ACCEPT_QUEUED) {
+		atomic_andnot(RPC_ACCEPT_QUEUED, &rpc->flags);
+		old_hsk->accept_queue_len--;
+	}
+	atomic_sub(rpc->msgin.num_bpages, &old_hsk->bpages_held);
+	atomic_add(rpc->msgin.num_bpages, &hsk->bpages_held);
+	rpc->hsk = hsk;
+	WRITE_ONCE(rpc->bucket, bucket);
+	if ((atomic_read(&rpc->flags) & RPC_PKTS_READY) || rpc->error)
+		homa_rpc_handoff(rpc);
+	INC_METRIC(rpcs_migrated, 1);
+	tt_record2("homa_rpc_migrate moved id %d off listener on port %d",
+		   rpc->id, old_hsk->port);
+
+done:
+	homa_sock_unlock(hsk);
+	homa_sock_unlock(old_hsk);
+	if (atomic_read(&rpc->flags) & RPC_RING_PENDING)
+		homa_ring_post(rpc);
+	if (result == 0)
+		homa_bucket_unlock(old_bucket, rpc->id);
+	else
+		homa_bucket_unlock(bucket, rpc->id);
+	return result;
+}
+
+/**
+ * homa_rpc_migratable() - Returns whether an RPC on a listening socket
+ * should move to a socket peeled off for a given remote host.
+ * @rpc:     RPC to check; it or its socket must be locked.
+ * @addr:    Address of the remote host (canonical IPv6 form).
+ * @port:    Port of the remote host, in host byte order.
+ *
+ * Return:   True if @rpc is a request from @addr:@port that has not yet
+ *           been read and no thread is in the process of receiving.
+ */
+static bool homa_rpc_migratable(struct homa_rpc *rpc,
+				const struct in6_addr *addr, __u16 port)
+{
+	if (homa_is_client(rpc->id) || rpc->state != RPC_INCOMING ||
+	    rpc->dport != port || !ipv6_addr_equal(&rpc->peer->addr, addr))
+		return false;
+
+	/* A thread on the parent is already receiving it. */
+	return !rpc->interest &&
+	       !(atomic_read(&rpc->flags) & RPC_HANDING_OFF);
+}
+
+/**
+ * homa_rpc_peer_pending() - Returns whether a socket has requests from a
+ * given remote host that homa_rpc_migrate_peer would move to a socket
+ * peeled off for that host.
+ * @hsk:     Socket to check.
+ * @remote:  Address of the remote host.
+ *
+ * Return:   True if there is at least one such request.
+ */
+bool homa_rpc_peer_pending(struct homa_sock *hsk,
+			   const union sockaddr_in_union *remote)
+{
+	struct in6_addr addr = canonical_ipv6_addr(remote);
+	__u16 port = ntohs(remote->in4.sin_port);
+	struct homa_rpc *rpc;
+	bool result = false;
+
+	homa_sock_lock(hsk, "homa_rpc_peer_pending");
+	list_for_each_entry(rpc, &hsk->active_rpcs, active_links) {
+		if (homa_rpc_migratable(rpc, &addr, port)) {
+			result = true;
+			break;
+		}
+	}
+	homa_sock_unlock(hsk);
+	return result;
+}
+
+/**
+ * homa_rpc_migrate_peer() - Invoked after a socket has been peeled off to
+ * move the parent's server RPCs for the new socket's remote host over to
+ * the new socket. Without this, requests that were partially received when
+ * the socket was peeled off would be stranded (later packets for them are
+ * delivered to the new socket), as would requests that have been received
+ * but not yet read. Client RPCs, and server RPCs that the application has
+ * already started to read, stay with the parent; packets for them are
+ * found with homa_find_parent_rpc.
+ * @parent:   Socket from which @hsk was peeled off.
+ * @hsk:      Socket just created by homa_sock_peel. Its @migrating flag
+ *            is cleared by this function, unless requests remain on
+ *            @parent: either @hsk has a buffer pool of its own (requests
+ *            that arrived after the caller decided not to share @parent's
+ *            pool), or other threads kept @parent's RPCs protected (see
+ *            homa_protect_rpcs) for too long. Those requests stay with
+ *            @parent, and @migrating stays set so that later packets for
+ *            them are still found there.
+ *
+ * Return:    0 for success, otherwise a negative errno (e.g., if one of
+ *            the sockets has been shut down).
+ */
+int homa_rpc_migrate_peer(struct homa_sock *parent, struct homa_sock *hsk)
+{
+#ifdef __UNIT_TEST__
+#define MIGRATE_MAX 2
+#else /* __UNIT_TEST__ */
+#define MIGRATE_MAX 32
+#endif /* __UNIT_TEST__ */
+#define MIGRATE_RETRIES 10
+	struct in6_addr addr = canonical_ipv6_addr(&hsk->remote_host);
+	__u16 port = ntohs(hsk->inet.inet_dport);
+	int count, tries, i;
+	bool stranded = false;
+	__u64 ids[MIGRATE_MAX];
+	struct homa_rpc *rpc;
+	int result = 0;
+
+	do {
+		/* Collect the requests to move in a single scan. The socket
+		 * lock must be released before calling homa_rpc_migrate, so
+		 * only ids are saved; each RPC is looked up (and locked)
+		 * again below, in case it was freed in the meantime. The
+		 * list is only scanned again if there were more requests
+		 * than fit in ids (the ones moved are no longer in it).
+		 */
+		count = 0;
+		homa_sock_lock(parent, "homa_rpc_migrate_peer");
+		list_for_each_entry(rpc, &parent->active_rpcs, active_links) {
+			if (!homa_rpc_migratable(rpc, &addr, port))
+				continue;
+			ids[count] = rpc->id;
+			count++;
+			if (count == MIGRATE_MAX)
+				break;
+		}
+		homa_sock_unlock(parent);
+		if (count > 0 && hsk->buffer_pool != parent->buffer_pool)
+			return 0;
+
+		for (i = 0; i < count; i++) {
+			for (tries = 0; ; tries++) {
+				rpc = homa_find_server_rpc(parent, &addr, ids[i]);
+				if (!rpc)
+					break;
+
+				/* A thread may have started to receive it. */
+				if (!homa_rpc_migratable(rpc, &addr, port)) {
+					homa_rpc_unlock(rpc);
+					break;
+				}
+				result = homa_rpc_migrate(rpc, hsk);
+				homa_rpc_unlock(rpc);
+				if (result == 0)
+					break;
+				if (result != -EBUSY)
+					goto done;
+
+				/* Another thread is scanning the parent's
+				 * RPCs; if it doesn't finish soon, leave the
+				 * RPC where it is.
+				 */
+				result = 0;
+				if (tries == MIGRATE_RETRIES) {
+					stranded = true;
+					break;
+				}
+				schedule();
+			}
+		}
+	} while (count == MIGRATE_MAX && !stranded);
+
+done:
+	if (!stranded || result != 0)
+		WRITE_ONCE(hsk->migrating, false);
+	return result;
+}
+
 /**
  * homa_rpc_reap() - Invoked to release resources associated with dead
  * RPCs for a given socket. For a large RPC, it can take a long time to
@@ -461,10 +741,13 @@ release:
 			homa_rpc_lock(rpc, "homa_rpc_reap");
 			homa_rpc_unlock(rpc);
 
-			if (unlikely(rpc->msgin.num_bpages))
+			if (unlikely(rpc->msgin.num_bpages)) {
+				atomic_sub(rpc->msgin.num_bpages,
+					   &rpc->hsk->bpages_held);
 				homa_pool_release_buffers(rpc->hsk->buffer_pool,
 							  rpc->msgin.num_bpages,
 							  rpc->msgin.bpage_offsets);
+			}
 			if (rpc->msgin.length >= 0) {
 				while (1) {
 					struct homa_gap *gap;
@@ -479,6 +762,8 @@ release:
 					kfree(gap);
 				}
 			}
+			if (rpc->msgout.pacer)
+				homa_pacer_put(rpc->msgout.pacer);
 			tt_record1("homa_rpc_reap finished reaping id %d",
 				   rpc->id);
 			rpc->state = 0;
@@ -494,6 +779,181 @@ release:
 	return result;
 }
 
+/**
+ * homa_reapers_init() - Create a background reaper (and its thread) for
+ * each NUMA node that has cores. Invoked when a struct homa is created.
+ * @homa:    Overall information about the Homa transport.
+ *
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_reapers_init(struct homa *homa)
+{
+	struct homa_reaper *reaper;
+	int i, node;
+
+	memset(homa->reapers, 0, sizeof(homa->reapers));
+	for (i = 0; i < nr_cpu_ids; i++) {
+		node = cpu_to_node(i);
+		if (homa->reapers[node])
+			continue;
+		reaper = kmalloc(sizeof(*reaper), GFP_KERNEL);
+		if (!reaper)
+			return -ENOMEM;
+		spin_lock_init(&reaper->lock);
+		INIT_LIST_HEAD(&reaper->socks);
+		reaper->active_hsk = NULL;
+		reaper->homa = homa;
+		reaper->node = node;
+		homa->reapers[node] = reaper;
+		reaper->thread = kthread_create_on_node(homa_reaper_main,
+							reaper, node,
+							"homa_reaper/%d", node);
+		if (IS_ERR(reaper->thread)) {
+			int err = PTR_ERR(reaper->thread);
+
+			reaper->thread = NULL;
+			pr_err("couldn't create homa reaper thread for node %d: error %d\n",
+			       node, err);
+			return err;
+		}
+		set_cpus_allowed_ptr(reaper->thread, cpumask_of_node(node));
+		wake_up_process(reaper->thread);
+	}
+	return 0;
+}
+
+/**
+ * homa_reapers_destroy() - Stop all of the reaper threads for a struct
+ * homa and free the reapers. All sockets must have been shut down.
+ * @homa:    Overall information about the Homa transport.
+ */
+void homa_reapers_destroy(struct homa *homa)
+{
+	int i;
+
+	for (i = 0; i < MAX_NUMNODES; i++) {
+		struct homa_reaper *reaper = homa->reapers[i];
+
+		if (!reaper)
+			continue;
+		if (reaper->thread)
+			kthread_stop(reaper->thread);
+		kfree(reaper);
+		homa->reapers[i] = NULL;
+	}
+}
+
+/**
+ * homa_reaper_enqueue() - Arrange for a socket's reaper thread to free
+ * its dead RPCs. Does nothing if the socket has no reaper thread (the
+ * RPCs will then be reaped in-line) or is being shut down.
+ * @hsk:    Socket with dead RPCs. Typically locked by the caller (but
+ *          it needn't be).
+ */
+void homa_reaper_enqueue(struct homa_sock *hsk)
+{
+	struct homa_reaper *reaper = hsk->reaper;
+
+	if (!homa_reaper_active(hsk))
+		return;
+	spin_lock_bh(&reaper->lock);
+	if (hsk->shutdown || !list_empty(&hsk->reap_links)) {
+		spin_unlock_bh(&reaper->lock);
+		return;
+	}
+	list_add_tail(&hsk->reap_links, &reaper->socks);
+	spin_unlock_bh(&reaper->lock);
+	INC_METRIC(reaper_queued, 1);
+	wake_up_process(reaper->thread);
+}
+
+/**
+ * homa_reaper_dequeue() - Invoked during socket shutdown (after
+ * hsk->shutdown has been set) to ensure that the socket's reaper will
+ * not touch it again. Doesn't return until any reaping of the socket
+ * that is already underway in the reaper thread has completed.
+ * @hsk:    Socket being shut down; must not be locked by the caller.
+ */
+void homa_reaper_dequeue(struct homa_sock *hsk)
+{
+	struct homa_reaper *reaper = hsk->reaper;
+
+	if (!reaper)
+		return;
+	spin_lock_bh(&reaper->lock);
+	list_del_init(&hsk->reap_links);
+	spin_unlock_bh(&reaper->lock);
+	while (READ_ONCE(reaper->active_hsk) == hsk)
+		cpu_relax();
+}
+
+/**
+ * homa_reaper_run() - Make one pass over the sockets queued on a reaper,
+ * freeing up to reap_limit buffers for each. Sockets that still have
+ * work afterwards are requeued for the next pass, so that reaping is
+ * batched across sockets in round-robin fashion.
+ * @reaper:   Reaper whose sockets should be processed.
+ */
+void homa_reaper_run(struct homa_reaper *reaper)
+{
+	struct homa_sock *hsk;
+	LIST_HEAD(socks);
+	__u64 start;
+	int more;
+
+	spin_lock_bh(&reaper->lock);
+	list_splice_init(&reaper->socks, &socks);
+	spin_unlock_bh(&reaper->lock);
+	while (1) {
+		spin_lock_bh(&reaper->lock);
+		hsk = list_first_entry_or_null(&socks, struct homa_sock,
+					       reap_links);
+		if (!hsk) {
+			spin_unlock_bh(&reaper->lock);
+			break;
+		}
+		list_del_init(&hsk->reap_links);
+		WRITE_ONCE(reaper->active_hsk, hsk);
+		spin_unlock_bh(&reaper->lock);
+
+		start = sched_clock();
+		more = homa_rpc_reap(hsk, reaper->homa->reap_limit);
+		INC_METRIC(reaper_ns, sched_clock() - start);
+
+		/* Requeue the socket before clearing active_hsk, so that
+		 * homa_reaper_dequeue can't miss it.
+		 */
+		if (more)
+			homa_reaper_enqueue(hsk);
+		smp_store_release(&reaper->active_hsk, NULL);
+	}
+}
+
+/**
+ * homa_reaper_main() - Top-level function for a reaper thread.
+ * @arg:    Pointer to the thread's struct homa_reaper.
+ *
+ * Return:  Always 0.
+ */
+int homa_reaper_main(void *arg)
+{
+	struct homa_reaper *reaper = (struct homa_reaper *)arg;
+
+	while (!kthread_should_stop()) {
+		homa_reaper_run(reaper);
+
+		/* Sleep if there's no work. Even if there is work, call
+		 * the scheduler to give other threads a chance to run.
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!list_empty(&reaper->socks) || kthread_should_stop())
+			__set_current_state(TASK_RUNNING);
+		schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
 /**
  * homa_find_client_rpc() - Locate client-side information about the RPC that
  * a packet belongs to, if there is any. Thread-safe without socket lock.
@@ -507,10 +967,12 @@ release:
 struct homa_rpc *homa_find_client_rpc(struct homa_sock *hsk, __u64 id)
 	__acquires(&crpc->bucket->lock)
 {
-	struct homa_rpc_bucket *bucket = homa_client_rpc_bucket(hsk, id);
+	struct homa_rpc_bucket *bucket;
 	struct homa_rpc *crpc;
 
-	homa_bucket_lock(bucket, id, __func__);
+	do {
+		bucket = homa_client_rpc_bucket(hsk, id);
+	} while (!homa_bucket_lock_current(bucket, id, __func__));
 	hlist_for_each_entry_rcu(crpc, &bucket->rpcs, hash_links) {
 		if (crpc->id == id)
 			return crpc;
@@ -534,10 +996,12 @@ struct homa_rpc *homa_find_server_rpc(struct homa_sock *hsk,
 				      const struct in6_addr *saddr, __u64 id)
 	__acquires(&srpc->bucket->lock)
 {
-	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, id);
+	struct homa_rpc_bucket *bucket;
 	struct homa_rpc *srpc;
 
-	homa_bucket_lock(bucket, id, __func__);
+	do {
+		bucket = homa_server_rpc_bucket(hsk, id);
+	} while (!homa_bucket_lock_current(bucket, id, __func__));
 	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
 		if (srpc->id == id && ipv6_addr_equal(&srpc->peer->addr, saddr))
 			return srpc;
@@ -546,6 +1010,42 @@ struct homa_rpc *homa_find_server_rpc(struct homa_sock *hsk,
 	return NULL;
 }
 
+/**
+ * homa_find_parent_rpc() - Invoked when an RPC lookup fails on a peeled-off
+ * socket: the RPC may still belong to the socket from which it was peeled
+ * off (a client RPC issued on the parent, a server RPC whose request the
+ * application read from the parent, or a request that hasn't yet been
+ * moved by homa_rpc_migrate_peer).
+ * @hsk:      Socket via which packet was received.
+ * @saddr:    Address from which the packet was sent.
+ * @id:       Unique identifier for the RPC.
+ *
+ * Return:    A pointer to the homa_rpc for this id in @hsk's parent, or NULL
+ *            if none. The RPC will be locked; the caller must eventually
+ *            unlock it by invoking homa_rpc_unlock.
+ */
+struct homa_rpc *homa_find_parent_rpc(struct homa_sock *hsk,
+				      const struct in6_addr *saddr, __u64 id)
+{
+	struct homa_sock *parent;
+	struct homa_rpc *rpc = NULL;
+
+	if (!hsk->connect)
+		return NULL;
+	rcu_read_lock();
+	parent = homa_sock_parent(hsk);
+	if (parent) {
+		if (homa_is_client(id))
+			rpc = homa_find_client_rpc(parent, id);
+		else
+			rpc = homa_find_server_rpc(parent, saddr, id);
+	}
+	rcu_read_unlock();
+	if (rpc)
+		INC_METRIC(parent_rpc_lookups, 1);
+	return rpc;
+}
+
 /**
  * homa_rpc_log() - Log info about a particular RPC; this is functionality
  * pulled out of homa_rpc_log_active because its indentation got too deep.
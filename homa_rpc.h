@@ -91,6 +91,21 @@ struct homa_message_out {
 	 * initialized.  Used to find the oldest outgoing message.
 	 */
 	__u64 init_ns;
+
+	/**
+	 * @pacer: Manages the output queue of the network device that
+	 * this message is transmitted on.
+	 */
+	struct homa_pacer *pacer;
+
+	/**
+	 * @uarg: Non-NULL means the message is being sent with MSG_ZEROCOPY:
+	 * data packets reference the sender's pages rather than copies, and
+	 * each holds a reference to this, which generates a completion
+	 * notification once all the packets have been freed. Only valid
+	 * during homa_message_out_fill.
+	 */
+	struct ubuf_info *uarg;
 };
 
 /**
@@ -176,6 +191,13 @@ struct homa_message_in {
 	/** @resend_all: if nonzero, set resend_all in the next grant packet. */
 	__u8 resend_all;
 
+	/**
+	 * @inline_data: nonzero means no buffer space is allocated for this
+	 * message: it stays in @packets until homa_recvmsg copies it
+	 * directly into the application's iovec (see SO_HOMA_INLINE).
+	 */
+	__u8 inline_data;
+
 	/**
 	 * @birth: sched_clock() time when this RPC was added to the grantable
 	 * list. Invalid if RPC isn't in the grantable list.
@@ -206,9 +228,11 @@ struct homa_rpc {
 	struct homa_sock *hsk;
 
 	/**
-	 * @bucket: Pointer to the bucket in hsk->client_rpc_buckets or
-	 * hsk->server_rpc_buckets where this RPC is linked. Used primarily
-	 * for locking the RPC (which is done by locking its bucket).
+	 * @bucket: Pointer to the bucket in hsk->client_rpc_table or
+	 * hsk->server_rpc_table where this RPC is linked. Used primarily
+	 * for locking the RPC (which is done by locking its bucket). May
+	 * change if the RPC is moved to a larger table, so always use
+	 * homa_rpc_lock rather than locking the bucket directly.
 	 */
 	struct homa_rpc_bucket *bucket;
 
@@ -267,12 +291,26 @@ struct homa_rpc {
 	 *                         preventing data copies to user space from
 	 *                         starting (and they limit throughput at
 	 *                         high network speeds).
+	 * RPC_ACCEPT_QUEUED -     The RPC is linked (via ready_links) into
+	 *                         @hsk->accept_queue and is counted in
+	 *                         @hsk->accept_queue_len.
+	 * RPC_RING_WAITING -      No thread was waiting when the RPC was
+	 *                         handed off, and its socket has a
+	 *                         completion ring: the RPC was left off the
+	 *                         ready lists until its message is complete.
+	 * RPC_RING_PENDING -      The RPC's message is complete and must be
+	 *                         posted to the socket's completion ring
+	 *                         with homa_ring_post once the socket lock
+	 *                         has been released.
 	 */
 #define RPC_PKTS_READY        1
 #define RPC_COPYING_FROM_USER 2
 #define RPC_COPYING_TO_USER   4
 #define RPC_HANDING_OFF       8
 #define APP_NEEDS_LOCK       16
+#define RPC_ACCEPT_QUEUED    32
+#define RPC_RING_WAITING     64
+#define RPC_RING_PENDING    128
 
 #define RPC_CANT_REAP (RPC_COPYING_FROM_USER | RPC_COPYING_TO_USER \
 		| RPC_HANDING_OFF)
@@ -331,21 +369,21 @@ struct homa_rpc {
 
 	/**
 	 * @hash_links: Used to link this object into a hash bucket for
-	 * either @hsk->client_rpc_buckets (for a client RPC), or
-	 * @hsk->server_rpc_buckets (for a server RPC).
+	 * either @hsk->client_rpc_table (for a client RPC), or
+	 * @hsk->server_rpc_table (for a server RPC).
 	 */
 	struct hlist_node hash_links;
 
 	/**
 	 * @ready_links: Used to link this object into
-	 * @hsk->ready_requests or @hsk->ready_responses.
+	 * @hsk->ready_requests, @hsk->ready_responses, or @hsk->accept_queue.
 	 */
 	struct list_head ready_links;
 
 	/**
-	 * @buf_links: Used to link this RPC into @hsk->waiting_for_bufs.
-	 * If the RPC isn't on @hsk->waiting_for_bufs, this is an empty
-	 * list pointing to itself.
+	 * @buf_links: Used to link this RPC into the waiting_for_bufs list
+	 * of @hsk->buffer_pool. If the RPC isn't on that list, this is an
+	 * empty list pointing to itself.
 	 */
 	struct list_head buf_links;
 
@@ -373,11 +411,25 @@ struct homa_rpc {
 	struct list_head grantable_links;
 
 	/**
-	 * @throttled_links: Used to link this RPC into homa->throttled_rpcs.
-	 * If this RPC isn't in homa->throttled_rpcs, this is an empty
-	 * list pointing to itself.
+	 * @throttled_node: Used to link this RPC into the throttled_rpcs
+	 * tree of msgout.pacer. If this RPC isn't in that tree, this node
+	 * is cleared (RB_EMPTY_NODE is true).
 	 */
-	struct list_head throttled_links;
+	struct rb_node throttled_node;
+
+	/**
+	 * @throttled_age_node: Used to link this RPC into the
+	 * throttled_by_age tree of msgout.pacer. Valid only when
+	 * @throttled_node is in use.
+	 */
+	struct rb_node throttled_age_node;
+
+	/**
+	 * @throttled_bytes: The number of bytes of msgout that remained
+	 * to be transmitted when this RPC was added to the throttled tree;
+	 * this is its sort key in that tree.
+	 */
+	int throttled_bytes;
 
 	/**
 	 * @silent_ticks: Number of times homa_timer has been invoked
@@ -416,12 +468,63 @@ struct homa_rpc {
 	u64 start_ns;
 };
 
+/**
+ * define HOMA_SLOW_REAP_NS - In-line reaping in homa_wait_for_message that
+ * takes longer than this is counted in the wait_reap_slow metric.
+ */
+#define HOMA_SLOW_REAP_NS 10000
+
+/**
+ * struct homa_reaper - A background thread that frees dead RPCs so that
+ * application threads don't have to. There is one reaper for each NUMA
+ * node; each socket is served by the reaper for the node on which it
+ * was created.
+ */
+struct homa_reaper {
+	/** @lock: Used to synchronize access to @socks and @active_hsk. */
+	spinlock_t lock;
+
+	/**
+	 * @socks: Sockets with dead RPCs that haven't yet been reaped,
+	 * linked through homa_sock.reap_links.
+	 */
+	struct list_head socks;
+
+	/**
+	 * @active_hsk: Socket whose RPCs the thread is currently reaping,
+	 * or NULL. homa_reaper_dequeue waits for this to change before
+	 * returning.
+	 */
+	struct homa_sock *active_hsk;
+
+	/**
+	 * @thread: Kernel thread that does the reaping; NULL if the thread
+	 * couldn't be started (in which case RPCs are reaped in-line).
+	 */
+	struct task_struct *thread;
+
+	/** @homa: Overall information about the Homa transport. */
+	struct homa *homa;
+
+	/** @node: NUMA node on which @thread runs. */
+	int node;
+};
+
 void     homa_check_rpc(struct homa_rpc *rpc);
 struct homa_rpc
 	       *homa_find_client_rpc(struct homa_sock *hsk, __u64 id);
+struct homa_rpc
+	       *homa_find_parent_rpc(struct homa_sock *hsk,
+				     const struct in6_addr *saddr, __u64 id);
 struct homa_rpc
 	       *homa_find_server_rpc(struct homa_sock *hsk,
 				     const struct in6_addr *saddr, __u64 id);
+void     homa_reaper_dequeue(struct homa_sock *hsk);
+void     homa_reaper_enqueue(struct homa_sock *hsk);
+int      homa_reaper_main(void *arg);
+void     homa_reaper_run(struct homa_reaper *reaper);
+void     homa_reapers_destroy(struct homa *homa);
+int      homa_reapers_init(struct homa *homa);
 void     homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 			struct homa_ack *ack);
 void     homa_rpc_free(struct homa_rpc *rpc);
@@ -429,6 +532,11 @@ void     homa_rpc_log(struct homa_rpc *rpc);
 void     homa_rpc_log_active(struct homa *homa, uint64_t id);
 void     homa_rpc_log_active_tt(struct homa *homa, int freeze_count);
 void     homa_rpc_log_tt(struct homa_rpc *rpc);
+int      homa_rpc_migrate(struct homa_rpc *rpc, struct homa_sock *hsk);
+int      homa_rpc_migrate_peer(struct homa_sock *parent,
+			       struct homa_sock *hsk);
+bool     homa_rpc_peer_pending(struct homa_sock *hsk,
+			       const union sockaddr_in_union *remote);
 struct homa_rpc
 	       *homa_rpc_new_client(struct homa_sock *hsk,
 				    const union sockaddr_in_union *dest);
@@ -456,7 +564,19 @@ int      homa_validate_incoming(struct homa *homa, int verbose,
  */
 static inline void homa_rpc_lock(struct homa_rpc *rpc, const char *locker)
 {
-	homa_bucket_lock(rpc->bucket, rpc->id, locker);
+	struct homa_rpc_bucket *bucket;
+
+	/* The RPC may move to a different bucket (homa_rpc_migrate) while
+	 * we wait for the lock, in which case we must retry with its
+	 * new bucket.
+	 */
+	while (1) {
+		bucket = READ_ONCE(rpc->bucket);
+		homa_bucket_lock(bucket, rpc->id, locker);
+		if (likely(bucket == rpc->bucket))
+			return;
+		homa_bucket_unlock(bucket, rpc->id);
+	}
 }
 
 /**
@@ -469,8 +589,17 @@ static inline void homa_rpc_lock(struct homa_rpc *rpc, const char *locker)
  */
 static inline int homa_rpc_try_lock(struct homa_rpc *rpc, const char *locker)
 {
-	if (!spin_trylock_bh(&rpc->bucket->lock))
+	struct homa_rpc_bucket *bucket = READ_ONCE(rpc->bucket);
+
+	if (!spin_trylock_bh(&bucket->lock))
+		return 0;
+	if (unlikely(bucket != rpc->bucket)) {
+		/* RPC was migrated to a different bucket (see
+		 * homa_rpc_lock).
+		 */
+		spin_unlock_bh(&bucket->lock);
 		return 0;
+	}
 	return 1;
 }
 
@@ -516,6 +645,17 @@ static inline void homa_unprotect_rpcs(struct homa_sock *hsk)
 	atomic_dec(&hsk->protect_count);
 }
 
+/**
+ * homa_reaper_active() - Returns true if dead RPCs for a socket will be
+ * freed by a background reaper thread, false if they must be reaped
+ * in-line.
+ * @hsk:    Socket of interest.
+ */
+static inline bool homa_reaper_active(struct homa_sock *hsk)
+{
+	return hsk->reaper && hsk->reaper->thread;
+}
+
 /**
  * homa_is_client(): returns true if we are the client for a particular RPC,
  * false if we are the server.
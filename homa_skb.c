@@ -10,13 +10,6 @@
 
 DEFINE_PER_CPU(struct homa_skb_core, homa_skb_core);
 
-#ifdef __UNIT_TEST__
-extern int mock_max_skb_frags;
-#define HOMA_MAX_SKB_FRAGS mock_max_skb_frags
-#else
-#define HOMA_MAX_SKB_FRAGS MAX_SKB_FRAGS
-#endif
-
 static void frag_page_set(skb_frag_t *frag, struct page *page)
 {
 	frag->netmem = page_to_netmem(page);
@@ -363,6 +356,93 @@ int homa_skb_append_from_iter(struct homa *homa, struct sk_buff *skb,
 	return 0;
 }
 
+/**
+ * homa_skb_append_zerocopy() - Append data to an sk_buff without copying
+ * it: new frags are added to the sk_buff that refer directly to the user
+ * pages containing the data. The caller must attach a ubuf_info to the
+ * sk_buff (skb_zcopy_set) so the sender is notified when the pages are
+ * no longer referenced.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @skb:      Append to this sk_buff.
+ * @iter:     Describes location of data to append; modified to reflect
+ *            the data appended.
+ * @length:   Number of bytes to append; iter must have at least this many
+ *            bytes.
+ * Return: 0 or a negative errno. -EMSGSIZE means @skb ran out of frags
+ * before all of the data could be appended (some of it may have been).
+ */
+int homa_skb_append_zerocopy(struct homa *homa, struct sk_buff *skb,
+			     struct iov_iter *iter, int length)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+	struct page *pages[MAX_SKB_FRAGS];
+	int chunk_length, max_pages, i;
+	ssize_t bytes;
+	size_t start;
+
+	while (length > 0) {
+		max_pages = HOMA_MAX_SKB_FRAGS - shinfo->nr_frags;
+		if (max_pages <= 0)
+			return -EMSGSIZE;
+		bytes = iov_iter_get_pages2(iter, pages, length, max_pages,
+					    &start);
+		if (bytes <= 0)
+			return bytes ? bytes : -EFAULT;
+		length -= bytes;
+		for (i = 0; bytes > 0; i++) {
+			skb_frag_t *frag = &shinfo->frags[shinfo->nr_frags];
+
+			chunk_length = PAGE_SIZE - start;
+			if (chunk_length > bytes)
+				chunk_length = bytes;
+			shinfo->nr_frags++;
+			frag_page_set(frag, pages[i]);
+			frag->offset = start;
+			skb_frag_size_set(frag, chunk_length);
+			skb_len_add(skb, chunk_length);
+			bytes -= chunk_length;
+			start = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * homa_skb_max_zerocopy_data() - Returns the largest amount of message
+ * data that can be placed in a single GSO packet when the data is
+ * appended with homa_skb_append_zerocopy. Each user page used by a
+ * segment occupies its own frag (as does each homa_seg_hdr between
+ * segments), so packets must be smaller than when data is copied.
+ * @max_seg_data:  Maximum number of bytes of message data in one segment.
+ * @max_gso_data:  Largest amount of data that would otherwise be placed
+ *                 in a GSO packet.
+ * @interleaved:   True means homa_seg_hdrs will be interleaved with the
+ *                 data (no TCP hijacking).
+ * Return:         A multiple of @max_seg_data no greater than
+ *                 @max_gso_data (unless that is less than @max_seg_data).
+ */
+int homa_skb_max_zerocopy_data(int max_seg_data, int max_gso_data,
+			       bool interleaved)
+{
+	int segs;
+
+	if (interleaved) {
+		/* A segment's data can straddle one more page boundary than
+		 * its length requires; all segments but the first also need
+		 * a frag for their homa_seg_hdr.
+		 */
+		segs = (HOMA_MAX_SKB_FRAGS + 1) /
+				(DIV_ROUND_UP(max_seg_data, PAGE_SIZE) + 2);
+	} else {
+		segs = ((HOMA_MAX_SKB_FRAGS - 1) * PAGE_SIZE) / max_seg_data;
+	}
+	if (segs < 1)
+		segs = 1;
+	if (segs * max_seg_data < max_gso_data)
+		return segs * max_seg_data;
+	return max_gso_data;
+}
+
 /**
  * homa_skb_append_from_skb() - Copy data from one skb to another. The
  * data is appended into new frags at the destination. The copies are done
@@ -424,6 +504,11 @@ int homa_skb_append_from_skb(struct homa *homa, struct sk_buff *dst_skb,
 		length -= chunk_size;
 		skb_len_add(dst_skb, chunk_size);
 	}
+
+	/* If the frags refer to user pages, the sender mustn't be notified
+	 * until the copy is also gone.
+	 */
+	skb_zcopy_set(dst_skb, skb_zcopy(src_skb), NULL);
 	return 0;
 }
 
@@ -470,11 +555,14 @@ void homa_skb_free_many_tx(struct homa *homa, struct sk_buff **skbs, int count)
 			continue;
 		}
 
-		/* Reclaim cacheable pages. */
+		/* Reclaim cacheable pages (pages from MSG_ZEROCOPY skbs
+		 * belong to the user, so they are never cached).
+		 */
 		for (j = 0; j < shinfo->nr_frags; j++) {
 			struct page *page = skb_frag_page(&shinfo->frags[j]);
 
-			if (compound_order(page) == HOMA_SKB_PAGE_ORDER &&
+			if (!skb_zcopy(skb) &&
+			    compound_order(page) == HOMA_SKB_PAGE_ORDER &&
 			    page_ref_count(page) == 1) {
 				pages_to_cache[num_pages] = page;
 				num_pages++;
@@ -21,6 +21,17 @@
  */
 #define HOMA_SKB_PAGE_SIZE (PAGE_SIZE << HOMA_SKB_PAGE_ORDER)
 
+/**
+ * define HOMA_MAX_SKB_FRAGS: maximum number of frags that Homa will
+ * place in a single sk_buff (unit tests can vary this).
+ */
+#ifdef __UNIT_TEST__
+extern int mock_max_skb_frags;
+#define HOMA_MAX_SKB_FRAGS mock_max_skb_frags
+#else
+#define HOMA_MAX_SKB_FRAGS MAX_SKB_FRAGS
+#endif
+
 /**
  * struct homa_page_pool - A cache of free pages available for use in tx skbs.
  * Each page is of size HOMA_SKB_PAGE_SIZE, and a pool is dedicated for
@@ -105,6 +116,8 @@ int      homa_skb_append_from_skb(struct homa *homa,
 				  int length);
 int      homa_skb_append_to_frag(struct homa *homa, struct sk_buff *skb,
 				 void *buf, int length);
+int      homa_skb_append_zerocopy(struct homa *homa, struct sk_buff *skb,
+				  struct iov_iter *iter, int length);
 void     homa_skb_cache_pages(struct homa *homa, struct page **pages,
 			      int count);
 void     homa_skb_cleanup(struct homa *homa);
@@ -117,6 +130,8 @@ void     homa_skb_get(struct sk_buff *skb, void *dest, int offset,
 		      int length);
 int      homa_skb_init(struct homa *homa);
 struct sk_buff *homa_skb_new_tx(int length);
+int      homa_skb_max_zerocopy_data(int max_seg_data, int max_gso_data,
+				    bool interleaved);
 bool     homa_skb_page_alloc(struct homa *homa,
 			     struct homa_skb_core *core);
 void     homa_skb_release_pages(struct homa *homa);
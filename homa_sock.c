@@ -5,6 +5,7 @@
 #include "homa_impl.h"
 #include "homa_peer.h"
 #include "homa_pool.h"
+#include "homa_ring.h"
 
 /**
  * homa_socktab_init() - Constructor for homa_socktabs.
@@ -17,6 +18,8 @@ void homa_socktab_init(struct homa_socktab *socktab)
 	spin_lock_init(&socktab->write_lock);
 	for (i = 0; i < HOMA_SOCKTAB_BUCKETS; i++)
 		INIT_HLIST_HEAD(&socktab->buckets[i]);
+	for (i = 0; i < HOMA_SOCKTAB_CONN_BUCKETS; i++)
+		INIT_HLIST_HEAD(&socktab->conn_buckets[i]);
 	INIT_LIST_HEAD(&socktab->active_scans);
 }
 
@@ -131,7 +134,6 @@ int homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 {
 	struct homa_socktab *socktab = homa->port_map;
 	int result = 0;
-	int i;
 
 	spin_lock_bh(&socktab->write_lock);
 	atomic_set(&hsk->protect_count, 0);
@@ -154,38 +156,57 @@ int homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->inet.inet_sport = htons(hsk->port);
 	homa->next_client_port++;
 	hsk->socktab_links.sock = hsk;
+	hsk->conn_links.sock = hsk;
+	INIT_HLIST_NODE(&hsk->conn_links.hash_links);
 	// Normal homa_socks are not connected
 	hsk->connect = false;
+	hsk->migrating = false;
+	hsk->peer = NULL;
+	seqlock_init(&hsk->geometry_lock);
+	hsk->dst = NULL;
+	memset(&hsk->geometry, 0, sizeof(hsk->geometry));
 	// Initialise destination (remote peer info, using addr-port tuple)
 	hsk->remote_host.in4.sin_family = AF_UNSPEC;
 	hsk->remote_host.in4.sin_addr.s_addr = 0;
 	hsk->remote_host.in4.sin_port = htons(0);
+	/* The socktab holds a reference to the socket while it is linked
+	 * (plus an RCU grace period afterwards); this allows RCU lookups to
+	 * take additional references safely (e.g., homa_gro_early_demux).
+	 */
+	sock_hold(&hsk->sock);
 	hlist_add_head_rcu(&hsk->socktab_links.hash_links,
 			   &socktab->buckets[homa_port_hash(hsk->port)]);
 	INIT_LIST_HEAD(&hsk->active_rpcs);
 	INIT_LIST_HEAD(&hsk->dead_rpcs);
 	hsk->dead_skbs = 0;
-	INIT_LIST_HEAD(&hsk->waiting_for_bufs);
+	hsk->reaper = homa->reapers[cpu_to_node(raw_smp_processor_id())];
+	INIT_LIST_HEAD(&hsk->reap_links);
 	INIT_LIST_HEAD(&hsk->ready_requests);
 	INIT_LIST_HEAD(&hsk->ready_responses);
-	INIT_LIST_HEAD(&hsk->request_interests);
-	INIT_LIST_HEAD(&hsk->response_interests);
-	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk->client_rpc_buckets[i];
-
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-		bucket->id = i;
-	}
-	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk->server_rpc_buckets[i];
-
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-		bucket->id = i + 1000000;
-	}
-	hsk->buffer_pool = kzalloc(sizeof(*hsk->buffer_pool), GFP_KERNEL);
-	if (!hsk->buffer_pool)
+	INIT_LIST_HEAD(&hsk->accept_queue);
+	hsk->accept_queue_len = 0;
+	hsk->accept_backlog = 0;
+	homa_interest_queue_init(&hsk->request_interests);
+	homa_interest_queue_init(&hsk->response_interests);
+	hsk->client_rpc_table = homa_rpc_table_new(HOMA_INITIAL_RPC_BUCKETS, 0,
+						   GFP_ATOMIC);
+	hsk->server_rpc_table = homa_rpc_table_new(HOMA_INITIAL_RPC_BUCKETS,
+						   1000000, GFP_ATOMIC);
+	atomic_set(&hsk->client_rpcs, 0);
+	atomic_set(&hsk->server_rpcs, 0);
+	spin_lock_init(&hsk->rpc_table_lock);
+	hsk->buffer_pool = homa_pool_new(homa);
+	atomic_set(&hsk->bpages_held, 0);
+	hsk->bpage_quota = -1;
+	hsk->ring = NULL;
+	hsk->wakeup_pending = 0;
+	hsk->poll_usecs = -1;
+	hsk->poll_adaptive = 0;
+	hsk->inline_max = 0;
+	hsk->last_arrival = 0;
+	hsk->avg_interarrival = 0;
+	if (!hsk->client_rpc_table || !hsk->server_rpc_table ||
+	    !hsk->buffer_pool)
 		result = -ENOMEM;
 	if (homa->hijack_tcp)
 		hsk->sock.sk_protocol = IPPROTO_TCP;
@@ -193,28 +214,65 @@ int homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	return result;
 }
 
-/*
- * homa_sock_unlink() - Unlinks a socket from its socktab and does
- * related cleanups. Once this method returns, the socket will not be
- * discoverable through the socktab.
+/**
+ * homa_sock_advance_scans() - If any scans in progress for a socktab are
+ * about to return a given socket, advance them to refer to the next socket
+ * in the chain instead. Must be invoked before unlinking a socket from
+ * its chain in socktab->buckets. The caller must hold socktab->write_lock.
+ * @socktab:   Table containing @hsk.
+ * @hsk:       Socket that is about to be removed from its hash chain.
  */
-void homa_sock_unlink(struct homa_sock *hsk)
+static void homa_sock_advance_scans(struct homa_socktab *socktab,
+				    struct homa_sock *hsk)
 {
-	struct homa_socktab *socktab = hsk->homa->port_map;
 	struct homa_socktab_scan *scan;
 
-	/* If any scans refer to this socket, advance them to refer to
-	 * the next socket instead.
-	 */
-	spin_lock_bh(&socktab->write_lock);
 	list_for_each_entry(scan, &socktab->active_scans, scan_links) {
 		if (!scan->next || scan->next->sock != hsk)
 			continue;
 		scan->next = (struct homa_socktab_links *)
 				rcu_dereference(hlist_next_rcu(&scan->next->hash_links));
 	}
+}
+
+/**
+ * homa_sock_put_rcu() - RCU callback that releases the socktab's reference
+ * to a socket once all RCU readers that might have found the socket in the
+ * socktab have finished.
+ * @head:    The socktab_rcu field of the socket.
+ */
+static void homa_sock_put_rcu(struct rcu_head *head)
+{
+	struct homa_sock *hsk = container_of(head, struct homa_sock,
+					     socktab_rcu);
+
+	/* The RPC tables can't be freed in homa_sock_shutdown: packet
+	 * handlers that found the socket before it was unlinked may still
+	 * be looking up RPCs in them.
+	 */
+	homa_rpc_table_free(hsk->client_rpc_table);
+	hsk->client_rpc_table = NULL;
+	homa_rpc_table_free(hsk->server_rpc_table);
+	hsk->server_rpc_table = NULL;
+	sock_put(&hsk->sock);
+}
+
+/*
+ * homa_sock_unlink() - Unlinks a socket from its socktab and does
+ * related cleanups. Once this method returns, the socket will not be
+ * discoverable through the socktab.
+ */
+void homa_sock_unlink(struct homa_sock *hsk)
+{
+	struct homa_socktab *socktab = hsk->homa->port_map;
+
+	spin_lock_bh(&socktab->write_lock);
+	homa_sock_advance_scans(socktab, hsk);
 	hlist_del_rcu(&hsk->socktab_links.hash_links);
+	if (!hlist_unhashed(&hsk->conn_links.hash_links))
+		hlist_del_init_rcu(&hsk->conn_links.hash_links);
 	spin_unlock_bh(&socktab->write_lock);
+	call_rcu(&hsk->socktab_rcu, homa_sock_put_rcu);
 }
 
 /**
@@ -229,6 +287,7 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 {
 	struct homa_interest *interest;
 	struct homa_rpc *rpc;
+	int node;
 #ifndef __STRIP__ /* See strip.py */
 	int i = 0;
 #endif /* See strip.py */
@@ -256,6 +315,7 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	hsk->shutdown = true;
 	homa_sock_unlink(hsk);
 	homa_sock_unlock(hsk);
+	homa_reaper_dequeue(hsk);
 
 	list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
 		homa_rpc_lock(rpc, "homa_sock_shutdown");
@@ -264,10 +324,19 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	}
 
 	homa_sock_lock(hsk, "homa_socket_shutdown #2");
-	list_for_each_entry(interest, &hsk->request_interests, request_links)
-		wake_up_process(interest->thread);
-	list_for_each_entry(interest, &hsk->response_interests, response_links)
-		wake_up_process(interest->thread);
+	for (node = 0; node < HOMA_INTEREST_NODES; node++) {
+		list_for_each_entry(interest,
+				    &hsk->request_interests.nodes[node],
+				    request_links)
+			wake_up_process(interest->thread);
+		list_for_each_entry(interest,
+				    &hsk->response_interests.nodes[node],
+				    response_links)
+			wake_up_process(interest->thread);
+	}
+	if (hsk->accept_backlog > 0)
+		/* Wake up any threads waiting in homa_accept. */
+		hsk->sock.sk_data_ready(&hsk->sock);
 	homa_sock_unlock(hsk);
 
 	while (!list_empty(&hsk->dead_rpcs)) {
@@ -282,10 +351,12 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	}
 
 	if (hsk->buffer_pool) {
-		homa_pool_destroy(hsk->buffer_pool);
-		kfree(hsk->buffer_pool);
+		homa_pool_put(hsk->buffer_pool);
 		hsk->buffer_pool = NULL;
 	}
+	hsk->peer = NULL;
+	dst_release(hsk->dst);
+	hsk->dst = NULL;
 }
 
 /**
@@ -296,7 +367,8 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 void homa_sock_destroy(struct homa_sock *hsk)
 {
 	homa_sock_shutdown(hsk);
-	sock_set_flag(&hsk->inet.sk, SOCK_RCU_FREE);
+	homa_ring_free(hsk->ring);
+	hsk->ring = NULL;
 }
 
 /**
@@ -339,12 +411,241 @@ int homa_sock_bind(struct homa_socktab *socktab, struct homa_sock *hsk,
 	hsk->inet.inet_sport = htons(hsk->port);
 	hlist_add_head_rcu(&hsk->socktab_links.hash_links,
 			   &socktab->buckets[homa_port_hash(port)]);
+	if (!hlist_unhashed(&hsk->conn_links.hash_links)) {
+		hlist_del_init_rcu(&hsk->conn_links.hash_links);
+		hlist_add_head_rcu(&hsk->conn_links.hash_links,
+				   &socktab->conn_buckets[homa_conn_hash(port,
+						&hsk->remote_host.sa)]);
+	}
 done:
 	spin_unlock_bh(&socktab->write_lock);
 	homa_sock_unlock(hsk);
 	return result;
 }
 
+/**
+ * homa_sock_set_remote() - Copy a remote address into hsk->remote_host,
+ * keeping only the address family, IP address, and port. The address is
+ * also recorded in the inet part of the socket, so that getpeername
+ * (and accept) can return it.
+ * @hsk:          Socket whose remote_host should be set.
+ * @remote_host:  New remote address; its family must match that of @hsk.
+ */
+static void homa_sock_set_remote(struct homa_sock *hsk,
+				 const struct sockaddr *remote_host)
+{
+	memset(&hsk->remote_host, 0, sizeof(hsk->remote_host));
+	if (hsk->sock.sk_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 =
+				(const struct sockaddr_in6 *)remote_host;
+
+		hsk->remote_host.in6.sin6_family = AF_INET6;
+		hsk->remote_host.in6.sin6_addr = in6->sin6_addr;
+		hsk->remote_host.in6.sin6_port = in6->sin6_port;
+		hsk->sock.sk_v6_daddr = in6->sin6_addr;
+		hsk->inet.inet_dport = in6->sin6_port;
+	} else {
+		const struct sockaddr_in *in4 =
+				(const struct sockaddr_in *)remote_host;
+
+		hsk->remote_host.in4.sin_family = AF_INET;
+		hsk->remote_host.in4.sin_addr.s_addr = in4->sin_addr.s_addr;
+		hsk->remote_host.in4.sin_port = in4->sin_port;
+		hsk->inet.inet_daddr = in4->sin_addr.s_addr;
+		hsk->inet.inet_dport = in4->sin_port;
+	}
+}
+
+/**
+ * homa_sock_hash_connected() - Add a socket to the connected-socket hash
+ * table of its socktab, keyed by its port and hsk->remote_host (which
+ * must already have been set). If the socket was already in the table it
+ * is rehashed.
+ * @hsk:    Socket to add; hsk->connect should be true.
+ */
+void homa_sock_hash_connected(struct homa_sock *hsk)
+{
+	struct homa_socktab *socktab = hsk->homa->port_map;
+
+	spin_lock_bh(&socktab->write_lock);
+	if (!hlist_unhashed(&hsk->conn_links.hash_links))
+		hlist_del_init_rcu(&hsk->conn_links.hash_links);
+	if (!hsk->shutdown)
+		hlist_add_head_rcu(&hsk->conn_links.hash_links,
+				   &socktab->conn_buckets[homa_conn_hash(hsk->port,
+						&hsk->remote_host.sa)]);
+	spin_unlock_bh(&socktab->write_lock);
+}
+
+/**
+ * homa_sock_cache_peer() - Look up the peer for a connected socket's
+ * remote host and record it in the socket, so that it needn't be looked
+ * up for each request. If the lookup fails, nothing is cached and peers
+ * will be looked up for each RPC as for unconnected sockets.
+ * @hsk:    Socket whose remote_host has just been set.
+ */
+void homa_sock_cache_peer(struct homa_sock *hsk)
+{
+	struct in6_addr addr = canonical_ipv6_addr(&hsk->remote_host);
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(hsk->homa->peers, &addr, &hsk->inet);
+	WRITE_ONCE(hsk->peer, IS_ERR(peer) ? NULL : peer);
+}
+
+/**
+ * homa_sock_unhash_connected() - Undo the effects of connect on a socket:
+ * remove it from the connected-socket hash table and forget its remote
+ * host (along with the cached peer and packet geometry). Its port, buffer
+ * pool, and RPCs are unaffected. The caller must hold the socket lock.
+ * @hsk:    Socket to disconnect.
+ */
+void homa_sock_unhash_connected(struct homa_sock *hsk)
+{
+	struct homa_socktab *socktab = hsk->homa->port_map;
+	struct dst_entry *dst;
+
+	spin_lock_bh(&socktab->write_lock);
+	if (!hlist_unhashed(&hsk->conn_links.hash_links))
+		hlist_del_init_rcu(&hsk->conn_links.hash_links);
+	hsk->connect = false;
+	WRITE_ONCE(hsk->peer, NULL);
+	memset(&hsk->remote_host, 0, sizeof(hsk->remote_host));
+	hsk->remote_host.in4.sin_family = AF_UNSPEC;
+	hsk->inet.inet_daddr = 0;
+	hsk->inet.inet_dport = 0;
+	memset(&hsk->sock.sk_v6_daddr, 0, sizeof(hsk->sock.sk_v6_daddr));
+	spin_unlock_bh(&socktab->write_lock);
+
+	write_seqlock_bh(&hsk->geometry_lock);
+	dst = hsk->dst;
+	hsk->dst = NULL;
+	write_sequnlock_bh(&hsk->geometry_lock);
+	dst_release(dst);
+}
+
+/**
+ * homa_sock_peel() - Turn a newly created socket into a socket peeled off
+ * from @parent: it takes over @parent's port and becomes connected to
+ * @remote_host, so that incoming packets from @remote_host are delivered
+ * to it instead of @parent.
+ * @hsk:          Newly initialized socket (it will give up its own port).
+ * @parent:       Socket from which @hsk is peeled off.
+ * @remote_host:  Address of the remote peer; the caller must have checked
+ *                that its family matches that of @hsk.
+ *
+ * Return:  0 for success, otherwise a negative errno.
+ */
+int homa_sock_peel(struct homa_sock *hsk, struct homa_sock *parent,
+		   const struct sockaddr *remote_host)
+{
+	struct homa_socktab *socktab = hsk->homa->port_map;
+	int result = 0;
+
+	spin_lock_bh(&socktab->write_lock);
+	if (hsk->shutdown || parent->shutdown) {
+		result = -ESHUTDOWN;
+		goto done;
+	}
+	homa_sock_advance_scans(socktab, hsk);
+	hlist_del_rcu(&hsk->socktab_links.hash_links);
+	hsk->port = parent->port;
+	hsk->inet.inet_num = hsk->port;
+	hsk->inet.inet_sport = htons(hsk->port);
+
+	/* Insert immediately after the parent, so that port lookups
+	 * (homa_sock_find and the fallback in homa_sock_find_connected)
+	 * encounter the parent before any of its peeled-off sockets.
+	 */
+	hlist_add_behind_rcu(&hsk->socktab_links.hash_links,
+			     &parent->socktab_links.hash_links);
+	homa_sock_set_remote(hsk, remote_host);
+	hsk->connect = true;
+
+	/* The caller must now invoke homa_rpc_migrate_peer, which will
+	 * clear this.
+	 */
+	WRITE_ONCE(hsk->migrating, true);
+	hlist_add_head_rcu(&hsk->conn_links.hash_links,
+			   &socktab->conn_buckets[homa_conn_hash(hsk->port,
+						remote_host)]);
+done:
+	spin_unlock_bh(&socktab->write_lock);
+	if (result == 0)
+		homa_sock_cache_peer(hsk);
+	return result;
+}
+
+/**
+ * homa_sock_parent() - Find the socket from which a given socket was
+ * peeled off.
+ * @hsk:    Socket of interest.
+ *
+ * Return:  The socket that owns @hsk's port and isn't connected, or NULL
+ * if @hsk wasn't peeled off or its parent has been shut down. The caller
+ * must hold an RCU read lock.
+ */
+struct homa_sock *homa_sock_parent(struct homa_sock *hsk)
+{
+	struct homa_sock *parent;
+
+	if (!hsk->connect)
+		return NULL;
+
+	/* Peeled-off sockets are linked after their parent, so the parent
+	 * is the first socket found for the port.
+	 */
+	parent = homa_sock_find(hsk->homa->port_map, hsk->port);
+	if (!parent || parent == hsk || parent->connect)
+		return NULL;
+	return parent;
+}
+
+/**
+ * homa_sock_share_pool() - Arrange for a socket to use the buffer pool of
+ * another socket instead of its own. This allows incoming messages to be
+ * moved between the sockets (see homa_rpc_migrate) without copying.
+ * @hsk:     Socket whose buffer pool should be replaced. Its existing pool
+ *           must not have any buffers allocated (typically @hsk has just
+ *           been created).
+ * @parent:  Socket whose buffer pool @hsk will share.
+ *
+ * Return:  0 for success, otherwise a negative errno.
+ */
+int homa_sock_share_pool(struct homa_sock *hsk, struct homa_sock *parent)
+{
+	struct homa_pool *pool;
+
+	if (hsk == parent)
+		return 0;
+	homa_sock_lock(parent, "homa_sock_share_pool");
+	if (parent->shutdown) {
+		homa_sock_unlock(parent);
+		return -ESHUTDOWN;
+	}
+	pool = parent->buffer_pool;
+	homa_pool_get(pool);
+	homa_sock_unlock(parent);
+
+	homa_sock_lock(hsk, "homa_sock_share_pool #2");
+	if (hsk->shutdown) {
+		homa_sock_unlock(hsk);
+		homa_pool_put(pool);
+		return -ESHUTDOWN;
+	}
+
+	/* If hsk's pool is shared, other sockets' RPCs may be using it. */
+	if (homa_pool_shared(hsk->buffer_pool)) {
+		homa_sock_unlock(hsk);
+		homa_pool_put(pool);
+		return -EBUSY;
+	}
+	swap(pool, hsk->buffer_pool);
+	homa_sock_unlock(hsk);
+	homa_pool_put(pool);
+	return 0;
+}
+
 /**
  * homa_sock_find() - Returns the socket associated with a given port.
  * @socktab:    Hash table in which to perform lookup.
@@ -379,12 +680,43 @@ struct homa_sock *homa_sock_find(struct homa_socktab *socktab,  __u16 port)
 }
 
 /**
- * homa_sock_find_connected() - Returns the socket associated with a given port and its remote host info.
- * This is used when demultiplexing, to cater for branched-off sockets sharing the same port
+ * homa_sock_remote_matches() - Returns true if a socket is connected to a
+ * given remote address and port.
+ * @hsk:          Connected socket.
+ * @remote_host:  Address and port of a remote peer.
+ */
+static inline bool homa_sock_remote_matches(struct homa_sock *hsk,
+					    const struct sockaddr *remote_host)
+{
+	if (hsk->sock.sk_family != remote_host->sa_family)
+		return false;
+	if (remote_host->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 =
+				(const struct sockaddr_in6 *)remote_host;
+
+		return hsk->remote_host.in6.sin6_port == in6->sin6_port &&
+		       ipv6_addr_equal(&hsk->remote_host.in6.sin6_addr,
+				       &in6->sin6_addr);
+	}
+	return hsk->remote_host.in4.sin_port ==
+			((const struct sockaddr_in *)remote_host)->sin_port &&
+	       hsk->remote_host.in4.sin_addr.s_addr ==
+			((const struct sockaddr_in *)remote_host)->sin_addr.s_addr;
+}
+
+/**
+ * homa_sock_find_connected() - Returns the socket that should receive
+ * packets arriving at a given port from a given remote host. This is used
+ * when demultiplexing, to cater for peeled-off sockets sharing the same port.
  * @socktab:         Hash table in which to perform lookup.
- * @remote_host:     The remote host of interest, must be initialised by the caller
- * @port:            The port of interest.
- * @return:          The socket on the port, whose hsk->remote_host matches @remote_host
+ * @remote_host:     The remote host of interest (AF_INET or AF_INET6).
+ * @port:            The local port of interest.
+ * Return:           The socket on @port that is connected to @remote_host,
+ *                   if there is one; otherwise the unconnected (listening)
+ *                   socket for @port, or NULL if neither exists.
+ *
+ * Connected sockets are found through socktab->conn_buckets, so the cost
+ * of a lookup does not depend on how many peeled-off sockets share @port.
  *
  * Note: this function uses RCU list-searching facilities, but it doesn't
  * call rcu_read_lock. The caller should do that, if the caller cares (this
@@ -394,44 +726,34 @@ struct homa_sock *homa_sock_find(struct homa_socktab *socktab,  __u16 port)
  * there is no need for matching daddr. daddr is handled by IP layer, and
  * is not relevant to Homa.
  */
-struct homa_sock *homa_sock_find_connected(struct homa_socktab *socktab, struct sockaddr *remote_host, __u16 port) {
+struct homa_sock *homa_sock_find_connected(struct homa_socktab *socktab,
+					   const struct sockaddr *remote_host,
+					   __u16 port)
+{
 	struct homa_socktab_links *link;
-	struct homa_sock *result = NULL;
-	struct homa_sock *listen = NULL;
-	struct sockaddr_in *in4;
-	struct sockaddr_in6 *in6;
-	if (remote_host->sa_family == AF_INET) {
-		in4 = (struct sockaddr_in *) remote_host;
-	}
-	else if (remote_host->sa_family == AF_INET6) {
-		in6 = (struct sockaddr_in6 *) remote_host;
+	struct homa_sock *hsk;
+
+	hlist_for_each_entry_rcu(link,
+				 &socktab->conn_buckets[homa_conn_hash(port,
+						remote_host)],
+				 hash_links) {
+		hsk = link->sock;
+		if (hsk->port == port && homa_sock_remote_matches(hsk,
+								  remote_host))
+			return hsk;
 	}
+
+	/* No connected socket; fall back to the listening socket. Peeled-off
+	 * sockets are linked after their parent in the port chain, so this
+	 * loop normally terminates before reaching any of them.
+	 */
 	hlist_for_each_entry_rcu(link, &socktab->buckets[homa_port_hash(port)],
 				 hash_links) {
-		struct homa_sock *hsk = link->sock;
-		/* matches remote host rather than just port */
-		if (hsk->port == port && hsk->sock.sk_family == remote_host->sa_family) {
-			if (hsk->sock.sk_family == AF_INET) {
-				/* remote_host port and addr */
-				if (hsk->remote_host.in4.sin_port == in4->sin_port && hsk->remote_host.in4.sin_addr.s_addr == in4->sin_addr.s_addr) {
-					result = hsk;
-					break;
-				}
-			}
-			else if (hsk->sock.sk_family == AF_INET6) {
-				/* remote_host port and addr */
-				if (hsk->remote_host.in6.sin6_port == in6->sin6_port && memcmp(&hsk->remote_host.in6.sin6_addr, &in6->sin6_addr, sizeof(struct in6_addr)) == 0) {
-					result = hsk;
-					break;
-				}
-			}
-		}
-		/* If no connected socket was found, check for the listening socket */
-		if (hsk->port == port && !hsk->connect) {
-			listen = hsk;
-		}
+		hsk = link->sock;
+		if (hsk->port == port && !hsk->connect)
+			return hsk;
 	}
-	return result ? result : listen;
+	return NULL;
 }
 
 /**
@@ -453,6 +775,115 @@ void homa_sock_lock_slow(struct homa_sock *hsk)
 	INC_METRIC(socket_lock_miss_ns, sched_clock() - start);
 }
 
+/**
+ * homa_rpc_table_new() - Allocate and initialize a hash table for RPCs.
+ * @num_buckets:  Number of buckets in the table; must be a power of 2.
+ * @id_offset:    Added to the index of each bucket to produce its id.
+ * @flags:        Flags to use for memory allocation.
+ *
+ * Return:        The new table, or NULL if memory couldn't be allocated.
+ */
+struct homa_rpc_table *homa_rpc_table_new(int num_buckets, int id_offset,
+					  gfp_t flags)
+{
+	struct homa_rpc_table *table;
+	int i;
+
+	table = kmalloc(struct_size(table, buckets, num_buckets), flags);
+	if (!table)
+		return NULL;
+	table->mask = num_buckets - 1;
+	table->prev = NULL;
+	for (i = 0; i < num_buckets; i++) {
+		struct homa_rpc_bucket *bucket = &table->buckets[i];
+
+		spin_lock_init(&bucket->lock);
+		INIT_HLIST_HEAD(&bucket->rpcs);
+		bucket->id = i + id_offset;
+		bucket->moved = false;
+	}
+	return table;
+}
+
+/**
+ * homa_rpc_table_free() - Release the memory for an RPC table, along with
+ * all of the tables that it replaced.
+ * @table:    Table to free; NULL means do nothing. The table must not
+ *            contain any RPCs.
+ */
+void homa_rpc_table_free(struct homa_rpc_table *table)
+{
+	struct homa_rpc_table *prev;
+
+	while (table) {
+		prev = table->prev;
+		kfree(table);
+		table = prev;
+	}
+}
+
+/**
+ * homa_rpc_table_grow() - Replace one of the RPC tables for a socket with
+ * a table twice as large, moving all of the RPCs to the new table. If
+ * another thread is already growing a table for the socket, or if memory
+ * can't be allocated, this function does nothing (the old table still
+ * works, it's just slower).
+ * @hsk:      Socket whose table should grow. The caller must not hold
+ *            any RPC locks for this socket.
+ * @server:   True means grow the table of server RPCs, false means the
+ *            table of client RPCs.
+ */
+void homa_rpc_table_grow(struct homa_sock *hsk, bool server)
+{
+	struct homa_rpc_table **table_ptr = server ? &hsk->server_rpc_table
+						   : &hsk->client_rpc_table;
+	int max = server ? HOMA_SERVER_RPC_BUCKETS : HOMA_CLIENT_RPC_BUCKETS;
+	struct homa_rpc_table *old, *new;
+	int i;
+
+	if (!spin_trylock_bh(&hsk->rpc_table_lock))
+		return;
+	old = *table_ptr;
+	if (old->mask + 1 >= max)
+		goto done;
+	new = homa_rpc_table_new(2 * (old->mask + 1), server ? 1000000 : 0,
+				 GFP_ATOMIC);
+	if (!new)
+		goto done;
+
+	/* Move RPCs one bucket at a time. Once a bucket has been emptied
+	 * it is marked as moved; threads that find a moved bucket spin
+	 * until the new table is visible. RPCs in new buckets are already
+	 * visible through rpc->bucket, so each new bucket must be locked
+	 * while it is modified.
+	 */
+	for (i = 0; i <= old->mask; i++) {
+		struct homa_rpc_bucket *bucket = &old->buckets[i];
+		struct hlist_node *next;
+		struct homa_rpc *rpc;
+
+		homa_bucket_lock(bucket, 0, "homa_rpc_table_grow");
+		hlist_for_each_entry_safe(rpc, next, &bucket->rpcs, hash_links) {
+			struct homa_rpc_bucket *dest;
+
+			dest = &new->buckets[(rpc->id >> 1) & new->mask];
+			spin_lock_nested(&dest->lock, SINGLE_DEPTH_NESTING);
+			__hlist_del(&rpc->hash_links);
+			hlist_add_head(&rpc->hash_links, &dest->rpcs);
+			WRITE_ONCE(rpc->bucket, dest);
+			spin_unlock(&dest->lock);
+		}
+		bucket->moved = true;
+		homa_bucket_unlock(bucket, 0);
+	}
+	new->prev = old;
+	smp_store_release(table_ptr, new);
+	INC_METRIC(rpc_table_grows, 1);
+
+done:
+	spin_unlock_bh(&hsk->rpc_table_lock);
+}
+
 /**
  * homa_bucket_lock_slow() - This function implements the slow path for
  * locking a bucket in one of the hash tables of RPCs. It is invoked when a
@@ -8,6 +8,7 @@
 /* Forward declarations. */
 struct homa;
 struct homa_pool;
+struct homa_ring;
 
 void     homa_sock_lock_slow(struct homa_sock *hsk);
 
@@ -17,9 +18,19 @@ void     homa_sock_lock_slow(struct homa_sock *hsk);
  */
 #define HOMA_SOCKTAB_BUCKETS 1024
 
+/**
+ * define HOMA_SOCKTAB_CONN_BUCKETS - Number of hash buckets used to look
+ * up connected sockets by (local port, remote address, remote port). Must
+ * be a power of 2. This is much larger than HOMA_SOCKTAB_BUCKETS because
+ * a single server port may have tens of thousands of peeled-off sockets.
+ */
+#define HOMA_SOCKTAB_CONN_BUCKETS 16384
+
 /**
  * struct homa_socktab - A hash table that maps from port numbers (either
- * client or server) to homa_sock objects.
+ * client or server) to homa_sock objects. A second table maps from
+ * (local port, remote address, remote port) to connected sockets
+ * (peeled-off sockets and sockets on which connect has been invoked).
  *
  * This table is managed exclusively by homa_socktab.c, using RCU to
  * minimize synchronization during lookups.
@@ -38,6 +49,13 @@ struct homa_socktab {
 	 */
 	struct hlist_head buckets[HOMA_SOCKTAB_BUCKETS];
 
+	/**
+	 * @conn_buckets: Heads of chains for the connected-socket hash
+	 * table. Chains consist of the @conn_links fields of homa_socks.
+	 * Every socket in this table also appears in @buckets.
+	 */
+	struct hlist_head conn_buckets[HOMA_SOCKTAB_CONN_BUCKETS];
+
 	/**
 	 * @active_scans: List of homa_socktab_scan structs for all scans
 	 * currently underway on this homa_socktab.
@@ -110,20 +128,118 @@ struct homa_rpc_bucket {
 	 * client RPCs.
 	 */
 	int id;
+
+	/**
+	 * @moved: true means homa_rpc_table_grow has moved all of the RPCs
+	 * in this bucket to a larger table; the bucket must not be used
+	 * anymore. Modified only when @lock is held.
+	 */
+	bool moved;
+};
+
+/**
+ * struct homa_rpc_table - A hash table of RPCs (either all of the client
+ * RPCs for a socket or all of its server RPCs). Tables start out small and
+ * are replaced with larger ones as the number of RPCs grows, so sockets
+ * with few RPCs (such as connected sockets) don't pay for large tables.
+ */
+struct homa_rpc_table {
+	/**
+	 * @mask: number of buckets in @buckets, minus one (the number
+	 * of buckets is always a power of 2).
+	 */
+	int mask;
+
+	/**
+	 * @prev: the (smaller) table that this one replaced, or NULL.
+	 * Lookups don't synchronize with table growth, so a thread could
+	 * still be looking at an old table after it has been replaced; old
+	 * tables are retained until the socket is freed.
+	 */
+	struct homa_rpc_table *prev;
+
+	/** @buckets: the hash buckets (@mask + 1 of them). */
+	struct homa_rpc_bucket buckets[];
 };
 
 /**
- * define HOMA_CLIENT_RPC_BUCKETS - Number of buckets in hash tables for
- * client RPCs. Must be a power of 2.
+ * define HOMA_INITIAL_RPC_BUCKETS - Number of buckets in a socket's
+ * RPC hash tables when the socket is created. Must be a power of 2.
+ */
+#define HOMA_INITIAL_RPC_BUCKETS 8
+
+/**
+ * define HOMA_CLIENT_RPC_BUCKETS - Maximum number of buckets in hash tables
+ * for client RPCs. Must be a power of 2.
  */
 #define HOMA_CLIENT_RPC_BUCKETS 1024
 
 /**
- * define HOMA_SERVER_RPC_BUCKETS - Number of buckets in hash tables for
- * server RPCs. Must be a power of 2.
+ * define HOMA_SERVER_RPC_BUCKETS - Maximum number of buckets in hash tables
+ * for server RPCs. Must be a power of 2.
  */
 #define HOMA_SERVER_RPC_BUCKETS 1024
 
+/**
+ * struct homa_geometry - Describes how an outgoing message is divided
+ * into packets.
+ */
+struct homa_geometry {
+	/**
+	 * @mtu: largest size for an on-the-wire packet (including all
+	 * headers through IP header, but not Ethernet header).
+	 */
+	int mtu;
+
+	/**
+	 * @max_seg_data: largest amount of Homa message data that fits
+	 * in an on-the-wire packet (after segmentation).
+	 */
+	int max_seg_data;
+
+	/**
+	 * @max_gso_data: largest amount of Homa message data that fits
+	 * in a GSO packet (before segmentation).
+	 */
+	int max_gso_data;
+
+	/**
+	 * @max_gso_size: value of homa->max_gso_size when this geometry
+	 * was computed.
+	 */
+	int max_gso_size;
+};
+
+/**
+ * define HOMA_INTEREST_NODES - Number of lists in a struct
+ * homa_interest_queue. NUMA nodes beyond this share lists.
+ */
+#define HOMA_INTEREST_NODES 8
+
+/**
+ * define HOMA_INTEREST_SCAN - Maximum number of interests that
+ * homa_choose_interest examines in each list of a homa_interest_queue
+ * while looking for a thread on an idle core.
+ */
+#define HOMA_INTEREST_SCAN 4
+
+/**
+ * struct homa_interest_queue - Threads waiting for one kind of incoming
+ * message (requests or responses) on a socket. Interests are grouped by the
+ * NUMA node of the core their thread registered on, so that
+ * homa_choose_interest can find a waiter near the core doing the handoff
+ * by examining only a few entries, no matter how many threads are waiting.
+ */
+struct homa_interest_queue {
+	/**
+	 * @nodes: Each entry lists the interests (linked through either
+	 * their request_links or their response_links) whose cores map
+	 * to that entry (see homa_interest_node); most recently registered
+	 * interests are first.
+	 */
+	struct list_head nodes[HOMA_INTEREST_NODES];
+};
+
 /**
  * struct homa_sock - Information about an open socket.
  */
@@ -213,11 +329,18 @@ struct homa_sock {
 	int dead_skbs;
 
 	/**
-	 * @waiting_for_bufs: Contains RPCs that are blocked because there
-	 * wasn't enough space in the buffer pool region for their incoming
-	 * messages. Sorted in increasing order of message length.
+	 * @reaper: Background thread that frees RPCs on @dead_rpcs (the one
+	 * for the NUMA node where the socket was created). NULL means the
+	 * reapers haven't been initialized.
 	 */
-	struct list_head waiting_for_bufs;
+	struct homa_reaper *reaper;
+
+	/**
+	 * @reap_links: Used to link this socket into reaper->socks when
+	 * it has dead RPCs waiting to be reaped; empty otherwise. Protected
+	 * by reaper->lock.
+	 */
+	struct list_head reap_links;
 
 	/**
 	 * @ready_requests: Contains server RPCs whose request message is
@@ -234,37 +357,139 @@ struct homa_sock {
 	struct list_head ready_responses;
 
 	/**
-	 * @request_interests: List of threads that want to receive incoming
+	 * @accept_queue: Contains server RPCs that arrived at this (listening)
+	 * socket from clients that don't yet have a socket of their own;
+	 * homa_accept creates those sockets. Linked through ready_links.
+	 * The head is oldest.
+	 */
+	struct list_head accept_queue;
+
+	/** @accept_queue_len: Number of RPCs in @accept_queue. */
+	int accept_queue_len;
+
+	/**
+	 * @accept_backlog: Maximum value of @accept_queue_len; once
+	 * @accept_queue is full, additional requests are queued in
+	 * @ready_requests just as if the socket weren't listening. 0 means
+	 * homa_listen has not been invoked on this socket.
+	 */
+	int accept_backlog;
+
+	/**
+	 * @request_interests: Threads that want to receive incoming
 	 * request messages.
 	 */
-	struct list_head request_interests;
+	struct homa_interest_queue request_interests;
 
 	/**
-	 * @response_interests: List of threads that want to receive incoming
+	 * @response_interests: Threads that want to receive incoming
 	 * response messages.
 	 */
-	struct list_head response_interests;
+	struct homa_interest_queue response_interests;
 
 	/**
-	 * @client_rpc_buckets: Hash table for fast lookup of client RPCs.
+	 * @client_rpc_table: Hash table for fast lookup of client RPCs.
 	 * Modifications are synchronized with bucket locks, not
-	 * the socket lock.
+	 * the socket lock. Replaced by homa_rpc_table_grow when it
+	 * becomes crowded.
 	 */
-	struct homa_rpc_bucket client_rpc_buckets[HOMA_CLIENT_RPC_BUCKETS];
+	struct homa_rpc_table *client_rpc_table;
 
 	/**
-	 * @server_rpc_buckets: Hash table for fast lookup of server RPCs.
+	 * @server_rpc_table: Hash table for fast lookup of server RPCs.
 	 * Modifications are synchronized with bucket locks, not
-	 * the socket lock.
+	 * the socket lock. Replaced by homa_rpc_table_grow when it
+	 * becomes crowded.
+	 */
+	struct homa_rpc_table *server_rpc_table;
+
+	/** @client_rpcs: number of RPCs in @client_rpc_table. */
+	atomic_t client_rpcs;
+
+	/** @server_rpcs: number of RPCs in @server_rpc_table. */
+	atomic_t server_rpcs;
+
+	/**
+	 * @rpc_table_lock: held by homa_rpc_table_grow while it replaces
+	 * one of the RPC tables, so that only one thread at a time grows
+	 * the tables for a socket.
 	 */
-	struct homa_rpc_bucket server_rpc_buckets[HOMA_SERVER_RPC_BUCKETS];
+	spinlock_t rpc_table_lock;
 
 	/**
 	 * @buffer_pool: used to allocate buffer space for incoming messages.
-	 * Storage is dynamically allocated.
+	 * Storage is dynamically allocated; sockets created by homa_accept
+	 * or SO_HOMA_PEELOFF share the pool of their parent socket, and
+	 * SO_HOMA_SHARE_RCVBUF lets any socket share another socket's pool.
 	 */
 	struct homa_pool *buffer_pool;
 
+	/**
+	 * @bpages_held: number of bpages in @buffer_pool allocated to this
+	 * socket's messages that haven't yet been returned to Homa (through
+	 * recvmsg, HOMAIOCRELEASE, HOMAIOCRECVBATCH, or the free ring of
+	 * @ring). Compared against the socket's quota when the pool is
+	 * shared.
+	 */
+	atomic_t bpages_held;
+
+	/**
+	 * @bpage_quota: soft limit on @bpages_held, set with
+	 * SO_HOMA_BPAGE_QUOTA. 0 means no limit; -1 means use
+	 * homa->bpage_quota.
+	 */
+	int bpage_quota;
+
+	/**
+	 * @ring: completion ring created with SO_HOMA_RING, or NULL if
+	 * none. Set under the socket lock and not freed until the socket
+	 * is destroyed (the application may have it mapped until then).
+	 */
+	struct homa_ring *ring;
+
+	/**
+	 * @wakeup_pending: nonzero means that a softirq batch has deferred
+	 * a wakeup for this socket (see homa_sock_wakeup), so RPCs that
+	 * become ready before the batch ends need no wakeups of their own.
+	 * Protected by the socket lock.
+	 */
+	int wakeup_pending;
+
+	/**
+	 * @poll_usecs: How long threads waiting for messages on this socket
+	 * should busy-wait before sleeping; -1 means use
+	 * homa->poll_usecs. Set with SO_HOMA_POLL.
+	 */
+	int poll_usecs;
+
+	/**
+	 * @poll_adaptive: Nonzero means threads should poll only if a
+	 * message is expected within the poll budget, based on
+	 * @avg_interarrival (see HOMA_POLL_ADAPTIVE).
+	 */
+	int poll_adaptive;
+
+	/**
+	 * @inline_max: Incoming messages no longer than this are delivered
+	 * directly into recvmsg's iovec rather than the buffer pool; 0
+	 * means never. Set with SO_HOMA_INLINE.
+	 */
+	int inline_max;
+
+	/**
+	 * @last_arrival: sched_clock() time when an RPC most recently
+	 * became ready on this socket (0 means none yet). Protected by the
+	 * socket lock (but read without it by homa_poll_budget).
+	 */
+	__u64 last_arrival;
+
+	/**
+	 * @avg_interarrival: Exponentially weighted moving average of the
+	 * time between successive arrivals on this socket, in ns. Protected
+	 * like @last_arrival.
+	 */
+	__u64 avg_interarrival;
+
 	/**
 	 * @remote_host: information about the remote host, only used under the connected semantics.
 	 * For client this is set after calling connect(), and for server this is set for the branched-off socket after calling homa_peeloff()
@@ -272,8 +497,58 @@ struct homa_sock {
 	 */
 	union sockaddr_in_union remote_host;
 
+	/**
+	 * @conn_links: Links this socket into the conn_buckets of the
+	 * socktab, keyed by @port and @remote_host. Unhashed unless
+	 * @connect is true.
+	 */
+	struct homa_socktab_links conn_links;
+
 	/** @connect: True means the hsk is one-to-one */
 	bool connect;
+
+	/**
+	 * @migrating: True means this socket was just peeled off and RPCs
+	 * for its remote host are still being moved to it from its parent
+	 * (see homa_rpc_migrate_peer), or requests for its remote host were
+	 * left on the parent because the sockets don't share a buffer pool.
+	 * While this is set, incoming requests must be matched against the
+	 * parent's RPCs before new RPCs are created. Read without the socket
+	 * lock.
+	 */
+	bool migrating;
+
+	/**
+	 * @peer: if the socket is connected, the peer for @remote_host,
+	 * cached here so that sending a request doesn't require a peer
+	 * lookup. NULL if the socket isn't connected (or the lookup failed).
+	 */
+	struct homa_peer *peer;
+
+	/**
+	 * @geometry_lock: used to read and update @dst and @geometry
+	 * consistently.
+	 */
+	seqlock_t geometry_lock;
+
+	/**
+	 * @dst: the dst of @peer from which @geometry was computed; the
+	 * socket holds a reference to it. NULL means @geometry is not valid.
+	 */
+	struct dst_entry *dst;
+
+	/**
+	 * @geometry: packet geometry for messages sent to @peer, cached so
+	 * that it needn't be recomputed for every message.
+	 */
+	struct homa_geometry geometry;
+
+	/**
+	 * @socktab_rcu: Used to release the socktab's reference to this
+	 * socket once an RCU grace period has elapsed after the socket was
+	 * unlinked (see homa_sock_unlink).
+	 */
+	struct rcu_head socktab_rcu;
 };
 
 /**
@@ -290,13 +565,28 @@ struct homa_v6_sock {
 
 void               homa_bucket_lock_slow(struct homa_rpc_bucket *bucket,
 					 __u64 id);
+void               homa_rpc_table_free(struct homa_rpc_table *table);
+void               homa_rpc_table_grow(struct homa_sock *hsk, bool server);
+struct homa_rpc_table *homa_rpc_table_new(int num_buckets, int id_offset,
+					  gfp_t flags);
 int                homa_sock_bind(struct homa_socktab *socktab,
 				  struct homa_sock *hsk, __u16 port);
+void               homa_sock_cache_peer(struct homa_sock *hsk);
 void               homa_sock_destroy(struct homa_sock *hsk);
 struct homa_sock  *homa_sock_find(struct homa_socktab *socktab, __u16 port);
-struct homa_sock *homa_sock_find_connected(struct homa_socktab *socktab, struct sockaddr *remote_host, __u16 port);
+struct homa_sock  *homa_sock_find_connected(struct homa_socktab *socktab,
+					    const struct sockaddr *remote_host,
+					    __u16 port);
+void               homa_sock_hash_connected(struct homa_sock *hsk);
 int                homa_sock_init(struct homa_sock *hsk, struct homa *homa);
+struct homa_sock  *homa_sock_parent(struct homa_sock *hsk);
+int                homa_sock_peel(struct homa_sock *hsk,
+				  struct homa_sock *parent,
+				  const struct sockaddr *remote_host);
+int                homa_sock_share_pool(struct homa_sock *hsk,
+					struct homa_sock *parent);
 void               homa_sock_shutdown(struct homa_sock *hsk);
+void               homa_sock_unhash_connected(struct homa_sock *hsk);
 void               homa_sock_unlink(struct homa_sock *hsk);
 int                homa_socket(struct sock *sk);
 void               homa_socktab_destroy(struct homa_socktab *socktab);
@@ -321,6 +611,23 @@ static inline void homa_sock_lock(struct homa_sock *hsk, const char *locker)
 //	hsk->last_locker = locker;
 }
 
+/**
+ * homa_sock_lock_nested() - Acquire the lock for a socket while the lock
+ * for a different socket is already held. All socket locks belong to the
+ * same lockdep class, so the nesting must be declared to lockdep. The
+ * lock must be released with homa_sock_unlock.
+ * @hsk:     Socket to lock.
+ * @locker:  Static string identifying where the socket was locked;
+ *           used to track down deadlocks.
+ */
+static inline void homa_sock_lock_nested(struct homa_sock *hsk,
+					 const char *locker)
+	__acquires(&hsk->lock)
+{
+	local_bh_disable();
+	spin_lock_nested(&hsk->lock, SINGLE_DEPTH_NESTING);
+}
+
 /**
  * homa_sock_unlock() - Release the lock for a socket.
  * @hsk:   Socket to lock.
@@ -347,6 +654,37 @@ static inline int homa_port_hash(__u16 port)
 	return port & (HOMA_SOCKTAB_BUCKETS - 1);
 }
 
+/**
+ * homa_conn_hash() - Hash function for connected sockets.
+ * @port:         Local port number of the socket.
+ * @remote_host:  Address and port of the remote end of the connection.
+ *                Must be AF_INET or AF_INET6.
+ *
+ * Return:  The index of the bucket in socktab->conn_buckets in which a
+ *          socket connected to @remote_host will be found (if it exists).
+ */
+static inline int homa_conn_hash(__u16 port,
+				 const struct sockaddr *remote_host)
+{
+	__u32 hash;
+
+	if (remote_host->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 =
+				(const struct sockaddr_in6 *)remote_host;
+
+		hash = jhash2((const __u32 *)in6->sin6_addr.s6_addr32, 4,
+			      ((__u32)port << 16) | ntohs(in6->sin6_port));
+	} else {
+		const struct sockaddr_in *in4 =
+				(const struct sockaddr_in *)remote_host;
+
+		hash = jhash_2words((__force __u32)in4->sin_addr.s_addr,
+				    ((__u32)port << 16) | ntohs(in4->sin_port),
+				    0);
+	}
+	return hash & (HOMA_SOCKTAB_CONN_BUCKETS - 1);
+}
+
 /**
  * homa_client_rpc_bucket() - Find the bucket containing a given
  * client RPC.
@@ -361,8 +699,9 @@ static inline struct homa_rpc_bucket *homa_client_rpc_bucket(struct homa_sock *h
 	/* We can use a really simple hash function here because RPC ids
 	 * are allocated sequentially.
 	 */
-	return &hsk->client_rpc_buckets[(id >> 1)
-			& (HOMA_CLIENT_RPC_BUCKETS - 1)];
+	struct homa_rpc_table *table = READ_ONCE(hsk->client_rpc_table);
+
+	return &table->buckets[(id >> 1) & table->mask];
 }
 
 /**
@@ -380,8 +719,37 @@ static inline struct homa_rpc_bucket *homa_server_rpc_bucket(struct homa_sock *h
 	 * naturally distribute themselves across the hash space.
 	 * Thus we can use the id directly as hash.
 	 */
-	return &hsk->server_rpc_buckets[(id >> 1)
-			& (HOMA_SERVER_RPC_BUCKETS - 1)];
+	struct homa_rpc_table *table = READ_ONCE(hsk->server_rpc_table);
+
+	return &table->buckets[(id >> 1) & table->mask];
+}
+
+/**
+ * homa_rpc_table_maybe_grow() - Invoked before adding an RPC to one of a
+ * socket's RPC tables; replaces the table with a larger one if it has
+ * become crowded.
+ * @hsk:      Socket whose table will receive a new RPC.
+ * @server:   True means the RPC is a server RPC, false means client.
+ */
+static inline void homa_rpc_table_maybe_grow(struct homa_sock *hsk,
+					     bool server)
+{
+	struct homa_rpc_table *table;
+	int max;
+
+	if (server) {
+		table = READ_ONCE(hsk->server_rpc_table);
+		max = HOMA_SERVER_RPC_BUCKETS;
+		if (likely(atomic_read(&hsk->server_rpcs) <= table->mask))
+			return;
+	} else {
+		table = READ_ONCE(hsk->client_rpc_table);
+		max = HOMA_CLIENT_RPC_BUCKETS;
+		if (likely(atomic_read(&hsk->client_rpcs) <= table->mask))
+			return;
+	}
+	if (table->mask + 1 < max)
+		homa_rpc_table_grow(hsk, server);
 }
 
 /**
@@ -399,6 +767,23 @@ static inline void homa_bucket_lock(struct homa_rpc_bucket *bucket,
 		homa_bucket_lock_slow(bucket, id);
 }
 
+/**
+ * homa_bucket_lock_nested() - Acquire the lock for an RPC hash table bucket
+ * while the lock for a different bucket is already held (all bucket locks
+ * belong to the same lockdep class). The lock must be released with
+ * homa_bucket_unlock.
+ * @bucket:    Bucket to lock
+ * @id:        ID of the RPC that is requesting the lock.
+ * @locker:    Static string identifying the locking code.
+ */
+static inline void homa_bucket_lock_nested(struct homa_rpc_bucket *bucket,
+					   __u64 id, const char *locker)
+	__acquires(&bucket->lock)
+{
+	local_bh_disable();
+	spin_lock_nested(&bucket->lock, SINGLE_DEPTH_NESTING);
+}
+
 /**
  * homa_bucket_unlock() - Release the lock for an RPC hash table bucket.
  * @bucket:   Bucket to unlock.
@@ -410,9 +795,89 @@ static inline void homa_bucket_unlock(struct homa_rpc_bucket *bucket, __u64 id)
 	spin_unlock_bh(&bucket->lock);
 }
 
+/**
+ * homa_bucket_lock_current() - Acquire the lock for a bucket returned by
+ * homa_client_rpc_bucket or homa_server_rpc_bucket, unless the bucket's
+ * table has been replaced in the meantime.
+ * @bucket:    Bucket to lock
+ * @id:        ID of the RPC that is requesting the lock.
+ * @locker:    Static string identifying the locking code.
+ *
+ * Return:     True means the bucket is now locked. False means its RPCs
+ *             have been moved to a new table; the bucket is not locked
+ *             and the caller must look up the bucket again.
+ */
+static inline bool homa_bucket_lock_current(struct homa_rpc_bucket *bucket,
+					    __u64 id, const char *locker)
+{
+	homa_bucket_lock(bucket, id, locker);
+	if (likely(!bucket->moved))
+		return true;
+	homa_bucket_unlock(bucket, id);
+	cpu_relax();
+	return false;
+}
+
 static inline struct homa_sock *homa_sk(const struct sock *sk)
 {
 	return (struct homa_sock *)sk;
 }
 
+/**
+ * homa_interest_node() - Returns the index of the list in a
+ * homa_interest_queue used for interests registered on a given core.
+ * @core:    Core number.
+ */
+static inline int homa_interest_node(int core)
+{
+	return cpu_to_node(core) % HOMA_INTEREST_NODES;
+}
+
+/**
+ * homa_interest_queue_init() - Initialize an empty homa_interest_queue.
+ * @queue:   Queue to initialize.
+ */
+static inline void homa_interest_queue_init(struct homa_interest_queue *queue)
+{
+	int i;
+
+	for (i = 0; i < HOMA_INTEREST_NODES; i++)
+		INIT_LIST_HEAD(&queue->nodes[i]);
+}
+
+/**
+ * homa_interest_queue_add() - Add an interest to a homa_interest_queue.
+ * The socket that owns @queue must be locked.
+ * @queue:   Queue to which the interest should be added.
+ * @links:   Either the request_links or the response_links field of the
+ *           interest (must match @queue).
+ * @core:    Core on which the interest's thread registered.
+ */
+static inline void homa_interest_queue_add(struct homa_interest_queue *queue,
+					   struct list_head *links, int core)
+{
+	list_add(links, &queue->nodes[homa_interest_node(core)]);
+}
+
+/**
+ * homa_skb_sock() - Return the socket attached to an incoming packet by
+ * homa_gro_early_demux, if any.
+ * @skb:     Incoming packet.
+ *
+ * Return:   The socket that should receive @skb, or NULL if early demux
+ *           didn't find one (or the socket has since been shut down), in
+ *           which case the caller must look the socket up.
+ */
+static inline struct homa_sock *homa_skb_sock(struct sk_buff *skb)
+{
+	struct sock *sk = skb->sk;
+
+	if (!sk || skb->destructor != sock_pfree ||
+	    sk->sk_prot->recvmsg != homa_recvmsg)
+		return NULL;
+	if (unlikely(homa_sk(sk)->shutdown))
+		return NULL;
+	return homa_sk(sk);
+}
+
 #endif /* _HOMA_SOCK_H */
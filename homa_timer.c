@@ -205,7 +205,15 @@ void homa_timer(struct homa *homa)
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(homa->port_map, &scan);
 			hsk; hsk = homa_socktab_next(&scan)) {
-		while (hsk->dead_skbs >= homa->dead_buffs_limit) {
+		if (hsk->dead_skbs >= homa->dead_buffs_limit &&
+		    homa_reaper_active(hsk)) {
+			/* The reaper thread should be handling this; make
+			 * sure it knows about the socket.
+			 */
+			homa_reaper_enqueue(hsk);
+		}
+		while (hsk->dead_skbs >= homa->dead_buffs_limit &&
+		       !homa_reaper_active(hsk)) {
 			/* If we get here, it means that homa_wait_for_message
 			 * isn't keeping up with RPC reaping, so we'll help
 			 * out.  See reap.txt for more info.
@@ -9,8 +9,6 @@
 #include "homa_rpc.h"
 #include "homa_skb.h"
 
-struct completion homa_pacer_kthread_done;
-
 /**
  * homa_init() - Constructor for homa objects.
  * @homa:   Object to initialize.
@@ -26,10 +24,12 @@ int homa_init(struct homa *homa)
 	_Static_assert(HOMA_MAX_PRIORITIES >= 8,
 		       "homa_init assumes at least 8 priority levels");
 
-	homa->pacer_kthread = NULL;
-	init_completion(&homa_pacer_kthread_done);
+	spin_lock_init(&homa->pacers_lock);
+	INIT_LIST_HEAD_RCU(&homa->pacers);
+	homa->default_pacer = NULL;
+	INIT_LIST_HEAD(&homa->dead_pacers);
+	homa->pacer_notifier.notifier_call = NULL;
 	atomic64_set(&homa->next_outgoing_id, 2);
-	atomic64_set(&homa->link_idle_time, sched_clock());
 	spin_lock_init(&homa->grantable_lock);
 	homa->grantable_lock_time = 0;
 	atomic_set(&homa->grant_recalc_count, 0);
@@ -46,13 +46,8 @@ int homa_init(struct homa *homa)
 	}
 	homa->grant_nonfifo = 0;
 	homa->grant_nonfifo_left = 0;
-	spin_lock_init(&homa->pacer_mutex);
 	homa->pacer_fifo_fraction = 50;
-	homa->pacer_fifo_count = 1;
-	homa->pacer_wake_time = 0;
-	spin_lock_init(&homa->throttle_lock);
-	INIT_LIST_HEAD_RCU(&homa->throttled_rpcs);
-	homa->throttle_add = 0;
+	homa->pacer_hrtimer = 0;
 	homa->throttle_min_bytes = 200;
 	atomic_set(&homa->total_incoming, 0);
 	homa->next_client_port = HOMA_MIN_DEFAULT_PORT;
@@ -115,20 +110,39 @@ int homa_init(struct homa *homa)
 	homa->reap_limit = 10;
 	homa->dead_buffs_limit = 5000;
 	homa->max_dead_buffs = 0;
-	homa->pacer_kthread = kthread_run(homa_pacer_main, homa,
-					  "homa_pacer");
-	if (IS_ERR(homa->pacer_kthread)) {
-		err = PTR_ERR(homa->pacer_kthread);
-		homa->pacer_kthread = NULL;
+	homa->default_pacer = homa_pacer_new(homa, NULL, GFP_KERNEL);
+	if (!homa->default_pacer) {
+		pr_err("%s couldn't create default pacer: kmalloc failure",
+		       __func__);
+		return -ENOMEM;
+	}
+	list_add_tail_rcu(&homa->default_pacer->links, &homa->pacers);
+	homa->default_pacer->kthread = kthread_run(homa_pacer_main,
+						   homa->default_pacer,
+						   "homa_pacer");
+	if (IS_ERR(homa->default_pacer->kthread)) {
+		err = PTR_ERR(homa->default_pacer->kthread);
+		homa->default_pacer->kthread = NULL;
 		pr_err("couldn't create homa pacer thread: error %d\n", err);
 		return err;
 	}
-	homa->pacer_exit = false;
+	homa->pacer_notifier.notifier_call = homa_pacer_netdev_event;
+	err = register_netdevice_notifier(&homa->pacer_notifier);
+	if (err) {
+		homa->pacer_notifier.notifier_call = NULL;
+		pr_err("couldn't register homa netdevice notifier: error %d\n",
+		       err);
+		return err;
+	}
+	err = homa_reapers_init(homa);
+	if (err)
+		return err;
 	homa->max_nic_queue_ns = 5000;
 	homa->ns_per_mbyte = 0;
 	homa->verbose = 0;
 	homa->max_gso_size = 10000;
 	homa->gso_force_software = 0;
+	homa->zerocopy_min = 65536;
 	homa->hijack_tcp = 0;
 	homa->max_gro_skbs = 20;
 	homa->gro_policy = HOMA_GRO_NORMAL;
@@ -143,6 +157,7 @@ int homa_init(struct homa *homa)
 	homa->flags = 0;
 	homa->freeze_type = 0;
 	homa->bpage_lease_usecs = 10000;
+	homa->bpage_quota = 0;
 	homa->next_id = 0;
 	homa_outgoing_sysctl_changed(homa);
 	homa_incoming_sysctl_changed(homa);
@@ -159,17 +174,18 @@ void homa_destroy(struct homa *homa)
 #include "utils.h"
 	unit_homa_destroy(homa);
 #endif /* __UNIT_TEST__ */
-	if (homa->pacer_kthread) {
-		homa_pacer_stop(homa);
-		wait_for_completion(&homa_pacer_kthread_done);
-	}
-
 	/* The order of the following statements matters! */
 	if (homa->port_map) {
 		homa_socktab_destroy(homa->port_map);
 		kfree(homa->port_map);
 		homa->port_map = NULL;
 	}
+	homa_reapers_destroy(homa);
+	if (homa->pacer_notifier.notifier_call) {
+		unregister_netdevice_notifier(&homa->pacer_notifier);
+		homa->pacer_notifier.notifier_call = NULL;
+	}
+	homa_pacers_destroy(homa);
 	if (homa->peers) {
 		homa_peertab_destroy(homa->peers);
 		kfree(homa->peers);
@@ -670,18 +686,18 @@ void homa_spin(int ns)
 
 /**
  * homa_throttle_lock_slow() - This function implements the slow path for
- * acquiring the throttle lock. It is invoked when the lock isn't immediately
- * available. It waits for the lock, but also records statistics about
- * the waiting time.
- * @homa:    Overall data about the Homa protocol implementation.
+ * acquiring a pacer's throttle lock. It is invoked when the lock isn't
+ * immediately available. It waits for the lock, but also records statistics
+ * about the waiting time.
+ * @pacer:   Pacer whose lock should be acquired.
  */
-void homa_throttle_lock_slow(struct homa *homa)
-	__acquires(&homa->throttle_lock)
+void homa_throttle_lock_slow(struct homa_pacer *pacer)
+	__acquires(&pacer->throttle_lock)
 {
 	__u64 start = sched_clock();
 
 	tt_record("beginning wait for throttle lock");
-	spin_lock_bh(&homa->throttle_lock);
+	spin_lock_bh(&pacer->throttle_lock);
 	tt_record("ending wait for throttle lock");
 	INC_METRIC(throttle_lock_misses, 1);
 	INC_METRIC(throttle_lock_miss_ns, sched_clock() - start);
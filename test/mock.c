@@ -12,6 +12,8 @@
 #include "mock.h"
 #include "utils.h"
 
+#include <linux/rbtree_augmented.h>
+
 #define KSELFTEST_NOT_MAIN 1m
 #include "kselftest_harness.h"
 
@@ -44,11 +46,13 @@ int mock_ip6_xmit_errors;
 int mock_ip_queue_xmit_errors;
 int mock_kmalloc_errors;
 int mock_kthread_create_errors;
+int mock_pin_user_pages_errors;
 int mock_register_protosw_errors;
 int mock_route_errors;
 int mock_spin_lock_held;
 int mock_trylock_errors;
 int mock_vmalloc_errors;
+int mock_zerocopy_errors;
 
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending;
@@ -56,6 +60,9 @@ int mock_signal_pending;
 /* Used as current task during tests. */
 struct task_struct mock_task;
 
+/* Returned by sockfd_lookup (NULL means sockfd_lookup fails with EBADF). */
+struct socket *mock_sockfd_socket;
+
 /* If a test sets this variable to nonzero, ip_queue_xmit will log
  * outgoing packets using the long format rather than short.
  */
@@ -177,10 +184,15 @@ int mock_page_nid_mask;
 char mock_printk_output [5000];
 
 struct dst_ops mock_dst_ops = {.mtu = mock_get_mtu};
+struct proto mock_homa_prot = {.recvmsg = homa_recvmsg};
 struct netdev_queue mock_net_queue = {.state = 0};
 struct net_device mock_net_device = {
 		.gso_max_segs = 1000,
 		.gso_max_size = 0,
+		.reg_state = NETREG_REGISTERED,
+#ifdef CONFIG_NET_NS
+		.nd_net = {.net = &init_net},
+#endif /* CONFIG_NET_NS */
 		._tx = &mock_net_queue};
 const struct net_offload *inet_offloads[MAX_INET_PROTOS];
 const struct net_offload *inet6_offloads[MAX_INET_PROTOS];
@@ -197,6 +209,7 @@ unsigned int nr_cpu_ids = 8;
 unsigned long page_offset_base;
 unsigned long phys_base;
 unsigned long vmemmap_base;
+struct workqueue_struct *system_wq;
 int __preempt_count;
 struct pcpu_hot pcpu_hot = {.cpu_number = 1};
 char sock_flow_table[RPS_SOCK_FLOW_TABLE_SIZE(1024)];
@@ -245,6 +258,16 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	return skb;
 }
 
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	func(head);
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	return false;
+}
+
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
@@ -350,6 +373,11 @@ void finish_wait(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry)
 {}
 
+void fput(struct file *file)
+{
+	UNIT_LOG("; ", "fput");
+}
+
 #if KERNEL_VERSION(5, 18, 0) > LINUX_VERSION_CODE
 	void get_random_bytes(void *buf, int nbytes)
 #else
@@ -384,7 +412,9 @@ void hrtimer_init(struct hrtimer *timer, clockid_t clock_id,
 
 void hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim,
 		u64 range_ns, const enum hrtimer_mode mode)
-{}
+{
+	unit_log_printf("; ", "hrtimer_start %lld ns", tim);
+}
 
 void __icmp_send(struct sk_buff *skb, int type, int code, __be32 info,
 		const struct ip_options *opt)
@@ -549,9 +579,40 @@ void iov_iter_init(struct iov_iter *i, unsigned int direction,
 	i->count = count;
 }
 
+ssize_t iov_iter_get_pages2(struct iov_iter *i, struct page **pages,
+		size_t maxsize, unsigned int maxpages, size_t *start)
+{
+	struct iovec *iov = (struct iovec *) iter_iov(i);
+	__u64 int_base = (__u64) iov->iov_base;
+	size_t bytes = iov->iov_len;
+	unsigned int n;
+
+	*start = int_base & (PAGE_SIZE - 1);
+	if (bytes > maxsize)
+		bytes = maxsize;
+	if (bytes > maxpages * PAGE_SIZE - *start)
+		bytes = maxpages * PAGE_SIZE - *start;
+	unit_log_printf("; ", "iov_iter_get_pages2 %lu bytes at %llu",
+			bytes, int_base);
+	for (n = 0; n < DIV_ROUND_UP(*start + bytes, PAGE_SIZE); n++)
+		pages[n] = mock_alloc_pages(GFP_KERNEL, 0);
+	i->count -= bytes;
+	iov->iov_base = (void *) (int_base + bytes);
+	iov->iov_len -= bytes;
+	if (iov->iov_len == 0)
+		i->__iov++;
+	return bytes;
+}
+
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
 {
+	struct iovec *iov = (struct iovec *) iter_iov(i);
+
+	/* Only handles reverts within the current iovec. */
 	unit_log_printf("; ", "iov_iter_revert %lu", bytes);
+	i->count += bytes;
+	iov->iov_base -= bytes;
+	iov->iov_len += bytes;
 }
 
 int ip6_datagram_connect(struct sock *sk, struct sockaddr *addr, int addr_len)
@@ -719,6 +780,11 @@ void kfree(const void *block)
 	free((void *) block);
 }
 
+void kvfree(const void *addr)
+{
+	kfree(addr);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
 void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 #else
@@ -737,6 +803,7 @@ void __kfree_skb(struct sk_buff *skb)
 		return;
 	}
 	unit_hash_erase(skbs_in_use, skb);
+	skb_zcopy_clear(skb, true);
 	while (shinfo->frag_list) {
 		struct sk_buff *next = shinfo->frag_list->next;
 
@@ -783,6 +850,11 @@ struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 	return NULL;
 }
 
+bool kthread_should_stop(void)
+{
+	return true;
+}
+
 int kthread_stop(struct task_struct *k)
 {
 	return 0;
@@ -816,6 +888,49 @@ ssize_t __modver_version_show(struct module_attribute *a,
 	return 0;
 }
 
+static void mock_zerocopy_complete(struct sk_buff *skb,
+		struct ubuf_info *uarg, bool success)
+{
+	struct ubuf_info_msgzc *uarg_zc = uarg_to_msgzc(uarg);
+
+	if (!refcount_dec_and_test(&uarg->refcnt))
+		return;
+	if (uarg_zc->len != 0)
+		unit_log_printf("; ", "zerocopy notification, %s",
+				uarg_zc->zerocopy ? "zerocopy" : "copied");
+	kfree(uarg_zc);
+}
+
+const struct ubuf_info_ops msg_zerocopy_ubuf_ops = {
+	.complete = mock_zerocopy_complete,
+};
+
+void msg_zerocopy_put_abort(struct ubuf_info *uarg, bool have_uref)
+{
+	unit_log_printf("; ", "msg_zerocopy_put_abort");
+	uarg_to_msgzc(uarg)->len--;
+	if (have_uref)
+		mock_zerocopy_complete(NULL, uarg, true);
+}
+
+struct ubuf_info *msg_zerocopy_realloc(struct sock *sk, size_t size,
+		struct ubuf_info *uarg)
+{
+	struct ubuf_info_msgzc *uarg_zc;
+
+	if (mock_check_error(&mock_zerocopy_errors))
+		return NULL;
+	uarg_zc = kmalloc(sizeof(*uarg_zc), GFP_KERNEL);
+	memset(uarg_zc, 0, sizeof(*uarg_zc));
+	uarg_zc->ubuf.ops = &msg_zerocopy_ubuf_ops;
+	uarg_zc->ubuf.flags = SKBFL_ZEROCOPY_FRAG | SKBFL_DONT_ORPHAN;
+	refcount_set(&uarg_zc->ubuf.refcnt, 1);
+	uarg_zc->len = 1;
+	uarg_zc->bytelen = size;
+	uarg_zc->zerocopy = 1;
+	return &uarg_zc->ubuf;
+}
+
 void __mutex_init(struct mutex *lock, const char *name,
 			 struct lock_class_key *key)
 {
@@ -833,6 +948,15 @@ void mutex_unlock(struct mutex *lock)
 	mock_active_locks--;
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+void napi_busy_loop(unsigned int napi_id,
+		bool (*loop_end)(void *, unsigned long),
+		void *loop_end_arg, bool prefer_busy_poll, u16 budget)
+{
+	unit_log_printf("; ", "napi_busy_loop id %u", napi_id);
+}
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 int netif_receive_skb(struct sk_buff *skb)
 {
 	struct homa_data_hdr *h = (struct homa_data_hdr *)
@@ -873,6 +997,15 @@ int _printk(const char *format, ...)
 	return 0;
 }
 
+long pin_user_pages_fast(unsigned long start, int nr_pages,
+		unsigned int gup_flags, struct page **pages)
+{
+	if (mock_check_error(&mock_pin_user_pages_errors))
+		return -EFAULT;
+	memset(pages, 0, nr_pages * sizeof(*pages));
+	return nr_pages;
+}
+
 struct proc_dir_entry *proc_create(const char *name, umode_t mode,
 				   struct proc_dir_entry *parent,
 				   const struct proc_ops *proc_ops)
@@ -926,6 +1059,15 @@ void *__pskb_pull_tail(struct sk_buff *skb, int delta)
 	return NULL;
 }
 
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		   struct work_struct *work)
+{
+	/* Run the work immediately, so tests can see its effects. */
+	unit_log_printf("; ", "queue_work");
+	work->func(work);
+	return true;
+}
+
 void _raw_spin_lock(raw_spinlock_t *lock)
 {
 	mock_active_locks++;
@@ -961,6 +1103,44 @@ int __lockfunc _raw_spin_trylock(raw_spinlock_t *lock)
 	return 1;
 }
 
+/* The rbtree functions below maintain a correctly ordered binary search
+ * tree, but never rebalance it; that's good enough for unit tests.
+ */
+static void mock_rb_propagate(struct rb_node *node, struct rb_node *stop) {}
+static void mock_rb_copy(struct rb_node *old, struct rb_node *new) {}
+static void mock_rb_rotate(struct rb_node *old, struct rb_node *new) {}
+static const struct rb_augment_callbacks mock_rb_callbacks = {
+	.propagate = mock_rb_propagate,
+	.copy = mock_rb_copy,
+	.rotate = mock_rb_rotate,
+};
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	__rb_erase_augmented(node, root, &mock_rb_callbacks);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (RB_EMPTY_NODE(node))
+		return NULL;
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return (struct rb_node *)node;
+	}
+	while ((parent = rb_parent(node)) && node == parent->rb_right)
+		node = parent;
+	return parent;
+}
+
+void rcu_barrier(void) {}
+
 bool rcuref_get_slowpath(rcuref_t *ref)
 {
 	return true;
@@ -968,12 +1148,23 @@ bool rcuref_get_slowpath(rcuref_t *ref)
 
 void refcount_warn_saturate(refcount_t *r, enum refcount_saturation_type t) {}
 
+int register_netdevice_notifier(struct notifier_block *nb)
+{
+	return 0;
+}
+
 void release_sock(struct sock *sk)
 {
 	mock_active_locks--;
 	sk->sk_lock.owned = 0;
 }
 
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr,
+		unsigned long pgoff)
+{
+	return 0;
+}
+
 void remove_wait_queue(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry)
 {}
@@ -993,6 +1184,12 @@ void security_sk_classify_flow(const struct sock *sk,
 		struct flowi_common *flic)
 {}
 
+int set_cpus_allowed_ptr(struct task_struct *p,
+			 const struct cpumask *new_mask)
+{
+	return 0;
+}
+
 void __show_free_areas(unsigned int filter, nodemask_t *nodemask,
 		int max_zone_idx)
 {}
@@ -1000,6 +1197,9 @@ void __show_free_areas(unsigned int filter, nodemask_t *nodemask,
 void sk_common_release(struct sock *sk)
 {}
 
+void sk_free(struct sock *sk)
+{}
+
 int sk_set_peek_off(struct sock *sk, int val)
 {
 	return 0;
@@ -1015,6 +1215,14 @@ void sk_skb_reason_drop(struct sock *sk, struct sk_buff *skb,
 #endif
 }
 
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	if (offset + len > skb->len)
+		return -EFAULT;
+	memcpy(to, skb->data + offset, len);
+	return 0;
+}
+
 int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 		struct iov_iter *iter, int size)
 {
@@ -1114,6 +1322,18 @@ int sock_common_setsockopt(struct socket *sock, int level, int optname,
 	return 0;
 }
 
+int sock_create(int family, int type, int protocol, struct socket **res)
+{
+	/* Complete sockets can't be created in unit tests. */
+	UNIT_LOG("; ", "sock_create");
+	return -ENOMEM;
+}
+
+struct socket *sock_from_file(struct file *file)
+{
+	return (struct socket *)file->private_data;
+}
+
 int sock_no_accept(struct socket *sock, struct socket *newsock,
 		struct proto_accept_arg *arg)
 {
@@ -1147,6 +1367,31 @@ int sock_no_socketpair(struct socket *sock1, struct socket *sock2)
 	return 0;
 }
 
+void sock_pfree(struct sk_buff *skb)
+{}
+
+int sock_recv_errqueue(struct sock *sk, struct msghdr *msg, int len,
+		int level, int type)
+{
+	unit_log_printf("; ", "sock_recv_errqueue level %d, type %d",
+			level, type);
+	return -EAGAIN;
+}
+
+void sock_release(struct socket *sock)
+{}
+
+struct socket *sockfd_lookup(int fd, int *err)
+{
+	if (!mock_sockfd_socket) {
+		*err = -EBADF;
+		return NULL;
+	}
+	return mock_sockfd_socket;
+}
+
+void synchronize_rcu(void) {}
+
 void __tasklet_hi_schedule(struct tasklet_struct *t)
 {}
 
@@ -1157,9 +1402,21 @@ void tasklet_init(struct tasklet_struct *t,
 void tasklet_kill(struct tasklet_struct *t)
 {}
 
+void unpin_user_pages(struct page **pages, unsigned long npages)
+{}
+
+void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npages,
+		bool make_dirty)
+{}
+
 void unregister_net_sysctl_table(struct ctl_table_header *header)
 {}
 
+int unregister_netdevice_notifier(struct notifier_block *nb)
+{
+	return 0;
+}
+
 void vfree(const void *block)
 {
 	if (!vmallocs_in_use || unit_hash_get(vmallocs_in_use, block) == NULL) {
@@ -1542,6 +1799,9 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	struct sock *sk = &hsk->sock;
 
 	memset(hsk, 0, sizeof(*hsk));
+	refcount_set(&sk->sk_refcnt, 1);
+	skb_queue_head_init(&sk->sk_error_queue);
+	sk->sk_prot = &mock_homa_prot;
 	sk->sk_data_ready = mock_data_ready;
 	sk->sk_family = mock_ipv6 ? AF_INET6 : AF_INET;
 	if ((port != 0) && (port >= HOMA_MIN_DEFAULT_PORT))
@@ -1597,6 +1857,7 @@ void mock_teardown(void)
 	mock_ip_queue_xmit_errors = 0;
 	mock_kmalloc_errors = 0;
 	mock_kthread_create_errors = 0;
+	mock_pin_user_pages_errors = 0;
 	mock_register_protosw_errors = 0;
 	mock_copy_to_user_dont_copy = 0;
 	mock_bpage_size = 0x10000;
@@ -1607,7 +1868,9 @@ void mock_teardown(void)
 	mock_route_errors = 0;
 	mock_trylock_errors = 0;
 	mock_vmalloc_errors = 0;
+	mock_zerocopy_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
+	mock_sockfd_socket = NULL;
 	mock_signal_pending = 0;
 	mock_xmit_log_verbose = 0;
 	mock_xmit_log_homa_info = 0;
@@ -1619,6 +1882,9 @@ void mock_teardown(void)
 	mock_printk_output[0] = 0;
 	mock_net_device.gso_max_size = 0;
 	mock_net_device.gso_max_segs = 1000;
+	mock_net_device.ifindex = 0;
+	mock_net_device.reg_state = NETREG_REGISTERED;
+	dev_net_set(&mock_net_device, &init_net);
 	memset(inet_offloads, 0, sizeof(inet_offloads));
 	inet_offloads[IPPROTO_TCP] = (struct net_offload __rcu *) &tcp_offload;
 	memset(inet6_offloads, 0, sizeof(inet6_offloads));
@@ -1696,3 +1962,17 @@ void *mock_vmalloc(size_t size)
 	unit_hash_set(vmallocs_in_use, block, "used");
 	return block;
 }
+
+/**
+ * mock_vmalloc_user() - Called instead of vmalloc_user when Homa is
+ * compiled for unit testing.
+ * @size:   Number of bytes to allocate.
+ */
+void *mock_vmalloc_user(size_t size)
+{
+	void *block = mock_vmalloc(size);
+
+	if (block)
+		memset(block, 0, size);
+	return block;
+}
@@ -14,6 +14,7 @@ extern int         mock_copy_to_user_dont_copy;
 extern int         mock_copy_to_user_errors;
 extern int         mock_cpu_idle;
 extern cycles_t    mock_cycles;
+extern struct proto mock_homa_prot;
 extern int         mock_import_iovec_errors;
 extern int         mock_import_ubuf_errors;
 extern int         mock_ip6_xmit_errors;
@@ -34,15 +35,19 @@ extern __u64       mock_ns;
 extern __u64       mock_ns_tick;
 extern int         mock_numa_mask;
 extern int         mock_page_nid_mask;
+extern int         mock_pin_user_pages_errors;
 extern char        mock_printk_output[];
 extern int         mock_route_errors;
 extern int         mock_spin_lock_held;
+extern struct socket
+		   *mock_sockfd_socket;
 extern struct task_struct
 		   mock_task;
 extern int         mock_trylock_errors;
 extern int         mock_vmalloc_errors;
 extern int         mock_xmit_log_verbose;
 extern int         mock_xmit_log_homa_info;
+extern int         mock_zerocopy_errors;
 
 struct page *
 		   mock_alloc_pages(gfp_t gfp, unsigned order);
@@ -76,3 +81,4 @@ void        mock_sock_init(struct homa_sock *hsk, struct homa *homa,
 			   int port);
 void        mock_teardown(void);
 void       *mock_vmalloc(size_t size);
+void       *mock_vmalloc_user(size_t size);
@@ -4,6 +4,7 @@
 #include "homa_offload.h"
 #include "homa_peer.h"
 #include "homa_pool.h"
+#include "homa_ring.h"
 #define KSELFTEST_NOT_MAIN 1
 #include "kselftest_harness.h"
 #include "ccutils.h"
@@ -30,8 +31,8 @@ void handoff_hook(char *id)
 			"%d in ready_requests, %d in ready_responses, %d in request_interests, %d in response_interests",
 			unit_list_length(&hook_rpc->hsk->ready_requests),
 			unit_list_length(&hook_rpc->hsk->ready_responses),
-			unit_list_length(&hook_rpc->hsk->request_interests),
-			unit_list_length(&hook_rpc->hsk->response_interests));
+			unit_interest_queue_length(&hook_rpc->hsk->request_interests),
+			unit_interest_queue_length(&hook_rpc->hsk->response_interests));
 }
 
 /* The following hook function marks an RPC ready after several calls. */
@@ -179,6 +180,58 @@ FIXTURE_TEARDOWN(homa_incoming)
 	unit_teardown();
 }
 
+/**
+ * peel_client() - Peel a socket off the fixture's server socket (hsk2),
+ * connected to the fixture's client.
+ * @hsk:    Socket to initialize.
+ * @self:   Test fixture.
+ */
+static void peel_client(struct homa_sock *hsk,
+			FIXTURE_DATA(homa_incoming) *self)
+{
+	union sockaddr_in_union addr;
+
+	mock_sock_init(hsk, &self->homa, 0);
+	memset(&addr, 0, sizeof(addr));
+	if (self->hsk2.inet.sk.sk_family == AF_INET) {
+		addr.in4.sin_family = AF_INET;
+		addr.in4.sin_addr.s_addr = ipv6_to_ipv4(self->client_ip[0]);
+		addr.in4.sin_port = htons(self->client_port);
+	} else {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_addr = self->client_ip[0];
+		addr.in6.sin6_port = htons(self->client_port);
+	}
+	homa_sock_peel(hsk, &self->hsk2, &addr.sa);
+}
+
+/**
+ * time_choose() - Measure the cost of homa_choose_interest.
+ * @homa:    Overall data about the Homa protocol.
+ * @queue:   Interests from which to choose.
+ * Return:   The smallest number of cycles measured for a batch of
+ *           1000 calls (the minimum filters out noise).
+ */
+static __u64 time_choose(struct homa *homa, struct homa_interest_queue *queue)
+{
+	__u64 start, elapsed, best = ~0ULL;
+	int i, j;
+
+	mock_cycles = ~0;
+	for (i = 0; i < 10; i++) {
+		start = mock_get_cycles();
+		for (j = 0; j < 1000; j++)
+			homa_choose_interest(homa, queue,
+					offsetof(struct homa_interest,
+						 request_links));
+		elapsed = mock_get_cycles() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	mock_cycles = 0;
+	return best;
+}
+
 TEST_F(homa_incoming, homa_message_in_init__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -212,6 +265,37 @@ TEST_F(homa_incoming, homa_message_in_init__no_buffers_available)
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 	EXPECT_EQ(0, crpc->msgin.granted);
 }
+TEST_F(homa_incoming, homa_message_in_init__inline)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 99, 1000, 1000);
+
+	self->hsk.inline_max = 1000;
+	EXPECT_EQ(0, homa_message_in_init(crpc, 1000, 1000));
+	EXPECT_EQ(1, crpc->msgin.inline_data);
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+	EXPECT_EQ(1000, crpc->msgin.granted);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->inline_msgs);
+
+	EXPECT_EQ(0, homa_message_in_init(crpc, 1001, 1001));
+	EXPECT_EQ(0, crpc->msgin.inline_data);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+}
+TEST_F(homa_incoming, homa_message_in_init__no_inline_with_ring)
+{
+	struct homa_ring_args args = {.entries = 4, .free_entries = 4};
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 99, 1000, 1000);
+
+	self->hsk.inline_max = 1000;
+	self->hsk.ring = homa_ring_new(&args);
+	ASSERT_FALSE(IS_ERR(self->hsk.ring));
+	EXPECT_EQ(0, homa_message_in_init(crpc, 1000, 1000));
+	EXPECT_EQ(0, crpc->msgin.inline_data);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+}
 TEST_F(homa_incoming, homa_message_in_init__update_metrics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -675,6 +759,54 @@ TEST_F(homa_incoming, homa_copy_to_user__basics)
 			unit_log_get());
 	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
 }
+TEST_F(homa_incoming, homa_copy_to_user__pinned_region)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc;
+	char *region;
+	int i;
+
+	/* Substitute real memory for the (fake) pinned pages of the buffer
+	 * region (page_address is the identity function in unit tests).
+	 */
+	region = malloc(4 * PAGE_SIZE);
+	pool->num_pinned_pages = 4;
+	pool->pinned_pages = kmalloc_array(4, sizeof(struct page *),
+					   GFP_KERNEL);
+	for (i = 0; i < 4; i++)
+		pool->pinned_pages[i] = (struct page *)(region + i * PAGE_SIZE);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(1400, homa_metrics_per_cpu()->pinned_copy_bytes);
+	EXPECT_EQ(0, *((int *) region));
+	EXPECT_EQ(1396, *((int *) (region + 1396)));
+	kfree(pool->pinned_pages);
+	pool->pinned_pages = NULL;
+	free(region);
+}
+TEST_F(homa_incoming, homa_copy_to_user__inline_message)
+{
+	struct homa_rpc *crpc;
+
+	self->hsk.inline_max = 2000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, crpc->msgin.inline_data);
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(2, skb_queue_len(&crpc->msgin.packets));
+}
 TEST_F(homa_incoming, homa_copy_to_user__rpc_freed)
 {
 	struct homa_rpc *crpc;
@@ -841,6 +973,78 @@ TEST_F(homa_incoming, homa_copy_to_user__timetrace_info)
 }
 #endif
 
+TEST_F(homa_incoming, homa_copy_inline__out_of_order_packets)
+{
+	struct sk_buff_head skbs;
+	struct msghdr msg = {};
+	struct iovec iov;
+
+	__skb_queue_head_init(&skbs);
+	self->data.message_length = htonl(2000);
+	self->data.seg.offset = htonl(1400);
+	__skb_queue_tail(&skbs, mock_skb_new(self->server_ip,
+			&self->data.common, 600, 1400));
+	self->data.seg.offset = 0;
+	__skb_queue_tail(&skbs, mock_skb_new(self->server_ip,
+			&self->data.common, 1400, 0));
+	iov.iov_base = (void *) 0x2000000;
+	iov.iov_len = 2000;
+	iov_iter_init(&msg.msg_iter, READ, &iov, 1, 2000);
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_copy_inline(&skbs, &msg));
+	EXPECT_STREQ("skb_copy_datagram_iter: 1400 bytes to 0x2000000: 0-1399; "
+			"skb_copy_datagram_iter: 600 bytes to 0x2000578: 1400-1999",
+			unit_log_get());
+	EXPECT_EQ(0, msg.msg_flags & MSG_TRUNC);
+	EXPECT_EQ(0, skb_queue_len(&skbs));
+}
+TEST_F(homa_incoming, homa_copy_inline__iovec_too_small)
+{
+	struct sk_buff_head skbs;
+	struct msghdr msg = {};
+	struct iovec iov;
+
+	__skb_queue_head_init(&skbs);
+	self->data.message_length = htonl(2000);
+	__skb_queue_tail(&skbs, mock_skb_new(self->server_ip,
+			&self->data.common, 1400, 0));
+	self->data.seg.offset = htonl(1400);
+	__skb_queue_tail(&skbs, mock_skb_new(self->server_ip,
+			&self->data.common, 600, 1400));
+	iov.iov_base = (void *) 0x2000000;
+	iov.iov_len = 1000;
+	iov_iter_init(&msg.msg_iter, READ, &iov, 1, 1000);
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_copy_inline(&skbs, &msg));
+	EXPECT_STREQ("skb_copy_datagram_iter: 1000 bytes to 0x2000000: 0-999",
+			unit_log_get());
+	EXPECT_EQ(MSG_TRUNC, msg.msg_flags & MSG_TRUNC);
+	EXPECT_EQ(0, skb_queue_len(&skbs));
+}
+TEST_F(homa_incoming, homa_copy_inline__error_in_skb_copy_datagram_iter)
+{
+	struct sk_buff_head skbs;
+	struct msghdr msg = {};
+	struct iovec iov;
+
+	__skb_queue_head_init(&skbs);
+	self->data.message_length = htonl(2000);
+	__skb_queue_tail(&skbs, mock_skb_new(self->server_ip,
+			&self->data.common, 1400, 0));
+	self->data.seg.offset = htonl(1400);
+	__skb_queue_tail(&skbs, mock_skb_new(self->server_ip,
+			&self->data.common, 600, 1400));
+	iov.iov_base = (void *) 0x2000000;
+	iov.iov_len = 2000;
+	iov_iter_init(&msg.msg_iter, READ, &iov, 1, 2000);
+
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_copy_inline(&skbs, &msg));
+	EXPECT_EQ(0, skb_queue_len(&skbs));
+}
+
 TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_ipv4)
 {
 	struct sk_buff *skb;
@@ -893,6 +1097,33 @@ TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_free_many_packets)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_STREQ("icmp6_send type 1, code 4", unit_log_get());
 }
+TEST_F(homa_incoming, homa_dispatch_pkts__use_early_demux_socket)
+{
+	struct sk_buff *skb;
+
+	/* There is no socket for the packet's port, so the packet can
+	 * only be delivered using the socket attached during GRO.
+	 */
+	self->data.common.dport = htons(100);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	skb->sk = &self->hsk2.sock;
+	skb->destructor = sock_pfree;
+	homa_dispatch_pkts(skb, &self->homa);
+	EXPECT_EQ(1, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_incoming, homa_dispatch_pkts__early_demux_socket_shutdown)
+{
+	struct sk_buff *skb;
+
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	skb->sk = &self->hsk.sock;
+	skb->destructor = sock_pfree;
+	homa_sock_shutdown(&self->hsk);
+	homa_dispatch_pkts(skb, &self->homa);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->hsk2.active_rpcs));
+}
 TEST_F(homa_incoming, homa_dispatch_pkts__new_server_rpc)
 {
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
@@ -943,6 +1174,51 @@ TEST_F(homa_incoming, homa_dispatch_pkts__non_data_packet_for_existing_server_rp
 			&self->homa);
 	EXPECT_STREQ("xmit BUSY", unit_log_get());
 }
+TEST_F(homa_incoming, homa_dispatch_pkts__server_rpc_in_parent_while_migrating)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk2, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 10000, 100);
+	struct homa_sock hsk3;
+
+	ASSERT_NE(NULL, srpc);
+	peel_client(&hsk3, self);
+	EXPECT_TRUE(hsk3.migrating);
+
+	/* Without the fallback, a duplicate RPC would be created in hsk3. */
+	self->data.seg.offset = htonl(1400);
+	self->data.common.sender_id = cpu_to_be64(self->client_id);
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
+			1400, 0), &self->homa);
+	EXPECT_EQ(7200, srpc->msgin.bytes_remaining);
+	EXPECT_EQ(0, unit_list_length(&hsk3.active_rpcs));
+	homa_sock_destroy(&hsk3);
+}
+TEST_F(homa_incoming, homa_dispatch_pkts__non_data_packet_for_rpc_in_parent)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk2, UNIT_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 10000, 100);
+	struct homa_resend_hdr resend = {.common = {
+		.sport = htons(self->client_port),
+		.dport = htons(self->server_port),
+		.type = RESEND,
+		.sender_id = cpu_to_be64(self->client_id)},
+		.offset = 0,
+		.length = 1000,
+		.priority = 3};
+	struct homa_sock hsk3;
+
+	ASSERT_NE(NULL, srpc);
+	peel_client(&hsk3, self);
+	hsk3.migrating = false;
+	unit_log_clear();
+	homa_dispatch_pkts(mock_skb_new(self->client_ip, &resend.common, 0, 0),
+			&self->homa);
+	EXPECT_STREQ("xmit BUSY", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->parent_rpc_lookups);
+	homa_sock_destroy(&hsk3);
+}
 TEST_F(homa_incoming, homa_dispatch_pkts__existing_client_rpc)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1235,6 +1511,30 @@ TEST_F(homa_incoming, homa_data_pkt__no_buffers)
 	EXPECT_EQ(1400, homa_metrics_per_cpu()->dropped_data_no_bufs);
 	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
 }
+TEST_F(homa_incoming, homa_data_pkt__inline_message)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1600);
+
+	ASSERT_NE(NULL, crpc);
+	self->hsk.inline_max = 2000;
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+	self->data.message_length = htonl(1600);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc);
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+
+	/* Not handed off until the message is complete. */
+	self->data.seg.offset = htonl(1400);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			200, 1400), crpc);
+	EXPECT_EQ(2, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->dropped_data_no_bufs);
+}
 TEST_F(homa_incoming, homa_data_pkt__update_delta)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2281,6 +2581,53 @@ TEST_F(homa_incoming, homa_wait_for_message__nothing_ready_nonblocking)
 			self->client_id);
 	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
 }
+TEST_F(homa_incoming, homa_wait_for_message__leave_reaping_to_reaper_thread)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+	struct task_struct task;
+	struct homa_rpc *rpc;
+
+	ASSERT_NE(NULL, crpc1);
+	task.pid = 77;
+	self->hsk.reaper->thread = &task;
+	homa_rpc_free(crpc1);
+	EXPECT_EQ(31, self->hsk.dead_skbs);
+	unit_log_clear();
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_NONBLOCKING,
+			0);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_EQ(31, self->hsk.dead_skbs);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->wait_reaps);
+	self->hsk.reaper->thread = NULL;
+}
+TEST_F(homa_incoming, homa_wait_for_message__reaper_thread_not_keeping_up)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+	struct task_struct task;
+	struct homa_rpc *rpc;
+
+	ASSERT_NE(NULL, crpc1);
+	task.pid = 77;
+	self->hsk.reaper->thread = &task;
+	self->homa.reap_limit = 5;
+	self->homa.dead_buffs_limit = 20;
+	homa_rpc_free(crpc1);
+	EXPECT_EQ(31, self->hsk.dead_skbs);
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_NONBLOCKING,
+			0);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_GT(20, self->hsk.dead_skbs);
+	EXPECT_NE(0, homa_metrics_per_cpu()->forced_reaps);
+	EXPECT_EQ(homa_metrics_per_cpu()->forced_reaps,
+		  homa_metrics_per_cpu()->wait_reaps);
+	self->hsk.reaper->thread = NULL;
+}
 TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -2482,46 +2829,83 @@ TEST_F(homa_incoming, homa_choose_interest__empty_list)
 
 	EXPECT_EQ(NULL, result);
 }
+TEST_F(homa_incoming, homa_choose_interest__prefer_local_node)
+{
+	struct homa_interest interest1, interest2;
+	struct homa_interest *result;
+
+	/* Current core is 1 (node 0); core 2 is on node 1. */
+	homa_interest_init(&interest1);
+	interest1.core = 3;
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest1.request_links, interest1.core);
+	homa_interest_init(&interest2);
+	interest2.core = 2;
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest2.request_links, interest2.core);
+
+	mock_ns = 5000;
+	self->homa.busy_ns = 1000;
+	per_cpu(homa_offload_core, 2).last_active = 2000;
+	per_cpu(homa_offload_core, 3).last_active = 2000;
+
+	result = homa_choose_interest(&self->homa,
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links));
+	homa_interest_queue_init(&self->hsk.request_interests);
+	ASSERT_NE(NULL, result);
+	EXPECT_EQ(3, result->core);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->handoffs_alt_thread);
+}
 TEST_F(homa_incoming, homa_choose_interest__find_idle_core)
 {
 	struct homa_interest interest1, interest2, interest3;
+	struct homa_interest *result;
 
 	homa_interest_init(&interest1);
 	interest1.core = 1;
-	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest1.request_links, interest1.core);
 	homa_interest_init(&interest2);
 	interest2.core = 2;
-	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest2.request_links, interest2.core);
 	homa_interest_init(&interest3);
 	interest3.core = 3;
-	list_add_tail(&interest3.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest3.request_links, interest3.core);
 
 	mock_ns = 5000;
 	self->homa.busy_ns = 1000;
 	per_cpu(homa_offload_core, 1).last_active = 4100;
 	per_cpu(homa_offload_core, 2).last_active = 3500;
-	per_cpu(homa_offload_core, 3).last_active = 2000;
+	per_cpu(homa_offload_core, 3).last_active = 4500;
 
-	struct homa_interest *result = homa_choose_interest(&self->homa,
+	result = homa_choose_interest(&self->homa,
 			&self->hsk.request_interests,
 			offsetof(struct homa_interest, request_links));
+	homa_interest_queue_init(&self->hsk.request_interests);
 	ASSERT_NE(NULL, result);
 	EXPECT_EQ(2, result->core);
-	INIT_LIST_HEAD(&self->hsk.request_interests);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_alt_thread);
 }
 TEST_F(homa_incoming, homa_choose_interest__all_cores_busy)
 {
 	struct homa_interest interest1, interest2, interest3;
+	struct homa_interest *result;
 
 	homa_interest_init(&interest1);
 	interest1.core = 1;
-	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest1.request_links, interest1.core);
 	homa_interest_init(&interest2);
 	interest2.core = 2;
-	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest2.request_links, interest2.core);
 	homa_interest_init(&interest3);
 	interest3.core = 3;
-	list_add_tail(&interest3.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest3.request_links, interest3.core);
 
 	mock_ns = 5000;
 	self->homa.busy_ns = 1000;
@@ -2529,12 +2913,72 @@ TEST_F(homa_incoming, homa_choose_interest__all_cores_busy)
 	per_cpu(homa_offload_core, 2).last_active = 4001;
 	per_cpu(homa_offload_core, 3).last_active = 4800;
 
-	struct homa_interest *result = homa_choose_interest(&self->homa,
+	/* Should return the most recent interest on the local node. */
+	result = homa_choose_interest(&self->homa,
 			&self->hsk.request_interests,
 			offsetof(struct homa_interest, request_links));
-	INIT_LIST_HEAD(&self->hsk.request_interests);
+	homa_interest_queue_init(&self->hsk.request_interests);
 	ASSERT_NE(NULL, result);
-	EXPECT_EQ(1, result->core);
+	EXPECT_EQ(3, result->core);
+}
+TEST_F(homa_incoming, homa_choose_interest__scan_limit)
+{
+	struct homa_interest interests[HOMA_INTEREST_SCAN + 1];
+	struct homa_interest *result;
+	int i;
+
+	/* The only idle core is at the end of the local node's list,
+	 * beyond the scan limit.
+	 */
+	for (i = 0; i <= HOMA_INTEREST_SCAN; i++) {
+		homa_interest_init(&interests[i]);
+		interests[i].core = (i == 0) ? 3 : 1;
+		homa_interest_queue_add(&self->hsk.request_interests,
+				&interests[i].request_links,
+				interests[i].core);
+	}
+
+	mock_ns = 5000;
+	self->homa.busy_ns = 1000;
+	per_cpu(homa_offload_core, 1).last_active = 4500;
+	per_cpu(homa_offload_core, 3).last_active = 2000;
+
+	result = homa_choose_interest(&self->homa,
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links));
+	homa_interest_queue_init(&self->hsk.request_interests);
+	EXPECT_EQ(&interests[HOMA_INTEREST_SCAN], result);
+}
+TEST_F(homa_incoming, homa_choose_interest__cost_independent_of_waiters)
+{
+#define NUM_WAITERS 500
+	struct homa_interest *interests;
+	__u64 few, many;
+	int i;
+
+	/* Worst case: every waiting thread is on a busy core. */
+	interests = kmalloc_array(NUM_WAITERS, sizeof(*interests),
+				  GFP_KERNEL);
+	mock_ns = 5000;
+	self->homa.busy_ns = 1000;
+	for (i = 0; i < 4; i++)
+		per_cpu(homa_offload_core, i).last_active = 4500;
+	for (i = 0; i < NUM_WAITERS; i++) {
+		homa_interest_init(&interests[i]);
+		interests[i].core = i % 4;
+		homa_interest_queue_add(&self->hsk.request_interests,
+				&interests[i].request_links,
+				interests[i].core);
+		if (i == 0)
+			few = time_choose(&self->homa,
+					  &self->hsk.request_interests);
+	}
+	many = time_choose(&self->homa, &self->hsk.request_interests);
+	EXPECT_GT(5*few + 1000, many);
+
+	homa_interest_queue_init(&self->hsk.request_interests);
+	kfree(interests);
+#undef NUM_WAITERS
 }
 
 TEST_F(homa_incoming, homa_rpc_handoff__handoff_already_in_progress)
@@ -2627,11 +3071,12 @@ TEST_F(homa_incoming, homa_rpc_handoff__response_interests)
 
 	homa_interest_init(&interest);
 	interest.thread = &mock_task;
-	list_add_tail(&interest.response_links, &self->hsk.response_interests);
+	homa_interest_queue_add(&self->hsk.response_interests,
+			&interest.response_links, interest.core);
 	homa_rpc_handoff(crpc);
 	EXPECT_EQ(crpc, (struct homa_rpc *)
 			atomic_long_read(&interest.ready_rpc));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.response_interests));
+	EXPECT_EQ(0, unit_interest_queue_length(&self->hsk.response_interests));
 	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
@@ -2658,11 +3103,12 @@ TEST_F(homa_incoming, homa_rpc_handoff__request_interests)
 	unit_log_clear();
 	homa_interest_init(&interest);
 	interest.thread = &mock_task;
-	list_add_tail(&interest.request_links, &self->hsk.request_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest.request_links, interest.core);
 	homa_rpc_handoff(srpc);
 	EXPECT_EQ(srpc, (struct homa_rpc *)
 			atomic_long_read(&interest.ready_rpc));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.request_interests));
+	EXPECT_EQ(0, unit_interest_queue_length(&self->hsk.request_interests));
 	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
 	atomic_andnot(RPC_HANDING_OFF, &srpc->flags);
 }
@@ -2679,6 +3125,52 @@ TEST_F(homa_incoming, homa_rpc_handoff__queue_on_ready_requests)
 	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
 	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
 }
+TEST_F(homa_incoming, homa_rpc_handoff__queue_on_accept_queue)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 20000, 100);
+	struct homa_interest interest;
+
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+	self->hsk.accept_backlog = 2;
+
+	/* Waiting receivers don't get requests held for homa_accept. */
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest.request_links, interest.core);
+	homa_rpc_handoff(srpc);
+	list_del(&interest.request_links);
+	EXPECT_EQ(NULL, (struct homa_rpc *)
+			atomic_long_read(&interest.ready_rpc));
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.accept_queue));
+	EXPECT_EQ(1, self->hsk.accept_queue_len);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->requests_accept_queued);
+
+	homa_rpc_free(srpc);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.accept_queue));
+	EXPECT_EQ(0, self->hsk.accept_queue_len);
+}
+TEST_F(homa_incoming, homa_rpc_handoff__accept_queue_full)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			1, 20000, 100);
+
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+	self->hsk.accept_backlog = 1;
+	self->hsk.accept_queue_len = 1;
+
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.accept_queue));
+	self->hsk.accept_queue_len = 0;
+}
 TEST_F(homa_incoming, homa_rpc_handoff__detach_interest)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2694,10 +3186,12 @@ TEST_F(homa_incoming, homa_rpc_handoff__detach_interest)
 	interest.thread = &mock_task;
 	interest.reg_rpc = crpc;
 	crpc->interest = &interest;
-	list_add_tail(&interest.response_links, &self->hsk.response_interests);
-	list_add_tail(&interest.request_links, &self->hsk.request_interests);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.response_interests));
-	EXPECT_EQ(1, unit_list_length(&self->hsk.request_interests));
+	homa_interest_queue_add(&self->hsk.response_interests,
+			&interest.response_links, interest.core);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest.request_links, interest.core);
+	EXPECT_EQ(1, unit_interest_queue_length(&self->hsk.response_interests));
+	EXPECT_EQ(1, unit_interest_queue_length(&self->hsk.request_interests));
 
 	homa_rpc_handoff(crpc);
 	crpc->interest = NULL;
@@ -2705,8 +3199,8 @@ TEST_F(homa_incoming, homa_rpc_handoff__detach_interest)
 			atomic_long_read(&interest.ready_rpc));
 	EXPECT_EQ(NULL, interest.reg_rpc);
 	EXPECT_EQ(NULL, crpc->interest);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.response_interests));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.request_interests));
+	EXPECT_EQ(0, unit_interest_queue_length(&self->hsk.response_interests));
+	EXPECT_EQ(0, unit_interest_queue_length(&self->hsk.request_interests));
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
 TEST_F(homa_incoming, homa_rpc_handoff__update_last_app_active)
@@ -2733,6 +3227,95 @@ TEST_F(homa_incoming, homa_rpc_handoff__update_last_app_active)
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
 
+TEST_F(homa_incoming, homa_poll_budget__fixed)
+{
+	self->homa.poll_usecs = 30;
+	EXPECT_EQ(30000, homa_poll_budget(&self->hsk, 1000));
+	self->hsk.poll_usecs = 0;
+	EXPECT_EQ(0, homa_poll_budget(&self->hsk, 1000));
+	self->hsk.poll_usecs = 5;
+	EXPECT_EQ(5000, homa_poll_budget(&self->hsk, 1000));
+}
+TEST_F(homa_incoming, homa_poll_budget__adaptive)
+{
+	self->hsk.poll_usecs = 10;
+	self->hsk.poll_adaptive = 1;
+
+	/* No history yet. */
+	EXPECT_EQ(10000, homa_poll_budget(&self->hsk, 50000));
+
+	self->hsk.last_arrival = 100000;
+	self->hsk.avg_interarrival = 20000;
+	EXPECT_EQ(0, homa_poll_budget(&self->hsk, 105000));
+	EXPECT_EQ(10000, homa_poll_budget(&self->hsk, 110000));
+	EXPECT_EQ(10000, homa_poll_budget(&self->hsk, 130000));
+	EXPECT_EQ(0, homa_poll_budget(&self->hsk, 130001));
+}
+TEST_F(homa_incoming, homa_poll_record_arrival)
+{
+	self->hsk.poll_usecs = 10;
+	mock_ns_tick = 0;
+	mock_ns = 5000;
+	homa_poll_record_arrival(&self->hsk);
+	EXPECT_EQ(5000, self->hsk.last_arrival);
+	EXPECT_EQ(0, self->hsk.avg_interarrival);
+
+	mock_ns = 13000;
+	homa_poll_record_arrival(&self->hsk);
+	EXPECT_EQ(13000, self->hsk.last_arrival);
+	EXPECT_EQ(2000, self->hsk.avg_interarrival);
+
+	/* Long gaps are limited to 4x the poll budget. */
+	mock_ns = 1000000;
+	homa_poll_record_arrival(&self->hsk);
+	EXPECT_EQ(11500, self->hsk.avg_interarrival);
+}
+TEST_F(homa_incoming, homa_sock_wakeup__not_deferred)
+{
+	unit_log_clear();
+	homa_sock_wakeup(&self->hsk);
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sock_wakeups);
+	EXPECT_EQ(0, self->hsk.wakeup_pending);
+}
+TEST_F(homa_incoming, homa_sock_wakeup__deferred_and_coalesced)
+{
+	struct homa_offload_core *offload_core = &per_cpu(homa_offload_core,
+			raw_smp_processor_id());
+
+	offload_core->defer_wakeups = 1;
+	unit_log_clear();
+	homa_sock_wakeup(&self->hsk);
+	homa_sock_wakeup(&self->hsk2);
+	homa_sock_wakeup(&self->hsk);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(2, offload_core->num_wakeups);
+	EXPECT_EQ(1, self->hsk.wakeup_pending);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sock_wakeups_coalesced);
+
+	homa_sock_flush_wakeups();
+	EXPECT_STREQ("sk->sk_data_ready invoked; sk->sk_data_ready invoked",
+		     unit_log_get());
+	EXPECT_EQ(2, homa_metrics_per_cpu()->sock_wakeups);
+	EXPECT_EQ(0, self->hsk.wakeup_pending);
+	EXPECT_EQ(0, offload_core->num_wakeups);
+	EXPECT_EQ(0, offload_core->defer_wakeups);
+}
+TEST_F(homa_incoming, homa_sock_wakeup__too_many_sockets)
+{
+	struct homa_offload_core *offload_core = &per_cpu(homa_offload_core,
+			raw_smp_processor_id());
+
+	offload_core->defer_wakeups = 1;
+	offload_core->num_wakeups = HOMA_MAX_DEFERRED_WAKEUPS;
+	unit_log_clear();
+	homa_sock_wakeup(&self->hsk);
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(0, self->hsk.wakeup_pending);
+	offload_core->num_wakeups = 0;
+	homa_sock_flush_wakeups();
+}
+
 TEST_F(homa_incoming, homa_incoming_sysctl_changed__grant_nonfifo)
 {
 	self->homa.fifo_grant_increment = 10000;
@@ -221,6 +221,69 @@ TEST_F(homa_offload, homa_gso_segment_set_ip_ids)
 	kfree_skb(segs);
 }
 
+TEST_F(homa_offload, homa_gro_early_demux__basics)
+{
+	struct sk_buff *skb;
+
+	self->header.common.dport = htons(99);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	homa_gro_early_demux(&self->homa, skb);
+	EXPECT_EQ(&self->hsk.sock, skb->sk);
+	EXPECT_EQ(sock_pfree, skb->destructor);
+	EXPECT_EQ(3, refcount_read(&self->hsk.sock.sk_refcnt));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->early_demux_hits);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->early_demux_misses);
+
+	/* Second call does nothing: socket already attached. */
+	homa_gro_early_demux(&self->homa, skb);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->early_demux_hits);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_gro_early_demux__no_socket)
+{
+	struct sk_buff *skb;
+
+	self->header.common.dport = htons(88);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	homa_gro_early_demux(&self->homa, skb);
+	EXPECT_EQ(NULL, skb->sk);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->early_demux_hits);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->early_demux_misses);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_gro_early_demux__socket_shutdown)
+{
+	struct sk_buff *skb;
+
+	self->header.common.dport = htons(99);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	self->hsk.shutdown = true;
+	homa_gro_early_demux(&self->homa, skb);
+	self->hsk.shutdown = false;
+	EXPECT_EQ(NULL, skb->sk);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->early_demux_misses);
+	kfree_skb(skb);
+}
+
+TEST_F(homa_offload, homa_gro_receive__early_demux)
+{
+	struct sk_buff *skb, *skb2;
+
+	self->header.common.dport = htons(99);
+	self->homa.gro_policy = 0;
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	cur_offload_core->held_skb = NULL;
+	homa_gro_receive(&self->empty_list, skb);
+	EXPECT_EQ(NULL, skb->sk);
+
+	self->homa.gro_policy = HOMA_GRO_EARLY_DEMUX;
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	cur_offload_core->held_skb = NULL;
+	homa_gro_receive(&self->empty_list, skb2);
+	EXPECT_EQ(&self->hsk.sock, skb2->sk);
+	kfree_skb(skb);
+	kfree_skb(skb2);
+}
 TEST_F(homa_offload, homa_gro_receive__update_offset_from_sequence)
 {
 	struct sk_buff *skb, *skb2;
@@ -623,6 +686,23 @@ TEST_F(homa_offload, homa_gro_complete__clear_held_skb)
 	homa_gro_complete(self->skb, 0);
 	EXPECT_EQ(NULL, offload_core->held_skb);
 }
+TEST_F(homa_offload, homa_gro_complete__busy_polling)
+{
+	struct homa_offload_core *offload_core = &per_cpu(homa_offload_core,
+			5);
+
+	self->homa.gro_policy = HOMA_GRO_NEXT;
+	mock_set_core(5);
+	self->skb->hash = 0;
+	offload_core->busy_polling = 1;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, self->skb->hash);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->gro_busy_poll_local);
+
+	offload_core->busy_polling = 0;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(6, self->skb->hash - 32);
+}
 TEST_F(homa_offload, homa_gro_complete__GRO_IDLE)
 {
 	self->homa.gro_policy = HOMA_GRO_IDLE;
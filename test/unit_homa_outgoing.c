@@ -33,6 +33,43 @@ void lock_free_hook(char *id)
 	}
 }
 
+/**
+ * time_send_setup() - Measure the per-request cost of setting up an
+ * outgoing message on a socket: creating the client RPC (which finds its
+ * peer) and filling in a one-packet request (which finds its geometry).
+ * @hsk:     Socket on which to create RPCs.
+ * @dest:    Destination for the requests.
+ * Return:   The smallest number of cycles measured for a batch of 100
+ *           requests (the minimum filters out noise).
+ */
+static __u64 time_send_setup(struct homa_sock *hsk,
+			     union sockaddr_in_union *dest)
+{
+	__u64 start, elapsed, best = ~0ULL;
+	struct homa_rpc *crpc;
+	int i, j;
+
+	mock_cycles = ~0;
+	for (i = 0; i < 10; i++) {
+		start = mock_get_cycles();
+		for (j = 0; j < 100; j++) {
+			crpc = homa_rpc_new_client(hsk, dest);
+			homa_message_out_fill(crpc,
+					unit_iov_iter((void *) 1000, 100), 0);
+			homa_rpc_free(crpc);
+			homa_rpc_unlock(crpc);
+		}
+		elapsed = mock_get_cycles() - start;
+		if (elapsed < best)
+			best = elapsed;
+		while (homa_rpc_reap(hsk, 1000) != 0)
+			;
+		unit_log_clear();
+	}
+	mock_cycles = 0;
+	return best;
+}
+
 FIXTURE(homa_outgoing) {
 	struct in6_addr client_ip[1];
 	int client_port;
@@ -44,6 +81,7 @@ FIXTURE(homa_outgoing) {
 	struct homa_sock hsk;
 	union sockaddr_in_union server_addr;
 	struct homa_peer *peer;
+	struct homa_pacer *pacer;
 };
 FIXTURE_SETUP(homa_outgoing)
 {
@@ -54,8 +92,9 @@ FIXTURE_SETUP(homa_outgoing)
 	self->client_id = 1234;
 	self->server_id = 1235;
 	homa_init(&self->homa);
+	self->pacer = self->homa.default_pacer;
 	mock_ns = 10000;
-	atomic64_set(&self->homa.link_idle_time, 10000);
+	atomic64_set(&self->pacer->link_idle_time, 10000);
 	self->homa.ns_per_mbyte = 1000000;
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	self->homa.unsched_bytes = 10000;
@@ -92,6 +131,28 @@ TEST_F(homa_outgoing, set_priority__priority_mapping)
 	EXPECT_STREQ("7 3", mock_xmit_prios);
 }
 
+TEST_F(homa_outgoing, homa_message_out_init__default_pacer)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	homa_rpc_unlock(crpc);
+	homa_message_out_init(crpc, 10000);
+	EXPECT_EQ(self->pacer, crpc->msgout.pacer);
+}
+TEST_F(homa_outgoing, homa_message_out_init__pacer_for_device)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	homa_rpc_unlock(crpc);
+	mock_net_device.ifindex = 3;
+	homa_message_out_init(crpc, 10000);
+	ASSERT_NE(NULL, crpc->msgout.pacer);
+	EXPECT_NE(self->pacer, crpc->msgout.pacer);
+	EXPECT_EQ(3, crpc->msgout.pacer->ifindex);
+}
+
 TEST_F(homa_outgoing, homa_fill_data_interleaved)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -132,6 +193,62 @@ TEST_F(homa_outgoing, homa_fill_data_interleaved__error_copying_data)
 	EXPECT_EQ(EFAULT, -PTR_ERR(skb));
 }
 
+TEST_F(homa_outgoing, homa_fill_data_interleaved__zerocopy)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct iov_iter *iter = unit_iov_iter((void *)1000, 5000);
+	struct ubuf_info *uarg;
+	struct sk_buff *skb;
+	char buffer[1000];
+
+	homa_rpc_unlock(crpc);
+	homa_message_out_init(crpc, 10000);
+	uarg = msg_zerocopy_realloc(&self->hsk.sock, 5000, NULL);
+	crpc->msgout.uarg = uarg;
+
+	unit_log_clear();
+	skb = homa_new_data_packet(crpc, iter, 10000, 5000, 1500);
+	EXPECT_STREQ("iov_iter_get_pages2 1500 bytes at 1000; "
+			"iov_iter_get_pages2 1500 bytes at 2500; "
+			"iov_iter_get_pages2 1500 bytes at 4000; "
+			"iov_iter_get_pages2 500 bytes at 5500", unit_log_get());
+	EXPECT_STREQ("DATA from 0.0.0.0:40000, dport 99, id 2, message_length 10000, offset 10000, data_length 1500, incoming 10000, extra segs 1500@11500 1500@13000 500@14500",
+			homa_print_packet(skb, buffer, sizeof(buffer)));
+	EXPECT_EQ(uarg, skb_zcopy(skb));
+	crpc->msgout.uarg = NULL;
+	net_zcopy_put(uarg);
+
+	unit_log_clear();
+	kfree_skb(skb);
+	EXPECT_STREQ("zerocopy notification, zerocopy", unit_log_get());
+}
+
+TEST_F(homa_outgoing, homa_fill_data_interleaved__zerocopy_frags_full)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct iov_iter *iter = unit_iov_iter((void *)0, 5000);
+	struct ubuf_info *uarg;
+	struct sk_buff *skb;
+
+	homa_rpc_unlock(crpc);
+	homa_message_out_init(crpc, 10000);
+	uarg = msg_zerocopy_realloc(&self->hsk.sock, 5000, NULL);
+	crpc->msgout.uarg = uarg;
+	mock_max_skb_frags = 1;
+
+	unit_log_clear();
+	skb = homa_new_data_packet(crpc, iter, 10000, 5000, 1500);
+	EXPECT_SUBSTR("iov_iter_get_pages2 1500 bytes at 0; "
+			"iov_iter_revert 1500; "
+			"_copy_from_iter 1500 bytes at 0", unit_log_get());
+	EXPECT_EQ(NULL, skb_zcopy(skb));
+	crpc->msgout.uarg = NULL;
+	net_zcopy_put(uarg);
+	kfree_skb(skb);
+}
+
 TEST_F(homa_outgoing, homa_new_data_packet__one_segment)
 {
 	struct iov_iter *iter = unit_iov_iter((void *) 1000, 5000);
@@ -286,6 +403,34 @@ TEST_F(homa_outgoing, homa_new_data_packet__gso_force_software)
 	kfree_skb(skb);
 }
 
+TEST_F(homa_outgoing, homa_new_data_packet__zerocopy_falls_back_to_copy)
+{
+	struct iov_iter *iter = unit_iov_iter((void *)4000, 5000);
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct ubuf_info *uarg;
+	struct sk_buff *skb;
+
+	homa_rpc_unlock(crpc);
+	homa_message_out_init(crpc, 500);
+	uarg = msg_zerocopy_realloc(&self->hsk.sock, 500, NULL);
+	crpc->msgout.uarg = uarg;
+	mock_max_skb_frags = 1;
+
+	unit_log_clear();
+	skb = homa_new_data_packet(crpc, iter, 0, 500, 2000);
+	EXPECT_STREQ("iov_iter_get_pages2 96 bytes at 4000; "
+			"iov_iter_revert 96; "
+			"_copy_from_iter 500 bytes at 4000", unit_log_get());
+	EXPECT_EQ(NULL, skb_zcopy(skb));
+	EXPECT_EQ(4500, iter->count);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->zerocopy_fallbacks);
+	EXPECT_EQ(0, uarg_to_msgzc(uarg)->zerocopy);
+	crpc->msgout.uarg = NULL;
+	net_zcopy_put(uarg);
+	kfree_skb(skb);
+}
+
 TEST_F(homa_outgoing, homa_message_out_fill__basics)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -431,6 +576,76 @@ TEST_F(homa_outgoing, homa_message_out_fill__gso_limit_less_than_mtu)
 	homa_rpc_unlock(crpc);
 	EXPECT_SUBSTR("max_seg_data 1400, max_gso_data 1400;", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_message_out_fill__cached_geometry)
+{
+	struct homa_rpc *crpc1, *crpc2, *crpc3;
+	struct dst_entry *dst;
+
+	crpc1 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc1));
+	self->hsk.peer = crpc1->peer;
+	ASSERT_EQ(0, -homa_message_out_fill(crpc1,
+			unit_iov_iter((void *) 1000, 3000), 0));
+	homa_rpc_unlock(crpc1);
+	EXPECT_SUBSTR("max_seg_data 1400,", unit_log_get());
+	EXPECT_EQ(crpc1->peer->dst, self->hsk.dst);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->geometry_cache_hits);
+
+	/* Cached geometry is used as long as the dst is current. */
+	mock_mtu -= 100;
+	unit_log_clear();
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc2));
+	EXPECT_EQ(crpc1->peer, crpc2->peer);
+	ASSERT_EQ(0, -homa_message_out_fill(crpc2,
+			unit_iov_iter((void *) 1000, 3000), 0));
+	homa_rpc_unlock(crpc2);
+	EXPECT_SUBSTR("max_seg_data 1400,", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->geometry_cache_hits);
+
+	/* Once the dst is obsolete, the geometry is recomputed. */
+	dst = crpc1->peer->dst;
+	dst->obsolete = 1;
+	unit_log_clear();
+	crpc3 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc3));
+	ASSERT_EQ(0, -homa_message_out_fill(crpc3,
+			unit_iov_iter((void *) 1000, 3000), 0));
+	homa_rpc_unlock(crpc3);
+	EXPECT_SUBSTR("max_seg_data 1300,", unit_log_get());
+	EXPECT_NE(dst, self->hsk.dst);
+	EXPECT_EQ(crpc1->peer->dst, self->hsk.dst);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->geometry_cache_hits);
+}
+TEST_F(homa_outgoing, homa_message_out_fill__geometry_not_cached_for_other_peers)
+{
+	struct homa_rpc *crpc;
+
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 1000, 3000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(NULL, self->hsk.dst);
+}
+TEST_F(homa_outgoing, homa_message_out_fill__cached_send_setup_cost)
+{
+	__u64 cached, uncached;
+
+	/* This is a microbenchmark comparing the cost of setting up a
+	 * request on a connected socket (peer and geometry cached) with
+	 * the cost when nothing is cached (peer lookup plus geometry
+	 * computation for every request).
+	 */
+	self->hsk.peer = NULL;
+	uncached = time_send_setup(&self->hsk, &self->server_addr);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->geometry_cache_hits);
+
+	self->hsk.peer = self->peer;
+	cached = time_send_setup(&self->hsk, &self->server_addr);
+	EXPECT_EQ(999, homa_metrics_per_cpu()->geometry_cache_hits);
+	EXPECT_GT(uncached + 1000, cached);
+}
 TEST_F(homa_outgoing, homa_message_out_fill__include_acks)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -477,6 +692,30 @@ TEST_F(homa_outgoing, homa_message_out_fill__multiple_segs_per_skbuff)
 			unit_log_get());
 	EXPECT_EQ(4200, homa_get_skb_info(crpc->msgout.packets)->data_bytes);
 }
+TEST_F(homa_outgoing, homa_message_out_fill__zerocopy_limits_gso_size)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct ubuf_info *uarg;
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_net_device.gso_max_size = 10000;
+	mock_max_skb_frags = 5;
+	uarg = msg_zerocopy_realloc(&self->hsk.sock, 5000, NULL);
+	crpc->msgout.uarg = uarg;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 1000, 5000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(NULL, crpc->msgout.uarg);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->zerocopy_msgs);
+	unit_log_clear();
+	unit_log_filled_skbs(crpc->msgout.packets, 0);
+	EXPECT_STREQ("DATA 1400@0 1400@1400; DATA 1400@2800 800@4200",
+			unit_log_get());
+	EXPECT_EQ(uarg, skb_zcopy(crpc->msgout.packets));
+	net_zcopy_put(uarg);
+}
 TEST_F(homa_outgoing, homa_message_out_fill__rpc_freed_during_copy)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -715,7 +954,7 @@ TEST_F(homa_outgoing, homa_xmit_data__below_throttle_min)
 			self->server_port, self->client_id, 200, 1000);
 
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->pacer->link_idle_time, 11000);
 	self->homa.max_nic_queue_ns = 500;
 	self->homa.throttle_min_bytes = 250;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
@@ -735,7 +974,7 @@ TEST_F(homa_outgoing, homa_xmit_data__force)
 			self->server_port, self->client_id+2, 5000, 1000);
 
 	/* First, get an RPC on the throttled list. */
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->pacer->link_idle_time, 11000);
 	self->homa.max_nic_queue_ns = 3000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	homa_xmit_data(crpc1, false);
@@ -746,8 +985,7 @@ TEST_F(homa_outgoing, homa_xmit_data__force)
 	/* Now force transmission. */
 	unit_log_clear();
 	homa_xmit_data(crpc2, true);
-	EXPECT_STREQ("xmit DATA 1400@0; wake_up_process pid -1",
-			unit_log_get());
+	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 1234, next_offset 2800; "
@@ -760,14 +998,13 @@ TEST_F(homa_outgoing, homa_xmit_data__throttle)
 			self->server_port, self->client_id, 6000, 1000);
 
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 11000);
+	atomic64_set(&self->pacer->link_idle_time, 11000);
 	self->homa.max_nic_queue_ns = 3000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 
 	homa_xmit_data(crpc, false);
 	EXPECT_STREQ("xmit DATA 1400@0; "
-			"xmit DATA 1400@1400; "
-			"wake_up_process pid -1", unit_log_get());
+			"xmit DATA 1400@1400", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 1234, next_offset 2800", unit_log_get());
@@ -1000,6 +1237,231 @@ TEST_F(homa_outgoing, homa_outgoing_sysctl_changed)
 	EXPECT_EQ(202000, self->homa.ns_per_mbyte);
 }
 
+TEST_F(homa_outgoing, homa_pacer_start__cant_create_thread)
+{
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 3;
+	mock_kthread_create_errors = 1;
+	pacer = homa_pacer_get(&self->homa, &mock_net_device);
+	ASSERT_NE(NULL, pacer);
+	EXPECT_EQ(NULL, pacer->kthread);
+	EXPECT_SUBSTR("couldn't create homa pacer thread for device 3",
+		      mock_printk_output);
+}
+
+TEST_F(homa_outgoing, homa_pacer_put__not_last_reference)
+{
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 3;
+	pacer = homa_pacer_get(&self->homa, &mock_net_device);
+	EXPECT_EQ(2, refcount_read(&pacer->refs));
+	unit_log_clear();
+	homa_pacer_put(pacer);
+	EXPECT_EQ(1, refcount_read(&pacer->refs));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(2, unit_list_length(&self->homa.pacers));
+}
+TEST_F(homa_outgoing, homa_pacer_put__free_pacer)
+{
+	struct netdev_notifier_info info = {.dev = &mock_net_device};
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 3;
+	pacer = homa_pacer_get(&self->homa, &mock_net_device);
+	homa_pacer_netdev_event(&self->homa.pacer_notifier,
+				NETDEV_UNREGISTER, &info);
+	EXPECT_EQ(1, refcount_read(&pacer->refs));
+	EXPECT_EQ(1, unit_list_length(&self->homa.pacers));
+	unit_log_clear();
+	homa_pacer_put(pacer);
+	EXPECT_STREQ("queue_work", unit_log_get());
+	EXPECT_TRUE(list_empty(&self->homa.dead_pacers));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->pacers_freed);
+}
+TEST_F(homa_outgoing, homa_pacer_free_work__claimed_by_destroy)
+{
+	struct homa_pacer *pacer;
+
+	/* The pacer isn't in dead_pacers, as if homa_pacers_destroy had
+	 * already claimed it.
+	 */
+	pacer = homa_pacer_new(&self->homa, &mock_net_device, GFP_KERNEL);
+	pacer->free_work.func(&pacer->free_work);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->pacers_freed);
+
+	/* The pacer is freed by homa_pacers_destroy (the test framework
+	 * will complain if it isn't).
+	 */
+	list_add_tail(&pacer->dead_links, &self->homa.dead_pacers);
+}
+
+TEST_F(homa_outgoing, homa_pacer_new__basics)
+{
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 5;
+	init_net.net_cookie = 44;
+	pacer = homa_pacer_new(&self->homa, &mock_net_device, GFP_KERNEL);
+	init_net.net_cookie = 0;
+
+	ASSERT_NE(NULL, pacer);
+	EXPECT_EQ(5, pacer->ifindex);
+	EXPECT_EQ(44, pacer->net_cookie);
+	EXPECT_EQ(1, refcount_read(&pacer->refs));
+	EXPECT_TRUE(list_empty(&pacer->dead_links));
+	EXPECT_EQ(&self->homa, pacer->homa);
+	EXPECT_EQ(1, pacer->fifo_count);
+	EXPECT_TRUE(RB_EMPTY_ROOT(&pacer->throttled_rpcs.rb_root));
+	EXPECT_TRUE(RB_EMPTY_ROOT(&pacer->throttled_by_age.rb_root));
+	EXPECT_EQ(NULL, pacer->kthread);
+	EXPECT_EQ(&homa_pacer_hrtimer, pacer->hrtimer.function);
+	kfree(pacer);
+}
+TEST_F(homa_outgoing, homa_pacer_new__no_device)
+{
+	struct homa_pacer *pacer = homa_pacer_new(&self->homa, NULL,
+						  GFP_KERNEL);
+
+	ASSERT_NE(NULL, pacer);
+	EXPECT_EQ(0, pacer->ifindex);
+	EXPECT_EQ(0, pacer->net_cookie);
+	kfree(pacer);
+}
+
+TEST_F(homa_outgoing, homa_pacer_get__null_device)
+{
+	int refs = refcount_read(&self->pacer->refs);
+
+	EXPECT_EQ(self->pacer, homa_pacer_get(&self->homa, NULL));
+	EXPECT_EQ(refs + 1, refcount_read(&self->pacer->refs));
+}
+TEST_F(homa_outgoing, homa_pacer_get__create_pacer)
+{
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 3;
+	pacer = homa_pacer_get(&self->homa, &mock_net_device);
+	ASSERT_NE(NULL, pacer);
+	EXPECT_NE(self->pacer, pacer);
+	EXPECT_EQ(3, pacer->ifindex);
+	EXPECT_STREQ("queue_work; wake_up_process pid -1", unit_log_get());
+	EXPECT_EQ(2, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->pacers_created);
+}
+TEST_F(homa_outgoing, homa_pacer_get__existing_pacer)
+{
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 3;
+	pacer = homa_pacer_get(&self->homa, &mock_net_device);
+	unit_log_clear();
+	EXPECT_EQ(pacer, homa_pacer_get(&self->homa, &mock_net_device));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(2, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->pacers_created);
+	EXPECT_EQ(3, refcount_read(&pacer->refs));
+}
+TEST_F(homa_outgoing, homa_pacer_get__device_unregistering)
+{
+	mock_net_device.ifindex = 3;
+	mock_net_device.reg_state = NETREG_UNREGISTERING;
+	EXPECT_EQ(self->pacer, homa_pacer_get(&self->homa, &mock_net_device));
+	EXPECT_EQ(1, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->pacers_created);
+}
+TEST_F(homa_outgoing, homa_pacer_get__same_ifindex_different_namespace)
+{
+	struct homa_pacer *pacer1, *pacer2;
+	struct net other_net;
+
+	mock_net_device.ifindex = 3;
+	pacer1 = homa_pacer_get(&self->homa, &mock_net_device);
+	memset(&other_net, 0, sizeof(other_net));
+	other_net.net_cookie = 99;
+	dev_net_set(&mock_net_device, &other_net);
+	pacer2 = homa_pacer_get(&self->homa, &mock_net_device);
+	EXPECT_NE(pacer1, pacer2);
+	EXPECT_NE(self->pacer, pacer2);
+	EXPECT_EQ(3, pacer2->ifindex);
+	EXPECT_EQ(99, pacer2->net_cookie);
+	EXPECT_EQ(pacer2, homa_pacer_get(&self->homa, &mock_net_device));
+	EXPECT_EQ(3, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(2, homa_metrics_per_cpu()->pacers_created);
+}
+TEST_F(homa_outgoing, homa_pacer_get__cant_allocate_pacer)
+{
+	mock_net_device.ifindex = 3;
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(self->pacer, homa_pacer_get(&self->homa, &mock_net_device));
+	EXPECT_EQ(1, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->pacers_created);
+}
+
+TEST_F(homa_outgoing, homa_pacer_netdev_event__ignore_other_events)
+{
+	struct netdev_notifier_info info = {.dev = &mock_net_device};
+	struct homa_pacer *pacer;
+
+	mock_net_device.ifindex = 3;
+	pacer = homa_pacer_get(&self->homa, &mock_net_device);
+	EXPECT_EQ(NOTIFY_DONE, homa_pacer_netdev_event(
+			&self->homa.pacer_notifier, NETDEV_DOWN, &info));
+	EXPECT_EQ(2, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(2, refcount_read(&pacer->refs));
+}
+TEST_F(homa_outgoing, homa_pacer_netdev_event__rpc_keeps_pacer_alive)
+{
+	struct netdev_notifier_info info = {.dev = &mock_net_device};
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	struct homa_pacer *pacer;
+
+	homa_rpc_unlock(crpc);
+	mock_net_device.ifindex = 3;
+	homa_message_out_init(crpc, 10000);
+	pacer = crpc->msgout.pacer;
+	EXPECT_EQ(3, pacer->ifindex);
+
+	EXPECT_EQ(NOTIFY_DONE, homa_pacer_netdev_event(
+			&self->homa.pacer_notifier, NETDEV_UNREGISTER, &info));
+	EXPECT_EQ(1, unit_list_length(&self->homa.pacers));
+	EXPECT_EQ(1, refcount_read(&pacer->refs));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->pacers_freed);
+
+	/* A new lookup creates a new pacer. */
+	EXPECT_NE(pacer, homa_pacer_get(&self->homa, &mock_net_device));
+
+	homa_rpc_free(crpc);
+	homa_rpc_reap(&self->hsk, 1000);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->pacers_freed);
+}
+TEST_F(homa_outgoing, homa_pacer_netdev_event__different_namespace)
+{
+	struct netdev_notifier_info info = {.dev = &mock_net_device};
+	struct net other_net;
+
+	mock_net_device.ifindex = 3;
+	homa_pacer_get(&self->homa, &mock_net_device);
+	memset(&other_net, 0, sizeof(other_net));
+	other_net.net_cookie = 99;
+	dev_net_set(&mock_net_device, &other_net);
+	homa_pacer_netdev_event(&self->homa.pacer_notifier,
+				NETDEV_UNREGISTER, &info);
+	EXPECT_EQ(2, unit_list_length(&self->homa.pacers));
+}
+TEST_F(homa_outgoing, homa_pacer_netdev_event__never_remove_default_pacer)
+{
+	struct netdev_notifier_info info = {.dev = &mock_net_device};
+
+	homa_pacer_netdev_event(&self->homa.pacer_notifier,
+				NETDEV_UNREGISTER, &info);
+	EXPECT_EQ(1, unit_list_length(&self->homa.pacers));
+}
+
+/* Don't know how to unit test homa_pacers_destroy... */
+
 TEST_F(homa_outgoing, homa_check_nic_queue__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1008,13 +1470,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__basics)
 
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->pacer->link_idle_time, 9000);
 	mock_ns = 8000;
 	self->homa.max_nic_queue_ns = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(self->pacer, crpc->msgout.packets,
 			false));
-	EXPECT_EQ(9500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(9500, atomic64_read(&self->pacer->link_idle_time));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_full)
 {
@@ -1024,13 +1486,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_full)
 
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->pacer->link_idle_time, 9000);
 	mock_ns = 7999;
 	self->homa.max_nic_queue_ns = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(0, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(0, homa_check_nic_queue(self->pacer, crpc->msgout.packets,
 			false));
-	EXPECT_EQ(9000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(9000, atomic64_read(&self->pacer->link_idle_time));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__queue_full_but_force)
 {
@@ -1040,13 +1502,13 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_full_but_force)
 
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->pacer->link_idle_time, 9000);
 	mock_ns = 7999;
 	self->homa.max_nic_queue_ns = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(self->pacer, crpc->msgout.packets,
 			true));
-	EXPECT_EQ(9500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(9500, atomic64_read(&self->pacer->link_idle_time));
 }
 TEST_F(homa_outgoing, homa_check_nic_queue__pacer_metrics)
 {
@@ -1057,14 +1519,14 @@ TEST_F(homa_outgoing, homa_check_nic_queue__pacer_metrics)
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	homa_add_to_throttled(crpc);
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
-	self->homa.pacer_wake_time = 9800;
+	atomic64_set(&self->pacer->link_idle_time, 9000);
+	self->pacer->wake_time = 9800;
 	mock_ns = 10000;
 	self->homa.max_nic_queue_ns = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(self->pacer, crpc->msgout.packets,
 			true));
-	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(10500, atomic64_read(&self->pacer->link_idle_time));
 	EXPECT_EQ(500, homa_metrics_per_cpu()->pacer_bytes);
 	EXPECT_EQ(200, homa_metrics_per_cpu()->pacer_lost_ns);
 }
@@ -1076,17 +1538,48 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_empty)
 
 	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
 	unit_log_clear();
-	atomic64_set(&self->homa.link_idle_time, 9000);
+	atomic64_set(&self->pacer->link_idle_time, 9000);
 	mock_ns = 10000;
 	self->homa.max_nic_queue_ns = 1000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
-	EXPECT_EQ(1, homa_check_nic_queue(&self->homa, crpc->msgout.packets,
+	EXPECT_EQ(1, homa_check_nic_queue(self->pacer, crpc->msgout.packets,
 			true));
-	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(10500, atomic64_read(&self->pacer->link_idle_time));
 }
 
 /* Don't know how to unit test homa_pacer_main... */
 
+TEST_F(homa_outgoing, homa_pacer_arm_timer__queue_short_enough)
+{
+	atomic64_set(&self->pacer->link_idle_time, 11000);
+	mock_ns = 10000;
+	self->homa.max_nic_queue_ns = 1000;
+	self->pacer->wake_time = 9000;
+	EXPECT_FALSE(homa_pacer_arm_timer(self->pacer));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(9000, self->pacer->wake_time);
+}
+TEST_F(homa_outgoing, homa_pacer_arm_timer__arm_timer)
+{
+	atomic64_set(&self->pacer->link_idle_time, 13500);
+	mock_ns = 10000;
+	self->homa.max_nic_queue_ns = 1000;
+	EXPECT_TRUE(homa_pacer_arm_timer(self->pacer));
+	EXPECT_STREQ("hrtimer_start 2500 ns", unit_log_get());
+	EXPECT_EQ(12500, self->pacer->wake_time);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->pacer_timer_sleeps);
+}
+
+TEST_F(homa_outgoing, homa_pacer_hrtimer)
+{
+	mock_task.pid = 55;
+	self->pacer->kthread = &mock_task;
+	EXPECT_EQ(HRTIMER_NORESTART, homa_pacer_hrtimer(&self->pacer->hrtimer));
+	EXPECT_STREQ("wake_up_process pid 55", unit_log_get());
+	self->pacer->kthread = NULL;
+}
+
+
 TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -1108,7 +1601,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 	self->homa.max_nic_queue_ns = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 	unit_log_clear();
@@ -1134,16 +1627,16 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	homa_add_to_throttled(crpc2);
 	homa_add_to_throttled(crpc3);
 
-	/* First attempt: pacer_fifo_count doesn't reach zero. */
+	/* First attempt: fifo_count doesn't reach zero. */
 	self->homa.max_nic_queue_ns = 1300;
-	self->homa.pacer_fifo_count = 200;
+	self->pacer->fifo_count = 200;
 	self->homa.pacer_fifo_fraction = 150;
 	mock_ns= 13000;
-	atomic64_set(&self->homa.link_idle_time, 10000);
+	atomic64_set(&self->pacer->link_idle_time, 10000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_SUBSTR("id 4, message_length 10000, offset 0, data_length 1400",
 			unit_log_get());
 	unit_log_clear();
@@ -1151,12 +1644,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	EXPECT_STREQ("request id 4, next_offset 1400; "
 			"request id 2, next_offset 0; "
 			"request id 6, next_offset 0", unit_log_get());
-	EXPECT_EQ(50, self->homa.pacer_fifo_count);
+	EXPECT_EQ(50, self->pacer->fifo_count);
 
-	/* Second attempt: pacer_fifo_count reaches zero. */
-	atomic64_set(&self->homa.link_idle_time, 10000);
+	/* Second attempt: fifo_count reaches zero. */
+	atomic64_set(&self->pacer->link_idle_time, 10000);
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_SUBSTR("id 2, message_length 20000, offset 0, data_length 1400",
 			unit_log_get());
 	unit_log_clear();
@@ -1164,7 +1657,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	EXPECT_STREQ("request id 4, next_offset 1400; "
 			"request id 2, next_offset 1400; "
 			"request id 6, next_offset 0", unit_log_get());
-	EXPECT_EQ(900, self->homa.pacer_fifo_count);
+	EXPECT_EQ(900, self->pacer->fifo_count);
 }
 TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 {
@@ -1178,7 +1671,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	mock_trylock_errors = 1;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_STREQ("", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -1189,7 +1682,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__queue_empty)
 	self->homa.max_nic_queue_ns = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -1203,15 +1696,35 @@ TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_fills)
 	homa_add_to_throttled(crpc);
 	self->homa.max_nic_queue_ns = 2001;
 	mock_ns = 10000;
-	atomic64_set(&self->homa.link_idle_time, 12000);
+	atomic64_set(&self->pacer->link_idle_time, 12000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 1234, next_offset 1400", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_pacer_xmit__hrtimer_mode_doesnt_spin)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id,
+			10000, 1000);
+
+	homa_add_to_throttled(crpc);
+	self->homa.max_nic_queue_ns = 2000;
+	self->homa.pacer_hrtimer = 1;
+	mock_ns = 10000;
+	atomic64_set(&self->pacer->link_idle_time, 12500);
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(self->pacer);
+	EXPECT_STREQ("", unit_log_get());
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 0", unit_log_get());
+}
 TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1224,12 +1737,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_trylock_errors = ~1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(1, homa_metrics_per_cpu()->pacer_skipped_rpcs);
 	unit_log_clear();
 	mock_trylock_errors = 0;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 }
@@ -1249,13 +1762,14 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	self->homa.max_nic_queue_ns = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(self->pacer);
 	EXPECT_STREQ("xmit DATA 1000@0; xmit DATA 1400@0",
 			unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("request id 4, next_offset 1400", unit_log_get());
-	EXPECT_TRUE(list_empty(&crpc1->throttled_links));
+	EXPECT_TRUE(RB_EMPTY_NODE(&crpc1->throttled_node));
+	EXPECT_EQ(1, unit_rbtree_size(&self->pacer->throttled_by_age));
 }
 
 /* Don't know how to unit test homa_pacer_stop... */
@@ -1307,6 +1821,72 @@ TEST_F(homa_outgoing, homa_add_to_throttled__basics)
 		"request id 8, next_offset 0; "
 		"request id 6, next_offset 0", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_add_to_throttled__age_index)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 2, 10000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 4, 5000, 1000);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 6, 15000, 1000);
+	struct rb_node *node;
+
+	/* Insertion order differs from both size order and age order. */
+	crpc1->msgout.init_ns = 300;
+	crpc2->msgout.init_ns = 200;
+	crpc3->msgout.init_ns = 100;
+	homa_add_to_throttled(crpc2);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc3);
+	node = rb_first_cached(&self->pacer->throttled_by_age);
+	EXPECT_EQ(crpc3, rb_entry(node, struct homa_rpc, throttled_age_node));
+	node = rb_next(node);
+	EXPECT_EQ(crpc2, rb_entry(node, struct homa_rpc, throttled_age_node));
+	node = rb_next(node);
+	EXPECT_EQ(crpc1, rb_entry(node, struct homa_rpc, throttled_age_node));
+	EXPECT_EQ(crpc2, rb_entry(rb_first_cached(&self->pacer->throttled_rpcs),
+				  struct homa_rpc, throttled_node));
+}
+TEST_F(homa_outgoing, homa_add_to_throttled__wake_pacer_thread)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+
+	mock_task.pid = 44;
+	self->pacer->kthread = &mock_task;
+	unit_log_clear();
+	homa_add_to_throttled(crpc);
+	EXPECT_STREQ("wake_up_process pid 44", unit_log_get());
+	self->pacer->kthread = NULL;
+}
+TEST_F(homa_outgoing, homa_add_to_throttled__separate_pacers)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 10000, 1000);
+
+	mock_net_device.ifindex = 3;
+	homa_pacer_put(crpc2->msgout.pacer);
+	crpc2->msgout.pacer = homa_pacer_new(&self->homa, &mock_net_device,
+					     GFP_KERNEL);
+	list_add_tail_rcu(&crpc2->msgout.pacer->links, &self->homa.pacers);
+	refcount_inc(&crpc2->msgout.pacer->refs);
+	homa_add_to_throttled(crpc1);
+	homa_add_to_throttled(crpc2);
+	EXPECT_EQ(1, unit_rbtree_size(&self->pacer->throttled_rpcs));
+	EXPECT_EQ(1, unit_rbtree_size(&crpc2->msgout.pacer->throttled_rpcs));
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 0; "
+		     "request id 1236, next_offset 0", unit_log_get());
+}
 TEST_F(homa_outgoing, homa_add_to_throttled__inc_metrics)
 {
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
@@ -1339,17 +1919,20 @@ TEST_F(homa_outgoing, homa_remove_from_throttled)
 			self->server_port, self->client_id, 5000, 1000);
 
 	homa_add_to_throttled(crpc);
-	EXPECT_FALSE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_EQ(1, unit_rbtree_size(&self->pacer->throttled_rpcs));
+	EXPECT_EQ(1, unit_rbtree_size(&self->pacer->throttled_by_age));
 
 	// First attempt will remove.
 	unit_log_clear();
 	homa_remove_from_throttled(crpc);
-	EXPECT_TRUE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, unit_rbtree_size(&self->pacer->throttled_rpcs));
+	EXPECT_EQ(0, unit_rbtree_size(&self->pacer->throttled_by_age));
+	EXPECT_TRUE(RB_EMPTY_NODE(&crpc->throttled_node));
 	EXPECT_STREQ("removing id 1234 from throttled list", unit_log_get());
 
 	// Second attempt: nothing to do.
 	unit_log_clear();
 	homa_remove_from_throttled(crpc);
-	EXPECT_TRUE(list_empty(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, unit_rbtree_size(&self->pacer->throttled_rpcs));
 	EXPECT_STREQ("", unit_log_get());
 }
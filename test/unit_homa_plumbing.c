@@ -206,6 +206,78 @@ TEST_F(homa_plumbing, homa_bind__ipv4_ok)
 	EXPECT_EQ(345, self->hsk.port);
 }
 
+TEST_F(homa_plumbing, homa_disconnect__basics)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 200);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 10000, 100);
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	ASSERT_NE(NULL, crpc);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+	EXPECT_TRUE(self->hsk.connect);
+
+	EXPECT_EQ(0, homa_disconnect(&self->hsk.inet.sk, 0));
+	EXPECT_FALSE(self->hsk.connect);
+	EXPECT_TRUE(hlist_unhashed(&self->hsk.conn_links.hash_links));
+	EXPECT_EQ(AF_UNSPEC, self->hsk.remote_host.in4.sin_family);
+	EXPECT_EQ(self->server_port, self->hsk.port);
+	EXPECT_EQ(pool, self->hsk.buffer_pool);
+	EXPECT_EQ(ECONNRESET, -crpc->error);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->disconnects);
+}
+TEST_F(homa_plumbing, homa_disconnect__not_connected)
+{
+	EXPECT_EQ(0, homa_disconnect(&self->hsk.inet.sk, 0));
+	EXPECT_FALSE(self->hsk.connect);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->disconnects);
+}
+TEST_F(homa_plumbing, homa_disconnect__socket_shutdown)
+{
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+	self->hsk.shutdown = 1;
+	EXPECT_EQ(ESHUTDOWN, -homa_disconnect(&self->hsk.inet.sk, 0));
+	EXPECT_TRUE(self->hsk.connect);
+	self->hsk.shutdown = 0;
+}
+TEST_F(homa_plumbing, homa_disconnect__peeled_off_socket)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	ASSERT_EQ(0, homa_sock_peel(&hsk2, &self->hsk, &self->client_addr.sa));
+	EXPECT_EQ(EOPNOTSUPP, -homa_disconnect(&hsk2.inet.sk, 0));
+	EXPECT_TRUE(hsk2.connect);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_disconnect__reconnect_to_new_peer)
+{
+	struct sockaddr unspec = {.sa_family = AF_UNSPEC};
+	struct homa_sock *found;
+
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+	EXPECT_EQ(EISCONN, -homa_connect(&self->hsk.inet.sk,
+			&self->client_addr.sa, sizeof(self->client_addr)));
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &unspec,
+			sizeof(unspec)));
+	EXPECT_FALSE(self->hsk.connect);
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->client_addr.sa,
+			sizeof(self->client_addr)));
+	EXPECT_TRUE(self->hsk.connect);
+	found = homa_sock_find_connected(self->homa.port_map,
+			&self->client_addr.sa, self->server_port);
+	EXPECT_EQ(&self->hsk, found);
+}
+
 TEST_F(homa_plumbing, homa_ioc_abort__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -249,6 +321,342 @@ TEST_F(homa_plumbing, homa_ioc_abort__nonexistent_rpc)
 	EXPECT_EQ(EINVAL, -homa_ioc_abort(&self->hsk.inet.sk, (int *) &args));
 }
 
+TEST_F(homa_plumbing, homa_ioc_recv_batch__basics)
+{
+	struct homa_recvbatch_msg msgs[4];
+	struct homa_recvbatch_args args = {msgs, 4, 0,
+			HOMA_RECVMSG_REQUEST | HOMA_RECVMSG_RESPONSE, 0, NULL};
+	struct homa_rpc *srpc1, *srpc2, *crpc;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 2,
+			300, 200);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 2000);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	ASSERT_NE(NULL, crpc);
+	crpc->completion_cookie = 44444;
+
+	EXPECT_EQ(0, -homa_ioc_recv_batch(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(3, args.num_msgs);
+	EXPECT_EQ(self->server_id, msgs[0].id);
+	EXPECT_EQ(100, msgs[0].length);
+	EXPECT_EQ(self->server_id + 2, msgs[1].id);
+	EXPECT_EQ(300, msgs[1].length);
+	EXPECT_EQ(self->client_id, msgs[2].id);
+	EXPECT_EQ(2000, msgs[2].length);
+	EXPECT_EQ(44444, msgs[2].completion_cookie);
+	EXPECT_EQ(1, msgs[2].num_bpages);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc1->state);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc2->state);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__cant_read_user_args)
+{
+	struct homa_recvbatch_args args = {NULL, 0, 0, 0, 0, NULL};
+
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__bogus_flags)
+{
+	struct homa_recvbatch_args args = {NULL, 0, 0, ~0, 0, NULL};
+
+	EXPECT_EQ(EINVAL, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__release_buffers)
+{
+	__u32 offsets[2];
+	struct homa_recvbatch_args args = {NULL, 0, 0, 0, 2, offsets};
+
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool, 2,
+			offsets, 0));
+	offsets[0] = 0;
+	offsets[1] = HOMA_BPAGE_SIZE;
+
+	EXPECT_EQ(0, -homa_ioc_recv_batch(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(0, args.num_msgs);
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[1].refs));
+	EXPECT_EQ(1, self->hsk.buffer_pool->check_waiting_invoked);
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__error_in_release_buffers)
+{
+	__u32 offsets[1];
+	struct homa_recvbatch_args args = {NULL, 1, 0,
+			HOMA_RECVMSG_REQUEST, 1, offsets};
+
+	offsets[0] = self->hsk.buffer_pool->num_bpages << HOMA_BPAGE_SHIFT;
+	EXPECT_EQ(EINVAL, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__no_messages)
+{
+	struct homa_recvbatch_msg msgs[2];
+	struct homa_recvbatch_args args = {msgs, 2, 0,
+			HOMA_RECVMSG_REQUEST | HOMA_RECVMSG_NONBLOCKING,
+			0, NULL};
+
+	EXPECT_EQ(EAGAIN, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+	EXPECT_EQ(0, args.num_msgs);
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__stop_at_max_msgs)
+{
+	struct homa_recvbatch_msg msgs[1];
+	struct homa_recvbatch_args args = {msgs, 1, 0,
+			HOMA_RECVMSG_REQUEST, 0, NULL};
+
+	ASSERT_NE(NULL, unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 200));
+	ASSERT_NE(NULL, unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id + 2, 100, 200));
+
+	EXPECT_EQ(0, -homa_ioc_recv_batch(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(1, args.num_msgs);
+	EXPECT_EQ(self->server_id, msgs[0].id);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__error_copying_out_msg)
+{
+	struct homa_recvbatch_msg msgs[2];
+	struct homa_recvbatch_args args = {msgs, 2, 0,
+			HOMA_RECVMSG_REQUEST, 0, NULL};
+
+	ASSERT_NE(NULL, unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 200));
+
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+	EXPECT_EQ(0, args.num_msgs);
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__inline_enabled)
+{
+	struct homa_recvbatch_msg msgs[2];
+	struct homa_recvbatch_args args = {msgs, 2, 0,
+			HOMA_RECVMSG_REQUEST, 0, NULL};
+
+	self->hsk.inline_max = 1000;
+	EXPECT_EQ(EINVAL, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_recv_batch__inline_message)
+{
+	struct homa_recvbatch_msg msgs[2];
+	struct homa_recvbatch_args args = {msgs, 2, 0,
+			HOMA_RECVMSG_REQUEST, 0, NULL};
+	struct homa_rpc *srpc;
+
+	/* The message arrives inline, then inline delivery is disabled. */
+	self->hsk.inline_max = 1000;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(1, srpc->msgin.inline_data);
+	self->hsk.inline_max = 0;
+
+	EXPECT_EQ(EMSGSIZE, -homa_ioc_recv_batch(&self->hsk.inet.sk,
+			(int *) &args));
+	EXPECT_EQ(0, args.num_msgs);
+	EXPECT_EQ(RPC_INCOMING, srpc->state);
+	EXPECT_NE(0, atomic_read(&srpc->flags) & RPC_PKTS_READY);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, skb_queue_len(&srpc->msgin.packets));
+}
+TEST_F(homa_plumbing, homa_ioc_release__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_release_args args;
+	__u32 offsets[2];
+
+	EXPECT_EQ(0, -homa_pool_get_pages(pool, 2, offsets, 0));
+	EXPECT_EQ(pool->num_bpages - 2, atomic_read(&pool->free_bpages));
+	memset(&args, 0, sizeof(args));
+	args.bpage_offsets = offsets;
+	args.num_bpages = 2;
+	offsets[0] = 0;
+	offsets[1] = HOMA_BPAGE_SIZE;
+	atomic_set(&self->hsk.bpages_held, 3);
+
+	EXPECT_EQ(0, -homa_ioc_release(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
+	EXPECT_EQ(1, pool->check_waiting_invoked);
+	EXPECT_EQ(pool->num_bpages, args.total_bpages);
+	EXPECT_EQ(pool->num_bpages, args.free_bpages);
+	EXPECT_EQ(1, args.held_bpages);
+	EXPECT_EQ(0, args.waiting_rpcs);
+	EXPECT_EQ(2, homa_metrics_per_cpu()->release_bpages);
+}
+TEST_F(homa_plumbing, homa_ioc_release__cant_read_user_args)
+{
+	struct homa_release_args args;
+
+	memset(&args, 0, sizeof(args));
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_release(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_release__nonzero_pad)
+{
+	struct homa_release_args args;
+
+	memset(&args, 0, sizeof(args));
+	args._pad = 1;
+	EXPECT_EQ(EINVAL, -homa_ioc_release(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_release__no_buffer_region)
+{
+	struct homa_release_args args;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	memset(&args, 0, sizeof(args));
+	EXPECT_EQ(EINVAL, -homa_ioc_release(&hsk2.inet.sk, (int *) &args));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_ioc_release__bad_offset)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_release_args args;
+	__u32 offsets[1];
+
+	memset(&args, 0, sizeof(args));
+	args.bpage_offsets = offsets;
+	args.num_bpages = 1;
+	offsets[0] = pool->num_bpages << HOMA_BPAGE_SHIFT;
+	EXPECT_EQ(EINVAL, -homa_ioc_release(&self->hsk.inet.sk,
+			(int *) &args));
+	EXPECT_EQ(1, pool->check_waiting_invoked);
+}
+TEST_F(homa_plumbing, homa_ioc_release__occupancy)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_release_args args;
+	struct homa_rpc *crpc;
+
+	/* Make an incoming message wait for buffer space. */
+	atomic_set(&pool->free_bpages, 0);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_FALSE(list_empty(&crpc->buf_links));
+	memset(&args, 0, sizeof(args));
+
+	EXPECT_EQ(0, -homa_ioc_release(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(0, args.free_bpages);
+	EXPECT_EQ(1, args.waiting_rpcs);
+}
+
+TEST_F(homa_plumbing, homa_ioc_send_batch__basics)
+{
+	struct iovec iov = {(void *) 1000, 200};
+	struct homa_sendbatch_msg msgs[2] = {
+		{.id = 0, .completion_cookie = 123, .iov = &iov, .iovcnt = 1},
+		{.id = self->server_id, .iov = &iov, .iovcnt = 1},
+	};
+	struct homa_sendbatch_args args = {msgs, 2, 0};
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
+			self->server_ip, self->client_ip, self->server_port,
+			self->server_id, 100, 200);
+
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+
+	EXPECT_EQ(0, -homa_ioc_send_batch(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(2, args.num_done);
+	EXPECT_EQ(0, msgs[0].result);
+	EXPECT_NE(0, msgs[0].id);
+	EXPECT_EQ(0, msgs[1].result);
+	EXPECT_EQ(RPC_OUTGOING, srpc->state);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(2, homa_metrics_per_cpu()->send_batch_msgs);
+}
+TEST_F(homa_plumbing, homa_ioc_send_batch__cant_read_user_args)
+{
+	struct homa_sendbatch_args args = {NULL, 0, 0};
+
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_send_batch(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_send_batch__not_connected)
+{
+	struct homa_sendbatch_args args = {NULL, 0, 0};
+
+	EXPECT_EQ(ENOTCONN, -homa_ioc_send_batch(&self->hsk.inet.sk,
+			(int *) &args));
+}
+TEST_F(homa_plumbing, homa_ioc_send_batch__error_importing_iovec)
+{
+	struct iovec iov = {(void *) 1000, 200};
+	struct homa_sendbatch_msg msgs[2] = {
+		{.id = 0, .iov = &iov, .iovcnt = 1},
+		{.id = 0, .iov = &iov, .iovcnt = 1},
+	};
+	struct homa_sendbatch_args args = {msgs, 2, 0};
+
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+	mock_import_iovec_errors = 1;
+
+	EXPECT_EQ(0, -homa_ioc_send_batch(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(2, args.num_done);
+	EXPECT_EQ(EINVAL, -msgs[0].result);
+	EXPECT_EQ(0, msgs[1].result);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_send_batch__response_rpc_doesnt_exist)
+{
+	struct iovec iov = {(void *) 1000, 200};
+	struct homa_sendbatch_msg msgs[1] = {
+		{.id = 99, .iov = &iov, .iovcnt = 1},
+	};
+	struct homa_sendbatch_args args = {msgs, 1, 0};
+
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+
+	EXPECT_EQ(0, -homa_ioc_send_batch(&self->hsk.inet.sk, (int *) &args));
+	EXPECT_EQ(1, args.num_done);
+	EXPECT_EQ(0, msgs[0].result);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_ioc_send_batch__cant_return_result)
+{
+	struct iovec iov = {(void *) 1000, 200};
+	struct homa_sendbatch_msg msgs[2] = {
+		{.id = 0, .iov = &iov, .iovcnt = 1},
+		{.id = 0, .iov = &iov, .iovcnt = 1},
+	};
+	struct homa_sendbatch_args args = {msgs, 2, 0};
+
+	EXPECT_EQ(0, homa_connect(&self->hsk.inet.sk, &self->server_addr.sa,
+			sizeof(self->server_addr)));
+	mock_copy_to_user_errors = 1;
+
+	EXPECT_EQ(EFAULT, -homa_ioc_send_batch(&self->hsk.inet.sk,
+			(int *) &args));
+	EXPECT_EQ(1, args.num_done);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+
 TEST_F(homa_plumbing, homa_socket__success)
 {
 	struct homa_sock sock;
@@ -314,7 +722,283 @@ TEST_F(homa_plumbing, homa_setsockopt__success)
 	EXPECT_EQ(64, self->hsk.buffer_pool->num_bpages);
 	EXPECT_EQ(1, homa_metrics_per_cpu()->so_set_buf_calls);
 }
+TEST_F(homa_plumbing, homa_setsockopt__pool_already_shared)
+{
+	struct homa_rcvbuf_args args;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	homa_pool_get(self->hsk.buffer_pool);
+	EXPECT_EQ(EBUSY, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval,
+			sizeof(struct homa_rcvbuf_args)));
+	homa_pool_put(self->hsk.buffer_pool);
+}
+TEST_F(homa_plumbing, homa_setsockopt__ext_args_bad_flags)
+{
+	struct homa_rcvbuf_ext_args args = {};
+	char buffer[5000];
+
+	args.rcvbuf.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.rcvbuf.length = 64*HOMA_BPAGE_SIZE;
+	args.flags = 2;
+	self->optval.user = &args;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval, sizeof(args)));
+	args.flags = HOMA_RCVBUF_PIN;
+	args._pad = 1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval, sizeof(args)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__ext_args_no_flags)
+{
+	struct homa_rcvbuf_ext_args args = {};
+	char buffer[5000];
+
+	args.rcvbuf.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.rcvbuf.length = 64*HOMA_BPAGE_SIZE;
+	self->optval.user = &args;
+	homa_pool_destroy(self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval, sizeof(args)));
+	EXPECT_EQ(64, self->hsk.buffer_pool->num_bpages);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool->pinned_pages);
+}
+TEST_F(homa_plumbing, homa_setsockopt__pin_region)
+{
+	struct homa_rcvbuf_ext_args args = {};
+	char buffer[5000];
+
+	args.rcvbuf.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.rcvbuf.length = 64*HOMA_BPAGE_SIZE;
+	args.flags = HOMA_RCVBUF_PIN;
+	self->optval.user = &args;
+	homa_pool_destroy(self->hsk.buffer_pool);
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval, sizeof(args)));
+	EXPECT_EQ(args.rcvbuf.start, self->hsk.buffer_pool->region);
+	EXPECT_NE(NULL, self->hsk.buffer_pool->pinned_pages);
+	EXPECT_EQ(64 * (HOMA_BPAGE_SIZE / PAGE_SIZE),
+		  self->hsk.buffer_pool->num_pinned_pages);
+}
+TEST_F(homa_plumbing, homa_setsockopt__pin_region_fails)
+{
+	struct homa_rcvbuf_ext_args args = {};
+	char buffer[5000];
+
+	args.rcvbuf.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.rcvbuf.length = 64*HOMA_BPAGE_SIZE;
+	args.flags = HOMA_RCVBUF_PIN;
+	self->optval.user = &args;
+	mock_pin_user_pages_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval, sizeof(args)));
+	EXPECT_EQ(100, self->hsk.buffer_pool->num_bpages);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool->pinned_pages);
+}
+TEST_F(homa_plumbing, homa_setsockopt__pin_region_but_pool_shared)
+{
+	struct homa_rcvbuf_ext_args args = {};
+	char buffer[5000];
+
+	args.rcvbuf.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.rcvbuf.length = 64*HOMA_BPAGE_SIZE;
+	args.flags = HOMA_RCVBUF_PIN;
+	self->optval.user = &args;
+	homa_pool_get(self->hsk.buffer_pool);
+	EXPECT_EQ(EBUSY, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval, sizeof(args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool->pinned_pages);
+	homa_pool_put(self->hsk.buffer_pool);
+}
+TEST_F(homa_plumbing, homa_setsockopt__share_rcvbuf_basics)
+{
+	struct socket other = {.sk = &self->hsk.sock};
+	struct homa_sock hsk2;
+	int fd = 5;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	mock_sockfd_socket = &other;
+	self->optval.user = &fd;
+	EXPECT_EQ(0, -homa_setsockopt(&hsk2.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_RCVBUF, self->optval, sizeof(int)));
+	EXPECT_EQ(self->hsk.buffer_pool, hsk2.buffer_pool);
+	EXPECT_STREQ("fput", unit_log_get());
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_setsockopt__share_rcvbuf_bad_fd)
+{
+	int fd = 5;
+
+	self->optval.user = &fd;
+	EXPECT_EQ(EBADF, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_RCVBUF, self->optval, sizeof(int)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__share_rcvbuf_not_homa_socket)
+{
+	struct proto other_prot = {};
+	struct socket other;
+	struct sock sk;
+	int fd = 5;
+
+	memset(&sk, 0, sizeof(sk));
+	sk.sk_prot = &other_prot;
+	other.sk = &sk;
+	mock_sockfd_socket = &other;
+	self->optval.user = &fd;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_RCVBUF, self->optval, sizeof(int)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__share_rcvbuf_region_in_use)
+{
+	struct socket other = {.sk = &self->hsk.sock};
+	struct homa_sock hsk2;
+	int fd = 5;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	mock_sockfd_socket = &other;
+	self->optval.user = &fd;
+	EXPECT_EQ(EBUSY, -homa_setsockopt(&hsk2.sock, IPPROTO_HOMA,
+			SO_HOMA_SHARE_RCVBUF, self->optval, sizeof(int)));
+	EXPECT_NE(self->hsk.buffer_pool, hsk2.buffer_pool);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_setsockopt__poll_bad_args)
+{
+	struct homa_poll_args args = {.usecs = -2, .flags = 0};
+
+	self->optval.user = &args;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POLL, self->optval, sizeof(args) - 1));
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POLL, self->optval, sizeof(args)));
+	args.usecs = 10;
+	args.flags = 2;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POLL, self->optval, sizeof(args)));
+	EXPECT_EQ(-1, self->hsk.poll_usecs);
+}
+TEST_F(homa_plumbing, homa_setsockopt__poll_success)
+{
+	struct homa_poll_args args = {.usecs = 20,
+			.flags = HOMA_POLL_ADAPTIVE};
+	int size = sizeof32(args);
+
+	self->hsk.last_arrival = 1000;
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_POLL, self->optval, sizeof(args)));
+	EXPECT_EQ(20, self->hsk.poll_usecs);
+	EXPECT_EQ(1, self->hsk.poll_adaptive);
+	EXPECT_EQ(0, self->hsk.last_arrival);
+
+	memset(&args, 0, sizeof(args));
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_POLL, (char *)&args, &size));
+	EXPECT_EQ(20, args.usecs);
+	EXPECT_EQ(HOMA_POLL_ADAPTIVE, args.flags);
+	EXPECT_EQ(sizeof32(args), size);
+}
+
+TEST_F(homa_plumbing, homa_setsockopt__inline_bad_args)
+{
+	int max = HOMA_MAX_INLINE + 1;
+
+	self->optval.user = &max;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(max) - 1));
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(max)));
+	max = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(max)));
+	EXPECT_EQ(0, self->hsk.inline_max);
+}
+TEST_F(homa_plumbing, homa_setsockopt__inline_success)
+{
+	int size = sizeof32(int);
+	int max = 1000;
+
+	self->optval.user = &max;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(max)));
+	EXPECT_EQ(1000, self->hsk.inline_max);
+
+	max = 0;
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_INLINE, (char *)&max, &size));
+	EXPECT_EQ(1000, max);
+	EXPECT_EQ(sizeof32(int), size);
+}
 
+TEST_F(homa_plumbing, homa_setsockopt__zerocopy_bad_args)
+{
+	int enable = 2;
+
+	self->optval.user = &enable;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(enable) - 1));
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(enable)));
+	EXPECT_FALSE(sock_flag(&self->hsk.sock, SOCK_ZEROCOPY));
+}
+TEST_F(homa_plumbing, homa_setsockopt__zerocopy_success)
+{
+	int size = sizeof32(int);
+	int enable = 1;
+
+	self->optval.user = &enable;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(enable)));
+	EXPECT_TRUE(sock_flag(&self->hsk.sock, SOCK_ZEROCOPY));
+
+	enable = 0;
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_ZEROCOPY, (char *)&enable, &size));
+	EXPECT_EQ(1, enable);
+	EXPECT_EQ(sizeof32(int), size);
+
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_ZEROCOPY, self->optval, sizeof(enable)));
+	EXPECT_FALSE(sock_flag(&self->hsk.sock, SOCK_ZEROCOPY));
+}
+
+TEST_F(homa_plumbing, homa_setsockopt__bpage_quota_bad_args)
+{
+	int quota = -2;
+
+	self->optval.user = &quota;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BPAGE_QUOTA, self->optval, sizeof(quota) - 1));
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BPAGE_QUOTA, self->optval, sizeof(quota)));
+	EXPECT_EQ(-1, self->hsk.bpage_quota);
+}
+TEST_F(homa_plumbing, homa_setsockopt__bpage_quota_success)
+{
+	int size = sizeof32(int);
+	int quota = 20;
+
+	self->optval.user = &quota;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_BPAGE_QUOTA, self->optval, sizeof(quota)));
+	EXPECT_EQ(20, self->hsk.bpage_quota);
+
+	quota = 0;
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_BPAGE_QUOTA, (char *)&quota, &size));
+	EXPECT_EQ(20, quota);
+	EXPECT_EQ(sizeof32(int), size);
+}
 
 TEST_F(homa_plumbing, homa_getsockopt__success)
 {
@@ -390,6 +1074,70 @@ TEST_F(homa_plumbing, homa_getsockopt__cant_copy_out_value)
 	EXPECT_EQ(NULL, val.start);
 	EXPECT_EQ(sizeof32(val), size);
 }
+TEST_F(homa_plumbing, homa_getsockopt__peeloff_batch_bad_length)
+{
+	struct homa_peeloff_batch_args args = {NULL, 0, 0};
+	int size = sizeof32(args) - 1;
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_PEELOFF_BATCH, (char *)&args, &size));
+}
+TEST_F(homa_plumbing, homa_getsockopt__peeloff_batch_cant_read_args)
+{
+	struct homa_peeloff_batch_args args = {NULL, 0, 0};
+	int size = sizeof32(args);
+
+	mock_copy_data_errors = 2;
+	EXPECT_EQ(EFAULT, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_PEELOFF_BATCH, (char *)&args, &size));
+}
+TEST_F(homa_plumbing, homa_getsockopt__peeloff_batch_nonzero_pad)
+{
+	struct homa_peeloff_batch_args args = {NULL, 0, 1};
+	int size = sizeof32(args);
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_PEELOFF_BATCH, (char *)&args, &size));
+}
+TEST_F(homa_plumbing, homa_getsockopt__peeloff_batch_empty)
+{
+	struct homa_peeloff_batch_args args = {NULL, 0, 0};
+	int size = sizeof32(args);
+
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_PEELOFF_BATCH, (char *)&args, &size));
+	EXPECT_EQ(0, args.count);
+}
+TEST_F(homa_plumbing, homa_getsockopt__peeloff_batch_returns_count)
+{
+	struct homa_peeloff_entry entries[2];
+	struct homa_peeloff_batch_args args = {entries, 2, 0};
+	int size = sizeof32(args);
+
+	memset(entries, 0, sizeof(entries));
+	self->hsk.shutdown = true;
+	EXPECT_EQ(2, homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_PEELOFF_BATCH, (char *)&args, &size));
+	EXPECT_EQ(2, args.count);
+	EXPECT_EQ(-ESHUTDOWN, entries[0].fd);
+	EXPECT_EQ(-ESHUTDOWN, entries[1].fd);
+	self->hsk.shutdown = false;
+}
+TEST_F(homa_plumbing, homa_getsockopt__peeloff_batch_cant_write_args)
+{
+	struct homa_peeloff_entry entry;
+	struct homa_peeloff_batch_args args = {&entry, 1, 0};
+	int size = sizeof32(args);
+
+	/* The entry was processed, so its count must still be returned. */
+	memset(&entry, 0, sizeof(entry));
+	self->hsk.shutdown = true;
+	mock_copy_to_user_errors = 2;
+	EXPECT_EQ(1, homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_PEELOFF_BATCH, (char *)&args, &size));
+	EXPECT_EQ(-ESHUTDOWN, entry.fd);
+	self->hsk.shutdown = false;
+}
 
 TEST_F(homa_plumbing, homa_sendmsg__msg_name_null)
 {
@@ -565,6 +1313,79 @@ TEST_F(homa_plumbing, homa_sendmsg__response_succeeds)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
 
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy)
+{
+	struct homa_rpc *crpc;
+
+	sock_set_flag(&self->hsk.sock, SOCK_ZEROCOPY);
+	self->homa.zerocopy_min = 200;
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("iov_iter_get_pages2 100 bytes", unit_log_get());
+	EXPECT_NOSUBSTR("_copy_from_iter", unit_log_get());
+	EXPECT_NOSUBSTR("zerocopy notification", unit_log_get());
+	EXPECT_EQ(NULL, self->sendmsg_hdr.msg_ubuf);
+	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(NULL, crpc->msgout.uarg);
+	EXPECT_NE(NULL, skb_zcopy(crpc->msgout.packets));
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_message_too_short)
+{
+	struct homa_rpc *crpc;
+
+	sock_set_flag(&self->hsk.sock, SOCK_ZEROCOPY);
+	self->homa.zerocopy_min = 201;
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("_copy_from_iter", unit_log_get());
+	EXPECT_SUBSTR("zerocopy notification, copied", unit_log_get());
+	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(NULL, skb_zcopy(crpc->msgout.packets));
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_not_enabled)
+{
+	self->homa.zerocopy_min = 0;
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("_copy_from_iter", unit_log_get());
+	EXPECT_NOSUBSTR("zerocopy notification", unit_log_get());
+}
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_cant_allocate_ubuf)
+{
+	sock_set_flag(&self->hsk.sock, SOCK_ZEROCOPY);
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	mock_zerocopy_errors = 1;
+	EXPECT_EQ(ENOBUFS, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_plumbing, homa_sendmsg__zerocopy_send_fails)
+{
+	sock_set_flag(&self->hsk.sock, SOCK_ZEROCOPY);
+	self->homa.zerocopy_min = 0;
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	self->sendmsg_hdr.msg_iter.count = HOMA_MAX_MESSAGE_LENGTH+1;
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("msg_zerocopy_put_abort", unit_log_get());
+	EXPECT_NOSUBSTR("zerocopy notification", unit_log_get());
+	EXPECT_EQ(NULL, self->sendmsg_hdr.msg_ubuf);
+}
+
+TEST_F(homa_plumbing, homa_recvmsg__error_queue)
+{
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, MSG_ERRQUEUE, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_SUBSTR("sock_recv_errqueue", unit_log_get());
+	EXPECT_EQ(0, homa_metrics_per_cpu()->recv_calls);
+}
 TEST_F(homa_plumbing, homa_recvmsg__wrong_args_length)
 {
 	self->recvmsg_hdr.msg_controllen -= 1;
@@ -614,6 +1435,57 @@ TEST_F(homa_plumbing, homa_recvmsg__release_buffers)
 	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[0].refs));
 	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[1].refs));
 }
+TEST_F(homa_plumbing, homa_recvmsg__released_buffers_restart_waiting_rpc)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc;
+
+	/* The application holds 2 bpages and the pool is otherwise
+	 * exhausted, so an incoming message must wait for buffer space.
+	 */
+	EXPECT_EQ(0, -homa_pool_get_pages(pool, 2,
+			self->recvmsg_args.bpage_offsets, 0));
+	atomic_set(&pool->free_bpages, 0);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_FALSE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+
+	/* Returning the bpages must let the RPC proceed, even though
+	 * there's no message for recvmsg to return.
+	 */
+	self->recvmsg_args.num_bpages = 2;
+	self->recvmsg_args.bpage_offsets[0] = 0;
+	self->recvmsg_args.bpage_offsets[1] = HOMA_BPAGE_SIZE;
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_TRUE(list_empty(&crpc->buf_links));
+	EXPECT_EQ(2, crpc->msgin.num_bpages);
+	EXPECT_TRUE(list_empty(&pool->waiting_for_bufs));
+}
+TEST_F(homa_plumbing, homa_recvmsg__bpages_held_until_returned)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, atomic_read(&self->hsk.bpages_held));
+
+	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(1, atomic_read(&self->hsk.bpages_held));
+
+	/* Return the bpages (there is no message to receive). */
+	self->recvmsg_args.id = 0;
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, atomic_read(&self->hsk.bpages_held));
+}
 TEST_F(homa_plumbing, homa_recvmsg__error_in_release_buffers)
 {
 	self->recvmsg_args.num_bpages = 1;
@@ -769,6 +1641,31 @@ TEST_F(homa_plumbing, homa_recvmsg__delete_server_rpc_after_error)
 	EXPECT_EQ(RPC_DEAD, srpc->state);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 }
+TEST_F(homa_plumbing, homa_recvmsg__inline_message)
+{
+	struct homa_rpc *crpc;
+	struct iovec iov;
+
+	self->hsk.inline_max = 2000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 2000);
+	ASSERT_NE(NULL, crpc);
+	iov.iov_base = (void *) 0x2000000;
+	iov.iov_len = 3000;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 3000);
+
+	unit_log_clear();
+	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			3000, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, self->recvmsg_args.id);
+	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
+	EXPECT_SUBSTR("skb_copy_datagram_iter: 1400 bytes to 0x2000000: 0-1399; "
+			"skb_copy_datagram_iter: 600 bytes to 0x2000578: 0-599",
+			unit_log_get());
+	EXPECT_EQ(0, self->recvmsg_hdr.msg_flags & MSG_TRUNC);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+}
 TEST_F(homa_plumbing, homa_recvmsg__error_copying_out_args)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
@@ -967,12 +1864,12 @@ TEST_F(homa_plumbing, homa_softirq__per_rpc_batching)
 	unit_log_clear();
 	homa_softirq(skb);
 	EXPECT_STREQ("id 2001, offsets 0; "
-			"sk->sk_data_ready invoked; "
 			"id 2003, offsets 0 1400 4200 2800 7000; "
-			"sk->sk_data_ready invoked; "
 			"id 2005, offsets 0 1400 5600; "
 			"sk->sk_data_ready invoked",
 			unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sock_wakeups);
+	EXPECT_EQ(2, homa_metrics_per_cpu()->sock_wakeups_coalesced);
 }
 
 TEST_F(homa_plumbing, homa_err_handler_v4__port_unreachable)
@@ -1079,6 +1976,82 @@ TEST_F(homa_plumbing, homa_err_handler_v6__protocol_not_supported)
 	kfree_skb(failed);
 }
 
+TEST_F(homa_plumbing, homa_listen__basics)
+{
+	struct socket sock = {.sk = &self->hsk.sock};
+
+	EXPECT_EQ(0, homa_listen(&sock, 10));
+	EXPECT_EQ(10, self->hsk.accept_backlog);
+	EXPECT_EQ(0, homa_listen(&sock, -3));
+	EXPECT_EQ(1, self->hsk.accept_backlog);
+}
+TEST_F(homa_plumbing, homa_listen__socket_connected)
+{
+	struct socket sock = {.sk = &self->hsk.sock};
+
+	self->hsk.connect = true;
+	EXPECT_EQ(EINVAL, -homa_listen(&sock, 10));
+	EXPECT_EQ(0, self->hsk.accept_backlog);
+	self->hsk.connect = false;
+}
+TEST_F(homa_plumbing, homa_listen__socket_shutdown)
+{
+	struct socket sock = {.sk = &self->hsk.sock};
+
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(ESHUTDOWN, -homa_listen(&sock, 10));
+}
+
+TEST_F(homa_plumbing, homa_accept__not_listening)
+{
+	struct proto_accept_arg arg = {.flags = O_NONBLOCK};
+	struct socket sock = {.sk = &self->hsk.sock};
+	struct socket newsock = {};
+
+	EXPECT_EQ(EINVAL, -homa_accept(&sock, &newsock, &arg));
+}
+TEST_F(homa_plumbing, homa_accept__nonblocking_queue_empty)
+{
+	struct proto_accept_arg arg = {.flags = O_NONBLOCK};
+	struct socket sock = {.sk = &self->hsk.sock};
+	struct socket newsock = {};
+
+	self->hsk.accept_backlog = 5;
+	EXPECT_EQ(EAGAIN, -homa_accept(&sock, &newsock, &arg));
+}
+TEST_F(homa_plumbing, homa_accept__socket_shutdown)
+{
+	struct proto_accept_arg arg = {.flags = 0};
+	struct socket sock = {.sk = &self->hsk.sock};
+	struct socket newsock = {};
+
+	self->hsk.accept_backlog = 5;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(ESHUTDOWN, -homa_accept(&sock, &newsock, &arg));
+}
+TEST_F(homa_plumbing, homa_accept__sock_create_fails)
+{
+	struct proto_accept_arg arg = {.flags = O_NONBLOCK};
+	struct socket sock = {.sk = &self->hsk.sock};
+	struct socket newsock = {};
+	struct homa_rpc *srpc;
+
+	self->hsk.accept_backlog = 5;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(1, self->hsk.accept_queue_len);
+	unit_log_clear();
+
+	EXPECT_EQ(ENOMEM, -homa_accept(&sock, &newsock, &arg));
+	EXPECT_STREQ("sock_create", unit_log_get());
+	EXPECT_EQ(1, self->hsk.accept_queue_len);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.accept_queue));
+	EXPECT_EQ(0, atomic_read(&srpc->flags) & RPC_HANDING_OFF);
+	EXPECT_NE(0, atomic_read(&srpc->flags) & RPC_ACCEPT_QUEUED);
+}
+
 TEST_F(homa_plumbing, homa_poll__not_readable)
 {
 	struct socket sock = {.sk = &self->hsk.sock};
@@ -1092,6 +2065,16 @@ TEST_F(homa_plumbing, homa_poll__socket_shutdown)
 	homa_sock_shutdown(&self->hsk);
 	EXPECT_EQ(POLLIN | POLLOUT | POLLWRNORM, homa_poll(NULL, &sock, NULL));
 }
+TEST_F(homa_plumbing, homa_poll__error_queue_not_empty)
+{
+	struct socket sock = {.sk = &self->hsk.sock};
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+
+	__skb_queue_tail(&self->hsk.sock.sk_error_queue, skb);
+	EXPECT_EQ(POLLERR | POLLOUT | POLLWRNORM, homa_poll(NULL, &sock, NULL));
+	__skb_unlink(skb, &self->hsk.sock.sk_error_queue);
+	kfree_skb(skb);
+}
 TEST_F(homa_plumbing, homa_poll__socket_readable)
 {
 	struct socket sock = {.sk = &self->hsk.sock};
@@ -1102,3 +2085,15 @@ TEST_F(homa_plumbing, homa_poll__socket_readable)
 	EXPECT_EQ(POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM,
 		  homa_poll(NULL, &sock, NULL));
 }
+TEST_F(homa_plumbing, homa_poll__accept_queue_nonempty)
+{
+	struct socket sock = {.sk = &self->hsk.sock};
+
+	self->hsk.accept_backlog = 5;
+	unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	EXPECT_EQ(1, self->hsk.accept_queue_len);
+	EXPECT_EQ(POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM,
+		  homa_poll(NULL, &sock, NULL));
+}
@@ -33,27 +33,13 @@ FIXTURE_TEARDOWN(homa_pool)
 	unit_teardown();
 }
 
-static void steal_bpages_hook(char *id)
+static void use_page_hook(char *id)
 {
 	if (strcmp(id, "spin_lock") != 0)
 		return;
 	if (!cur_pool)
 		return;
-	switch (cur_pool->cores[1].next_candidate) {
-	case 1:
-		atomic_set(&cur_pool->descriptors[0].refs, 2);
-		break;
-	case 2:
-		atomic_set(&cur_pool->descriptors[1].refs, 1);
-		cur_pool->descriptors[1].owner = 3;
-		cur_pool->descriptors[1].expiration = mock_ns + 1;
-	case 3:
-		atomic_set(&cur_pool->descriptors[2].refs, 1);
-		cur_pool->descriptors[2].owner = 3;
-		cur_pool->descriptors[2].expiration = mock_ns - 1;
-	case 4:
-		atomic_set(&cur_pool->descriptors[3].refs, 1);
-	}
+	atomic_set(&cur_pool->descriptors[1].refs, 2);
 }
 static void change_owner_hook(char *id)
 {
@@ -65,6 +51,35 @@ static void change_owner_hook(char *id)
 			.page_hint].owner = -1;
 }
 
+/**
+ * time_get_pages() - Measure the cost of allocating a single bpage with
+ * homa_pool_get_pages and then releasing it.
+ * @pool:     Pool from which to allocate.
+ * Return:    The smallest number of cycles measured for a batch of
+ *            1000 allocate/release pairs (the minimum filters out noise).
+ */
+static __u64 time_get_pages(struct homa_pool *pool)
+{
+	__u64 start, elapsed, best = ~0ULL;
+	__u32 page;
+	int i, j;
+
+	mock_cycles = ~0;
+	for (i = 0; i < 10; i++) {
+		start = mock_get_cycles();
+		for (j = 0; j < 1000; j++) {
+			homa_pool_get_pages(pool, 1, &page, 0);
+			page <<= HOMA_BPAGE_SHIFT;
+			homa_pool_release_buffers(pool, 1, &page);
+		}
+		elapsed = mock_get_cycles() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	mock_cycles = 0;
+	return best;
+}
+
 TEST_F(homa_pool, homa_pool_set_bpages_needed)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
@@ -72,13 +87,30 @@ TEST_F(homa_pool, homa_pool_set_bpages_needed)
 	atomic_set(&pool->free_bpages, 0);
 	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE+1);
-	ASSERT_FALSE(list_empty(&self->hsk.waiting_for_bufs));
+	ASSERT_FALSE(list_empty(&pool->waiting_for_bufs));
 	EXPECT_EQ(3, pool->bpages_needed);
 	unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE);
 	EXPECT_EQ(2, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_new__cant_allocate)
+{
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(NULL, homa_pool_new(&self->homa));
+}
+TEST_F(homa_pool, homa_pool_put__pool_still_shared)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	homa_pool_get(pool);
+	EXPECT_TRUE(homa_pool_shared(pool));
+	homa_pool_put(pool);
+	EXPECT_FALSE(homa_pool_shared(pool));
+	EXPECT_EQ(100, pool->num_bpages);
+	EXPECT_NE(NULL, pool->region);
+}
+
 TEST_F(homa_pool, homa_pool_init__basics)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
@@ -113,6 +145,91 @@ TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
 			100*HOMA_BPAGE_SIZE));
 }
+TEST_F(homa_pool, homa_pool_init__cant_allocate_free_map)
+{
+	homa_pool_destroy(self->hsk.buffer_pool);
+	mock_kmalloc_errors = 4;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk, (void *) 0x100000,
+			100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool->region);
+}
+
+TEST_F(homa_pool, homa_pool_pin__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_pin(pool));
+	EXPECT_NE(NULL, pool->pinned_pages);
+	EXPECT_EQ(100 * (HOMA_BPAGE_SIZE / PAGE_SIZE), pool->num_pinned_pages);
+
+	/* Second call is a no-op. */
+	EXPECT_EQ(0, -homa_pool_pin(pool));
+}
+TEST_F(homa_pool, homa_pool_pin__pin_fails)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+
+	mock_pin_user_pages_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_pool_pin(pool));
+	EXPECT_EQ(NULL, pool->pinned_pages);
+}
+
+TEST_F(homa_pool, homa_pool_pin_region__basics)
+{
+	struct page **pages;
+	int num_pages;
+
+	pages = homa_pool_pin_region((void *) 0x1000000,
+				     10*HOMA_BPAGE_SIZE + 1000, &num_pages);
+	ASSERT_FALSE(IS_ERR(pages));
+	EXPECT_EQ(10 * (HOMA_BPAGE_SIZE / PAGE_SIZE), num_pages);
+	homa_pool_unpin_region(pages, num_pages);
+}
+TEST_F(homa_pool, homa_pool_pin_region__not_page_aligned)
+{
+	int num_pages;
+
+	EXPECT_EQ(-EINVAL, PTR_ERR(homa_pool_pin_region((void *) 0x1000010,
+			10*HOMA_BPAGE_SIZE, &num_pages)));
+}
+TEST_F(homa_pool, homa_pool_pin_region__region_too_small)
+{
+	int num_pages;
+
+	EXPECT_EQ(-EINVAL, PTR_ERR(homa_pool_pin_region((void *) 0x1000000,
+			HOMA_BPAGE_SIZE - 1, &num_pages)));
+}
+TEST_F(homa_pool, homa_pool_pin_region__cant_allocate_page_array)
+{
+	int num_pages;
+
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(-ENOMEM, PTR_ERR(homa_pool_pin_region((void *) 0x1000000,
+			10*HOMA_BPAGE_SIZE, &num_pages)));
+}
+TEST_F(homa_pool, homa_pool_pin_region__pin_fails)
+{
+	int num_pages;
+
+	mock_pin_user_pages_errors = 1;
+	EXPECT_EQ(-EFAULT, PTR_ERR(homa_pool_pin_region((void *) 0x1000000,
+			10*HOMA_BPAGE_SIZE, &num_pages)));
+}
+
+TEST_F(homa_pool, homa_pool_set_pinned)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct page **pages;
+	int num_pages;
+
+	pages = homa_pool_pin_region(pool->region,
+				     pool->num_bpages << HOMA_BPAGE_SHIFT,
+				     &num_pages);
+	ASSERT_FALSE(IS_ERR(pages));
+	homa_pool_set_pinned(pool, pages, num_pages);
+	EXPECT_EQ(pages, pool->pinned_pages);
+	EXPECT_EQ(num_pages, pool->num_pinned_pages);
+}
 
 TEST_F(homa_pool, homa_pool_get_rcvbuf)
 {
@@ -125,105 +242,203 @@ TEST_F(homa_pool, homa_pool_get_rcvbuf)
 	EXPECT_EQ(10*HOMA_BPAGE_SIZE, args.length);
 }
 
-TEST_F(homa_pool, homa_pool_get_pages__basics)
+TEST_F(homa_pool, homa_pool_revoke_lease__basics)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(0, pages[0]);
-	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
+	self->homa.bpage_lease_usecs = 1;
+	mock_ns = 5000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
+	atomic_set(&pool->descriptors[1].refs, 1);
+	pool->cores[3].page_hint = 1;
+	pool->lease_core = 3;
+	mock_ns = 7000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(1, pages[0]);
 	EXPECT_EQ(-1, pool->descriptors[1].owner);
-	EXPECT_EQ(2, pool->cores[raw_smp_processor_id()].next_candidate);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
+	EXPECT_EQ(4, pool->lease_core);
 	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->bpage_lease_revokes);
 }
-TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
+TEST_F(homa_pool, homa_pool_revoke_lease__wrap_around)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	atomic_set(&pool->free_bpages, 1);
-	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
-	atomic_set(&pool->free_bpages, 2);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	pool->lease_core = pool->num_cores - 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, pool->lease_core);
 }
-TEST_F(homa_pool, homa_pool_get_pages__set_limit)
+TEST_F(homa_pool, homa_pool_revoke_lease__lease_not_expired)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	atomic_set(&pool->free_bpages, 62);
-	pool->cores[raw_smp_processor_id()].next_candidate = 49;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(49, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	self->homa.bpage_lease_usecs = 1;
+	mock_ns = 5000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
+	atomic_set(&pool->descriptors[1].refs, 1);
+	pool->cores[3].page_hint = 1;
+	pool->lease_core = 3;
+	mock_ns = 5500;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(2, pages[0]);
+	EXPECT_EQ(1, pool->descriptors[1].owner);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->bpage_lease_revokes);
 }
-TEST_F(homa_pool, homa_pool_get_pages__set_limit_with_MIN_EXTRA)
+TEST_F(homa_pool, homa_pool_revoke_lease__page_in_use)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	atomic_set(&pool->free_bpages, 92);
-	pool->cores[raw_smp_processor_id()].next_candidate = 13;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(13, pages[0]);
-	EXPECT_EQ(0, pages[1]);
+	self->homa.bpage_lease_usecs = 1;
+	mock_ns = 5000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
+	pool->cores[3].page_hint = 1;
+	pool->lease_core = 3;
+	mock_ns = 7000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(2, pages[0]);
+	EXPECT_EQ(1, pool->descriptors[1].owner);
+	EXPECT_EQ(2, atomic_read(&pool->descriptors[1].refs));
 }
-TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_bpages)
+TEST_F(homa_pool, homa_pool_revoke_lease__cant_lock_page)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	mock_ns = 1000;
-	atomic_set(&pool->descriptors[0].refs, 2);
+	self->homa.bpage_lease_usecs = 1;
+	mock_ns = 5000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
 	atomic_set(&pool->descriptors[1].refs, 1);
-	pool->descriptors[1].owner = 3;
-	pool->descriptors[1].expiration = mock_ns + 1;
-	atomic_set(&pool->descriptors[2].refs, 1);
-	pool->descriptors[2].owner = 3;
-	pool->descriptors[2].expiration = mock_ns - 1;
-	atomic_set(&pool->descriptors[3].refs, 1);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	pool->cores[3].page_hint = 1;
+	pool->lease_core = 3;
+	mock_ns = 7000;
+	mock_trylock_errors = 1;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
 	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	EXPECT_EQ(1, pool->descriptors[1].owner);
 }
-TEST_F(homa_pool, homa_pool_get_pages__cant_lock_pages)
+TEST_F(homa_pool, homa_pool_revoke_lease__state_changes_while_locking)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	mock_ns = 1000;
-	mock_trylock_errors = 3;
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	self->homa.bpage_lease_usecs = 1;
+	mock_ns = 5000;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
+	atomic_set(&pool->descriptors[1].refs, 1);
+	pool->cores[3].page_hint = 1;
+	pool->lease_core = 3;
+	mock_ns = 7000;
+	unit_hook_register(use_page_hook);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
 	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(3, pages[1]);
+	EXPECT_EQ(1, pool->descriptors[1].owner);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->bpage_lease_revokes);
 }
-TEST_F(homa_pool, homa_pool_get_pages__state_changes_while_locking)
+
+TEST_F(homa_pool, homa_pool_get_pages__basics)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
 
-	mock_ns = 1000;
-	unit_hook_register(steal_bpages_hook);
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(2, pages[0]);
-	EXPECT_EQ(4, pages[1]);
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, pages[1]);
+	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
+	EXPECT_EQ(-1, pool->descriptors[1].owner);
+	EXPECT_EQ(98, atomic_read(&pool->free_bpages));
+}
+TEST_F(homa_pool, homa_pool_get_pages__not_enough_space)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	__u32 pages[10];
+
+	atomic_set(&pool->free_bpages, 1);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	atomic_set(&pool->free_bpages, 2);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 }
-TEST_F(homa_pool, homa_pool_get_pages__steal_expired_page)
+TEST_F(homa_pool, homa_pool_get_pages__revoke_all_expired_leases)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	__u32 pages[10];
+	int i;
 
-	pool->descriptors[0].owner = 5;
+	self->homa.bpage_lease_usecs = 1;
 	mock_ns = 5000;
-	pool->descriptors[0].expiration = mock_ns - 1;
-	atomic_set(&pool->free_bpages, 20);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
+	atomic_set(&pool->descriptors[0].refs, 1);
+	atomic_set(&pool->descriptors[1].refs, 1);
+	for (i = 0; i < pool->num_cores; i++)
+		pool->cores[i].page_hint = 5;
+	pool->cores[3].page_hint = 0;
+	pool->cores[6].page_hint = 1;
+	pool->lease_core = 1;
+
+	/* The pool is out of space, except for the expired leases. */
+	atomic_set(&pool->free_bpages, 0);
+	mock_ns = 7000;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
 	EXPECT_EQ(-1, pool->descriptors[0].owner);
-	EXPECT_EQ(19, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(-1, pool->descriptors[1].owner);
+	EXPECT_EQ(2, homa_metrics_per_cpu()->bpage_lease_revokes);
+	EXPECT_EQ(0, atomic_read(&pool->free_bpages));
+
+	/* Each core was checked exactly once more. */
+	EXPECT_EQ(2, pool->lease_core);
+}
+TEST_F(homa_pool, homa_pool_get_pages__lowest_index_first)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	__u32 pages[10];
+
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 4, pages, 0));
+	pages[0] = 2 << HOMA_BPAGE_SHIFT;
+	pages[1] = 0;
+	EXPECT_EQ(0, homa_pool_release_buffers(pool, 2, pages));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 3, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(2, pages[1]);
+	EXPECT_EQ(4, pages[2]);
+}
+TEST_F(homa_pool, homa_pool_get_pages__free_hint)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	__u32 pages[10];
+	int i;
+
+	/* Need a pool big enough for multiple summary words. */
+	ASSERT_EQ(0, homa_pool_init(&self->hsk, (void *) 0x1000000,
+			(__u64) 5000 * HOMA_BPAGE_SIZE));
+	for (i = 0; i < BITS_PER_LONG * BITS_PER_LONG; i++)
+		ASSERT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(BITS_PER_LONG * BITS_PER_LONG, pages[0]);
+	EXPECT_EQ(1, pool->free_hint);
+
+	pages[0] = 5 << HOMA_BPAGE_SHIFT;
+	EXPECT_EQ(0, homa_pool_release_buffers(pool, 1, pages));
+	EXPECT_EQ(0, pool->free_hint);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(5, pages[0]);
+}
+TEST_F(homa_pool, homa_pool_get_pages__free_map_out_of_sync)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	__u32 pages[100];
+
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 99, pages, 0));
+	atomic_set(&pool->free_bpages, 3);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(3, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(99, pages[0]);
 }
 TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 {
@@ -238,6 +453,30 @@ TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 			pool->descriptors[pages[1]].expiration);
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[1].refs));
 }
+TEST_F(homa_pool, homa_pool_get_pages__cost_independent_of_pool_state)
+{
+	static const int sizes[] = {100, 5000, 50000};
+	static const int fill_percents[] = {0, 50, 99};
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	__u64 few, many;
+	int i, j, k, fill;
+	__u32 page;
+
+	few = time_get_pages(pool);
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (j = 0; j < ARRAY_SIZE(fill_percents); j++) {
+			ASSERT_EQ(0, homa_pool_init(&self->hsk,
+					(void *) 0x1000000,
+					(__u64) sizes[i] * HOMA_BPAGE_SIZE));
+			fill = sizes[i] * fill_percents[j] / 100;
+			for (k = 0; k < fill; k++)
+				ASSERT_EQ(0, homa_pool_get_pages(pool, 1,
+						&page, 0));
+			many = time_get_pages(pool);
+			EXPECT_GT(5*few + 1000, many);
+		}
+	}
+}
 
 TEST_F(homa_pool, homa_pool_allocate__basics)
 {
@@ -254,6 +493,7 @@ TEST_F(homa_pool, homa_pool_allocate__basics)
 	EXPECT_EQ(2, pool->cores[raw_smp_processor_id()].page_hint);
 	EXPECT_EQ(150000 - 2*HOMA_BPAGE_SIZE,
 			pool->cores[raw_smp_processor_id()].allocated);
+	EXPECT_EQ(3, atomic_read(&self->hsk.bpages_held));
 }
 TEST_F(homa_pool, homa_pool_no_buffer_pool)
 {
@@ -300,8 +540,9 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_locked_and_page_stolen)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	struct homa_rpc *crpc;
+	__u32 pages[2];
 
-	pool->cores[raw_smp_processor_id()].next_candidate = 2;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	atomic_set(&pool->free_bpages, 40);
 	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2000);
@@ -348,8 +589,9 @@ TEST_F(homa_pool, homa_pool_allocate__owned_page_overflow)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	struct homa_rpc *crpc;
+	__u32 pages[2];
 
-	pool->cores[raw_smp_processor_id()].next_candidate = 2;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	atomic_set(&pool->free_bpages, 50);
 	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2000);
@@ -372,8 +614,9 @@ TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	struct homa_rpc *crpc1, *crpc2;
+	__u32 pages[2];
 
-	pool->cores[raw_smp_processor_id()].next_candidate = 2;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 2000);
 	ASSERT_NE(NULL, crpc1);
@@ -421,21 +664,126 @@ TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 			&self->server_ip, 4000, 102, 1000, 2000);
 
 	ASSERT_EQ(0, atomic_read(&pool->free_bpages));
-	ASSERT_FALSE(list_empty(&self->hsk.waiting_for_bufs));
-	rpc = list_first_entry(&self->hsk.waiting_for_bufs, struct homa_rpc,
+	ASSERT_FALSE(list_empty(&pool->waiting_for_bufs));
+	rpc = list_first_entry(&pool->waiting_for_bufs, struct homa_rpc,
 			buf_links);
 	EXPECT_EQ(98, rpc->id);
-	ASSERT_FALSE(list_is_last(&rpc->buf_links, &self->hsk.waiting_for_bufs));
+	ASSERT_FALSE(list_is_last(&rpc->buf_links, &pool->waiting_for_bufs));
 	rpc = list_next_entry(rpc, buf_links);
 	EXPECT_EQ(102, rpc->id);
-	ASSERT_FALSE(list_is_last(&rpc->buf_links, &self->hsk.waiting_for_bufs));
+	ASSERT_FALSE(list_is_last(&rpc->buf_links, &pool->waiting_for_bufs));
 	rpc = list_next_entry(rpc, buf_links);
 	EXPECT_EQ(100, rpc->id);
-	EXPECT_TRUE(list_is_last(&rpc->buf_links, &self->hsk.waiting_for_bufs));
+	EXPECT_TRUE(list_is_last(&rpc->buf_links, &pool->waiting_for_bufs));
 	EXPECT_EQ(3, homa_metrics_per_cpu()->buffer_alloc_failures);
 	EXPECT_EQ(1, pool->bpages_needed);
 }
 
+TEST_F(homa_pool, homa_pool_allocate__over_quota_but_no_waiters)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc;
+
+	self->homa.bpage_quota = 2;
+	homa_pool_get(pool);
+	atomic_set(&self->hsk.bpages_held, 5);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(6, atomic_read(&self->hsk.bpages_held));
+	homa_pool_put(pool);
+}
+TEST_F(homa_pool, homa_pool_allocate__over_quota_yields_to_waiter)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_sock hsk2;
+
+	self->homa.bpage_quota = 2;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	ASSERT_EQ(0, homa_sock_share_pool(&hsk2, &self->hsk));
+	atomic_set(&pool->free_bpages, 0);
+	crpc1 = unit_client_rpc(&hsk2, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	EXPECT_EQ(0, crpc1->msgin.num_bpages);
+
+	atomic_set(&pool->free_bpages, 1);
+	atomic_set(&self->hsk.bpages_held, 5);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			2000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->bpage_quota_deferrals);
+	EXPECT_EQ(crpc1, list_first_entry(&pool->waiting_for_bufs,
+			struct homa_rpc, buf_links));
+	EXPECT_EQ(crpc2, list_last_entry(&pool->waiting_for_bufs,
+			struct homa_rpc, buf_links));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_pool, homa_pool_allocate__sockets_under_quota_wait_first)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_sock hsk2;
+
+	self->homa.bpage_quota = 2;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	ASSERT_EQ(0, homa_sock_share_pool(&hsk2, &self->hsk));
+	atomic_set(&pool->free_bpages, 0);
+	atomic_set(&self->hsk.bpages_held, 5);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 98, 1000,
+			2000);
+	crpc2 = unit_client_rpc(&hsk2, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 100, 1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+
+	/* crpc2 is longer, but its socket is under quota. */
+	EXPECT_EQ(crpc2, list_first_entry(&pool->waiting_for_bufs,
+			struct homa_rpc, buf_links));
+	EXPECT_EQ(2, pool->bpages_needed);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_pool, homa_pool_allocate__socket_quota_overrides_sysctl)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_sock hsk2;
+
+	self->homa.bpage_quota = 0;
+	self->hsk.bpage_quota = 2;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	ASSERT_EQ(0, homa_sock_share_pool(&hsk2, &self->hsk));
+	atomic_set(&pool->free_bpages, 0);
+	crpc1 = unit_client_rpc(&hsk2, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 2*HOMA_BPAGE_SIZE);
+	ASSERT_NE(NULL, crpc1);
+
+	atomic_set(&pool->free_bpages, 1);
+	atomic_set(&self->hsk.bpages_held, 5);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 100, 1000,
+			2000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, crpc2->msgin.num_bpages);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->bpage_quota_deferrals);
+
+	/* A quota of 0 on the socket disables the sysctl quota. */
+	homa_rpc_free(crpc2);
+	self->homa.bpage_quota = 2;
+	self->hsk.bpage_quota = 0;
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&self->client_ip, &self->server_ip, 4000, 102, 1000,
+			2000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(1, crpc2->msgin.num_bpages);
+	homa_sock_destroy(&hsk2);
+}
+
 TEST_F(homa_pool, homa_pool_get_buffer)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
@@ -454,11 +802,97 @@ TEST_F(homa_pool, homa_pool_get_buffer)
 	EXPECT_EQ((void *) (pool->region + 2*HOMA_BPAGE_SIZE + 100), buffer);
 }
 
+TEST_F(homa_pool, homa_pool_copy_skb__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_data_hdr h;
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+	char *region;
+	int i;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 10000);
+	ASSERT_NE(NULL, crpc);
+	ASSERT_EQ(0, crpc->msgin.bpage_offsets[0]);
+
+	/* Substitute real memory for the first few pinned pages of the
+	 * region (page_address is the identity function in unit tests).
+	 */
+	region = malloc(4 * PAGE_SIZE);
+	memset(region, 0, 4 * PAGE_SIZE);
+	pool->num_pinned_pages = 4;
+	pool->pinned_pages = kmalloc_array(4, sizeof(struct page *),
+					   GFP_KERNEL);
+	for (i = 0; i < 4; i++)
+		pool->pinned_pages[i] = (struct page *)(region + i * PAGE_SIZE);
+
+	memset(&h, 0, sizeof(h));
+	h.common.type = DATA;
+	h.seg.offset = htonl(4000);
+	skb = mock_skb_new(&self->server_ip, &h.common, 1400, 4000);
+	EXPECT_EQ(0, homa_pool_copy_skb(crpc, skb));
+	EXPECT_EQ(0, memcmp(region + 4000, skb->data + sizeof(h), 1400));
+	kfree_skb(skb);
+	free(region);
+}
+TEST_F(homa_pool, homa_pool_copy_skb__not_pinned)
+{
+	struct homa_data_hdr h;
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 10000);
+	ASSERT_NE(NULL, crpc);
+	memset(&h, 0, sizeof(h));
+	h.common.type = DATA;
+	h.seg.offset = htonl(4000);
+	skb = mock_skb_new(&self->server_ip, &h.common, 1400, 4000);
+	EXPECT_EQ(EFAULT, -homa_pool_copy_skb(crpc, skb));
+	kfree_skb(skb);
+}
+TEST_F(homa_pool, homa_pool_copy_skb__contiguous_pages)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_data_hdr h;
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+	char *region;
+	int i;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 10000);
+	ASSERT_NE(NULL, crpc);
+
+	/* The fake pages are adjacent struct pages (as within a huge
+	 * page), so a chunk that crosses a page boundary must be copied
+	 * through the mapping of its first page.
+	 */
+	region = malloc(4 * PAGE_SIZE);
+	memset(region, 0, 4 * PAGE_SIZE);
+	pool->num_pinned_pages = 4;
+	pool->pinned_pages = kmalloc_array(4, sizeof(struct page *),
+					   GFP_KERNEL);
+	for (i = 0; i < 4; i++)
+		pool->pinned_pages[i] = ((struct page *)region) + i;
+
+	memset(&h, 0, sizeof(h));
+	h.common.type = DATA;
+	h.seg.offset = htonl(4000);
+	skb = mock_skb_new(&self->server_ip, &h.common, 1400, 4000);
+	EXPECT_EQ(0, homa_pool_copy_skb(crpc, skb));
+	EXPECT_EQ(0, memcmp(region + 4000, skb->data + sizeof(h), 1400));
+	kfree_skb(skb);
+	free(region);
+}
+
 TEST_F(homa_pool, homa_pool_release_buffers__basics)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
 	struct homa_rpc *crpc1, *crpc2;
 	char *saved_region;
+	__u32 buffer;
 
 	crpc1 = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
 			&self->server_ip, 4000, 98, 1000, 150000);
@@ -486,6 +920,10 @@ TEST_F(homa_pool, homa_pool_release_buffers__basics)
 			crpc1->msgin.bpage_offsets);
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
 	pool->region = saved_region;
+
+	/* Released bpages can be allocated again. */
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, &buffer, 0));
+	EXPECT_EQ(0, buffer);
 }
 TEST_F(homa_pool, homa_pool_release_buffers__bogus_offset)
 {
@@ -495,6 +933,35 @@ TEST_F(homa_pool, homa_pool_release_buffers__bogus_offset)
 						       1, &buffer));
 }
 
+TEST_F(homa_pool, homa_pool_return_buffers__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(3, atomic_read(&self->hsk.bpages_held));
+
+	EXPECT_EQ(0, homa_pool_return_buffers(&self->hsk, 2,
+			crpc->msgin.bpage_offsets));
+	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(&self->hsk.bpages_held));
+}
+TEST_F(homa_pool, homa_pool_return_buffers__count_doesnt_go_negative)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	atomic_set(&self->hsk.bpages_held, 1);
+
+	EXPECT_EQ(0, homa_pool_return_buffers(&self->hsk, 3,
+			crpc->msgin.bpage_offsets));
+	EXPECT_EQ(0, atomic_read(&self->hsk.bpages_held));
+}
+
 TEST_F(homa_pool, homa_pool_check_waiting__basics)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
@@ -565,7 +1032,7 @@ TEST_F(homa_pool, homa_pool_check_waiting__rpc_initially_locked)
 			"rpc lock unavailable in homa_pool_check_waiting",
 			unit_log_get());
 	EXPECT_EQ(1, crpc->msgin.num_bpages);
-	EXPECT_TRUE(list_empty(&self->hsk.waiting_for_bufs));
+	EXPECT_TRUE(list_empty(&pool->waiting_for_bufs));
 }
 TEST_F(homa_pool, homa_pool_check_waiting__reset_bpages_needed)
 {
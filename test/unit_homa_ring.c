@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "homa_impl.h"
+#include "homa_pool.h"
+#include "homa_ring.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+FIXTURE(homa_ring) {
+	struct in6_addr client_ip[1];
+	int client_port;
+	struct in6_addr server_ip[1];
+	int server_port;
+	__u64 client_id;
+	struct homa homa;
+	struct homa_sock hsk;
+	struct homa_ring_args args;
+	char *region;
+};
+FIXTURE_SETUP(homa_ring)
+{
+	struct homa_pool *pool;
+	int i;
+
+	self->client_ip[0] = unit_get_in_addr("196.168.0.1");
+	self->client_port = 40000;
+	self->server_ip[0] = unit_get_in_addr("1.2.3.4");
+	self->server_port = 99;
+	self->client_id = 1234;
+	homa_init(&self->homa);
+	self->homa.unsched_bytes = 10000;
+	self->homa.window_param = 10000;
+	mock_sock_init(&self->hsk, &self->homa, self->server_port);
+	self->args.entries = 4;
+	self->args.free_entries = 8;
+
+	/* Substitute real memory for the (fake) pinned pages of the buffer
+	 * region (page_address is the identity function in unit tests).
+	 */
+	pool = self->hsk.buffer_pool;
+	self->region = malloc(pool->num_bpages << HOMA_BPAGE_SHIFT);
+	pool->num_pinned_pages = (pool->num_bpages << HOMA_BPAGE_SHIFT)
+			>> PAGE_SHIFT;
+	pool->pinned_pages = kmalloc_array(pool->num_pinned_pages,
+					   sizeof(struct page *), GFP_KERNEL);
+	for (i = 0; i < pool->num_pinned_pages; i++)
+		pool->pinned_pages[i] = (struct page *)
+				(self->region + i * PAGE_SIZE);
+	self->hsk.ring = homa_ring_new(&self->args);
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_ring)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+	free(self->region);
+}
+
+TEST_F(homa_ring, homa_ring_new__bad_sizes)
+{
+	struct homa_ring_args args = {.entries = 0, .free_entries = 8};
+
+	EXPECT_EQ(-EINVAL, PTR_ERR(homa_ring_new(&args)));
+	args.entries = 6;
+	EXPECT_EQ(-EINVAL, PTR_ERR(homa_ring_new(&args)));
+	args.entries = 2 * HOMA_RING_MAX_ENTRIES;
+	EXPECT_EQ(-EINVAL, PTR_ERR(homa_ring_new(&args)));
+	args.entries = 8;
+	args.free_entries = 3;
+	EXPECT_EQ(-EINVAL, PTR_ERR(homa_ring_new(&args)));
+}
+TEST_F(homa_ring, homa_ring_new__no_memory)
+{
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(-ENOMEM, PTR_ERR(homa_ring_new(&self->args)));
+}
+TEST_F(homa_ring, homa_ring_new__basics)
+{
+	struct homa_ring *ring = self->hsk.ring;
+
+	ASSERT_FALSE(IS_ERR(ring));
+	EXPECT_EQ(3, ring->mask);
+	EXPECT_EQ(7, ring->free_mask);
+	EXPECT_EQ(0, ring->size % PAGE_SIZE);
+	EXPECT_EQ(4, ring->hdr->entries);
+	EXPECT_EQ(8, ring->hdr->free_entries);
+	EXPECT_EQ(sizeof(struct homa_ring_hdr), ring->hdr->entries_offset);
+	EXPECT_EQ(sizeof(struct homa_ring_hdr)
+			+ 4 * sizeof(struct homa_recvbatch_msg),
+			ring->hdr->free_offset);
+	EXPECT_EQ(0, ring->hdr->head);
+}
+
+TEST_F(homa_ring, homa_ring_recycle__basics)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_ring *ring = self->hsk.ring;
+	int free_bpages = atomic_read(&pool->free_bpages);
+
+	atomic_set(&pool->descriptors[2].refs, 1);
+	atomic_set(&pool->descriptors[5].refs, 1);
+	atomic_sub(2, &pool->free_bpages);
+	atomic_set(&self->hsk.bpages_held, 3);
+	ring->free[0] = 2 << HOMA_BPAGE_SHIFT;
+	ring->free[1] = 5 << HOMA_BPAGE_SHIFT;
+	ring->hdr->free_head = 2;
+	EXPECT_EQ(2, homa_ring_recycle(&self->hsk));
+	EXPECT_EQ(2, ring->hdr->free_tail);
+	EXPECT_EQ(free_bpages, atomic_read(&pool->free_bpages));
+	EXPECT_EQ(1, atomic_read(&self->hsk.bpages_held));
+	EXPECT_EQ(0, homa_ring_recycle(&self->hsk));
+}
+TEST_F(homa_ring, homa_ring_recycle__corrupt_index)
+{
+	struct homa_ring *ring = self->hsk.ring;
+
+	ring->hdr->free_head = 9;
+	EXPECT_EQ(0, homa_ring_recycle(&self->hsk));
+	EXPECT_EQ(0, ring->hdr->free_tail);
+}
+
+TEST_F(homa_ring, homa_ring_post__basics)
+{
+	struct homa_ring *ring = self->hsk.ring;
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			       self->server_ip, self->client_port,
+			       self->client_id, 3000, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+	EXPECT_TRUE(list_empty(&self->hsk.ready_requests));
+	EXPECT_EQ(1, ring->hdr->head);
+	EXPECT_EQ(self->client_id + 1, ring->entries[0].id);
+	EXPECT_EQ(3000, ring->entries[0].length);
+	EXPECT_EQ(1, ring->entries[0].num_bpages);
+	EXPECT_EQ(0, srpc->msgin.num_bpages);
+	EXPECT_EQ(1, atomic_read(&self->hsk.bpages_held));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->ring_posts);
+	EXPECT_TRUE(homa_ring_readable(ring));
+}
+TEST_F(homa_ring, homa_ring_post__recycled_bpages_check_waiting)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_ring *ring = self->hsk.ring;
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			       self->server_ip, self->client_port,
+			       self->client_id, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(0, pool->check_waiting_invoked);
+
+	/* Second message: the application has returned the first one's
+	 * bpage, so waiting RPCs must get a chance at it.
+	 */
+	ring->free[0] = ring->entries[0].bpage_offsets[0];
+	ring->hdr->free_head = 1;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			       self->server_ip, self->client_port,
+			       self->client_id + 2, 100, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(1, ring->hdr->free_tail);
+	EXPECT_EQ(1, pool->check_waiting_invoked);
+}
+TEST_F(homa_ring, homa_ring_post__incomplete_message)
+{
+	struct homa_ring *ring = self->hsk.ring;
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			       self->server_ip, self->client_port,
+			       self->client_id, 3000, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(RPC_INCOMING, srpc->state);
+	EXPECT_NE(0, atomic_read(&srpc->flags) & RPC_RING_WAITING);
+	EXPECT_TRUE(list_empty(&self->hsk.ready_requests));
+	EXPECT_EQ(0, ring->hdr->head);
+}
+TEST_F(homa_ring, homa_ring_post__ring_full)
+{
+	struct homa_ring *ring = self->hsk.ring;
+	struct homa_rpc *srpc;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+				       self->client_ip, self->server_ip,
+				       self->client_port,
+				       self->client_id + 2 * i, 100, 100);
+		ASSERT_NE(NULL, srpc);
+	}
+	EXPECT_EQ(4, ring->hdr->head);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->ring_overflows);
+	EXPECT_FALSE(list_empty(&self->hsk.ready_requests));
+	EXPECT_EQ(RPC_INCOMING, srpc->state);
+	EXPECT_NE(0, atomic_read(&srpc->flags) & RPC_PKTS_READY);
+}
@@ -12,6 +12,28 @@
 #define n(x) htons(x)
 #define N(x) htonl(x)
 
+/**
+ * peel() - Create a socket peeled off from another socket, sharing its
+ * buffer pool.
+ * @hsk:     Socket to initialize.
+ * @parent:  Socket from which @hsk is peeled off.
+ * @ip:      IP address of the remote host.
+ * @port:    Port number of the remote host (host byte order).
+ */
+static void peel(struct homa_sock *hsk, struct homa_sock *parent,
+		 struct in6_addr *ip, int port)
+{
+	union sockaddr_in_union addr;
+
+	mock_sock_init(hsk, parent->homa, 0);
+	homa_sock_share_pool(hsk, parent);
+	memset(&addr, 0, sizeof(addr));
+	addr.in6.sin6_family = AF_INET6;
+	addr.in6.sin6_addr = *ip;
+	addr.in6.sin6_port = htons(port);
+	homa_sock_peel(hsk, parent, &addr.sa);
+}
+
 FIXTURE(homa_rpc) {
 	struct in6_addr client_ip[1];
 	int client_port;
@@ -115,6 +137,38 @@ TEST_F(homa_rpc, homa_rpc_new_client__socket_shutdown)
 	EXPECT_EQ(ESHUTDOWN, -PTR_ERR(crpc));
 	self->hsk.shutdown = 0;
 }
+TEST_F(homa_rpc, homa_rpc_new_client__grow_table)
+{
+	struct homa_rpc *crpcs[HOMA_INITIAL_RPC_BUCKETS + 1];
+	int i;
+
+	for (i = 0; i < HOMA_INITIAL_RPC_BUCKETS; i++) {
+		crpcs[i] = homa_rpc_new_client(&self->hsk, &self->server_addr);
+		ASSERT_FALSE(IS_ERR(crpcs[i]));
+		homa_rpc_unlock(crpcs[i]);
+	}
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS,
+		  atomic_read(&self->hsk.client_rpcs));
+
+	crpcs[i] = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpcs[i]));
+	homa_rpc_unlock(crpcs[i]);
+	EXPECT_EQ(2*HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_table_grows);
+	for (i = 0; i <= HOMA_INITIAL_RPC_BUCKETS; i++) {
+		EXPECT_EQ(crpcs[i], homa_find_client_rpc(&self->hsk,
+				crpcs[i]->id));
+		homa_rpc_unlock(crpcs[i]);
+	}
+	homa_rpc_lock(crpcs[0], "test");
+	homa_rpc_free(crpcs[0]);
+	homa_rpc_unlock(crpcs[0]);
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS,
+		  atomic_read(&self->hsk.client_rpcs));
+}
 
 TEST_F(homa_rpc, homa_rpc_new_server__normal)
 {
@@ -472,12 +526,261 @@ TEST_F(homa_rpc, homa_rpc_free__remove_from_throttled_list)
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 10000, 1000);
+	struct homa_pacer *pacer = self->homa.default_pacer;
 
 	homa_add_to_throttled(crpc);
-	EXPECT_EQ(1, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(1, unit_rbtree_size(&pacer->throttled_rpcs));
 	unit_log_clear();
 	homa_rpc_free(crpc);
-	EXPECT_EQ(0, unit_list_length(&self->homa.throttled_rpcs));
+	EXPECT_EQ(0, unit_rbtree_size(&pacer->throttled_rpcs));
+}
+
+TEST_F(homa_rpc, homa_rpc_migrate__basics)
+{
+	struct homa_rpc *srpc, *found;
+	struct homa_sock hsk2;
+
+	self->hsk.accept_backlog = 5;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(1, self->hsk.accept_queue_len);
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_share_pool(&hsk2, &self->hsk));
+
+	homa_rpc_lock(srpc, "test");
+	EXPECT_EQ(0, homa_rpc_migrate(srpc, &hsk2));
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(&hsk2, srpc->hsk);
+	EXPECT_EQ(0, self->hsk.accept_queue_len);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.accept_queue));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&hsk2.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&hsk2.ready_requests));
+	EXPECT_EQ(0, atomic_read(&srpc->flags) & RPC_ACCEPT_QUEUED);
+	EXPECT_EQ(NULL, homa_find_server_rpc(&self->hsk, self->client_ip,
+			self->server_id));
+	found = homa_find_server_rpc(&hsk2, self->client_ip, self->server_id);
+	EXPECT_EQ(srpc, found);
+	if (found)
+		homa_rpc_unlock(found);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpcs_migrated);
+	EXPECT_EQ(0, atomic_read(&self->hsk.server_rpcs));
+	EXPECT_EQ(1, atomic_read(&hsk2.server_rpcs));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate__pools_differ)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	mock_sock_init(&hsk2, &self->homa, 0);
+
+	homa_rpc_lock(srpc, "test");
+	EXPECT_EQ(EINVAL, -homa_rpc_migrate(srpc, &hsk2));
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(&self->hsk, srpc->hsk);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate__rpcs_protected)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_share_pool(&hsk2, &self->hsk));
+
+	homa_protect_rpcs(&self->hsk);
+	homa_rpc_lock(srpc, "test");
+	EXPECT_EQ(EBUSY, -homa_rpc_migrate(srpc, &hsk2));
+	homa_rpc_unlock(srpc);
+	homa_unprotect_rpcs(&self->hsk);
+	EXPECT_EQ(&self->hsk, srpc->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	homa_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_rpc, homa_rpc_peer_pending)
+{
+	union sockaddr_in_union addr;
+	struct homa_rpc *srpc;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.in6.sin6_family = AF_INET6;
+	addr.in6.sin6_addr = *self->client_ip;
+	addr.in6.sin6_port = htons(self->client_port);
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_FALSE(homa_rpc_peer_pending(&self->hsk, &addr));
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port + 1,
+			self->server_id + 2, 100, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_FALSE(homa_rpc_peer_pending(&self->hsk, &addr));
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 4,
+			10000, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_TRUE(homa_rpc_peer_pending(&self->hsk, &addr));
+}
+
+TEST_F(homa_rpc, homa_rpc_migrate_peer__basics)
+{
+	struct homa_rpc *srpc1, *srpc2, *srpc3, *srpc4;
+	struct homa_sock hsk2;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			10000, 200);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 2,
+			100, 200);
+	srpc3 = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 4,
+			100, 200);
+	srpc4 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port + 1,
+			self->server_id + 6, 100, 200);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	ASSERT_NE(NULL, srpc3);
+	ASSERT_NE(NULL, srpc4);
+	peel(&hsk2, &self->hsk, self->client_ip, self->client_port);
+	EXPECT_TRUE(hsk2.migrating);
+
+	EXPECT_EQ(0, homa_rpc_migrate_peer(&self->hsk, &hsk2));
+	EXPECT_FALSE(hsk2.migrating);
+	EXPECT_EQ(&hsk2, srpc1->hsk);
+	EXPECT_EQ(&hsk2, srpc2->hsk);
+	EXPECT_EQ(&self->hsk, srpc3->hsk);
+	EXPECT_EQ(&self->hsk, srpc4->hsk);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(2, unit_list_length(&hsk2.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(2, homa_metrics_per_cpu()->rpcs_migrated);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate_peer__more_rpcs_than_batch)
+{
+	struct homa_rpc *srpc1, *srpc2, *srpc3;
+	struct homa_sock hsk2;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 2,
+			100, 200);
+	srpc3 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 4,
+			100, 200);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	ASSERT_NE(NULL, srpc3);
+	peel(&hsk2, &self->hsk, self->client_ip, self->client_port);
+
+	EXPECT_EQ(0, -homa_rpc_migrate_peer(&self->hsk, &hsk2));
+	EXPECT_EQ(&hsk2, srpc1->hsk);
+	EXPECT_EQ(&hsk2, srpc2->hsk);
+	EXPECT_EQ(&hsk2, srpc3->hsk);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(3, homa_metrics_per_cpu()->rpcs_migrated);
+	EXPECT_FALSE(hsk2.migrating);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate_peer__rpcs_protected_too_long)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	peel(&hsk2, &self->hsk, self->client_ip, self->client_port);
+
+	homa_protect_rpcs(&self->hsk);
+	EXPECT_EQ(0, -homa_rpc_migrate_peer(&self->hsk, &hsk2));
+	homa_unprotect_rpcs(&self->hsk);
+	EXPECT_EQ(&self->hsk, srpc->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_TRUE(hsk2.migrating);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate_peer__skip_rpc_being_received)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	peel(&hsk2, &self->hsk, self->client_ip, self->client_port);
+
+	atomic_or(RPC_HANDING_OFF, &srpc->flags);
+	EXPECT_EQ(0, homa_rpc_migrate_peer(&self->hsk, &hsk2));
+	atomic_andnot(RPC_HANDING_OFF, &srpc->flags);
+	EXPECT_EQ(&self->hsk, srpc->hsk);
+	EXPECT_FALSE(hsk2.migrating);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate_peer__pools_differ)
+{
+	union sockaddr_in_union addr;
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+
+	/* Like peel, but without sharing the pool. */
+	mock_sock_init(&hsk2, &self->homa, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.in6.sin6_family = AF_INET6;
+	addr.in6.sin6_addr = *self->client_ip;
+	addr.in6.sin6_port = htons(self->client_port);
+	EXPECT_EQ(0, -homa_sock_peel(&hsk2, &self->hsk, &addr.sa));
+
+	EXPECT_EQ(0, -homa_rpc_migrate_peer(&self->hsk, &hsk2));
+	EXPECT_EQ(&self->hsk, srpc->hsk);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->rpcs_migrated);
+	EXPECT_TRUE(hsk2.migrating);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_rpc, homa_rpc_migrate_peer__parent_shutdown)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	peel(&hsk2, &self->hsk, self->client_ip, self->client_port);
+
+	/* Leave the RPC in the list, as if shutdown were in progress. */
+	self->hsk.shutdown = true;
+	EXPECT_EQ(ESHUTDOWN, -homa_rpc_migrate_peer(&self->hsk, &hsk2));
+	self->hsk.shutdown = false;
+	EXPECT_EQ(&self->hsk, srpc->hsk);
+	EXPECT_FALSE(hsk2.migrating);
+	homa_sock_destroy(&hsk2);
 }
 
 TEST_F(homa_rpc, homa_rpc_reap__basics)
@@ -622,6 +925,22 @@ TEST_F(homa_rpc, homa_rpc_reap__release_buffers)
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
 	EXPECT_EQ(1, self->hsk.buffer_pool->check_waiting_invoked);
 }
+TEST_F(homa_rpc, homa_rpc_reap__release_pacer)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1000);
+	struct homa_pacer *pacer = self->homa.default_pacer;
+	int refs;
+
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(pacer, crpc->msgout.pacer);
+	refs = refcount_read(&pacer->refs);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(refs, refcount_read(&pacer->refs));
+	homa_rpc_reap(&self->hsk, 100);
+	EXPECT_EQ(refs - 1, refcount_read(&pacer->refs));
+}
 TEST_F(homa_rpc, homa_rpc_reap__free_gaps)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -644,6 +963,138 @@ TEST_F(homa_rpc, homa_rpc_reap__nothing_to_reap)
 	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
 }
 
+TEST_F(homa_rpc, homa_reapers_init__basics)
+{
+	/* Cores 0 and 2 are on node 1, all others on node 0. */
+	ASSERT_NE(NULL, self->homa.reapers[0]);
+	ASSERT_NE(NULL, self->homa.reapers[1]);
+	EXPECT_EQ(NULL, self->homa.reapers[2]);
+	EXPECT_EQ(1, self->homa.reapers[1]->node);
+	EXPECT_EQ(self->homa.reapers[0], self->hsk.reaper);
+}
+TEST_F(homa_rpc, homa_reapers_init__kmalloc_error)
+{
+	struct homa homa2;
+
+	memset(&homa2, 0, sizeof(homa2));
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_reapers_init(&homa2));
+	EXPECT_EQ(NULL, homa2.reapers[0]);
+	homa_reapers_destroy(&homa2);
+}
+TEST_F(homa_rpc, homa_reapers_init__cant_create_thread)
+{
+	struct homa homa2;
+
+	memset(&homa2, 0, sizeof(homa2));
+	mock_kthread_create_errors = 1;
+	EXPECT_EQ(EACCES, -homa_reapers_init(&homa2));
+	EXPECT_SUBSTR("couldn't create homa reaper thread for node 1",
+		      mock_printk_output);
+	homa_reapers_destroy(&homa2);
+}
+
+TEST_F(homa_rpc, homa_reaper_enqueue__no_thread)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 100);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_TRUE(list_empty(&self->hsk.reap_links));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->reaper_queued);
+}
+TEST_F(homa_rpc, homa_reaper_enqueue__basics)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 100);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id + 2, 5000, 100);
+	struct homa_reaper *reaper = self->hsk.reaper;
+	struct task_struct task;
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	task.pid = 77;
+	reaper->thread = &task;
+	unit_log_clear();
+	homa_rpc_free(crpc1);
+	EXPECT_SUBSTR("wake_up_process pid 77", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&reaper->socks));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->reaper_queued);
+
+	/* Second free: socket already queued. */
+	homa_rpc_free(crpc2);
+	EXPECT_EQ(1, unit_list_length(&reaper->socks));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->reaper_queued);
+	reaper->thread = NULL;
+}
+TEST_F(homa_rpc, homa_reaper_enqueue__socket_shutdown)
+{
+	struct homa_reaper *reaper = self->hsk.reaper;
+	struct task_struct task;
+
+	task.pid = 77;
+	reaper->thread = &task;
+	self->hsk.shutdown = true;
+	homa_reaper_enqueue(&self->hsk);
+	self->hsk.shutdown = false;
+	EXPECT_TRUE(list_empty(&reaper->socks));
+	reaper->thread = NULL;
+}
+
+TEST_F(homa_rpc, homa_reaper_dequeue)
+{
+	struct homa_reaper *reaper = self->hsk.reaper;
+	struct task_struct task;
+
+	task.pid = 77;
+	reaper->thread = &task;
+	homa_reaper_enqueue(&self->hsk);
+	EXPECT_EQ(1, unit_list_length(&reaper->socks));
+	homa_reaper_dequeue(&self->hsk);
+	EXPECT_TRUE(list_empty(&reaper->socks));
+	EXPECT_TRUE(list_empty(&self->hsk.reap_links));
+	reaper->thread = NULL;
+}
+
+TEST_F(homa_rpc, homa_reaper_run__requeue_if_more_work)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 2000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id + 2, 5000, 100);
+	struct homa_reaper *reaper = self->hsk.reaper;
+	struct task_struct task;
+	int i;
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	task.pid = 77;
+	reaper->thread = &task;
+	self->homa.reap_limit = 7;
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	unit_log_clear();
+
+	homa_reaper_run(reaper);
+	EXPECT_STREQ("reaped 1234; wake_up_process pid 77", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&reaper->socks));
+	EXPECT_EQ(NULL, reaper->active_hsk);
+	EXPECT_STREQ("1236", dead_rpcs(&self->hsk));
+
+	for (i = 0; i < 10 && !list_empty(&reaper->socks); i++)
+		homa_reaper_run(reaper);
+	EXPECT_TRUE(list_empty(&reaper->socks));
+	EXPECT_STREQ("", dead_rpcs(&self->hsk));
+	reaper->thread = NULL;
+}
+
 TEST_F(homa_rpc, homa_find_client_rpc)
 {
 	struct homa_rpc *crpc1, *crpc2, *crpc3, *crpc4;
@@ -716,3 +1167,28 @@ TEST_F(homa_rpc, homa_find_server_rpc)
 	homa_rpc_unlock(srpc4);
 	EXPECT_EQ(NULL, homa_find_server_rpc(&self->hsk, self->client_ip, 3));
 }
+
+TEST_F(homa_rpc, homa_find_parent_rpc__basics)
+{
+	struct homa_rpc *srpc, *found;
+	struct homa_sock hsk2;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(NULL, homa_find_parent_rpc(&self->hsk, self->client_ip,
+			self->server_id));
+	peel(&hsk2, &self->hsk, self->client_ip, self->client_port);
+
+	EXPECT_EQ(NULL, homa_find_server_rpc(&hsk2, self->client_ip,
+			self->server_id));
+	found = homa_find_parent_rpc(&hsk2, self->client_ip, self->server_id);
+	EXPECT_EQ(srpc, found);
+	if (found)
+		homa_rpc_unlock(found);
+	EXPECT_EQ(NULL, homa_find_parent_rpc(&hsk2, self->client_ip,
+			self->server_id + 2));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->parent_rpc_lookups);
+	homa_sock_destroy(&hsk2);
+}
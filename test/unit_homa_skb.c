@@ -448,6 +448,55 @@ TEST_F(homa_skb, homa_skb_append_from_iter__no_memory)
 			iter, 2000));
 }
 
+TEST_F(homa_skb, homa_skb_append_zerocopy__basics)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 1000, 10000);
+	struct skb_shared_info *shinfo = skb_shinfo(self->skb);
+
+	unit_log_clear();
+	EXPECT_EQ(0, homa_skb_append_zerocopy(&self->homa, self->skb, iter,
+			5000));
+	EXPECT_STREQ("iov_iter_get_pages2 5000 bytes at 1000",
+			unit_log_get());
+	EXPECT_EQ(2, shinfo->nr_frags);
+	EXPECT_EQ(1000, skb_frag_off(&shinfo->frags[0]));
+	EXPECT_EQ(PAGE_SIZE - 1000, skb_frag_size(&shinfo->frags[0]));
+	EXPECT_EQ(0, skb_frag_off(&shinfo->frags[1]));
+	EXPECT_EQ(5000 - (PAGE_SIZE - 1000), skb_frag_size(&shinfo->frags[1]));
+	EXPECT_EQ(5000, self->skb->len);
+	EXPECT_EQ(5000, iter->count);
+}
+TEST_F(homa_skb, homa_skb_append_zerocopy__out_of_frags)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 0, 10000);
+	struct skb_shared_info *shinfo = skb_shinfo(self->skb);
+
+	mock_max_skb_frags = 2;
+	unit_log_clear();
+	EXPECT_EQ(EMSGSIZE, -homa_skb_append_zerocopy(&self->homa, self->skb,
+			iter, 10000));
+	EXPECT_EQ(2, shinfo->nr_frags);
+	EXPECT_EQ(2 * PAGE_SIZE, self->skb->len);
+}
+
+TEST_F(homa_skb, homa_skb_max_zerocopy_data__interleaved)
+{
+	mock_max_skb_frags = 17;
+	EXPECT_EQ(8400, homa_skb_max_zerocopy_data(1400, 10000, true));
+	EXPECT_EQ(5600, homa_skb_max_zerocopy_data(1400, 5600, true));
+
+	/* Always room for at least one segment. */
+	mock_max_skb_frags = 2;
+	EXPECT_EQ(8000, homa_skb_max_zerocopy_data(8000, 16000, true));
+}
+TEST_F(homa_skb, homa_skb_max_zerocopy_data__not_interleaved)
+{
+	mock_max_skb_frags = 17;
+	EXPECT_EQ((16 * PAGE_SIZE / 1400) * 1400,
+			homa_skb_max_zerocopy_data(1400, 100000, false));
+	EXPECT_EQ(9800, homa_skb_max_zerocopy_data(1400, 9800, false));
+}
+
 TEST_F(homa_skb, homa_skb_append_from_skb__header_only)
 {
 	struct sk_buff *src_skb = test_skb(&self->homa);
@@ -541,6 +590,27 @@ TEST_F(homa_skb, homa_skb_append_from_skb__dst_runs_out_of_frags)
 	kfree_skb(dst_skb);
 }
 
+TEST_F(homa_skb, homa_skb_append_from_skb__zerocopy)
+{
+	struct sk_buff *src_skb = test_skb(&self->homa);
+	struct sk_buff *dst_skb = homa_skb_new_tx(100);
+	struct ubuf_info *uarg;
+
+	uarg = msg_zerocopy_realloc(NULL, 1000, NULL);
+	skb_zcopy_set(src_skb, uarg, NULL);
+	net_zcopy_put(uarg);
+	EXPECT_EQ(0, homa_skb_append_from_skb(&self->homa, dst_skb, src_skb,
+			320, 600));
+	EXPECT_EQ(uarg, skb_zcopy(dst_skb));
+
+	/* The notification mustn't happen until both skbs are gone. */
+	unit_log_clear();
+	kfree_skb(src_skb);
+	EXPECT_STREQ("", unit_log_get());
+	kfree_skb(dst_skb);
+	EXPECT_STREQ("zerocopy notification, zerocopy", unit_log_get());
+}
+
 TEST_F(homa_skb, homa_skb_free_many_tx__basics)
 {
 	struct sk_buff *skbs[2];
@@ -599,6 +669,27 @@ TEST_F(homa_skb, homa_skb_free_many_tx__check_page_order)
 	EXPECT_EQ(page, self->homa.page_pools[0]->pages[0]);
 }
 
+TEST_F(homa_skb, homa_skb_free_many_tx__dont_cache_zerocopy_pages)
+{
+	struct ubuf_info *uarg;
+	struct sk_buff *skb;
+	int i, length;
+
+	skb = homa_skb_new_tx(100);
+	for (i = 0; i < 3; i++) {
+		length = 2 * HOMA_SKB_PAGE_SIZE;
+		homa_skb_extend_frags(&self->homa, skb, &length);
+	}
+	uarg = msg_zerocopy_realloc(NULL, 1000, NULL);
+	skb_zcopy_set(skb, uarg, NULL);
+	net_zcopy_put(uarg);
+
+	unit_log_clear();
+	homa_skb_free_many_tx(&self->homa, &skb, 1);
+	EXPECT_EQ(0, self->homa.page_pools[0]->avail);
+	EXPECT_STREQ("zerocopy notification, zerocopy", unit_log_get());
+}
+
 TEST_F(homa_skb, homa_skb_cache_pages__different_numa_nodes)
 {
 	struct page *pages[4];
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: BSD-2-Clause
 
 #include "homa_impl.h"
+#include "homa_pool.h"
 #include "homa_sock.h"
 #define KSELFTEST_NOT_MAIN 1
 #include "kselftest_harness.h"
@@ -21,6 +22,51 @@ int num_active_scans(struct homa_socktab *socktab)
 	return count;
 }
 
+/**
+ * set_remote() - Fill in an IPv6 socket address for use with
+ * homa_sock_find_connected and homa_sock_peel.
+ * @addr:   Address to fill in.
+ * @ip:     IP address, in the form accepted by unit_get_in_addr.
+ * @port:   Port number (host byte order).
+ * Return:  @addr, as a struct sockaddr.
+ */
+static struct sockaddr *set_remote(union sockaddr_in_union *addr, char *ip,
+				   int port)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->in6.sin6_family = AF_INET6;
+	addr->in6.sin6_addr = unit_get_in_addr(ip);
+	addr->in6.sin6_port = htons(port);
+	return &addr->sa;
+}
+
+/**
+ * time_lookups() - Measure the cost of homa_sock_find_connected.
+ * @socktab:  Table in which to perform lookups.
+ * @addr:     Remote address to look up.
+ * @port:     Local port to look up.
+ * Return:    The smallest number of cycles measured for a batch of
+ *            1000 lookups (the minimum filters out noise).
+ */
+static __u64 time_lookups(struct homa_socktab *socktab,
+			  struct sockaddr *addr, int port)
+{
+	__u64 start, elapsed, best = ~0ULL;
+	int i, j;
+
+	mock_cycles = ~0;
+	for (i = 0; i < 10; i++) {
+		start = mock_get_cycles();
+		for (j = 0; j < 1000; j++)
+			homa_sock_find_connected(socktab, addr, port);
+		elapsed = mock_get_cycles() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	mock_cycles = 0;
+	return best;
+}
+
 FIXTURE(homa_sock) {
 	struct homa homa;
 	struct homa_sock hsk;
@@ -148,6 +194,17 @@ TEST_F(homa_sock, homa_sock_init__kzalloc_failure)
 	EXPECT_EQ(ENOMEM, -homa_sock_init(&sock, &self->homa));
 	homa_sock_destroy(&sock);
 }
+TEST_F(homa_sock, homa_sock_init__rpc_tables)
+{
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.server_rpc_table->mask);
+	EXPECT_EQ(1, self->hsk.client_rpc_table->buckets[1].id);
+	EXPECT_EQ(1000001, self->hsk.server_rpc_table->buckets[1].id);
+	EXPECT_EQ(0, atomic_read(&self->hsk.client_rpcs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.server_rpcs));
+}
 TEST_F(homa_sock, homa_sock_init__hijack_tcp)
 {
 	struct homa_sock hijack, no_hijack;
@@ -238,6 +295,33 @@ TEST_F(homa_sock, homa_sock_unlink__remove_from_map)
 	EXPECT_EQ(NULL, homa_sock_find(self->homa.port_map, client3));
 }
 
+TEST_F(homa_sock, homa_sock_unlink__release_socktab_reference)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(2, refcount_read(&hsk2.sock.sk_refcnt));
+	homa_sock_shutdown(&hsk2);
+	EXPECT_EQ(1, refcount_read(&hsk2.sock.sk_refcnt));
+}
+TEST_F(homa_sock, homa_sock_unlink__remove_connected)
+{
+	union sockaddr_in_union addr;
+	struct homa_sock hsk2;
+
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_peel(&hsk2, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40000)));
+	EXPECT_EQ(&hsk2, homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, 100));
+
+	homa_sock_shutdown(&hsk2);
+	EXPECT_TRUE(hlist_unhashed(&hsk2.conn_links.hash_links));
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, 100));
+}
+
 TEST_F(homa_sock, homa_sock_shutdown__unlink_socket)
 {
 	struct homa_sock hsk;
@@ -283,18 +367,25 @@ TEST_F(homa_sock, homa_sock_shutdown__wakeup_interests)
 	struct task_struct task1, task2, task3;
 
 	interest1.thread = &task1;
+	interest1.core = 1;
 	task1.pid = 100;
 	interest2.thread = &task2;
+	interest2.core = 0;
 	task2.pid = 200;
 	interest3.thread = &task3;
+	interest3.core = 0;
 	task3.pid = 300;
 	EXPECT_FALSE(self->hsk.shutdown);
-	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
-	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
-	list_add_tail(&interest3.response_links, &self->hsk.response_interests);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest1.request_links, interest1.core);
+	homa_interest_queue_add(&self->hsk.request_interests,
+			&interest2.request_links, interest2.core);
+	homa_interest_queue_add(&self->hsk.response_interests,
+			&interest3.response_links, interest3.core);
+	unit_log_clear();
 	homa_sock_shutdown(&self->hsk);
 	EXPECT_TRUE(self->hsk.shutdown);
-	EXPECT_STREQ("wake_up_process pid -1; wake_up_process pid 100; "
+	EXPECT_STREQ("wake_up_process pid 100; "
 			"wake_up_process pid 200; wake_up_process pid 300",
 			unit_log_get());
 }
@@ -333,6 +424,180 @@ TEST_F(homa_sock, homa_sock_bind__socket_shutdown)
 			100));
 }
 
+TEST_F(homa_sock, homa_sock_bind__rehash_connected_socket)
+{
+	union sockaddr_in_union addr;
+
+	set_remote(&addr, "1.2.3.4", 40000);
+	self->hsk.remote_host = addr;
+	self->hsk.connect = true;
+	homa_sock_hash_connected(&self->hsk);
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, self->hsk.port));
+
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, 100));
+}
+
+TEST_F(homa_sock, homa_sock_hash_connected__socket_shutdown)
+{
+	union sockaddr_in_union addr;
+
+	homa_sock_shutdown(&self->hsk);
+	set_remote(&addr, "1.2.3.4", 40000);
+	self->hsk.remote_host = addr;
+	self->hsk.connect = true;
+	homa_sock_hash_connected(&self->hsk);
+	EXPECT_TRUE(hlist_unhashed(&self->hsk.conn_links.hash_links));
+}
+TEST_F(homa_sock, homa_sock_cache_peer__basics)
+{
+	union sockaddr_in_union addr;
+
+	set_remote(&addr, "1.2.3.4", 40000);
+	self->hsk.remote_host = addr;
+	homa_sock_cache_peer(&self->hsk);
+	ASSERT_NE(NULL, self->hsk.peer);
+	EXPECT_TRUE(ipv6_addr_equal(&addr.in6.sin6_addr,
+				    &self->hsk.peer->addr));
+}
+TEST_F(homa_sock, homa_sock_cache_peer__route_error)
+{
+	union sockaddr_in_union addr;
+
+	set_remote(&addr, "1.2.3.4", 40000);
+	self->hsk.remote_host = addr;
+	mock_route_errors = 1;
+	homa_sock_cache_peer(&self->hsk);
+	EXPECT_EQ(NULL, self->hsk.peer);
+}
+TEST_F(homa_sock, homa_sock_unhash_connected)
+{
+	union sockaddr_in_union addr;
+
+	set_remote(&addr, "1.2.3.4", 40000);
+	self->hsk.remote_host = addr;
+	self->hsk.connect = true;
+	homa_sock_hash_connected(&self->hsk);
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, self->hsk.port));
+
+	homa_sock_cache_peer(&self->hsk);
+	ASSERT_NE(NULL, self->hsk.peer);
+	self->hsk.dst = self->hsk.peer->dst;
+	dst_hold(self->hsk.dst);
+
+	homa_sock_unhash_connected(&self->hsk);
+	EXPECT_TRUE(hlist_unhashed(&self->hsk.conn_links.hash_links));
+	EXPECT_FALSE(self->hsk.connect);
+	EXPECT_EQ(NULL, self->hsk.peer);
+	EXPECT_EQ(NULL, self->hsk.dst);
+	EXPECT_EQ(AF_UNSPEC, self->hsk.remote_host.in4.sin_family);
+	EXPECT_EQ(0, self->hsk.inet.inet_dport);
+}
+
+TEST_F(homa_sock, homa_sock_peel__basics)
+{
+	union sockaddr_in_union addr;
+	struct homa_sock hsk2;
+
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_peel(&hsk2, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40000)));
+	EXPECT_EQ(100, hsk2.port);
+	EXPECT_EQ(htons(100), hsk2.inet.inet_sport);
+	EXPECT_TRUE(hsk2.connect);
+	EXPECT_EQ(htons(40000), hsk2.remote_host.in6.sin6_port);
+	EXPECT_EQ(htons(40000), hsk2.inet.inet_dport);
+	EXPECT_TRUE(hsk2.migrating);
+	EXPECT_NE(NULL, hsk2.peer);
+
+	/* The parent must still own the port. */
+	EXPECT_EQ(&self->hsk, homa_sock_find(self->homa.port_map, 100));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_peel__parent_shutdown)
+{
+	union sockaddr_in_union addr;
+	struct homa_sock hsk2;
+	int port;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	port = hsk2.port;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(ESHUTDOWN, -homa_sock_peel(&hsk2, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40000)));
+	EXPECT_EQ(port, hsk2.port);
+	EXPECT_FALSE(hsk2.connect);
+	homa_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_sock, homa_sock_parent__basics)
+{
+	union sockaddr_in_union addr;
+	struct homa_sock hsk2;
+
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(NULL, homa_sock_parent(&hsk2));
+	EXPECT_EQ(0, homa_sock_peel(&hsk2, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40000)));
+	EXPECT_EQ(&self->hsk, homa_sock_parent(&hsk2));
+	EXPECT_EQ(NULL, homa_sock_parent(&self->hsk));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_parent__parent_shut_down)
+{
+	union sockaddr_in_union addr;
+	struct homa_sock hsk2, hsk3;
+
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	mock_sock_init(&hsk2, &self->homa, 0);
+	mock_sock_init(&hsk3, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_peel(&hsk2, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40000)));
+	EXPECT_EQ(0, homa_sock_peel(&hsk3, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40001)));
+	homa_sock_shutdown(&self->hsk);
+
+	/* The first socket on the port is now a sibling. */
+	EXPECT_EQ(NULL, homa_sock_parent(&hsk2));
+	EXPECT_EQ(NULL, homa_sock_parent(&hsk3));
+	homa_sock_destroy(&hsk2);
+	homa_sock_destroy(&hsk3);
+}
+
+TEST_F(homa_sock, homa_sock_share_pool__basics)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_NE(self->hsk.buffer_pool, hsk2.buffer_pool);
+	EXPECT_EQ(0, homa_sock_share_pool(&hsk2, &self->hsk));
+	EXPECT_EQ(self->hsk.buffer_pool, hsk2.buffer_pool);
+	EXPECT_TRUE(homa_pool_shared(self->hsk.buffer_pool));
+
+	/* The pool must survive the shutdown of either socket. */
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_FALSE(homa_pool_shared(hsk2.buffer_pool));
+	EXPECT_EQ(100, hsk2.buffer_pool->num_bpages);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_share_pool__parent_shutdown)
+{
+	struct homa_pool *pool;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	pool = hsk2.buffer_pool;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(ESHUTDOWN, -homa_sock_share_pool(&hsk2, &self->hsk));
+	EXPECT_EQ(pool, hsk2.buffer_pool);
+	homa_sock_destroy(&hsk2);
+}
+
 TEST_F(homa_sock, homa_sock_find__basics)
 {
 	struct homa_sock hsk2;
@@ -377,6 +642,93 @@ TEST_F(homa_sock, homa_sock_find__long_hash_chain)
 	homa_sock_destroy(&hsk4);
 }
 
+TEST_F(homa_sock, homa_sock_find_connected__basics)
+{
+	union sockaddr_in_union addr;
+	struct homa_sock hsk2, hsk3;
+
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_peel(&hsk2, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40000)));
+	mock_sock_init(&hsk3, &self->homa, 0);
+	EXPECT_EQ(0, homa_sock_peel(&hsk3, &self->hsk,
+			set_remote(&addr, "1.2.3.4", 40001)));
+
+	EXPECT_EQ(&hsk2, homa_sock_find_connected(self->homa.port_map,
+			set_remote(&addr, "1.2.3.4", 40000), 100));
+	EXPECT_EQ(&hsk3, homa_sock_find_connected(self->homa.port_map,
+			set_remote(&addr, "1.2.3.4", 40001), 100));
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			set_remote(&addr, "1.2.3.4", 40002), 100));
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			set_remote(&addr, "1.2.3.5", 40000), 100));
+	EXPECT_EQ(NULL, homa_sock_find_connected(self->homa.port_map,
+			set_remote(&addr, "1.2.3.4", 40000), 101));
+	homa_sock_destroy(&hsk2);
+	homa_sock_destroy(&hsk3);
+}
+TEST_F(homa_sock, homa_sock_find_connected__no_listener)
+{
+	union sockaddr_in_union addr;
+
+	/* A socket on which connect was invoked accepts packets only
+	 * from its peer.
+	 */
+	set_remote(&addr, "1.2.3.4", 99);
+	self->hsk.remote_host = addr;
+	self->hsk.connect = true;
+	homa_sock_hash_connected(&self->hsk);
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, self->hsk.port));
+	EXPECT_EQ(NULL, homa_sock_find_connected(self->homa.port_map,
+			set_remote(&addr, "1.2.3.4", 100), self->hsk.port));
+}
+TEST_F(homa_sock, homa_sock_find_connected__lookup_cost_independent_of_conns)
+{
+#define NUM_CONNS 500
+	__u64 conn_few, conn_many, listen_few, listen_many;
+	union sockaddr_in_union addr, other;
+	struct homa_sock *socks;
+	int i;
+
+	/* This is a microbenchmark: the time to find a connected socket
+	 * (or fall back to the listener) shouldn't change much as the
+	 * number of peeled-off sockets on the port grows. With a linear
+	 * search of the port's chain, the second measurement would be
+	 * hundreds of times larger than the first.
+	 */
+	socks = kmalloc(NUM_CONNS * sizeof(*socks), GFP_KERNEL);
+	ASSERT_NE(NULL, socks);
+	EXPECT_EQ(0, homa_sock_bind(self->homa.port_map, &self->hsk, 100));
+	set_remote(&other, "2.2.2.2", 1000);
+	for (i = 0; i < NUM_CONNS; i++) {
+		mock_sock_init(&socks[i], &self->homa, 0);
+		EXPECT_EQ(0, homa_sock_peel(&socks[i], &self->hsk,
+				set_remote(&addr, "1.2.3.4", 40000 + i)));
+		if (i == 0) {
+			conn_few = time_lookups(self->homa.port_map,
+					&addr.sa, 100);
+			listen_few = time_lookups(self->homa.port_map,
+					&other.sa, 100);
+		}
+	}
+	set_remote(&addr, "1.2.3.4", 40000);
+	EXPECT_EQ(&socks[0], homa_sock_find_connected(self->homa.port_map,
+			&addr.sa, 100));
+	EXPECT_EQ(&self->hsk, homa_sock_find_connected(self->homa.port_map,
+			&other.sa, 100));
+	conn_many = time_lookups(self->homa.port_map, &addr.sa, 100);
+	listen_many = time_lookups(self->homa.port_map, &other.sa, 100);
+	EXPECT_GT(5*conn_few + 1000, conn_many);
+	EXPECT_GT(5*listen_few + 1000, listen_many);
+
+	for (i = 0; i < NUM_CONNS; i++)
+		homa_sock_destroy(&socks[i]);
+	kfree(socks);
+#undef NUM_CONNS
+}
+
 TEST_F(homa_sock, homa_sock_lock_slow)
 {
 	mock_ns_tick = 100;
@@ -392,3 +744,67 @@ TEST_F(homa_sock, homa_sock_lock_slow)
 	EXPECT_EQ(100, homa_metrics_per_cpu()->socket_lock_miss_ns);
 	homa_sock_unlock(&self->hsk);
 }
+
+TEST_F(homa_sock, homa_rpc_table_grow__basics)
+{
+	struct homa_rpc_table *old = self->hsk.server_rpc_table;
+	struct homa_rpc *srpc1, *srpc2, *found;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, 1235, 10000, 100);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port,
+			1235 + 2*HOMA_INITIAL_RPC_BUCKETS, 10000, 100);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	EXPECT_EQ(srpc1->bucket, srpc2->bucket);
+
+	homa_rpc_table_grow(&self->hsk, true);
+	EXPECT_EQ(2*HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.server_rpc_table->mask);
+	EXPECT_EQ(old, self->hsk.server_rpc_table->prev);
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+	EXPECT_NE(srpc1->bucket, srpc2->bucket);
+	EXPECT_TRUE(old->buckets[(1235 >> 1) & old->mask].moved);
+	EXPECT_EQ(1000000 + ((1235 + 2*HOMA_INITIAL_RPC_BUCKETS) >> 1
+			& self->hsk.server_rpc_table->mask),
+		  srpc2->bucket->id);
+	found = homa_find_server_rpc(&self->hsk, self->client_ip, 1235);
+	EXPECT_EQ(srpc1, found);
+	if (found)
+		homa_rpc_unlock(found);
+	found = homa_find_server_rpc(&self->hsk, self->client_ip,
+				     1235 + 2*HOMA_INITIAL_RPC_BUCKETS);
+	EXPECT_EQ(srpc2, found);
+	if (found)
+		homa_rpc_unlock(found);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_table_grows);
+}
+TEST_F(homa_sock, homa_rpc_table_grow__table_already_max_size)
+{
+	int i;
+
+	for (i = HOMA_INITIAL_RPC_BUCKETS; i < HOMA_CLIENT_RPC_BUCKETS; i *= 2)
+		homa_rpc_table_grow(&self->hsk, false);
+	EXPECT_EQ(HOMA_CLIENT_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+	homa_rpc_table_grow(&self->hsk, false);
+	EXPECT_EQ(HOMA_CLIENT_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+}
+TEST_F(homa_sock, homa_rpc_table_grow__table_lock_busy)
+{
+	mock_trylock_errors = 1;
+	homa_rpc_table_grow(&self->hsk, false);
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+}
+TEST_F(homa_sock, homa_rpc_table_grow__kmalloc_failure)
+{
+	mock_kmalloc_errors = 1;
+	homa_rpc_table_grow(&self->hsk, false);
+	EXPECT_EQ(HOMA_INITIAL_RPC_BUCKETS - 1,
+		  self->hsk.client_rpc_table->mask);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->rpc_table_grows);
+}
@@ -89,7 +89,18 @@ TEST_F(homa_utils, homa_init__cant_create_pacer_thread)
 	memset(&homa2, 0, sizeof(homa2));
 	mock_kthread_create_errors = 1;
 	EXPECT_EQ(EACCES, -homa_init(&homa2));
-	EXPECT_EQ(NULL, homa2.pacer_kthread);
+	EXPECT_EQ(NULL, homa2.default_pacer->kthread);
+	homa_destroy(&homa2);
+}
+TEST_F(homa_utils, homa_init__cant_create_reaper_thread)
+{
+	struct homa homa2;
+
+	memset(&homa2, 0, sizeof(homa2));
+	mock_kthread_create_errors = 2;
+	EXPECT_EQ(EACCES, -homa_init(&homa2));
+	EXPECT_NE(NULL, homa2.reapers[1]);
+	EXPECT_EQ(NULL, homa2.reapers[1]->thread);
 	homa_destroy(&homa2);
 }
 
@@ -122,6 +122,21 @@ struct in6_addr unit_get_in_addr(char *s)
 	return ret;
 }
 
+/**
+ * unit_interest_queue_length() - Return the total number of interests in
+ * a homa_interest_queue (across all of its lists).
+ * @queue:  Queue whose interests should be counted.
+ */
+int unit_interest_queue_length(struct homa_interest_queue *queue)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < HOMA_INTEREST_NODES; i++)
+		count += unit_list_length(&queue->nodes[i]);
+	return count;
+}
+
 /**
  * unit_list_length() - Return the number of entries in a list (not including
  * the list header.
@@ -161,14 +176,16 @@ void unit_log_hashed_rpcs(struct homa_sock *hsk)
 	struct homa_rpc *rpc;
 	int i;
 
-	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->client_rpc_buckets[i].rpcs,
+	for (i = 0; i <= hsk->client_rpc_table->mask; i++) {
+		hlist_for_each_entry_rcu(rpc,
+				&hsk->client_rpc_table->buckets[i].rpcs,
 				hash_links) {
 			unit_log_printf(" ", "%llu", rpc->id);
 		}
 	}
-	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->server_rpc_buckets[i].rpcs,
+	for (i = 0; i <= hsk->server_rpc_table->mask; i++) {
+		hlist_for_each_entry_rcu(rpc,
+				&hsk->server_rpc_table->buckets[i].rpcs,
 				hash_links) {
 			unit_log_printf(" ", "%llu", rpc->id);
 		}
@@ -292,18 +309,25 @@ void unit_log_skb_list(struct sk_buff_head *packets, int verbose)
 
 /**
  * unit_log_throttled() - Append to the test log information about all of
- * the messages in homa->throttle_rpcs.
+ * the messages in the throttled trees of all of Homa's pacers, in SRPT
+ * order.
  * @homa:     Homa's overall state.
  */
 void unit_log_throttled(struct homa *homa)
 {
+	struct homa_pacer *pacer;
+	struct rb_node *node;
 	struct homa_rpc *rpc;
 
-	list_for_each_entry_rcu(rpc, &homa->throttled_rpcs, throttled_links) {
-		unit_log_printf("; ", "%s id %llu, next_offset %d",
-				homa_is_client(rpc->id) ? "request"
-				: "response", rpc->id,
-				rpc->msgout.next_xmit_offset);
+	list_for_each_entry_rcu(pacer, &homa->pacers, links) {
+		for (node = rb_first_cached(&pacer->throttled_rpcs); node;
+		     node = rb_next(node)) {
+			rpc = rb_entry(node, struct homa_rpc, throttled_node);
+			unit_log_printf("; ", "%s id %llu, next_offset %d",
+					homa_is_client(rpc->id) ? "request"
+					: "response", rpc->id,
+					rpc->msgout.next_xmit_offset);
+		}
 	}
 }
 
@@ -331,6 +355,20 @@ const char *unit_print_gaps(struct homa_rpc *rpc)
 	return buffer;
 }
 
+/**
+ * unit_rbtree_size() - Return the number of nodes in a red-black tree.
+ * @root:   Root of the tree.
+ */
+int unit_rbtree_size(struct rb_root_cached *root)
+{
+	struct rb_node *node;
+	int count = 0;
+
+	for (node = rb_first_cached(root); node; node = rb_next(node))
+		count++;
+	return count;
+}
+
 /**
  * unit_server_rpc() - Create a homa_server_rpc and arrange for it to be
  * in a given state.
@@ -39,6 +39,8 @@ extern struct homa_rpc
 extern struct in6_addr
 		     unit_get_in_addr(char *s);
 extern void          unit_homa_destroy(struct homa *homa);
+extern int           unit_interest_queue_length(
+			struct homa_interest_queue *queue);
 extern struct iov_iter
 		    *unit_iov_iter(void *buffer, size_t length);
 extern int           unit_list_length(struct list_head *head);
@@ -50,6 +52,7 @@ extern void          unit_log_hashed_rpcs(struct homa_sock *hsk);
 extern void          unit_log_message_out_packets(
 			struct homa_message_out *message, int verbose);
 extern const char   *unit_print_gaps(struct homa_rpc *rpc);
+extern int           unit_rbtree_size(struct rb_root_cached *root);
 extern struct homa_rpc
 		    *unit_server_rpc(struct homa_sock *hsk,
 			enum unit_rpc_state state, struct in6_addr *server_ip,